@@ -215,12 +215,8 @@ void getFourierTransformsAndCtfs(long int part_id,
 			if (baseMLO->do_preread_images)
 			{
 
-                img().reshape(baseMLO->mydata.particles[part_id].images[img_id].img);
                 CTIC(accMLO->timer,"ParaReadPrereadImages");
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(baseMLO->mydata.particles[part_id].images[img_id].img)
-				{
-                	DIRECT_MULTIDIM_ELEM(img(), n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(baseMLO->mydata.particles[part_id].images[img_id].img, n);
-				}
+				baseMLO->mydata.particles[part_id].images[img_id].getPrereadImage(img());
 				CTOC(accMLO->timer,"ParaReadPrereadImages");
 			}
 			else
@@ -235,7 +231,7 @@ void getFourierTransformsAndCtfs(long int part_id,
 				else
 				{
 					CTIC(accMLO->timer,"ParaRead2DImages");
-					img() = baseMLO->exp_imgs[my_metadata_offset];
+					baseMLO->getPooledImage(my_metadata_offset, img());
 					CTOC(accMLO->timer,"ParaRead2DImages");
 				}
 			}
@@ -266,7 +266,7 @@ void MlOptimiserCuda::doThreadExpectationSomeParticles(int thread_id)
 	//put mweight allocation here
 	size_t first_ipart = 0, last_ipart = 0;
 
-	while (baseMLO->exp_ipart_ThreadTaskDistributor->getTasks(first_ipart, last_ipart))
+	while (baseMLO->exp_ipart_TaskDistributor->getTasks(thread_id, first_ipart, last_ipart))
 	{
 		CTIC(timer,"oneTask");
 		for (long unsigned ipart = first_ipart; ipart <= last_ipart; ipart++)
@@ -0,0 +1,326 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <exception>
+#include <omp.h>
+#include <tiffio.h>
+#include <src/args.h>
+#include <src/image.h>
+
+// This program writes a synthetic movie (8-bit counts, as from a counting detector)
+// in one of the compressed formats that relion_run_motioncorr reads, and measures
+// how fast the frames are decoded in different ways. It fails if any of them gives
+// different pixels than decoding the frames one after another with one thread.
+
+class MovieReadBenchmark
+{
+public:
+
+	IOParser parser;
+	FileName fn_root, format;
+	int nx, ny, n_frames, rows_per_strip, n_threads, n_repeat;
+	double mean_count;
+	bool keep_movie;
+
+	void read(int argc, char **argv)
+	{
+		parser.setCommandLine(argc, argv);
+		parser.addSection("Options");
+		fn_root = parser.getOption("--o", "Rootname for the synthetic movie", "movie_read_benchmark");
+		format = parser.getOption("--format", "Movie format: tif_lzw, tif_deflate, tif_zstd, mrc, mrc_bz2, mrc_xz or mrc_zst", "tif_lzw");
+		nx = textToInteger(parser.getOption("--nx", "Frame width", "4096"));
+		ny = textToInteger(parser.getOption("--ny", "Frame height", "4096"));
+		n_frames = textToInteger(parser.getOption("--n_frames", "Number of frames", "40"));
+		rows_per_strip = textToInteger(parser.getOption("--rows_per_strip", "Rows per TIFF strip", "64"));
+		mean_count = textToFloat(parser.getOption("--mean_count", "Average number of electrons per pixel per frame", "1"));
+		n_threads = textToInteger(parser.getOption("--j", "Number of threads", "1"));
+		n_repeat = textToInteger(parser.getOption("--repeat", "Number of times every measurement is repeated (the fastest one is reported)", "3"));
+		keep_movie = parser.checkOption("--keep", "Do not delete the synthetic movie afterwards");
+
+		if (parser.checkForErrors())
+			REPORT_ERROR("Errors encountered on the command line (see above), exiting...");
+	}
+
+	void run()
+	{
+		FileName fn_movie = writeMovie();
+		std::cout << " Movie: " << fn_movie << " (" << nx << " x " << ny << " x " << n_frames << ", "
+		          << fileSizeMB(fn_movie) << " MB on disc, " << rawSizeMB() << " MB as 8-bit pixels)" << std::endl;
+		std::cout << " Decoding speed in MB of 8-bit pixels per second, with " << n_threads << " thread(s):" << std::endl;
+
+		// Every way of decoding must give the same pixels as decoding one frame after another with one thread
+		std::vector<Image<float> > Iref;
+		if (format.contains("tif"))
+		{
+			readTiffFromMemory(fn_movie, Iref, 1, 1);
+			measureAndCheck("per-frame reads from the file", Iref,
+			                [&](std::vector<Image<float> > &Iframes){ readFramesFromFile(fn_movie, Iframes, n_threads); });
+			measureAndCheck("frames from memory, in parallel", Iref,
+			                [&](std::vector<Image<float> > &Iframes){ readTiffFromMemory(fn_movie, Iframes, n_threads, 1); });
+			measureAndCheck("strips from memory, in parallel", Iref,
+			                [&](std::vector<Image<float> > &Iframes){ readTiffFromMemory(fn_movie, Iframes, 1, n_threads); });
+			measureAndCheck("as chosen by relion_run_motioncorr", Iref,
+			                [&](std::vector<Image<float> > &Iframes){ readTiffFromMemory(fn_movie, Iframes, -1, -1); });
+		}
+		else if (format == "mrc")
+		{
+			readFramesFromFile(fn_movie, Iref, 1);
+			measureAndCheck("per-frame reads from the file", Iref,
+			                [&](std::vector<Image<float> > &Iframes){ readFramesFromFile(fn_movie, Iframes, n_threads); });
+		}
+		else
+		{
+			readCompressedMRC(fn_movie, Iref, false);
+			measureAndCheck("frames from the pipe, serially", Iref,
+			                [&](std::vector<Image<float> > &Iframes){ readCompressedMRC(fn_movie, Iframes, false); });
+			measureAndCheck("frames from the pipe, converted in parallel", Iref,
+			                [&](std::vector<Image<float> > &Iframes){ readCompressedMRC(fn_movie, Iframes, true); });
+		}
+		std::cout << " All ways of decoding gave the same pixels." << std::endl;
+
+		if (!keep_movie)
+			std::remove(fn_movie.c_str());
+	}
+
+private:
+
+	double rawSizeMB()
+	{
+		return (double)nx * ny * n_frames / (1024. * 1024.);
+	}
+
+	double fileSizeMB(FileName fn)
+	{
+		FILE *fh = fopen(fn.c_str(), "rb");
+		if (fh == NULL)
+			REPORT_ERROR("Cannot open " + fn);
+		fseek(fh, 0, SEEK_END);
+		double size = ftell(fh) / (1024. * 1024.);
+		fclose(fh);
+		return size;
+	}
+
+	template <typename F>
+	double measure(F f)
+	{
+		double best = -1.;
+		for (int i = 0; i < n_repeat; i++)
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			f();
+			double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (best < 0. || t < best)
+				best = t;
+		}
+		return best;
+	}
+
+	template <typename F>
+	void measureAndCheck(std::string what, const std::vector<Image<float> > &Iref, F decode)
+	{
+		std::vector<Image<float> > Iframes;
+		report(what, measure([&]{ decode(Iframes); }));
+
+		if (Iframes.size() != Iref.size())
+			REPORT_ERROR("Decoding " + what + " gave a different number of frames");
+		for (int iframe = 0; iframe < Iref.size(); iframe++)
+		{
+			if (!Iframes[iframe]().sameShape(Iref[iframe]()) ||
+			    memcmp(MULTIDIM_ARRAY(Iframes[iframe]()), MULTIDIM_ARRAY(Iref[iframe]()), MULTIDIM_SIZE(Iref[iframe]()) * sizeof(float)) != 0)
+				REPORT_ERROR("Decoding " + what + " gave different pixels in frame " + integerToString(iframe + 1));
+		}
+	}
+
+	void report(std::string what, double seconds)
+	{
+		const double speed = rawSizeMB() / seconds;
+		std::cout << "  " << what << ": " << seconds << " s = " << speed << " MB/s = "
+		          << speed / n_threads << " MB/s per thread" << std::endl;
+	}
+
+	void makeFrame(std::mt19937 &rng, std::vector<unsigned char> &frame)
+	{
+		std::poisson_distribution<int> poisson(mean_count);
+		frame.resize((size_t)nx * ny);
+		for (size_t n = 0; n < frame.size(); n++)
+			frame[n] = (unsigned char)XMIPP_MIN(poisson(rng), 255);
+	}
+
+	FileName writeMovie()
+	{
+		std::mt19937 rng(1234);
+		std::vector<unsigned char> frame;
+
+		if (format.contains("tif"))
+		{
+			uint16_t compression;
+			if (format == "tif_lzw")
+				compression = COMPRESSION_LZW;
+			else if (format == "tif_deflate")
+				compression = COMPRESSION_DEFLATE;
+			else if (format == "tif_zstd")
+				compression = COMPRESSION_ZSTD;
+			else
+				REPORT_ERROR("Unknown --format " + format);
+
+			FileName fn_movie = fn_root + ".tif";
+			TIFF *ftiff = TIFFOpen(fn_movie.c_str(), "w");
+			if (ftiff == NULL)
+				REPORT_ERROR("Cannot write " + fn_movie);
+			for (int iframe = 0; iframe < n_frames; iframe++)
+			{
+				makeFrame(rng, frame);
+				TIFFSetField(ftiff, TIFFTAG_IMAGEWIDTH, nx);
+				TIFFSetField(ftiff, TIFFTAG_IMAGELENGTH, ny);
+				TIFFSetField(ftiff, TIFFTAG_BITSPERSAMPLE, 8);
+				TIFFSetField(ftiff, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+				TIFFSetField(ftiff, TIFFTAG_SAMPLESPERPIXEL, 1);
+				TIFFSetField(ftiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+				TIFFSetField(ftiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+				TIFFSetField(ftiff, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
+				if (TIFFSetField(ftiff, TIFFTAG_COMPRESSION, compression) != 1)
+					REPORT_ERROR("This libtiff does not support --format " + format);
+
+				for (int y = 0, strip = 0; y < ny; y += rows_per_strip, strip++)
+				{
+					const int rows = XMIPP_MIN(rows_per_strip, ny - y);
+					TIFFWriteEncodedStrip(ftiff, strip, &frame[(size_t)y * nx], (size_t)rows * nx);
+				}
+				TIFFWriteDirectory(ftiff);
+			}
+			TIFFClose(ftiff);
+
+			return fn_movie;
+		}
+
+		FileName fn_movie = fn_root + ".mrcs";
+		Image<float> Iframe(nx, ny);
+		for (int iframe = 0; iframe < n_frames; iframe++)
+		{
+			makeFrame(rng, frame);
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Iframe())
+				DIRECT_MULTIDIM_ELEM(Iframe(), n) = frame[n];
+			Iframe.write(fn_movie, -1, true, (iframe == 0) ? WRITE_OVERWRITE : WRITE_APPEND, SShort); // RELION does not write 8-bit MRC
+		}
+
+		if (format == "mrc")
+			return fn_movie;
+
+		std::string command;
+		if (format == "mrc_bz2")
+			command = "pbzip2 -f -p" + integerToString(n_threads) + " " + fn_movie;
+		else if (format == "mrc_xz")
+			command = "xz -f -T" + integerToString(n_threads) + " " + fn_movie;
+		else if (format == "mrc_zst")
+			command = "zstd -q -f --rm " + fn_movie;
+		else
+			REPORT_ERROR("Unknown --format " + format);
+
+		if (system(command.c_str()) != 0)
+			REPORT_ERROR("Failed to compress the movie with: " + command);
+
+		return fn_movie + ((format == "mrc_bz2") ? ".bz2" : (format == "mrc_xz") ? ".xz" : ".zst");
+	}
+
+	// As relion_run_motioncorr did for all formats but EER and compressed MRC
+	void readFramesFromFile(FileName fn_movie, std::vector<Image<float> > &Iframes, int frame_threads)
+	{
+		Iframes.resize(n_frames);
+		#pragma omp parallel for num_threads(frame_threads)
+		for (int iframe = 0; iframe < n_frames; iframe++)
+			Iframes[iframe].read(fn_movie, true, iframe, false, true);
+	}
+
+	// With frame_threads and strip_threads negative, as relion_run_motioncorr chooses them (see getTiffStripThreads)
+	void readTiffFromMemory(FileName fn_movie, std::vector<Image<float> > &Iframes, int frame_threads, int strip_threads)
+	{
+		std::vector<char> raw((size_t)(fileSizeMB(fn_movie) * 1024. * 1024. + 0.5));
+		FILE *fh = fopen(fn_movie.c_str(), "rb");
+		if (fh == NULL || fread(&raw[0], raw.size(), 1, fh) != 1)
+			REPORT_ERROR("Cannot read " + fn_movie);
+		fclose(fh);
+
+		if (strip_threads < 0)
+		{
+			strip_threads = getTiffStripThreads(&raw[0], raw.size(), n_frames, n_threads);
+			frame_threads = (strip_threads > 1) ? 1 : n_threads;
+		}
+
+		Iframes.resize(n_frames);
+		#pragma omp parallel for num_threads(frame_threads)
+		for (int iframe = 0; iframe < n_frames; iframe++)
+			Iframes[iframe].readTiffInMemory(&raw[0], raw.size(), true, iframe, false, true, strip_threads);
+	}
+
+	void readCompressedMRC(FileName fn_movie, std::vector<Image<float> > &Iframes, bool parallel_conversion)
+	{
+		CompressedMRCReader reader;
+		reader.read(fn_movie, n_threads);
+
+		Iframes.resize(n_frames);
+		if (!parallel_conversion)
+		{
+			for (int iframe = 0; iframe < n_frames; iframe++)
+				reader.readFrameInto(Iframes[iframe], iframe);
+			return;
+		}
+
+		std::exception_ptr error;
+		#pragma omp parallel for ordered schedule(static, 1) num_threads(n_threads)
+		for (int iframe = 0; iframe < n_frames; iframe++)
+		{
+			std::vector<char> raw;
+			#pragma omp ordered
+			{
+				try
+				{
+					if (!error)
+						reader.readRawFrame(raw, iframe);
+				}
+				catch (...)
+				{
+					error = std::current_exception();
+				}
+			}
+			if (!raw.empty())
+				reader.convertRawFrame(raw, Iframes[iframe]);
+		}
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	MovieReadBenchmark prm;
+
+	try
+	{
+		prm.read(argc, argv);
+		prm.run();
+	}
+	catch (RelionError XE)
+	{
+		std::cerr << XE;
+		return RELION_EXIT_FAILURE;
+	}
+
+	return RELION_EXIT_SUCCESS;
+}
@@ -1121,7 +1121,11 @@ class star_handler_parameters
 
 		std::vector<RFLOAT> values;
 
-		read_check_ignore_optics(MD, fn_in, tablename_in);
+		// Only the histogrammed column is needed (this avoids reading all others from a binary STAR file)
+		if (do_ignore_optics)
+			MD.read(fn_in, tablename_in, std::vector<EMDLabel>(1, label));
+		else
+			read_check_ignore_optics(MD, fn_in, tablename_in);
 		if (!MD.containsLabel(label))
 			REPORT_ERROR("ERROR: The column specified in --hist_column is not present in the input STAR file.");
 
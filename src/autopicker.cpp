@@ -18,6 +18,12 @@
  * source code. Additional authorship citations may be added, but existing
  * author citations must be preserved.
  ***************************************************************************/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <unistd.h>
 #include "src/autopicker.h"
 #include <src/jaz/single_particle/new_ft.h>
 
@@ -121,6 +127,8 @@ if(do_gpu)
 	angpix_ref = textToFloat(parser.getOption("--angpix_ref", "Pixel size of the references in Angstroms (default is same as micrographs)", "-1"));
 	do_invert = parser.checkOption("--invert", "Density in micrograph is inverted w.r.t. density in template");
 	psi_sampling = textToFloat(parser.getOption("--ang", "Angular sampling (in degrees); use 360 for no rotations", "10"));
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads for template matching on the CPU", "1"));
+	do_precalc_rotated_refs = parser.checkOption("--precalc_rotated_refs", "Rotate all references only once (instead of for every micrograph), keep them in memory and cache them on disc in the output directory");
 	lowpass = textToFloat(parser.getOption("--lowpass", "Lowpass filter in Angstroms for the references (prevent Einstein-from-noise!)","-1"));
 	highpass = textToFloat(parser.getOption("--highpass", "Highpass filter in Angstroms for the micrographs","-1"));
 	do_ctf = parser.checkOption("--ctf", "Perform CTF correction on the references?");
@@ -239,6 +247,9 @@ void AutoPicker::initialise(int rank)
 #endif
 	if (random_seed == -1) random_seed = time(NULL);
 
+	picking_time = correlation_time = 0.;
+	nr_timed_micrographs = 0;
+
 	if (fn_in.isStarFile())
 	{
 		ObservationModel::loadSafely(fn_in, obsModel, MDmic, "micrographs", verb);
@@ -959,6 +970,13 @@ void AutoPicker::initialise(int rank)
 
 			if (verb > 0)
 				progress_bar(Mrefs.size());
+
+			psi_angles.clear();
+			for (RFLOAT psi = 0. ; psi < 360.; psi+=psi_sampling)
+				psi_angles.push_back(psi);
+
+			if (do_precalc_rotated_refs && !do_gpu)
+				precalculateRotatedReferences();
 		}
 	}
 
@@ -1039,7 +1057,10 @@ void AutoPicker::run()
 	}
 
 	if (verb > 0)
+	{
 		progress_bar(fn_micrographs.size());
+		printPickingTimes();
+	}
 
 
 }
@@ -3385,12 +3406,13 @@ void AutoPicker::autoPickLoGOneMicrograph(FileName &fn_mic, long int imic)
 
 void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 {
+	std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+	double my_correlation_time = 0.;
 	Image<RFLOAT> Imic;
 	MultidimArray<Complex > Faux, Faux2, Fmic;
 	MultidimArray<RFLOAT> Maux, Mstddev, Mmean, Mstddev2, Mavg, Mdiff2, MsumX2, Mccf_best, Mpsi_best, Fctf, Mccf_best_combined, Mpsi_best_combined;
 	MultidimArray<int> Mclass_best_combined;
 	FourierTransformer transformer;
-	RFLOAT sum_ref_under_circ_mask, sum_ref2_under_circ_mask;
 	int my_skip_side = autopick_skip_side + particle_size/2;
 	CTF ctf;
 
@@ -3679,177 +3701,9 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 #ifdef TIMING
 			timer.tic(TIMING_B3);
 #endif
-			Mccf_best.initConstant(-LARGE_NUMBER);
-			bool is_first_psi = true;
-			for (RFLOAT psi = 0. ; psi < 360.; psi+=psi_sampling)
-			{
-				// Get the Euler matrix
-				Matrix2D<RFLOAT> A(3,3);
-				Euler_angles2matrix(0., 0., psi, A);
-
-				// Now get the FT of the rotated (non-ctf-corrected) template
-				Faux.initZeros(downsize_mic, downsize_mic/2 + 1);
-				PPref[iref].get2DFourierTransform(Faux, A);
-
-#ifdef DEBUG
-				std::cerr << " psi= " << psi << std::endl;
-				windowFourierTransform(Faux, Faux2, micrograph_size);
-				CenterFFTbySign(Faux2);
-				tt().resize(micrograph_size, micrograph_size);
-				transformer.inverseFourierTransform(Faux2, tt());
-				tt.write("Mref_rot.spi");
-
-				windowFourierTransform(Fmic, Faux2, micrograph_size);
-				CenterFFTbySign(Faux2);
-				transformer.inverseFourierTransform(Faux2, tt());
-				tt.write("Mmic.spi");
-
-#endif
-#ifdef TIMING
-	timer.tic(TIMING_B4);
-#endif
-				// Apply the CTF on-the-fly (so same PPref can be used for many different micrographs)
-				if (do_ctf)
-				{
-					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
-					{
-						DIRECT_MULTIDIM_ELEM(Faux, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
-					}
-#ifdef TIMING
-	timer.toc(TIMING_B4);
-#endif
-#ifdef DEBUG
-				MultidimArray<RFLOAT> ttt(micrograph_size, micrograph_size);
-				windowFourierTransform(Faux, Faux2, micrograph_size);
-				CenterFFTbySign(Faux2);
-				transformer.inverseFourierTransform(Faux2, ttt);
-				ttt.setXmippOrigin();
-				tt().resize(particle_size, particle_size);
-				tt().setXmippOrigin();
-				FOR_ALL_ELEMENTS_IN_ARRAY2D(tt())
-				{
-					A2D_ELEM(tt(), i, j) = A2D_ELEM(ttt, i, j);
-				}
-				tt.write("Mref_rot_ctf.spi");
-#endif
-				}
-
-				if (is_first_psi)
-				{
-#ifdef TIMING
-	timer.tic(TIMING_B5);
-#endif
-					// Calculate the expected ratio of probabilities for this CTF-corrected reference
-					// and the sum_ref_under_circ_mask and sum_ref_under_circ_mask2
-					// Do this also if we're not recalculating the fom maps...
-					// This calculation needs to be done on an "non-shrinked" micrograph, in order to get the correct I^2 statistics
-					windowFourierTransform(Faux, Faux2, micrograph_size);
-					CenterFFTbySign(Faux2);
-					Maux.resize(micrograph_size, micrograph_size);
-					transformer.inverseFourierTransform(Faux2, Maux);
-					Maux.setXmippOrigin();
-#ifdef DEBUG
-					Image<RFLOAT> ttt;
-					ttt()=Maux;
-					ttt.write("Maux.spi");
-#endif
-					sum_ref_under_circ_mask = 0.;
-					sum_ref2_under_circ_mask = 0.;
-					RFLOAT suma2 = 0.;
-					RFLOAT sumn = 1.;
-					MultidimArray<RFLOAT> Mctfref(particle_size, particle_size);
-					Mctfref.setXmippOrigin();
-					FOR_ALL_ELEMENTS_IN_ARRAY2D(Mctfref) // only loop over smaller Mctfref, but take values from large Maux!
-					{
-						if (i*i + j*j < particle_radius2)
-						{
-							suma2 += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
-							suma2 += 2. * A2D_ELEM(Maux, i, j) * rnd_gaus(0., 1.);
-							sum_ref_under_circ_mask += A2D_ELEM(Maux, i, j);
-							sum_ref2_under_circ_mask += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
-							sumn += 1.;
-						}
-#ifdef DEBUG
-						A2D_ELEM(Mctfref, i, j) = A2D_ELEM(Maux, i, j);
-#endif
-					}
-					sum_ref_under_circ_mask /= sumn;
-					sum_ref2_under_circ_mask /= sumn;
-					expected_Pratio = exp(suma2 / (2. * sumn));
-#ifdef DEBUG
-					std::cerr << " expected_Pratio["<<iref<<"]= " << expected_Pratio << std::endl;
-					tt()=Mctfref;
-					tt.write("Mctfref.spi");
-					std::cerr << "suma2 " << suma2<< " sumn " << sumn << " suma2/2sumn="<< suma2 / (2. * sumn) << std::endl;
-					std::cerr << " nr_pixels_under_mask= " << nr_pixels_circular_mask << " nr_pixels_under_invmask= " << nr_pixels_circular_invmask << std::endl;
-					std::cerr << "sum_ref_under_circ_mask " << sum_ref_under_circ_mask << std::endl;
-					std::cerr << "sum_ref2_under_circ_mask " << sum_ref2_under_circ_mask << std::endl;
-					std::cerr << "expected_Pratio " << expected_Pratio << std::endl;
-#endif
-
-					// Maux goes back to the workSize
-					Maux.resize(workSize, workSize);
-#ifdef TIMING
-					timer.toc(TIMING_B5);
-#endif
-				}
-
-#ifdef TIMING
-				timer.tic(TIMING_B6);
-#endif
-				// Now multiply template and micrograph to calculate the cross-correlation
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
-				{
-					DIRECT_MULTIDIM_ELEM(Faux, n) = conj(DIRECT_MULTIDIM_ELEM(Faux, n)) * DIRECT_MULTIDIM_ELEM(Fmic, n);
-				}
-
-				// If we're not doing shrink, then Faux is bigger than Faux2!
-				windowFourierTransform(Faux, Faux2, workSize);
-				CenterFFTbySign(Faux2);
-				transformer.inverseFourierTransform(Faux2, Maux);
-#ifdef DEBUG
-				tt()=Maux*normfft;
-				tt.write("Mcc.spi");
-#endif
-
-				// Calculate ratio of prabilities P(ref)/P(zero)
-				// Keep track of the best values and their corresponding iref and psi
-
-				// So now we already had precalculated: Mdiff2 = 1/sig*Sum(X^2) - 2/sig*Sum(X) + mu^2/sig*Sum(1)
-				// Still to do (per reference): - 2/sig*Sum(AX) + 2*mu/sig*Sum(A) + Sum(A^2)
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Maux)
-				{
-					RFLOAT diff2 = - 2. * normfft * DIRECT_MULTIDIM_ELEM(Maux, n);
-					diff2 += 2. * DIRECT_MULTIDIM_ELEM(Mmean, n) * sum_ref_under_circ_mask;
-					if (DIRECT_MULTIDIM_ELEM(Mstddev, n) > 1E-10)
-						diff2 /= DIRECT_MULTIDIM_ELEM(Mstddev, n);
-					diff2 += sum_ref2_under_circ_mask;
-					diff2 = exp(- diff2 / 2.); // exponentiate to reflect the Gaussian error model. sigma=1 after normalization, 0.4=1/sqrt(2pi)
-
-					// Store fraction of (1 - probability-ratio) wrt  (1 - expected Pratio)
-					diff2 = (diff2 - 1.) / (expected_Pratio - 1.);
-#ifdef DEBUG
-					DIRECT_MULTIDIM_ELEM(Maux, n) = diff2;
-#endif
-					if (diff2 > DIRECT_MULTIDIM_ELEM(Mccf_best, n))
-					{
-						DIRECT_MULTIDIM_ELEM(Mccf_best, n) = diff2;
-						DIRECT_MULTIDIM_ELEM(Mpsi_best, n) = psi;
-					}
-				}
-#ifdef DEBUG
-				std::cerr << " Maux.computeMax()= " << Maux.computeMax() << std::endl;
-				tt()=Maux;
-				tt.write("Mccf.spi");
-			    std::cerr << " Press any key to continue... "  << std::endl;
-			    char c;
-			    std::cin >> c;
-#endif
-			    is_first_psi = false;
-#ifdef TIMING
-	timer.toc(TIMING_B6);
-#endif
-			} // end for psi
+			std::chrono::steady_clock::time_point ccf_start = std::chrono::steady_clock::now();
+			calculateBestCCF(iref, Fmic, Fctf, Mmean, Mstddev, normfft, Mccf_best, Mpsi_best, expected_Pratio);
+			my_correlation_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - ccf_start).count();
 #ifdef TIMING
 	timer.toc(TIMING_B3);
 #endif
@@ -4019,6 +3873,304 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 	timer.toc(TIMING_B9);
 #endif
 	}
+
+	double my_picking_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	picking_time += my_picking_time;
+	correlation_time += my_correlation_time;
+	nr_timed_micrographs++;
+	if (verb > 1)
+		std::cerr << "Picked " << fn_mic << " in " << my_picking_time << " sec, of which "
+		          << my_correlation_time << " sec in correlations with the references" << std::endl;
+}
+
+void AutoPicker::printPickingTimes()
+{
+	if (nr_timed_micrographs == 0)
+		return;
+
+	std::cout << " + Template matching took on average " << picking_time / nr_timed_micrographs
+	          << " sec per micrograph, of which " << correlation_time / nr_timed_micrographs
+	          << " sec in correlations with the references (using " << nr_threads << " threads)" << std::endl;
+}
+
+// 64-bit FNV-1a hash, to recognise the cached rotated references of the same run
+static void hashBytes(const void *data, size_t size, unsigned long long &hash)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+}
+
+void AutoPicker::precalculateRotatedReferences()
+{
+	long int nr_refs = PPref.size();
+	long int nr_psis = psi_angles.size();
+	rotated_ref_size = (long int)downsize_mic * (downsize_mic/2 + 1);
+
+	// The cache is identified by the (masked) references, the pixel size and the sizes of the FTs
+	unsigned long long key = 14695981039346656037ULL;
+	for (int iref = 0; iref < Mrefs.size(); iref++)
+		hashBytes(MULTIDIM_ARRAY(Mrefs[iref]), MULTIDIM_SIZE(Mrefs[iref]) * sizeof(RFLOAT), key);
+	hashBytes(&angpix, sizeof(angpix), key);
+	hashBytes(&downsize_mic, sizeof(downsize_mic), key);
+	hashBytes(&micrograph_size, sizeof(micrograph_size), key);
+	hashBytes(&padding, sizeof(padding), key);
+	hashBytes(&psi_angles[0], nr_psis * sizeof(RFLOAT), key);
+
+	std::stringstream ss;
+	ss << std::hex << key;
+	FileName fn_cache = fn_odir + "rotated_references_" + ss.str() + ".bin";
+
+	double size_gb = (double)nr_refs * nr_psis * rotated_ref_size * sizeof(Complex) / (1024. * 1024. * 1024.);
+	rotated_refs.resize(nr_refs * nr_psis * rotated_ref_size);
+
+	long long header[4] = {(long long)key, nr_refs, nr_psis, rotated_ref_size};
+	if (exists(fn_cache))
+	{
+		std::ifstream fh(fn_cache.c_str(), std::ios::binary);
+		long long my_header[4];
+		fh.read((char *)my_header, sizeof(my_header));
+		if (fh && std::equal(header, header + 4, my_header))
+		{
+			fh.read((char *)&rotated_refs[0], rotated_refs.size() * sizeof(Complex));
+			if (fh)
+			{
+				if (verb > 0)
+					std::cout << " + Read " << nr_refs * nr_psis << " rotated references (" << size_gb << " GB) from " << fn_cache << std::endl;
+				return;
+			}
+		}
+		if (verb > 0)
+			std::cout << " + WARNING: ignoring incomplete or outdated " << fn_cache << std::endl;
+	}
+
+	if (verb > 0)
+		std::cout << " + Rotating all references (" << size_gb << " GB) ..." << std::endl;
+
+	#pragma omp parallel for num_threads(nr_threads) schedule(dynamic)
+	for (long int irot = 0; irot < nr_refs * nr_psis; irot++)
+	{
+		Matrix2D<RFLOAT> A(3,3);
+		Euler_angles2matrix(0., 0., psi_angles[irot % nr_psis], A);
+
+		MultidimArray<Complex> Fref(downsize_mic, downsize_mic/2 + 1);
+		Fref.initZeros();
+		PPref[irot / nr_psis].get2DFourierTransform(Fref, A);
+		memcpy(&rotated_refs[irot * rotated_ref_size], MULTIDIM_ARRAY(Fref), rotated_ref_size * sizeof(Complex));
+	}
+
+	// Write to a temporary file first, so that other MPI processes never read a partial cache
+	// (the process ID alone is not unique when the processes run on several nodes that share fn_odir)
+	mktree(fn_odir);
+	char nodename[64] = "undefined";
+	gethostname(nodename,sizeof(nodename));
+	FileName fn_tmp = fn_cache + ".tmp_" + std::string(nodename) + "_" + integerToString(getpid());
+	std::ofstream fh(fn_tmp.c_str(), std::ios::binary);
+	fh.write((char *)header, sizeof(header));
+	fh.write((char *)&rotated_refs[0], rotated_refs.size() * sizeof(Complex));
+	fh.close();
+	if (!fh || std::rename(fn_tmp.c_str(), fn_cache.c_str()) != 0)
+	{
+		std::remove(fn_tmp.c_str());
+		if (verb > 0)
+			std::cout << " + WARNING: failed to cache the rotated references in " << fn_cache << std::endl;
+	}
+}
+
+void AutoPicker::getRotatedReference(int iref, int ipsi, const MultidimArray<RFLOAT> &Fctf, MultidimArray<Complex> &Fref)
+{
+	Fref.resize(downsize_mic, downsize_mic/2 + 1);
+	if (!rotated_refs.empty())
+	{
+		memcpy(MULTIDIM_ARRAY(Fref), &rotated_refs[(iref * psi_angles.size() + ipsi) * rotated_ref_size],
+		       rotated_ref_size * sizeof(Complex));
+	}
+	else
+	{
+		// Get the Euler matrix
+		Matrix2D<RFLOAT> A(3,3);
+		Euler_angles2matrix(0., 0., psi_angles[ipsi], A);
+
+		// Now get the FT of the rotated (non-ctf-corrected) template
+		Fref.initZeros();
+		PPref[iref].get2DFourierTransform(Fref, A);
+	}
+
+	// Apply the CTF on-the-fly (so same PPref can be used for many different micrographs)
+	if (do_ctf)
+	{
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fref)
+		{
+			DIRECT_MULTIDIM_ELEM(Fref, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
+		}
+	}
+}
+
+void AutoPicker::calculateBestCCF(int iref, const MultidimArray<Complex> &Fmic, const MultidimArray<RFLOAT> &Fctf,
+		const MultidimArray<RFLOAT> &Mmean, const MultidimArray<RFLOAT> &Mstddev, RFLOAT normfft,
+		MultidimArray<RFLOAT> &Mccf_best, MultidimArray<RFLOAT> &Mpsi_best, RFLOAT &expected_Pratio)
+{
+	RFLOAT sum_ref_under_circ_mask = 0., sum_ref2_under_circ_mask = 0.;
+	{
+		// Calculate the expected ratio of probabilities for this CTF-corrected reference
+		// and the sum_ref_under_circ_mask and sum_ref_under_circ_mask2
+		// Do this also if we're not recalculating the fom maps...
+		// This calculation needs to be done on an "non-shrinked" micrograph, in order to get the correct I^2 statistics
+		// Only do this for the first psi, and before the threads start, as rnd_gaus is not thread-safe
+		MultidimArray<Complex> Faux, Faux2;
+		MultidimArray<RFLOAT> Maux;
+		FourierTransformer transformer;
+		getRotatedReference(iref, 0, Fctf, Faux);
+		windowFourierTransform(Faux, Faux2, micrograph_size);
+		CenterFFTbySign(Faux2);
+		Maux.resize(micrograph_size, micrograph_size);
+		transformer.inverseFourierTransform(Faux2, Maux);
+		Maux.setXmippOrigin();
+
+		RFLOAT suma2 = 0.;
+		RFLOAT sumn = 1.;
+		MultidimArray<RFLOAT> Mctfref(particle_size, particle_size);
+		Mctfref.setXmippOrigin();
+		FOR_ALL_ELEMENTS_IN_ARRAY2D(Mctfref) // only loop over smaller Mctfref, but take values from large Maux!
+		{
+			if (i*i + j*j < particle_radius2)
+			{
+				suma2 += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
+				suma2 += 2. * A2D_ELEM(Maux, i, j) * rnd_gaus(0., 1.);
+				sum_ref_under_circ_mask += A2D_ELEM(Maux, i, j);
+				sum_ref2_under_circ_mask += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
+				sumn += 1.;
+			}
+		}
+		sum_ref_under_circ_mask /= sumn;
+		sum_ref2_under_circ_mask /= sumn;
+		expected_Pratio = exp(suma2 / (2. * sumn));
+#ifdef DEBUG
+		std::cerr << " expected_Pratio["<<iref<<"]= " << expected_Pratio << std::endl;
+		std::cerr << "sum_ref_under_circ_mask " << sum_ref_under_circ_mask << std::endl;
+		std::cerr << "sum_ref2_under_circ_mask " << sum_ref2_under_circ_mask << std::endl;
+#endif
+	}
+
+	// Distribute the psi angles over the threads. Each thread keeps its own best maps,
+	// which are combined afterwards, so the threads never need to wait for each other.
+	int my_nr_threads = XMIPP_MIN(nr_threads, (int)psi_angles.size());
+	std::vector<MultidimArray<RFLOAT> > thread_Mccf(my_nr_threads - 1), thread_Mpsi(my_nr_threads - 1);
+	std::exception_ptr error;
+
+	#pragma omp parallel num_threads(my_nr_threads)
+	{
+		int thread_id = omp_get_thread_num();
+		MultidimArray<RFLOAT> &my_Mccf = (thread_id == 0) ? Mccf_best : thread_Mccf[thread_id - 1];
+		MultidimArray<RFLOAT> &my_Mpsi = (thread_id == 0) ? Mpsi_best : thread_Mpsi[thread_id - 1];
+		my_Mccf.resize(workSize, workSize);
+		my_Mpsi.resize(workSize, workSize);
+		my_Mccf.initConstant(-LARGE_NUMBER);
+		my_Mpsi.initZeros();
+
+		MultidimArray<Complex> Faux, Faux2;
+		MultidimArray<RFLOAT> Maux(workSize, workSize);
+		FourierTransformer transformer;
+
+		// Each thread gets increasing psi angles, so that ties go to the first psi, as in a serial loop
+		#pragma omp for schedule(dynamic)
+		for (int ipsi = 0; ipsi < psi_angles.size(); ipsi++)
+		{
+			try
+			{
+				RFLOAT psi = psi_angles[ipsi];
+				if (!rotated_refs.empty())
+				{
+					// Multiply the pre-rotated template with the CTF and the micrograph in a single pass
+					const Complex *Fref = &rotated_refs[(iref * psi_angles.size() + ipsi) * rotated_ref_size];
+					Faux.resize(downsize_mic, downsize_mic/2 + 1);
+					if (do_ctf)
+					{
+						FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
+						{
+							DIRECT_MULTIDIM_ELEM(Faux, n) = conj(Fref[n]) * (DIRECT_MULTIDIM_ELEM(Fctf, n) * DIRECT_MULTIDIM_ELEM(Fmic, n));
+						}
+					}
+					else
+					{
+						FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
+						{
+							DIRECT_MULTIDIM_ELEM(Faux, n) = conj(Fref[n]) * DIRECT_MULTIDIM_ELEM(Fmic, n);
+						}
+					}
+				}
+				else
+				{
+					getRotatedReference(iref, ipsi, Fctf, Faux);
+
+					// Now multiply template and micrograph to calculate the cross-correlation
+					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
+					{
+						DIRECT_MULTIDIM_ELEM(Faux, n) = conj(DIRECT_MULTIDIM_ELEM(Faux, n)) * DIRECT_MULTIDIM_ELEM(Fmic, n);
+					}
+				}
+
+				// If we're not doing shrink, then Faux is bigger than Faux2!
+				windowFourierTransform(Faux, Faux2, workSize);
+				CenterFFTbySign(Faux2);
+				transformer.inverseFourierTransform(Faux2, Maux);
+
+				// Calculate ratio of prabilities P(ref)/P(zero)
+				// Keep track of the best values and their corresponding iref and psi
+
+				// So now we already had precalculated: Mdiff2 = 1/sig*Sum(X^2) - 2/sig*Sum(X) + mu^2/sig*Sum(1)
+				// Still to do (per reference): - 2/sig*Sum(AX) + 2*mu/sig*Sum(A) + Sum(A^2)
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Maux)
+				{
+					RFLOAT diff2 = - 2. * normfft * DIRECT_MULTIDIM_ELEM(Maux, n);
+					diff2 += 2. * DIRECT_MULTIDIM_ELEM(Mmean, n) * sum_ref_under_circ_mask;
+					if (DIRECT_MULTIDIM_ELEM(Mstddev, n) > 1E-10)
+						diff2 /= DIRECT_MULTIDIM_ELEM(Mstddev, n);
+					diff2 += sum_ref2_under_circ_mask;
+					diff2 = exp(- diff2 / 2.); // exponentiate to reflect the Gaussian error model. sigma=1 after normalization, 0.4=1/sqrt(2pi)
+
+					// Store fraction of (1 - probability-ratio) wrt  (1 - expected Pratio)
+					diff2 = (diff2 - 1.) / (expected_Pratio - 1.);
+					if (diff2 > DIRECT_MULTIDIM_ELEM(my_Mccf, n))
+					{
+						DIRECT_MULTIDIM_ELEM(my_Mccf, n) = diff2;
+						DIRECT_MULTIDIM_ELEM(my_Mpsi, n) = psi;
+					}
+				}
+			}
+			catch (...)
+			{
+				#pragma omp critical(AutoPicker_error)
+				error = std::current_exception();
+			}
+		}
+
+		// Combine the best maps of all threads, every thread taking a part of the pixels
+		if (my_nr_threads > 1)
+		{
+			#pragma omp for
+			for (long int n = 0; n < MULTIDIM_SIZE(Mccf_best); n++)
+			{
+				for (int ithread = 0; ithread < my_nr_threads - 1; ithread++)
+				{
+					RFLOAT ccf = DIRECT_MULTIDIM_ELEM(thread_Mccf[ithread], n);
+					RFLOAT psi = DIRECT_MULTIDIM_ELEM(thread_Mpsi[ithread], n);
+					if (ccf > DIRECT_MULTIDIM_ELEM(Mccf_best, n) ||
+					    (ccf == DIRECT_MULTIDIM_ELEM(Mccf_best, n) && psi < DIRECT_MULTIDIM_ELEM(Mpsi_best, n)))
+					{
+						DIRECT_MULTIDIM_ELEM(Mccf_best, n) = ccf;
+						DIRECT_MULTIDIM_ELEM(Mpsi_best, n) = psi;
+					}
+				}
+			}
+		}
+	}
+
+	if (error)
+		std::rethrow_exception(error);
 }
 
 FileName AutoPicker::getOutputRootName(FileName fn_mic)
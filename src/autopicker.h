@@ -286,6 +286,24 @@ public:
 	// In-plane rotational sampling (in degrees)
 	RFLOAT psi_sampling;
 
+	// Number of threads for template matching on the CPU
+	int nr_threads;
+
+	// Rotate all references only once, instead of for every micrograph?
+	bool do_precalc_rotated_refs;
+
+	// All in-plane rotations that are searched
+	std::vector<RFLOAT> psi_angles;
+
+	// With do_precalc_rotated_refs: FTs of all rotated references (at downsize_mic, without CTF),
+	// stored one after the other, with all rotations of a reference together
+	std::vector<Complex> rotated_refs;
+	long int rotated_ref_size;
+
+	// Wall-clock seconds spent on template-matching micrographs, and on the correlations with the references therein
+	double picking_time, correlation_time;
+	long int nr_timed_micrographs;
+
 	// Fraction of expected probability ratio to consider as peaks
 	RFLOAT min_fraction_expected_Pratio;
 
@@ -412,6 +430,20 @@ public:
 	void autoPickLoGOneMicrograph(FileName &fn_mic, long int imic);
 	void autoPickOneMicrograph(FileName &fn_mic, long int imic);
 
+	// Calculate (or read from the cache in fn_odir) all rotated references for do_precalc_rotated_refs
+	void precalculateRotatedReferences();
+
+	// FT of reference iref, rotated over psi_angles[ipsi] and multiplied with the CTF (if any), at downsize_mic
+	void getRotatedReference(int iref, int ipsi, const MultidimArray<RFLOAT> &Fctf, MultidimArray<Complex> &Fref);
+
+	// Best probability-ratio and its psi over all rotations of reference iref (using nr_threads threads)
+	void calculateBestCCF(int iref, const MultidimArray<Complex> &Fmic, const MultidimArray<RFLOAT> &Fctf,
+			const MultidimArray<RFLOAT> &Mmean, const MultidimArray<RFLOAT> &Mstddev, RFLOAT normfft,
+			MultidimArray<RFLOAT> &Mccf_best, MultidimArray<RFLOAT> &Mpsi_best, RFLOAT &expected_Pratio);
+
+	// Print the average template-matching times per micrograph
+	void printPickingTimes();
+
 	// Get the output coordinate filename given the micrograph filename
 	FileName getOutputRootName(FileName fn_mic);
 	// Uses Roseman2003 formulae to calculate stddev under the mask through FFTs
@@ -115,5 +115,8 @@ void AutoPickerMpi::run()
 	}
 
 	if (verb > 0)
+	{
 		progress_bar(my_nr_micrographs);
+		printPickingTimes();
+	}
 }
@@ -56,7 +56,7 @@ void BackProjector::backproject2Dto3D(const MultidimArray<Complex > &f2d,
   	                              const Matrix2D<RFLOAT> &A,
                                       const MultidimArray<RFLOAT> *Mweight,
                                       RFLOAT r_ewald_sphere, bool is_positive_curvature,
-                                      Matrix2D<RFLOAT>* magMatrix)
+                                      Matrix2D<RFLOAT>* magMatrix, BackProjectorLocks *locks)
 {
 	RFLOAT m00, m10, m01, m11;
 
@@ -126,6 +126,9 @@ void BackProjector::backproject2Dto3D(const MultidimArray<Complex > &f2d,
 	const int s  = YSIZE(f2d);
 	const int sh = XSIZE(f2d);
 
+	// Neighbouring pixels mostly go into the same planes: keep their stripes locked
+	BackProjectorLocks::Holder holder(locks);
+
 	for (int i = 0; i < s; i++)
 	{
 		int y, first_allowed_x;
@@ -284,6 +287,8 @@ void BackProjector::backproject2Dto3D(const MultidimArray<Complex > &f2d,
 					my_val = conj(my_val);
 				}
 
+				holder.lock(z0, z1);
+
 				// Store slice in 3D weighted sum
 				DIRECT_A3D_ELEM(data, z0, y0, x0) += dd000 * my_val;
 				DIRECT_A3D_ELEM(data, z0, y0, x1) += dd001 * my_val;
@@ -336,6 +341,8 @@ void BackProjector::backproject2Dto3D(const MultidimArray<Complex > &f2d,
 					continue;
 				}
 
+				holder.lock(zr, zr);
+
 				if (is_neg_x)
 				{
 					DIRECT_A3D_ELEM(data, zr, yr, xr) += conj(my_val);
@@ -35,6 +35,87 @@
 #include "src/tabfuncs.h"
 #include "src/symmetries.h"
 #include <src/jaz/single_particle/complex_io.h>
+#include <omp.h>
+#include <vector>
+
+/** Locks on stripes of z-planes of the data and weight arrays of a BackProjector
+ *
+ * With these, several threads can back-project into the same BackProjector
+ * at the same time. A thread only ever acquires stripes in increasing order,
+ * and only when it holds none, so threads cannot deadlock.
+ */
+class BackProjectorLocks
+{
+public:
+
+	BackProjectorLocks(int zdim, int planes_per_stripe = 4)
+	: planes(XMIPP_MAX(1, planes_per_stripe)), stripes((zdim + planes - 1) / planes)
+	{
+		for (size_t i = 0; i < stripes.size(); i++)
+			omp_init_lock(&stripes[i]);
+	}
+
+	~BackProjectorLocks()
+	{
+		for (size_t i = 0; i < stripes.size(); i++)
+			omp_destroy_lock(&stripes[i]);
+	}
+
+	// The stripes held by one thread during one back-projection
+	class Holder
+	{
+	public:
+
+		Holder(BackProjectorLocks *_locks) : locks(_locks), first(0), last(-1) {}
+
+		~Holder()
+		{
+			release();
+		}
+
+		// Make sure (physical) planes z0 to z1 are locked; z0 <= z1
+		inline void lock(int z0, int z1)
+		{
+			if (locks == NULL) return;
+
+			int s0 = z0 / locks->planes;
+			int s1 = z1 / locks->planes;
+			if (s0 >= first && s1 <= last) return;
+
+			release();
+			for (int s = s0; s <= s1; s++)
+				omp_set_lock(&locks->stripes[s]);
+			first = s0;
+			last = s1;
+		}
+
+		inline void lockAll()
+		{
+			if (locks != NULL) lock(0, locks->planes * locks->stripes.size() - 1);
+		}
+
+		void release()
+		{
+			for (int s = first; s <= last; s++)
+				omp_unset_lock(&locks->stripes[s]);
+			first = 0;
+			last = -1;
+		}
+
+	private:
+
+		BackProjectorLocks *locks;
+		int first, last;
+	};
+
+private:
+
+	int planes;
+	std::vector<omp_lock_t> stripes;
+
+	BackProjectorLocks(const BackProjectorLocks&);
+	BackProjectorLocks& operator=(const BackProjectorLocks&);
+};
 
 class BackProjector: public Projector
 {
@@ -183,25 +264,32 @@ public:
 	/*
 	* Set a 2D Fourier Transform back into the 2D or 3D data array
 	* Depending on the dimension of the map, this will be a backprojection or a rotation operation
+	* If locks are given, this can be called from multiple threads at the same time
+	* (only 2D-to-3D backprojections run concurrently, the other operations lock the entire array)
 	*/
 	void set2DFourierTransform(const MultidimArray<Complex > &img_in,
 	                           const Matrix2D<RFLOAT> &A,
 	                           const MultidimArray<RFLOAT> *Mweight = NULL,
 	                           RFLOAT r_ewald_sphere = -1.,
 	                           bool is_positive_curvature = true,
-	                           Matrix2D<RFLOAT>* magMatrix = 0)
+	                           Matrix2D<RFLOAT>* magMatrix = 0,
+	                           BackProjectorLocks *locks = NULL)
 	{
 		// Back-rotation of a 3D Fourier Transform
 		if (img_in.getDim() == 3)
 		{
 			if (ref_dim != 3)
 				REPORT_ERROR("Backprojector::set3DFourierTransform%%ERROR: Dimension of the data array should be 3");
+			BackProjectorLocks::Holder holder(locks);
+			holder.lockAll();
 			backrotate3D(img_in, A, Mweight);
 		}
 		else if (img_in.getDim() == 1)
 		{
 			if (ref_dim != 2)
 				REPORT_ERROR("Backprojector::set1DFourierTransform%%ERROR: Dimension of the data array should be 2");
+			BackProjectorLocks::Holder holder(locks);
+			holder.lockAll();
 			backproject1Dto2D(img_in, A, Mweight);
 		}
 		else
@@ -209,10 +297,14 @@ public:
 			switch (ref_dim)
 			{
 			case 2:
+			{
+				BackProjectorLocks::Holder holder(locks);
+				holder.lockAll();
 				backrotate2D(img_in, A, Mweight, magMatrix);
 				break;
+			}
 			case 3:
-				backproject2Dto3D(img_in, A, Mweight, r_ewald_sphere, is_positive_curvature, magMatrix);
+				backproject2Dto3D(img_in, A, Mweight, r_ewald_sphere, is_positive_curvature, magMatrix, locks);
 				break;
 			default:
 				REPORT_ERROR("Backprojector::set2DSlice%%ERROR: Dimension of the data array should be 2 or 3");
@@ -240,13 +332,15 @@ public:
 	/*
 	* Set a 2D slice in the 3D map (backward projection)
 	* If a exp_Mweight is given, rather than adding 1 to all relevant pixels in the weight array, we use exp_Mweight
+	* If locks are given, only the stripes of z-planes that are being written to are locked
 	*/
 	void backproject2Dto3D(const MultidimArray<Complex > &img_in,
 	                       const Matrix2D<RFLOAT> &A,
 	                       const MultidimArray<RFLOAT> *Mweight = NULL,
 	                       RFLOAT r_ewald_sphere = -1.,
 	                       bool is_positive_curvature = true,
-	                       Matrix2D<RFLOAT>* magMatrix = 0);
+	                       Matrix2D<RFLOAT>* magMatrix = 0,
+	                       BackProjectorLocks *locks = NULL);
 
 	/*
 	* Set a 1D slice in the 2D map (backward projection)
@@ -20,6 +20,69 @@
 #include "src/exp_model.h"
 #include <sys/statvfs.h>
 
+void ExpImage::setPrereadImage(const MultidimArray<float> &in, int preread_bits)
+{
+	img.clear();
+	img_half.clear();
+	img_byte.clear();
+
+	if (preread_bits == 32)
+	{
+		img = in;
+	}
+	else if (preread_bits == 16)
+	{
+		img_half.reshape(in);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(in)
+		{
+			DIRECT_MULTIDIM_ELEM(img_half, n) = float2half(DIRECT_MULTIDIM_ELEM(in, n));
+		}
+	}
+	else if (preread_bits == 8)
+	{
+		RFLOAT minval, maxval;
+		in.computeDoubleMinMax(minval, maxval);
+		byte_offset = minval;
+		byte_scale = (maxval > minval) ? (maxval - minval) / 255. : 1.;
+
+		img_byte.reshape(in);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(in)
+		{
+			DIRECT_MULTIDIM_ELEM(img_byte, n) = (unsigned char)ROUND((DIRECT_MULTIDIM_ELEM(in, n) - byte_offset) / byte_scale);
+		}
+	}
+	else
+		REPORT_ERROR("ExpImage::setPrereadImage: pre-read images can only be stored with 32, 16 or 8 bits per pixel.");
+}
+
+void ExpImage::getPrereadImage(MultidimArray<RFLOAT> &out) const
+{
+	if (NZYXSIZE(img_half) > 0)
+	{
+		out.reshape(img_half);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(img_half)
+		{
+			DIRECT_MULTIDIM_ELEM(out, n) = (RFLOAT)half2float(DIRECT_MULTIDIM_ELEM(img_half, n));
+		}
+	}
+	else if (NZYXSIZE(img_byte) > 0)
+	{
+		out.reshape(img_byte);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(img_byte)
+		{
+			DIRECT_MULTIDIM_ELEM(out, n) = byte_offset + byte_scale * (RFLOAT)DIRECT_MULTIDIM_ELEM(img_byte, n);
+		}
+	}
+	else
+	{
+		out.reshape(img);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(img)
+		{
+			DIRECT_MULTIDIM_ELEM(out, n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(img, n);
+		}
+	}
+}
+
 long int Experiment::numberOfParticles(int random_subset)
 {
 	if (random_subset == 0)
@@ -766,7 +829,7 @@ void Experiment::copyParticlesToScratch(int verb, bool do_copy, bool also_do_ctf
 
 // Read from file
 void Experiment::read(FileName fn_exp, bool do_ignore_particle_name, bool do_ignore_group_name, bool do_preread_images,
-                      bool need_tiltpsipriors_for_helical_refine, int verb)
+                      bool need_tiltpsipriors_for_helical_refine, int verb, int preread_bits)
 {
 
 //#define DEBUG_READ
@@ -966,7 +1029,7 @@ void Experiment::read(FileName fn_exp, bool do_ignore_particle_name, bool do_ign
 				}
 				img.readFromOpenFile(img_name, hFile, -1, false);
 				img().setXmippOrigin();
-				particles[part_id].images[img_id].img = img();
+				particles[part_id].images[img_id].setPrereadImage(img(), preread_bits);
 			}
 
 #ifdef DEBUG_READ
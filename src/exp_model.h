@@ -58,8 +58,13 @@ public:
 	// Pre-read array of the image in RAM
 	MultidimArray<float> img;
 
+	// Pre-read image at reduced precision (see setPrereadImage)
+	MultidimArray<float16> img_half;
+	MultidimArray<unsigned char> img_byte;
+	float byte_scale, byte_offset;
+
 	// Empty Constructor
-	ExpImage() {}
+	ExpImage(): byte_scale(1.), byte_offset(0.) {}
 
 	// Destructor needed for work with vectors
 	~ExpImage() {}
@@ -74,7 +79,10 @@ public:
 		group_id = copy.group_id;
 		optics_group = copy.optics_group;
 		img = copy.img;
-
+		img_half = copy.img_half;
+		img_byte = copy.img_byte;
+		byte_scale = copy.byte_scale;
+		byte_offset = copy.byte_offset;
 	}
 
 	// Define assignment operator in terms of the copy constructor
@@ -87,8 +95,19 @@ public:
 		group_id = copy.group_id;
 		optics_group = copy.optics_group;
 		img = copy.img;
+		img_half = copy.img_half;
+		img_byte = copy.img_byte;
+		byte_scale = copy.byte_scale;
+		byte_offset = copy.byte_offset;
 		return *this;
 	}
+
+	// Store a pre-read image with 32 (float), 16 (half-precision float) or 8 bits per pixel.
+	// For 8 bits, the pixel values are quantised linearly between the minimum and maximum of this image.
+	void setPrereadImage(const MultidimArray<float> &in, int preread_bits = 32);
+
+	// Get the pre-read image back, whatever precision it was stored at
+	void getPrereadImage(MultidimArray<RFLOAT> &out) const;
 };
 
 class ExpParticle
@@ -339,7 +358,8 @@ public:
 		FileName fn_in,
 		bool do_ignore_particle_name = false,
 		bool do_ignore_group_name = false, bool do_preread_images = false,
-		bool need_tiltpsipriors_for_helical_refine = false, int verb = 0);
+		bool need_tiltpsipriors_for_helical_refine = false, int verb = 0,
+		int preread_bits = 32);
 
 	// Write
 	void write(FileName fn_root);
@@ -48,6 +48,10 @@
 #include "src/args.h"
 #include <string.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <map>
 
 //#define TIMING_FFTW
 #ifdef TIMING_FFTW
@@ -66,6 +70,206 @@
 
 //#define DEBUG_PLANS
 
+// Process-wide plan cache -------------------------------------------------
+// Plans are shared by all transformers with the same dimensions, precision,
+// placement and data alignment. As FourierTransformer always executes with
+// the new-array interface (fftw_execute_dft_r2c etc.), a plan can be used
+// on any pair of arrays of the same shape and alignment, also by several
+// threads at the same time.
+struct FFTWPlanCacheKey
+{
+	bool is_complex;
+	std::vector<int> N;
+	bool in_place;
+	int align_in, align_out;
+	int nr_threads;
+	unsigned flags;
+
+	bool operator<(const FFTWPlanCacheKey &other) const
+	{
+		if (is_complex != other.is_complex) return is_complex < other.is_complex;
+		if (N != other.N) return N < other.N;
+		if (in_place != other.in_place) return in_place < other.in_place;
+		if (align_in != other.align_in) return align_in < other.align_in;
+		if (align_out != other.align_out) return align_out < other.align_out;
+		if (nr_threads != other.nr_threads) return nr_threads < other.nr_threads;
+		return flags < other.flags;
+	}
+};
+
+struct FFTWPlanCacheEntry
+{
+#ifdef RELION_SINGLE_PRECISION
+	fftwf_plan forward, backward;
+#else
+	fftw_plan forward, backward;
+#endif
+	// Number of transformers that currently hold these plans
+	long int users;
+};
+
+class FFTWPlanCache
+{
+public:
+	std::map<FFTWPlanCacheKey, FFTWPlanCacheEntry*> entries;
+	unsigned flags;
+	int nr_threads;
+	std::string fn_wisdom;
+	bool wisdom_has_changed;
+
+	FFTWPlanCache():
+		flags(FFTW_ESTIMATE),
+		nr_threads(1),
+		wisdom_has_changed(false)
+	{
+		const char *planner = getenv("RELION_FFTW_PLANNER");
+		if (planner != NULL)
+		{
+			std::string mode(planner);
+			if (mode == "measure")
+				flags = FFTW_MEASURE;
+			else if (mode == "patient")
+				flags = FFTW_PATIENT;
+			else if (mode != "estimate")
+				std::cerr << " WARNING: ignoring unknown RELION_FFTW_PLANNER value: " << mode << " (use estimate, measure or patient)" << std::endl;
+		}
+
+		const char *wisdom = getenv("RELION_FFTW_WISDOM");
+		if (wisdom != NULL)
+			setWisdomFile(wisdom);
+	}
+
+	void setWisdomFile(const std::string &fn)
+	{
+		fn_wisdom = fn;
+		wisdom_has_changed = false;
+		if (fn_wisdom == "" || !exists(fn_wisdom))
+			return;
+#if defined(MKLFFT)
+		// The MKL wrappers do not keep any wisdom
+		bool success = false;
+#elif defined(RELION_SINGLE_PRECISION)
+		bool success = fftwf_import_wisdom_from_filename(fn_wisdom.c_str());
+#else
+		bool success = fftw_import_wisdom_from_filename(fn_wisdom.c_str());
+#endif
+		if (!success)
+			std::cerr << " WARNING: cannot read FFTW wisdom from " << fn_wisdom << std::endl;
+	}
+
+	void exportWisdom()
+	{
+		if (fn_wisdom == "" || !wisdom_has_changed)
+			return;
+
+		// Several processes may share the wisdom file: write to a unique temporary file and rename it
+		std::string fn_tmp = fn_wisdom + ".tmp" + integerToString(getpid());
+#if defined(MKLFFT)
+		bool success = false;
+#elif defined(RELION_SINGLE_PRECISION)
+		bool success = fftwf_export_wisdom_to_filename(fn_tmp.c_str());
+#else
+		bool success = fftw_export_wisdom_to_filename(fn_tmp.c_str());
+#endif
+		if (!success || rename(fn_tmp.c_str(), fn_wisdom.c_str()) != 0)
+		{
+			std::cerr << " WARNING: cannot write FFTW wisdom to " << fn_wisdom << std::endl;
+			remove(fn_tmp.c_str());
+			return;
+		}
+		wisdom_has_changed = false;
+	}
+
+	// Destroy all plans that are not used by any transformer, and return whether the cache is now empty
+	bool purge()
+	{
+		std::map<FFTWPlanCacheKey, FFTWPlanCacheEntry*>::iterator it = entries.begin();
+		while (it != entries.end())
+		{
+			if (it->second->users == 0)
+			{
+#ifdef RELION_SINGLE_PRECISION
+				fftwf_destroy_plan(it->second->forward);
+				fftwf_destroy_plan(it->second->backward);
+#else
+				fftw_destroy_plan(it->second->forward);
+				fftw_destroy_plan(it->second->backward);
+#endif
+				delete it->second;
+				entries.erase(it++);
+			}
+			else
+				it++;
+		}
+		return entries.empty();
+	}
+};
+
+// Offset of an array with respect to the SIMD alignment that FFTW plans depend on
+static int fftwAlignmentOf(RFLOAT *ptr)
+{
+#if defined(MKLFFT)
+	// The MKL wrappers do not provide fftw_alignment_of
+	return (int)((size_t)ptr % 64);
+#elif defined(RELION_SINGLE_PRECISION)
+	return fftwf_alignment_of(ptr);
+#else
+	return fftw_alignment_of(ptr);
+#endif
+}
+
+static void exportFFTWWisdomAtExit();
+
+// Never destroyed, so that transformers in static objects can still release their plans at exit
+static FFTWPlanCache& getFFTWPlanCache()
+{
+	static FFTWPlanCache *cache = NULL;
+	if (cache == NULL)
+	{
+		cache = new FFTWPlanCache();
+		atexit(exportFFTWWisdomAtExit);
+	}
+	return *cache;
+}
+
+static void exportFFTWWisdomAtExit()
+{
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	getFFTWPlanCache().exportWisdom();
+}
+
+void FourierTransformer::setPlannerRigour(unsigned flags)
+{
+	if (flags != FFTW_ESTIMATE && flags != FFTW_MEASURE && flags != FFTW_PATIENT)
+		REPORT_ERROR("FourierTransformer::setPlannerRigour: use FFTW_ESTIMATE, FFTW_MEASURE or FFTW_PATIENT");
+
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	getFFTWPlanCache().flags = flags;
+}
+
+void FourierTransformer::setPlannerThreads(int nr_threads)
+{
+#ifdef MKLFFT
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	{
+		fftw_plan_with_nthreads(nr_threads);
+		getFFTWPlanCache().nr_threads = nr_threads;
+	}
+#endif
+}
+
+void FourierTransformer::setWisdomFile(const std::string &fn_wisdom)
+{
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	getFFTWPlanCache().setWisdomFile(fn_wisdom);
+}
+
+void FourierTransformer::exportWisdom()
+{
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	getFFTWPlanCache().exportWisdom();
+}
+
 // Constructors and destructors --------------------------------------------
 FourierTransformer::FourierTransformer():
 		plans_are_set(false)
@@ -88,18 +292,49 @@ FourierTransformer::~FourierTransformer()
 FourierTransformer::FourierTransformer(const FourierTransformer& op) :
 		plans_are_set(false)
 {
-	// Clear current object
-	clear();
+	init();
 	// New object is an extact copy of op
 	*this = op;
 }
 
+FourierTransformer& FourierTransformer::operator=(const FourierTransformer& op)
+{
+	if (this == &op)
+		return *this;
+
+	// Clear current object
+	clear();
+
+	fReal = op.fReal;
+	fComplex = op.fComplex;
+	fFourier = op.fFourier;
+	dataPtr = op.dataPtr;
+	// fFourier has been copied to new memory, so the plans will be checked again at the next setReal
+	complexDataPtr = op.complexDataPtr;
+
+	// Share the plans of op
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	{
+		if (op.plans_are_set)
+		{
+			fPlanForward = op.fPlanForward;
+			fPlanBackward = op.fPlanBackward;
+			planCacheEntry = op.planCacheEntry;
+			planCacheEntry->users++;
+			plans_are_set = true;
+		}
+	}
+
+	return *this;
+}
+
 void FourierTransformer::init()
 {
 	fReal = NULL;
 	fComplex = NULL;
 	fPlanForward = NULL;
 	fPlanBackward = NULL;
+	planCacheEntry = NULL;
 	dataPtr = NULL;
 	complexDataPtr = NULL;
 }
@@ -120,11 +355,23 @@ void FourierTransformer::cleanup()
 	clear();
 	// Then clean up all the junk fftw keeps lying around
 	// SOMEHOW THE FOLLOWING IS NOT ALLOWED WHEN USING MULTPLE TRANSFORMER OBJECTS....
+	// Therefore, only do this once no other transformer holds any cached plans
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	{
+		FFTWPlanCache &cache = getFFTWPlanCache();
+		// fftw_cleanup also forgets all wisdom
+		cache.exportWisdom();
+		if (cache.purge())
+		{
 #ifdef RELION_SINGLE_PRECISION
-	fftwf_cleanup();
+			fftwf_cleanup();
 #else
-	fftw_cleanup();
+			fftw_cleanup();
 #endif
+			// Get the wisdom back for the plans that are made after this
+			cache.setWisdomFile(cache.fn_wisdom);
+		}
+	}
 
 #ifdef DEBUG_PLANS
 	std::cerr << "CLEANED-UP this= "<<this<< std::endl;
@@ -139,13 +386,11 @@ void FourierTransformer::destroyPlans()
 	{
 		if (plans_are_set)
 		{
-#ifdef RELION_SINGLE_PRECISION
-			fftwf_destroy_plan(fPlanForward);
-			fftwf_destroy_plan(fPlanBackward);
-#else
-			fftw_destroy_plan(fPlanForward);
-			fftw_destroy_plan(fPlanBackward);
-#endif
+			// The plans remain in the cache for other transformers of the same size
+			planCacheEntry->users--;
+			planCacheEntry = NULL;
+			fPlanForward = NULL;
+			fPlanBackward = NULL;
 			plans_are_set = false;
 		}
 	}
@@ -205,35 +450,11 @@ void FourierTransformer::setReal(MultidimArray<RFLOAT> &input, bool force_new_pl
 			break;
 		}
 
-		// Destroy both forward and backward plans if they already exist
-		destroyPlans();
-
-		// Make new plans
-		plans_are_set = true;
-
+		// Get (possibly shared) plans from the cache, this releases the old ones
 		RCTIC(TIMING_FFTW_PLAN);
-
-		#pragma omp critical(FourierTransformer_fftw_plan)
-		{
-#ifdef RELION_SINGLE_PRECISION
-			fPlanForward = fftwf_plan_dft_r2c(ndim, N, MULTIDIM_ARRAY(*fReal),
-							  (fftwf_complex*) MULTIDIM_ARRAY(fFourier), FFTW_ESTIMATE);
-			fPlanBackward = fftwf_plan_dft_c2r(ndim, N,
-							   (fftwf_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal),
-							   FFTW_ESTIMATE);
-#else
-			fPlanForward = fftw_plan_dft_r2c(ndim, N, MULTIDIM_ARRAY(*fReal),
-							 (fftw_complex*) MULTIDIM_ARRAY(fFourier), FFTW_ESTIMATE);
-			fPlanBackward = fftw_plan_dft_c2r(ndim, N,
-							  (fftw_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal),
-							  FFTW_ESTIMATE);
-#endif
-		}	
+		acquirePlans(ndim, N, false);
 		RCTOC(TIMING_FFTW_PLAN);
 
-		if (fPlanForward == NULL || fPlanBackward == NULL)
-			REPORT_ERROR("FFTW plans cannot be created");
-
 #ifdef DEBUG_PLANS
 		std::cerr << " SETREAL fPlanForward= " << fPlanForward << " fPlanBackward= " << fPlanBackward  <<" this= "<<this<< std::endl;
 #endif
@@ -284,33 +505,135 @@ void FourierTransformer::setReal(MultidimArray<Complex > &input, bool force_new_
 			break;
 		}
 
-		// Destroy both forward and backward plans if they already exist
-		destroyPlans();
+		// Get (possibly shared) plans from the cache, this releases the old ones
+		RCTIC(TIMING_FFTW_PLAN);
+		acquirePlans(ndim, N, true);
+		RCTOC(TIMING_FFTW_PLAN);
+
+		delete [] N;
+		complexDataPtr=MULTIDIM_ARRAY(*fComplex);
+	}
+}
+
+void FourierTransformer::acquirePlans(int ndim, int *N, bool is_complex)
+{
+	FFTWPlanCacheKey key;
+	key.is_complex = is_complex;
+	key.N = std::vector<int>(N, N + ndim);
 
-		plans_are_set = true;
+	RFLOAT *in = (is_complex) ? (RFLOAT*) MULTIDIM_ARRAY(*fComplex) : MULTIDIM_ARRAY(*fReal);
+	RFLOAT *out = (RFLOAT*) MULTIDIM_ARRAY(fFourier);
+	key.in_place = (in == out);
+	key.align_in = fftwAlignmentOf(in);
+	key.align_out = fftwAlignmentOf(out);
 
-		RCTIC(TIMING_FFTW_PLAN);
-		#pragma omp critical(FourierTransformer_fftw_plan)
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	{
+		FFTWPlanCache &cache = getFFTWPlanCache();
+		key.nr_threads = cache.nr_threads;
+		key.flags = cache.flags;
+
+		// Release the old plans (this cannot call destroyPlans(), as we are already inside the critical section)
+		if (plans_are_set)
+		{
+			planCacheEntry->users--;
+			plans_are_set = false;
+		}
+
+		std::map<FFTWPlanCacheKey, FFTWPlanCacheEntry*>::iterator it = cache.entries.find(key);
+		if (it != cache.entries.end())
+		{
+			planCacheEntry = it->second;
+		}
+		else
 		{
+			// FFTW_MEASURE and FFTW_PATIENT overwrite the arrays: plan on scratch arrays of the same alignment instead
+			bool use_scratch = (key.flags != FFTW_ESTIMATE);
+			size_t real_size = 1, fourier_size = 1;
+			for (int d = 0; d < ndim - 1; d++)
+			{
+				real_size *= N[d];
+				fourier_size *= N[d];
+			}
+			real_size *= N[ndim - 1];
+			fourier_size *= (is_complex) ? N[ndim - 1] : N[ndim - 1] / 2 + 1;
+			size_t in_bytes = ((is_complex) ? 2 * real_size : real_size) * sizeof(RFLOAT);
+			size_t out_bytes = 2 * fourier_size * sizeof(RFLOAT);
+
+			char *in_scratch = NULL, *out_scratch = NULL;
+			RFLOAT *plan_in = in, *plan_out = out;
+			if (use_scratch)
+			{
+				// Allocate a bit more than needed, so that the scratch arrays can be shifted to the alignment of the data
 #ifdef RELION_SINGLE_PRECISION
-			fPlanForward = fftwf_plan_dft(ndim, N, (fftwf_complex*) MULTIDIM_ARRAY(*fComplex),
-						      (fftwf_complex*) MULTIDIM_ARRAY(fFourier), FFTW_FORWARD, FFTW_ESTIMATE);
-			fPlanBackward = fftwf_plan_dft(ndim, N, (fftwf_complex*) MULTIDIM_ARRAY(fFourier),
-						       (fftwf_complex*) MULTIDIM_ARRAY(*fComplex), FFTW_BACKWARD, FFTW_ESTIMATE);
+				in_scratch = (char*) fftwf_malloc(in_bytes + 64);
+				out_scratch = (key.in_place) ? in_scratch : (char*) fftwf_malloc(out_bytes + 64);
 #else
-			fPlanForward = fftw_plan_dft(ndim, N, (fftw_complex*) MULTIDIM_ARRAY(*fComplex),
-						     (fftw_complex*) MULTIDIM_ARRAY(fFourier), FFTW_FORWARD, FFTW_ESTIMATE);
-			fPlanBackward = fftw_plan_dft(ndim, N, (fftw_complex*) MULTIDIM_ARRAY(fFourier),
-						      (fftw_complex*) MULTIDIM_ARRAY(*fComplex), FFTW_BACKWARD, FFTW_ESTIMATE);
+				in_scratch = (char*) fftw_malloc(in_bytes + 64);
+				out_scratch = (key.in_place) ? in_scratch : (char*) fftw_malloc(out_bytes + 64);
 #endif
-		}		
-		RCTOC(TIMING_FFTW_PLAN);
+				if (in_scratch == NULL || out_scratch == NULL)
+					REPORT_ERROR("FourierTransformer::acquirePlans: cannot allocate scratch arrays for FFTW planning");
+				plan_in = (RFLOAT*)(in_scratch + key.align_in);
+				plan_out = (RFLOAT*)(out_scratch + key.align_out);
+			}
+
+			FFTWPlanCacheEntry *entry = new FFTWPlanCacheEntry();
+			entry->users = 0;
+#ifdef RELION_SINGLE_PRECISION
+			if (is_complex)
+			{
+				entry->forward = fftwf_plan_dft(ndim, N, (fftwf_complex*) plan_in,
+				                                (fftwf_complex*) plan_out, FFTW_FORWARD, key.flags);
+				entry->backward = fftwf_plan_dft(ndim, N, (fftwf_complex*) plan_out,
+				                                 (fftwf_complex*) plan_in, FFTW_BACKWARD, key.flags);
+			}
+			else
+			{
+				entry->forward = fftwf_plan_dft_r2c(ndim, N, plan_in,
+				                                    (fftwf_complex*) plan_out, key.flags);
+				entry->backward = fftwf_plan_dft_c2r(ndim, N,
+				                                     (fftwf_complex*) plan_out, plan_in, key.flags);
+			}
+#else
+			if (is_complex)
+			{
+				entry->forward = fftw_plan_dft(ndim, N, (fftw_complex*) plan_in,
+				                               (fftw_complex*) plan_out, FFTW_FORWARD, key.flags);
+				entry->backward = fftw_plan_dft(ndim, N, (fftw_complex*) plan_out,
+				                                (fftw_complex*) plan_in, FFTW_BACKWARD, key.flags);
+			}
+			else
+			{
+				entry->forward = fftw_plan_dft_r2c(ndim, N, plan_in,
+				                                   (fftw_complex*) plan_out, key.flags);
+				entry->backward = fftw_plan_dft_c2r(ndim, N,
+				                                    (fftw_complex*) plan_out, plan_in, key.flags);
+			}
+#endif
+			if (use_scratch)
+			{
+#ifdef RELION_SINGLE_PRECISION
+				fftwf_free(in_scratch);
+				if (!key.in_place) fftwf_free(out_scratch);
+#else
+				fftw_free(in_scratch);
+				if (!key.in_place) fftw_free(out_scratch);
+#endif
+				cache.wisdom_has_changed = true;
+			}
 
-		if (fPlanForward == NULL || fPlanBackward == NULL)
-			REPORT_ERROR("FFTW plans cannot be created");
+			if (entry->forward == NULL || entry->backward == NULL)
+				REPORT_ERROR("FFTW plans cannot be created");
 
-		delete [] N;
-		complexDataPtr=MULTIDIM_ARRAY(*fComplex);
+			cache.entries[key] = entry;
+			planCacheEntry = entry;
+		}
+
+		planCacheEntry->users++;
+		fPlanForward = planCacheEntry->forward;
+		fPlanBackward = planCacheEntry->backward;
+		plans_are_set = true;
 	}
 }
 
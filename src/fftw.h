@@ -129,6 +129,9 @@
 #define FFTW2D_ELEM(V, ip, jp) \
 	(DIRECT_A2D_ELEM((V), ((ip < 0) ? (ip + YSIZE(V)) : (ip)), (jp)))
 
+/** Entry of the process-wide FFTW plan cache (defined in fftw.cpp) */
+struct FFTWPlanCacheEntry;
+
 /** Fourier Transformer class.
  * @ingroup FourierW
  *
@@ -175,6 +178,9 @@ public:
 
 	bool plans_are_set;
 
+	/* Entry of the process-wide plan cache that fPlanForward and fPlanBackward were taken from */
+	FFTWPlanCacheEntry *planCacheEntry;
+
 // Public methods
 public:
 	/** Default constructor */
@@ -191,6 +197,36 @@ public:
 	 */
 	FourierTransformer(const FourierTransformer& op);
 
+	/** Assignment
+	 *
+	 * The plans are shared with op through the plan cache.
+	 */
+	FourierTransformer& operator=(const FourierTransformer& op);
+
+	/** Set the planner rigour for all plans that are made from now on:
+	 *  FFTW_ESTIMATE (default), FFTW_MEASURE or FFTW_PATIENT.
+	 *  The default can also be set through the environment variable
+	 *  RELION_FFTW_PLANNER (estimate, measure or patient).
+	 *  Plans are always made on scratch arrays, so the data is not overwritten.
+	 */
+	static void setPlannerRigour(unsigned flags);
+
+	/** Set the number of threads for all plans that are made from now on
+	 *  (this calls fftw_plan_with_nthreads). Plans with different numbers
+	 *  of threads are kept separately in the plan cache.
+	 *  Only MKL builds link a multi-threaded FFTW; otherwise this does nothing.
+	 */
+	static void setPlannerThreads(int nr_threads);
+
+	/** Read FFTW wisdom from this file (if it exists) and write the accumulated
+	 *  wisdom back to it at exit. The file can also be set through the
+	 *  environment variable RELION_FFTW_WISDOM.
+	 */
+	static void setWisdomFile(const std::string &fn_wisdom);
+
+	/** Write the accumulated wisdom to the wisdom file now (if one was set) */
+	static void exportWisdom();
+
 	/** Compute the Fourier transform of a MultidimArray, 2D and 3D.
 	    If getCopy is false, an alias to the transformed data is returned.
 	    This is a faster option since a copy of all the data is avoided,
@@ -339,12 +375,17 @@ public:
 	void clear();
 
 	/** This calls fftw_cleanup.
+	 *  Cached plans that are not used by any other transformer are destroyed first;
+	 *  fftw_cleanup is skipped while other transformers still hold plans.
 	*/
 	void cleanup();
 
-	/** Destroy both forward and backward fftw planes (mutex locked */
+	/** Release both forward and backward fftw plans back to the plan cache (mutex locked) */
 	void destroyPlans();
 
+	/** Get forward and backward plans for the current arrays from the plan cache */
+	void acquirePlans(int ndim, int *N, bool is_complex);
+
 	/** Computes the transform, specified in Init() function
 	    If normalization=true the forward transform is normalized
 	    (no normalization is made in the inverse transform)
@@ -95,7 +95,7 @@ typedef enum
 typedef enum
 {
 	WRITE_OVERWRITE, //forget about the old file and overwrite it
-	WRITE_APPEND,	 //append and object at the end of a stack, so far can not append stacks
+	WRITE_APPEND,	 //append an object at the end of a stack (for MRC stacks, all images in the object)
 	WRITE_REPLACE,	 //replace a particular object by another
 	WRITE_READONLY	 //only can read the file
 } WriteMode;
@@ -114,7 +114,7 @@ extern "C" {
 #ifdef TIFF_DEBUG
 		std::cout << "TiffInMemoryReadProc: read_size = " << read_size << " cur_pos = " << tiff_handle->pos << " buf_size = " << tiff_handle->size << std::endl;
 #endif
-		if (tiff_handle->pos + read_size >= tiff_handle->size)
+		if (tiff_handle->pos + read_size > tiff_handle->size)
 			REPORT_ERROR("TiffInMemoryReadProc: seeking beyond the end of the buffer.");
 
 		memcpy(buf, tiff_handle->buf + tiff_handle->pos, read_size);
@@ -141,20 +141,20 @@ extern "C" {
 		switch (whence)
 		{
 			case SEEK_SET:
-				tiff_handle->pos = 0;
+				tiff_handle->pos = offset;
 				break;
 			case SEEK_CUR:
 				tiff_handle->pos += offset;
 				break;
 			case SEEK_END:
-				REPORT_ERROR("TIFFInMemorySeekProc: SEEK_END is not supported.");
-				// break; // intentional to suppress compiler warnings.
+				tiff_handle->pos = tiff_handle->size + offset;
+				break;
 		}
 
-		if (tiff_handle->pos >= tiff_handle->size)
+		if (tiff_handle->pos > tiff_handle->size)
 			REPORT_ERROR("TIFFInMemorySeekProc: seeking beyond the end of the buffer.");
 
-		return 0;
+		return tiff_handle->pos;
 	}
 
 	static int TiffInMemoryCloseProc(thandle_t handle)
@@ -948,6 +948,40 @@ public:
 		}
 	}
 
+	/** Read the raw data of a single image from memory
+	  *
+	  * pixels points to the first pixel of the image, e.g. inside a memory-mapped stack
+	  * (see MappedStackReader). The pixels are byte-swapped if needed and cast to T.
+	  * The main header is left untouched.
+	  */
+	void readFromMemory(const char *pixels, long int Xdim, long int Ydim, long int Zdim,
+	                    DataType datatype, int swap_bytes)
+	{
+		if (datatype == UHalf && (Xdim * Ydim) % 2 != 0)
+			REPORT_ERROR("Image::readFromMemory: for UHalf, Xdim * Ydim must be even.");
+
+		data.setDimensions(Xdim, Ydim, Zdim, 1);
+		data.coreAllocateReuse();
+
+		size_t nr_pixels = ZYXSIZE(data);
+		size_t pagesize = (datatype == UHalf) ? nr_pixels / 2 : nr_pixels * gettypesize(datatype);
+
+		if (swap_bytes)
+		{
+			// swapPage works in place, and the mapped pages are read-only
+			char *page = (char *) askMemory(pagesize * sizeof(char));
+			memcpy(page, pixels, pagesize);
+			swap = swap_bytes;
+			swapPage(page, pagesize, datatype);
+			castPage2T(page, MULTIDIM_ARRAY(data), datatype, nr_pixels);
+			freeMemory(page, pagesize * sizeof(char));
+		}
+		else
+		{
+			castPage2T(const_cast<char *>(pixels), MULTIDIM_ARRAY(data), datatype, nr_pixels);
+		}
+	}
+
 	/** Read the raw data
 	  */
 	int readData(FILE* fimg, long int select_img, DataType datatype, unsigned long pad, bool dont_seek=false)
@@ -1354,8 +1388,13 @@ public:
 		(*this)()+=aux();
 	}
 
+	/** Read a TIFF file that is already in memory
+	  *
+	  * With n_threads > 1, the strips of each page are decoded in parallel,
+	  * every thread through its own handle on buf.
+	  */
 	int readTiffInMemory(void* buf, size_t size, bool readdata=true, long int select_img = -1,
-	                     bool mapData = false, bool is_2D = false)
+	                     bool mapData = false, bool is_2D = false, int n_threads = 1)
 	{
 		int err = 0;
 
@@ -1377,7 +1416,7 @@ public:
 		                             TiffInMemoryReadProc, TiffInMemoryWriteProc, TiffInMemorySeekProc,
 		                             TiffInMemoryCloseProc, TiffInMemorySizeProc, TiffInMemoryMapFileProc,
 		                             TiffInMemoryUnmapFileProc);
-		err = readTIFF(ftiff, select_img, readdata, true, "in-memory-tiff");
+		err = readTIFF(ftiff, select_img, readdata, true, "in-memory-tiff", &handle, n_threads);
 		TIFFClose(ftiff);
 
 		return err;
@@ -1575,6 +1614,34 @@ private:
 	}
 };
 
+/** Threads per frame for Image::readTiffInMemory, to decode n_frames frames of a TIFF file in memory with n_threads threads
+  *
+  * Either the frames are decoded in parallel, one thread each (returns 1), or one after another,
+  * with their strips in parallel (returns n_threads), whichever takes fewer rounds of strip decoding.
+  */
+inline int getTiffStripThreads(void* buf, size_t size, int n_frames, int n_threads)
+{
+	if (n_threads < 2)
+		return 1;
+
+	TiffInMemory handle;
+	handle.buf = (unsigned char*)buf;
+	handle.size = size;
+	handle.pos = 0;
+	TIFF* ftiff = TIFFClientOpen("in-memory-tiff", "r", (thandle_t)&handle,
+	                             TiffInMemoryReadProc, TiffInMemoryWriteProc, TiffInMemorySeekProc,
+	                             TiffInMemoryCloseProc, TiffInMemorySizeProc, TiffInMemoryMapFileProc,
+	                             TiffInMemoryUnmapFileProc);
+	if (ftiff == NULL)
+		return 1;
+	const long int n_strips = TIFFNumberOfStrips(ftiff);
+	TIFFClose(ftiff);
+
+	const long int frame_rounds = ((n_frames + n_threads - 1) / n_threads) * n_strips;
+	const long int strip_rounds = n_frames * ((n_strips + n_threads - 1) / n_threads);
+	return (strip_rounds < frame_rounds) ? n_threads : 1;
+}
+
 class CompressedMRCReader
 {
 /*
@@ -1661,7 +1728,7 @@ class CompressedMRCReader
 		if (filename.endsWith("bz2"))
 			commandline = "pbzip2 -cdkp" + integerToString(n_threads);
 		else if (filename.endsWith("xz"))
-			commandline = "xz -cdk";
+			commandline = "xz -cdkT" + integerToString(n_threads); // only multi-block files are decompressed in parallel
 		else if (filename.endsWith("zst"))
 			commandline = "zstd -cdk";
 		else
@@ -1687,6 +1754,35 @@ class CompressedMRCReader
 		delete header;
 	};
 
+	// Read the raw data of a frame from the pipe. As for readFrameInto, frames must be requested in order.
+	// Together with convertRawFrame, this allows the frames to be converted in parallel.
+	void readRawFrame(std::vector<char> &raw, size_t frame)
+	{
+		if (pipe == NULL)
+			REPORT_ERROR("CompressedMRCReader::readRawFrame() called before a file is opened.");
+
+		const size_t nr_pixels = (size_t)Ihead.data.xdim * Ihead.data.ydim;
+		const size_t frame_size = (datatype == UHalf) ? nr_pixels / 2 : nr_pixels * gettypesize(datatype);
+
+		if (frame < current_frame)
+			REPORT_ERROR("CompressedMRCReader::readRawFrame() cannot rewind a pipe.");
+		else if (frame > current_frame)
+			skip(frame_size * (frame - current_frame));
+
+		current_frame = frame + 1;
+		raw.resize(frame_size);
+		if (fread(&raw[0], frame_size, 1, pipe) < 1)
+			REPORT_ERROR((std::string)"CompressedMRCReader::readRawFrame() failed to read data from the pipe.\n" + \
+			             "Command line for the pipe: " + commandline);
+	}
+
+	// Convert the data from readRawFrame. This is thread-safe.
+	template<typename T>
+	void convertRawFrame(const std::vector<char> &raw, Image<T> &image) const
+	{
+		image.readFromMemory(&raw[0], Ihead.data.xdim, Ihead.data.ydim, 1, datatype, 0);
+	}
+
 	template<typename T>
 	void readFrameInto(Image<T> &image, size_t frame)
 	{
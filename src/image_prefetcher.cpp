@@ -0,0 +1,271 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include "src/image_prefetcher.h"
+#include "src/mapped_stack.h"
+
+ImagePrefetcher::ImagePrefetcher(int _max_ahead)
+: max_ahead(XMIPP_MAX(0, _max_ahead)), reading(NULL), do_stop(false),
+  read_time(0.), stall_time(0.)
+{
+	io_thread = std::thread(&ImagePrefetcher::run, this);
+}
+
+ImagePrefetcher::~ImagePrefetcher()
+{
+	clear();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		do_stop = true;
+	}
+	cond.notify_all();
+	io_thread.join();
+}
+
+// Sort images by stack and then by number in the stack
+static void getFileOrder(const std::vector<FileName> &fn_imgs, std::vector<long int> &img_nrs,
+                         std::vector<FileName> &fn_stacks, std::vector<size_t> &order)
+{
+	img_nrs.resize(fn_imgs.size());
+	fn_stacks.resize(fn_imgs.size());
+	order.resize(fn_imgs.size());
+	for (size_t i = 0; i < fn_imgs.size(); i++)
+	{
+		fn_imgs[i].decompose(img_nrs[i], fn_stacks[i]);
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+	{
+		int cmp = fn_stacks[a].compare(fn_stacks[b]);
+		return (cmp != 0) ? cmp < 0 : img_nrs[a] < img_nrs[b];
+	});
+}
+
+// Read one image, only re-opening hFile for a new stack
+static void readOneImage(const FileName &fn_img, const FileName &fn_stack, long int img_nr,
+                         fImageHandler &hFile, FileName &fn_open_stack, Image<RFLOAT> &img)
+{
+	if (MappedStackReader::canRead(fn_img))
+	{
+		MappedStackReader::forThisThread().read(fn_stack, img_nr - 1, img);
+	}
+	else
+	{
+		if (fn_stack != fn_open_stack)
+		{
+			hFile.openFile(fn_stack, WRITE_READONLY);
+			fn_open_stack = fn_stack;
+		}
+		img.readFromOpenFile(fn_img, hFile, -1, false);
+	}
+	img().setXmippOrigin();
+}
+
+void ImagePrefetcher::readImages(const std::vector<FileName> &fn_imgs, std::vector<MultidimArray<RFLOAT> > &imgs)
+{
+	std::vector<long int> img_nrs;
+	std::vector<FileName> fn_stacks;
+	std::vector<size_t> order;
+	getFileOrder(fn_imgs, img_nrs, fn_stacks, order);
+
+	imgs.resize(fn_imgs.size());
+
+	fImageHandler hFile;
+	FileName fn_open_stack = "";
+	Image<RFLOAT> img;
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		size_t iimg = order[i];
+		readOneImage(fn_imgs[iimg], fn_stacks[iimg], img_nrs[iimg], hFile, fn_open_stack, img);
+		imgs[iimg] = img();
+	}
+}
+
+void ImagePrefetcher::push(long int batch_id, const std::vector<FileName> &fn_imgs)
+{
+	Batch *batch = new Batch;
+	batch->id = batch_id;
+	batch->fn_imgs = fn_imgs;
+	batch->imgs.resize(fn_imgs.size());
+	batch->is_read.resize(fn_imgs.size(), false);
+	batch->cancelled = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		batches.push_back(batch);
+	}
+	cond.notify_all();
+}
+
+bool ImagePrefetcher::canPush()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return (batches.size() < (size_t)max_ahead + 1);
+}
+
+bool ImagePrefetcher::isQueued(long int batch_id)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (size_t ibatch = 0; ibatch < batches.size(); ibatch++)
+		if (batches[ibatch]->id == batch_id)
+			return true;
+	return false;
+}
+
+bool ImagePrefetcher::isCurrent(long int batch_id)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return (!batches.empty() && batches.front()->id == batch_id);
+}
+
+const MultidimArray<RFLOAT>& ImagePrefetcher::get(size_t i)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (batches.empty() || i >= batches.front()->imgs.size())
+		REPORT_ERROR("BUG: ImagePrefetcher::get: image not in the current batch");
+
+	Batch *batch = batches.front();
+	if (!batch->is_read[i] && !error)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		cond.wait(lock, [&]{ return batch->is_read[i] || error; });
+		stall_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	if (error)
+		std::rethrow_exception(error);
+
+	return batch->imgs[i];
+}
+
+void ImagePrefetcher::popFront(std::unique_lock<std::mutex> &lock)
+{
+	Batch *batch = batches.front();
+	batch->cancelled = true;
+	// The I/O thread may still be working on it
+	cond.wait(lock, [&]{ return reading != batch; });
+	batches.pop_front();
+	delete batch;
+}
+
+void ImagePrefetcher::release()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (!batches.empty())
+		popFront(lock);
+}
+
+void ImagePrefetcher::clear()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!batches.empty())
+		popFront(lock);
+	// An error in a dropped batch is of no concern anymore
+	error = std::exception_ptr();
+}
+
+double ImagePrefetcher::getReadTime()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return read_time;
+}
+
+double ImagePrefetcher::getStallTime()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return stall_time;
+}
+
+void ImagePrefetcher::resetStats()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	read_time = stall_time = 0.;
+}
+
+void ImagePrefetcher::run()
+{
+	fImageHandler hFile;
+	FileName fn_open_stack = "";
+	Image<RFLOAT> img;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		// Find the oldest batch that has not been read yet
+		Batch *batch = NULL;
+		for (size_t ibatch = 0; ibatch < batches.size(); ibatch++)
+		{
+			Batch *b = batches[ibatch];
+			if (!b->cancelled && std::find(b->is_read.begin(), b->is_read.end(), false) != b->is_read.end())
+			{
+				batch = b;
+				break;
+			}
+		}
+
+		if (batch == NULL || error)
+		{
+			if (do_stop)
+				return;
+			cond.wait(lock);
+			continue;
+		}
+
+		reading = batch;
+		lock.unlock();
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::vector<long int> img_nrs;
+		std::vector<FileName> fn_stacks;
+		std::vector<size_t> order;
+		getFileOrder(batch->fn_imgs, img_nrs, fn_stacks, order);
+
+		std::exception_ptr my_error;
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			size_t iimg = order[i];
+			try
+			{
+				readOneImage(batch->fn_imgs[iimg], fn_stacks[iimg], img_nrs[iimg], hFile, fn_open_stack, img);
+				batch->imgs[iimg] = img();
+			}
+			catch (...)
+			{
+				my_error = std::current_exception();
+			}
+
+			lock.lock();
+			if (my_error)
+				error = my_error;
+			else
+				batch->is_read[iimg] = true;
+			bool do_quit = (batch->cancelled || error);
+			lock.unlock();
+			cond.notify_all();
+			if (do_quit)
+				break;
+		}
+
+		lock.lock();
+		read_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		reading = NULL;
+		cond.notify_all();
+	}
+}
@@ -0,0 +1,108 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef IMAGE_PREFETCHER_H_
+#define IMAGE_PREFETCHER_H_
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "src/image.h"
+
+/** Background reader for batches of particle images
+ *
+ * A dedicated I/O thread reads the images of queued batches (in file order, see
+ * readImages), while the calling threads work on the oldest batch. Workers ask for
+ * single images with get(), which only waits if that image has not been read yet.
+ * At most max_ahead batches are queued beyond the one being worked on.
+ */
+class ImagePrefetcher
+{
+public:
+
+	ImagePrefetcher(int max_ahead = 1);
+	~ImagePrefetcher();
+
+	/** Read images into imgs (in the order of fn_imgs), accessing the disc sorted by stack and image number.
+	 *  MRC stacks are read through a memory map, other formats through the usual reader.
+	 */
+	static void readImages(const std::vector<FileName> &fn_imgs, std::vector<MultidimArray<RFLOAT> > &imgs);
+
+	/** Queue a batch of images for reading in the background */
+	void push(long int batch_id, const std::vector<FileName> &fn_imgs);
+
+	/** Can another batch be queued without exceeding max_ahead? */
+	bool canPush();
+
+	/** Has this batch been queued (and not released yet)? */
+	bool isQueued(long int batch_id);
+
+	/** Is this batch the oldest one in the queue? */
+	bool isCurrent(long int batch_id);
+
+	/** Image i of the oldest batch, waiting for the I/O thread if needed (thread-safe) */
+	const MultidimArray<RFLOAT>& get(size_t i);
+
+	/** Done with the oldest batch */
+	void release();
+
+	/** Drop all queued batches */
+	void clear();
+
+	/** Seconds spent reading by the I/O thread, and summed over all threads waiting in get() */
+	double getReadTime();
+	double getStallTime();
+	void resetStats();
+
+private:
+
+	struct Batch
+	{
+		long int id;
+		std::vector<FileName> fn_imgs;
+		std::vector<MultidimArray<RFLOAT> > imgs;
+		std::vector<bool> is_read;
+		bool cancelled;
+	};
+
+	int max_ahead;
+	std::deque<Batch*> batches;
+	Batch *reading;
+	bool do_stop;
+	double read_time, stall_time;
+	std::exception_ptr error;
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::thread io_thread;
+
+	void run();
+
+	// Drop the oldest batch; the lock must be held
+	void popFront(std::unique_lock<std::mutex> &lock);
+
+	ImagePrefetcher(const ImagePrefetcher&);
+	ImagePrefetcher& operator=(const ImagePrefetcher&);
+};
+
+#endif /* IMAGE_PREFETCHER_H_ */
@@ -31,6 +31,7 @@
 #include <src/jaz/single_particle/stack_helper.h>
 #include <src/jaz/single_particle/img_proc/image_op.h>
 #include <src/jaz/single_particle/parallel_ft.h>
+#include <src/jaz/single_particle/prediction_cache.h>
 
 #include <src/jaz/util/zio.h>
 
@@ -249,6 +250,8 @@ void CtfRefiner::processSubsetMicrographs(long g_start, long g_end)
 
 	std::vector<ParFourierTransformer> fts(nr_omp_threads);
 
+	PredictionCache predictionCache(&reference, &obsModel, nr_omp_threads);
+
 	long nr_done = 0;
 	FileName prevdir = "";
 
@@ -275,33 +278,27 @@ void CtfRefiner::processSubsetMicrographs(long g_start, long g_end)
 			int res = system(command.c_str());
 		}
 
-		std::vector<Image<Complex>>
-				predSameT, // phase-demodulated (defocus)
-				predOppNT, // not phase-demodulated (tilt)
-				predOppT;  // phase-demodulated (mag and aberr)
-		// applyMtf is always true
+		// All predictions are made before any estimator updates the particles.
+		// The defocus, B-factor, aberration and magnification fits all use the same
+		// phase-modulated prediction and the tilt fit uses the same projections
+		// without the phase, so each particle is only projected once.
+		predictionCache.setMicrograph(unfinishedMdts[g]);
+
+		std::vector<Image<Complex>> noPred;
 
 		// Four booleans in predictAll are applyCtf, applyTilt, applyShift, applyMtf.
-		if (do_defocus_fit || do_bfac_fit)
-		{
-			predSameT = reference.predictAll(
-				unfinishedMdts[g], obsModel, ReferenceMap::Own, nr_omp_threads,
-				false, true, false, true, do_ctf_padding);
-		}
+		// applyMtf is always true
+		const std::vector<Image<Complex>>& predSameT = // phase-demodulated (defocus)
+			(do_defocus_fit || do_bfac_fit)?
+				predictionCache.predictAll(ReferenceMap::Own, false, true, false, true, do_ctf_padding) : noPred;
 
-		if (do_tilt_fit)
-		{
-			predOppNT = reference.predictAll(
-				unfinishedMdts[g], obsModel, ReferenceMap::Own, nr_omp_threads,
-				false, false, false, true, do_ctf_padding);
-		}
+		const std::vector<Image<Complex>>& predOppNT = // not phase-demodulated (tilt)
+			do_tilt_fit?
+				predictionCache.predictAll(ReferenceMap::Own, false, false, false, true, do_ctf_padding) : noPred;
 
-		if (do_aberr_fit || do_mag_fit)
-		{
-			predOppT = reference.predictAll(
-				unfinishedMdts[g], obsModel, ReferenceMap::Own, nr_omp_threads,
-				false, true, false, true, do_ctf_padding);
-		}
+		const std::vector<Image<Complex>>& predOppT = // phase-demodulated (mag and aberr)
+			(do_aberr_fit || do_mag_fit)?
+				predictionCache.predictAll(ReferenceMap::Own, false, true, false, true, do_ctf_padding) : noPred;
 
 		if (do_defocus_fit)
 		{
@@ -346,6 +343,7 @@ void CtfRefiner::processSubsetMicrographs(long g_start, long g_end)
 	if (verb > 0)
 	{
 		progress_bar(my_nr_micrographs);
+		predictionCache.printStatistics(std::cout);
 	}
 }
 
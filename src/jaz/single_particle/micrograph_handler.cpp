@@ -38,7 +38,11 @@ MicrographHandler::MicrographHandler()
 	  last_movieFn(""),
 	  corrMicFn(""),
 	  eer_upsampling(-1),
-	  eer_grouping(-1)
+	  eer_grouping(-1),
+	  movieCacheGB(0),
+	  movieCacheBytes(0),
+	  movieCacheHits(0),
+	  movieCacheMisses(0)
 {}
 
 void MicrographHandler::init(
@@ -372,110 +376,133 @@ std::vector<std::vector<Image<Complex>>> MicrographHandler::loadMovie(
 
 	FileName movieFn = micrograph.getMovieFilename();
 	std::string gainFn = micrograph.getGainFilename();
-	MultidimArray<bool> defectMask;
-
-	const bool mgHasGain = (gainFn != "");
-	const bool hasDefect = (mgHasGain || micrograph.fnDefect != "" || micrograph.hotpixelX.size() != 0);
+	const bool returnSingleFrame = single_frame_relative_index >= 0;
 	
-	if (hasDefect)
+	if (returnSingleFrame && offsets_in != 0 && (*offsets_in)[0].size() != 1)
 	{
-		if (movieFn == last_movieFn)
-		{
-			defectMask = lastDefectMask;
-		}
-		else
-		{
-			micrograph.fillDefectAndHotpixels(defectMask);
-			lastDefectMask = defectMask;
-		}
+		REPORT_ERROR_STR("MicrographHandler::loadMovie: attempting to read one single frame "
+						 << "while the initial trajectories contain more than one position");
 	}
-	last_movieFn = movieFn;
 
-	if (debug)
-	{
-		std::cout << "loading: " << "\n";
-		std::cout << "-> meta: " << metaFn << "\n";
-		std::cout << "-> data: " << movieFn << "\n";
-		std::cout << "-> gain: " << gainFn << "\n";
-		std::cout << "-> mask: " << micrograph.fnDefect << "\n";
-		std::cout << "-> nhot: " << micrograph.hotpixelX.size() << "\n";
-		std::cout << "-> hasdefect: " << (hasDefect ? 1 : 0) << std::endl;
-	}
+	const int frame0 = returnSingleFrame? single_frame_relative_index : firstFrame;
+	const int fc = returnSingleFrame? 1 : lastFrame - firstFrame + 1;
+
+	// A movie that has been loaded before (e.g. for motion estimation) does not have to be read again
+	const bool useCache = movieCacheGB > 0 && !saveMem;
 
-	const bool isEER = EERRenderer::isEER(movieFn);
+	long int cacheOffset = 0;
+	std::shared_ptr<BufferedImage<float>> cachedMovie = useCache?
+		findCachedMovie(movieFn, frame0, fc, cacheOffset) :
+		std::shared_ptr<BufferedImage<float>>();
 
-	if (mgHasGain)
+	BufferedImage<float> muGraph;
+	RawImage<float> movieFrames;
+
+	if (cachedMovie)
+	{
+		movieFrames = cachedMovie->getSlabRef(cacheOffset, fc);
+	}
+	else
 	{
-		if (gainFn != last_gainFn)
+		MultidimArray<bool> defectMask;
+
+		const bool mgHasGain = (gainFn != "");
+		const bool hasDefect = (mgHasGain || micrograph.fnDefect != "" || micrograph.hotpixelX.size() != 0);
+	
+		if (hasDefect)
 		{
-			last_gainFn = gainFn;
-			
-			if (isEER) // TODO: Takanori: Remove this once we updated RelionCor
+			if (movieFn == last_movieFn)
 			{
-				if (eer_upsampling < 0)
-					eer_upsampling = micrograph.getEERUpsampling();
-				EERRenderer::loadEERGain(gainFn, lastGainRef(), eer_upsampling);
+				defectMask = lastDefectMask;
 			}
 			else
 			{
-				lastGainRef.read(gainFn);
+				micrograph.fillDefectAndHotpixels(defectMask);
+				lastDefectMask = defectMask;
 			}
 		}
+		last_movieFn = movieFn;
 
-		// Mask pixels with zero gain
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(defectMask)
-			if (DIRECT_MULTIDIM_ELEM(lastGainRef(), n) == 0)
-				DIRECT_MULTIDIM_ELEM(defectMask, n) = true;
-	}
-	
-	BufferedImage<float> muGraph;
-	
-	RawImage<RFLOAT> gainRef_new(lastGainRef);
-	RawImage<bool> defectMask_new(defectMask);
+		if (debug)
+		{
+			std::cout << "loading: " << "\n";
+			std::cout << "-> meta: " << metaFn << "\n";
+			std::cout << "-> data: " << movieFn << "\n";
+			std::cout << "-> gain: " << gainFn << "\n";
+			std::cout << "-> mask: " << micrograph.fnDefect << "\n";
+			std::cout << "-> nhot: " << micrograph.hotpixelX.size() << "\n";
+			std::cout << "-> hasdefect: " << (hasDefect ? 1 : 0) << std::endl;
+		}
+
+		const bool isEER = EERRenderer::isEER(movieFn);
+
+		if (mgHasGain)
+		{
+			if (gainFn != last_gainFn)
+			{
+				last_gainFn = gainFn;
+			
+				if (isEER) // TODO: Takanori: Remove this once we updated RelionCor
+				{
+					if (eer_upsampling < 0)
+						eer_upsampling = micrograph.getEERUpsampling();
+					EERRenderer::loadEERGain(gainFn, lastGainRef(), eer_upsampling);
+				}
+				else
+				{
+					lastGainRef.read(gainFn);
+				}
+			}
+
+			// Mask pixels with zero gain
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(defectMask)
+				if (DIRECT_MULTIDIM_ELEM(lastGainRef(), n) == 0)
+					DIRECT_MULTIDIM_ELEM(defectMask, n) = true;
+		}
 	
-	RawImage<RFLOAT>* gainRefToUse = mgHasGain? &gainRef_new : 0;
-	RawImage<bool>* defectMaskToUse = hasDefect? &defectMask_new : 0;
+		RawImage<RFLOAT> gainRef_new(lastGainRef);
+		RawImage<bool> defectMask_new(defectMask);
 	
-	const bool returnSingleFrame = single_frame_relative_index >= 0;
+		RawImage<RFLOAT>* gainRefToUse = mgHasGain? &gainRef_new : 0;
+		RawImage<bool>* defectMaskToUse = hasDefect? &defectMask_new : 0;
 	
-	if (returnSingleFrame && offsets_in != 0 && (*offsets_in)[0].size() != 1)
-	{
-		REPORT_ERROR_STR("MicrographHandler::loadMovie: attempting to read one single frame "
-						 << "while the initial trajectories contain more than one position");
-	}
+		if (isEER)			
+		{
+			if (eer_upsampling < 0)
+			{
+				eer_upsampling = micrograph.getEERUpsampling();
+			}
+		
+			if (eer_grouping < 0)
+			{
+				eer_grouping = micrograph.getEERGrouping();
+			}
 
-	const int frame0 = returnSingleFrame? single_frame_relative_index : firstFrame;
-	const int fc = returnSingleFrame? 1 : lastFrame - firstFrame + 1;
-				
-	if (isEER)			
-	{
-		if (eer_upsampling < 0)
+			muGraph = MovieLoader::readEER<float>(
+				movieFn, gainRefToUse, defectMaskToUse,
+				frame0, fc,
+				eer_upsampling, eer_grouping,
+				nr_omp_threads);
+		}
+		else
 		{
-			eer_upsampling = micrograph.getEERUpsampling();
+			muGraph = MovieLoader::readDense<float>(
+				movieFn, gainRefToUse, defectMaskToUse,
+				frame0, fc,
+				hotCutoff,
+				nr_omp_threads);
 		}
-		
-		if (eer_grouping < 0)
+
+		if (useCache && !returnSingleFrame)
 		{
-			eer_grouping = micrograph.getEERGrouping();
+			cachedMovie = cacheMovie(movieFn, frame0, muGraph);
 		}
 
-		muGraph = MovieLoader::readEER<float>(
-			movieFn, gainRefToUse, defectMaskToUse,
-			frame0, fc,
-			eer_upsampling, eer_grouping,
-			nr_omp_threads);
-	}
-	else
-	{
-		muGraph = MovieLoader::readDense<float>(
-			movieFn, gainRefToUse, defectMaskToUse,
-			frame0, fc,
-			hotCutoff,
-			nr_omp_threads);
+		movieFrames = cachedMovie? cachedMovie->getFullRef() : muGraph.getFullRef();
 	}
-	
+
 	std::vector<std::vector<Image<Complex>>> movie = SpaExtraction::extractMovieStackFS(
-			mdt, muGraph, s,
+			mdt, movieFrames, s,
 			angpix, coords_angpix, movie_angpix, data_angpix,
 			offsets_in, offsets_out, 
 			nr_omp_threads);
@@ -502,6 +529,82 @@ std::vector<std::vector<Image<Complex>>> MicrographHandler::loadMovie(
 	return movie;
 }
 
+std::shared_ptr<BufferedImage<float>> MicrographHandler::findCachedMovie(
+		const std::string& movieFn, int frame0, int fc, long int& offset)
+{
+	for (std::list<CachedMovie>::iterator it = movieCache.begin(); it != movieCache.end(); it++)
+	{
+		if (it->movieFn == movieFn && frame0 >= it->frame0
+				&& frame0 + fc <= it->frame0 + it->frames->zdim)
+		{
+			// move to the front (most recently used)
+			movieCache.splice(movieCache.begin(), movieCache, it);
+
+			offset = frame0 - movieCache.front().frame0;
+			movieCacheHits++;
+
+			return movieCache.front().frames;
+		}
+	}
+
+	movieCacheMisses++;
+
+	return std::shared_ptr<BufferedImage<float>>();
+}
+
+std::shared_ptr<BufferedImage<float>> MicrographHandler::cacheMovie(
+		const std::string& movieFn, int frame0, BufferedImage<float>& frames)
+{
+	const size_t bytes = frames.getSize() * sizeof(float);
+	const size_t maxBytes = (size_t)(movieCacheGB * 1024.0 * 1024.0 * 1024.0);
+
+	if (bytes > maxBytes)
+	{
+		return std::shared_ptr<BufferedImage<float>>();
+	}
+
+	while (movieCacheBytes + bytes > maxBytes)
+	{
+		movieCacheBytes -= movieCache.back().frames->getSize() * sizeof(float);
+		movieCache.pop_back();
+	}
+
+	// Swapping the buffers leaves the data where it is, so nothing is copied
+	std::shared_ptr<BufferedImage<float>> stored(new BufferedImage<float>());
+
+	stored->xdim = frames.xdim;
+	stored->ydim = frames.ydim;
+	stored->zdim = frames.zdim;
+	stored->dataVec.swap(frames.dataVec);
+	stored->data = &(stored->dataVec[0]);
+
+	frames.xdim = frames.ydim = frames.zdim = 0;
+	frames.data = 0;
+
+	CachedMovie entry;
+	entry.movieFn = movieFn;
+	entry.frame0 = frame0;
+	entry.frames = stored;
+
+	movieCache.push_front(entry);
+	movieCacheBytes += bytes;
+
+	return stored;
+}
+
+void MicrographHandler::printMovieCacheStatistics(std::ostream& os) const
+{
+	const long int total = movieCacheHits + movieCacheMisses;
+
+	if (total == 0)
+	{
+		return;
+	}
+
+	os << " + Movie cache: " << movieCacheHits << " of " << total
+	   << " movie loads served from memory (" << (100.0 * movieCacheHits / total) << "%)" << std::endl;
+}
+
 void MicrographHandler::loadInitialTracks(
 		const MetaDataTable &mdt, double angpix,
 		const std::vector<d2Vector>& pos,
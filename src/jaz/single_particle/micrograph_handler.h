@@ -23,9 +23,12 @@
 
 #include <string>
 #include <map>
+#include <list>
+#include <memory>
 
 #include <src/jaz/gravis/t2Vector.h>
 #include <src/jaz/single_particle/parallel_ft.h>
+#include <src/jaz/image/buffered_image.h>
 
 #include <src/micrograph_model.h>
 #include <src/image.h>
@@ -42,6 +45,9 @@ class MicrographHandler
 		int eer_upsampling, eer_grouping;
 	
 		bool debug, saveMem, ready;
+
+		// Maximal size of the movie cache in GB (0 = do not cache movies)
+		double movieCacheGB;
 	
 		std::string corrMicFn;
 	
@@ -111,6 +117,9 @@ class MicrographHandler
 	std::string getMetaName(
 			std::string micName, bool die_on_error = true);
 
+	// Write how often loadMovie found its movie in the cache
+	void printMovieCacheStatistics(std::ostream& os) const;
+
 	protected:
 
 		Image<RFLOAT> lastGainRef;
@@ -119,6 +128,30 @@ class MicrographHandler
 	
 		std::map<std::string, std::string> mic2meta;
 
+		/* Decoded and gain-corrected movies, most recently used first.
+		   Motion estimation and frame recombination both load the same movie,
+		   and the latter often one frame at a time, so keeping it around
+		   means every movie only has to be read once. */
+		struct CachedMovie
+		{
+			std::string movieFn;
+			int frame0;
+			std::shared_ptr<BufferedImage<float>> frames;
+		};
+
+		std::list<CachedMovie> movieCache;
+		size_t movieCacheBytes;
+		long int movieCacheHits, movieCacheMisses;
+
+	// Returns the cached frames [frame0, frame0 + fc) of movieFn, or 0 if they are not in the cache.
+	// The entry is kept alive by the returned pointer even if it is evicted later.
+	std::shared_ptr<BufferedImage<float>> findCachedMovie(
+			const std::string& movieFn, int frame0, int fc, long int& offset);
+
+	// Take over the frames of the given movie (leaving it empty), evicting the least recently used movies if necessary
+	std::shared_ptr<BufferedImage<float>> cacheMovie(
+			const std::string& movieFn, int frame0, BufferedImage<float>& frames);
+
 	void loadInitial(
 			const std::vector<MetaDataTable>& mdts, bool verb,
 			int& fc, double& dosePerFrame, std::string& metaFn);
@@ -77,6 +77,7 @@ void MotionRefiner::read(int argc, char **argv)
 	maxMG = textToInteger(parser.getOption("--max_MG", "Last micrograph index (default is to process all)", "-1"));
 	
 	micrographHandler.saveMem = parser.checkOption("--sbs", "Load movies slice-by-slice to save memory (slower)");
+	micrographHandler.movieCacheGB = textToDouble(parser.getOption("--movie_cache", "Keep up to this many GB of decoded movies in memory, so that motion estimation and frame combination read each movie only once (0 = off; ignored with --sbs)", "0"));
 	
 	parser.addSection("Expert options");
 	
@@ -409,8 +410,8 @@ void MotionRefiner::run()
 
 		for (int m = firstTotalMgWithoutFCC; m < mgc; m++)
 		{
-			// TODO: TAKANORI: micrograph handler can cache movie frames to avoid reading movies twice.
-			//                 (if --sbs, don't cache to save memory)
+			// With --movie_cache, the micrograph handler keeps the movie read by
+			// the motion estimator for the frame recombiner.
 
 			if (estimateMotion && motionUnfinished[m])
 			{
@@ -433,6 +434,7 @@ void MotionRefiner::run()
 		if (verb > 0)
 		{
 			progress_bar(left);
+			micrographHandler.printMovieCacheStatistics(std::cout);
 		}
 	}
 	else
@@ -1392,8 +1392,14 @@ void ObservationModel::saveNew(
 
 	particlesMdt.setName(tablename);
 	particlesMdt.write(of);
+	of.close();
 
 	std::rename(tmpfilename.c_str(), filename.c_str());
+
+	std::vector<const MetaDataTable*> tables(2);
+	tables[0] = &opticsMdt;
+	tables[1] = &particlesMdt;
+	MetaDataTable::writeBinaryStar(filename, tables);
 }
 
 void ObservationModel::save(MetaDataTable &particlesMdt, std::string filename, std::string tablename)
@@ -1406,8 +1412,14 @@ void ObservationModel::save(MetaDataTable &particlesMdt, std::string filename, s
 
 	particlesMdt.setName(tablename);
 	particlesMdt.write(of);
+	of.close();
 
 	std::rename(tmpfilename.c_str(), filename.c_str());
+
+	std::vector<const MetaDataTable*> tables(2);
+	tables[0] = &opticsMdt;
+	tables[1] = &particlesMdt;
+	MetaDataTable::writeBinaryStar(filename, tables);
 }
 
 bool ObservationModel::containsAllColumnsNeededForPrediction(const MetaDataTable& partMdt)
@@ -0,0 +1,109 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "prediction_cache.h"
+#include <src/jaz/single_particle/obs_model.h>
+
+#include <omp.h>
+
+PredictionCache::PredictionCache(ReferenceMap* reference, ObservationModel* obsModel, int threads)
+:	reference(reference),
+	obsModel(obsModel),
+	threads(threads),
+	requested(0),
+	projected(0)
+{
+}
+
+void PredictionCache::setMicrograph(const MetaDataTable& mdt)
+{
+	// A copy, so that estimators updating the particles (e.g. their defoci)
+	// do not change what the cached predictions refer to
+	this->mdt = mdt;
+	entries.clear();
+}
+
+const std::vector<Image<Complex>>& PredictionCache::predictAll(
+		ReferenceMap::HalfSet hs,
+		bool applyCtf, bool applyTilt, bool applyShift, bool applyMtf, bool applyCtfPadding)
+{
+	const int pc = mdt.numberOfObjects();
+
+	Entry& entry = entries[key(hs, applyCtf, applyShift, applyMtf, applyCtfPadding)];
+
+	requested += pc;
+
+	if (!entry.hasPlain)
+	{
+		// The projection itself is always stored without the odd-aberration phase
+		entry.plain = reference->predictAll(
+			mdt, *obsModel, hs, threads,
+			applyCtf, false, applyShift, applyMtf, applyCtfPadding);
+
+		entry.hasPlain = true;
+		projected += pc;
+	}
+
+	if (!applyTilt)
+	{
+		return entry.plain;
+	}
+
+	if (!entry.hasModulated)
+	{
+		entry.modulated = entry.plain;
+
+		#pragma omp parallel for num_threads(threads)
+		for (int p = 0; p < pc; p++)
+		{
+			obsModel->demodulatePhase(mdt, p, entry.modulated[p](), true);
+		}
+
+		entry.hasModulated = true;
+	}
+
+	return entry.modulated;
+}
+
+long int PredictionCache::getRequested() const
+{
+	return requested;
+}
+
+long int PredictionCache::getProjected() const
+{
+	return projected;
+}
+
+void PredictionCache::printStatistics(std::ostream& os) const
+{
+	const double hitRate = requested > 0? 100.0 * (requested - projected) / (double) requested : 0.0;
+
+	os << " + Predictions: " << requested << " requested, " << projected
+	   << " projected (cache hit rate: " << hitRate << "%)" << std::endl;
+}
+
+int PredictionCache::key(
+		ReferenceMap::HalfSet hs, bool applyCtf, bool applyShift,
+		bool applyMtf, bool applyCtfPadding)
+{
+	return (hs == ReferenceMap::Own? 0 : 1)
+		| (applyCtf? 2 : 0)
+		| (applyShift? 4 : 0)
+		| (applyMtf? 8 : 0)
+		| (applyCtfPadding? 16 : 0);
+}
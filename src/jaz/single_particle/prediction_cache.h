@@ -0,0 +1,89 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef PREDICTION_CACHE_H
+#define PREDICTION_CACHE_H
+
+#include <src/image.h>
+#include <src/metadata_table.h>
+#include <src/jaz/single_particle/reference_map.h>
+
+#include <vector>
+#include <map>
+
+class ObservationModel;
+
+/* Memoizes the predictions of all particles on one micrograph,
+   so that several estimators can share them.
+
+   Predictions are keyed by (particle, half-map, CTF, shift, MTF and CTF-padding flags).
+   The phase-modulated (applyTilt = true) and the plain (applyTilt = false) variants
+   are derived from the same projection, since the odd-aberration phase
+   is only a per-pixel factor on top of it.
+
+   The returned references remain valid until the next call to setMicrograph.
+*/
+class PredictionCache
+{
+	public:
+
+		PredictionCache(ReferenceMap* reference, ObservationModel* obsModel, int threads);
+
+		// Forget all predictions and start on a new micrograph
+		void setMicrograph(const MetaDataTable& mdt);
+
+		// Same arguments as ReferenceMap::predictAll
+		const std::vector<Image<Complex>>& predictAll(
+				ReferenceMap::HalfSet hs,
+				bool applyCtf = true,
+				bool applyTilt = true,
+				bool applyShift = true,
+				bool applyMtf = true,
+				bool applyCtfPadding = false);
+
+		// Number of particle predictions that were requested and
+		// how many of them had to be projected
+		long int getRequested() const;
+		long int getProjected() const;
+
+		void printStatistics(std::ostream& os) const;
+
+
+	private:
+
+		struct Entry
+		{
+			Entry() : hasPlain(false), hasModulated(false) {}
+
+			bool hasPlain, hasModulated;
+			std::vector<Image<Complex>> plain, modulated;
+		};
+
+		ReferenceMap* reference;
+		ObservationModel* obsModel;
+		int threads;
+
+		MetaDataTable mdt;
+		std::map<int, Entry> entries;
+
+		long int requested, projected;
+
+		static int key(ReferenceMap::HalfSet hs, bool applyCtf, bool applyShift,
+		               bool applyMtf, bool applyCtfPadding);
+};
+
+#endif
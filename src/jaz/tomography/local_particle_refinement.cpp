@@ -1,5 +1,6 @@
 #include "local_particle_refinement.h"
 #include <src/jaz/tomography/extraction.h>
+#include <src/jaz/tomography/particle_stack_cache.h>
 #include <src/jaz/tomography/prediction.h>
 #include <src/jaz/tomography/projection/fwd_projection.h>
 #include <src/jaz/math/Tait_Bryan_angles.h>
@@ -22,7 +23,8 @@ LocalParticleRefinement::LocalParticleRefinement(
 		const AberrationsCache& aberrationsCache,
 		double dose_cutoff,
 		int minFrame,
-		int maxFrame)
+		int maxFrame,
+		ParticleStackCache* stackCache)
 :
 	particle_id(particle_id),
 	particleSet(particleSet),
@@ -54,9 +56,18 @@ LocalParticleRefinement::LocalParticleRefinement(
 
 	std::vector<d4Matrix> tomo_to_image;
 
-	TomoExtraction::extractAt3D_Fourier(
-			tomogram.stack, s, 1.0, tomogram, trajectory, isVisible,
-			observations, tomo_to_image, 1, false);
+	if (stackCache != 0)
+	{
+		stackCache->extractAt3D_Fourier(
+				particleSet.getName(particle_id), tomogram, s, 1.0, trajectory, isVisible,
+				observations, tomo_to_image, 1, false);
+	}
+	else
+	{
+		TomoExtraction::extractAt3D_Fourier(
+				tomogram.stack, s, 1.0, tomogram, trajectory, isVisible,
+				observations, tomo_to_image, 1, false);
+	}
 
 	const d4Matrix particle_to_tomo = particleSet.getMatrix4x4(
 			particle_id, s, s, s);
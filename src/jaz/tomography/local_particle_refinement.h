@@ -7,6 +7,8 @@
 #include <src/jaz/tomography/reference_map.h>
 #include <src/jaz/optics/aberrations_cache.h>
 
+class ParticleStackCache;
+
 
 class LocalParticleRefinement : public FastDifferentiableOptimization
 {
@@ -22,7 +24,8 @@ class LocalParticleRefinement : public FastDifferentiableOptimization
 				const AberrationsCache& aberrationsCache,
 				double dose_cutoff,
 				int minFrame,
-				int maxFrame);
+				int maxFrame,
+				ParticleStackCache* stackCache = 0);
 
 
 			const ParticleIndex particle_id;
@@ -0,0 +1,272 @@
+#include "particle_stack_cache.h"
+#include "extraction.h"
+#include "tomogram.h"
+#include <src/jaz/util/zio.h>
+#include <src/jaz/util/log.h>
+#include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+using namespace gravis;
+
+// Increment this whenever the extraction or the file layout changes
+#define PARTICLE_STACK_CACHE_VERSION 1
+
+
+template <typename T>
+static void appendToKey(std::string& key, const T& value)
+{
+	key.append((const char*) &value, sizeof(T));
+}
+
+
+ParticleStackCache::ParticleStackCache(std::string directory)
+:	directory(directory),
+	hits(0),
+	misses(0),
+	writeFailures(0)
+{
+	if (this->directory.length() > 0 && this->directory[this->directory.length()-1] != '/')
+	{
+		this->directory = this->directory + "/";
+	}
+}
+
+bool ParticleStackCache::isActive() const
+{
+	return directory.length() > 0;
+}
+
+void ParticleStackCache::extractAt3D_Fourier(
+		const std::string& particleName,
+		const Tomogram& tomogram,
+		int s, double bin,
+		const std::vector<d3Vector>& trajectory,
+		const std::vector<bool>& isVisible,
+		RawImage<fComplex>& out,
+		std::vector<d4Matrix>& projOut,
+		int num_threads,
+		bool circle_crop)
+{
+	if (!isActive())
+	{
+		TomoExtraction::extractAt3D_Fourier(
+			tomogram.stack, s, bin, tomogram, trajectory, isVisible,
+			out, projOut, num_threads, circle_crop);
+
+		return;
+	}
+
+	const std::string key = makeKey(
+			tomogram, s, bin, trajectory, isVisible, out, circle_crop);
+
+	const std::string filename = getFilename(particleName, s, bin);
+
+	if (read(filename, key, out, projOut))
+	{
+		#pragma omp atomic
+		hits++;
+
+		return;
+	}
+
+	TomoExtraction::extractAt3D_Fourier(
+		tomogram.stack, s, bin, tomogram, trajectory, isVisible,
+		out, projOut, num_threads, circle_crop);
+
+	#pragma omp atomic
+	misses++;
+
+	if (!write(filename, key, out, projOut))
+	{
+		#pragma omp atomic
+		writeFailures++;
+	}
+}
+
+void ParticleStackCache::printStatistics() const
+{
+	if (!isActive()) return;
+
+	Log::print(
+		"Particle stack cache: " + ZIO::itoa(hits) + " stacks read, "
+		+ ZIO::itoa(misses) + " extracted");
+
+	if (writeFailures > 0)
+	{
+		Log::warn(
+			ZIO::itoa(writeFailures) + " particle stacks could not be written to "
+			+ directory);
+	}
+}
+
+std::string ParticleStackCache::getFilename(
+		const std::string& particleName, int s, double bin) const
+{
+	return directory + particleName
+		+ "_b" + ZIO::itoa(s) + "_bin" + ZIO::itoa(bin) + ".stack";
+}
+
+std::string ParticleStackCache::makeKey(
+		const Tomogram& tomogram,
+		int s, double bin,
+		const std::vector<d3Vector>& trajectory,
+		const std::vector<bool>& isVisible,
+		const RawImage<fComplex>& out,
+		bool circle_crop) const
+{
+	const int fc = tomogram.frameCount;
+
+	std::string key;
+
+	appendToKey(key, (int32_t) PARTICLE_STACK_CACHE_VERSION);
+
+	key.append(tomogram.tiltSeriesFilename);
+	key.push_back('\0');
+
+	struct stat fileStatus;
+
+	if (stat(tomogram.tiltSeriesFilename.c_str(), &fileStatus) == 0)
+	{
+		appendToKey(key, (int64_t) fileStatus.st_size);
+		appendToKey(key, (int64_t) fileStatus.st_mtime);
+	}
+
+	appendToKey(key, (int64_t) tomogram.stack.xdim);
+	appendToKey(key, (int64_t) tomogram.stack.ydim);
+	appendToKey(key, (int64_t) tomogram.stack.zdim);
+
+	appendToKey(key, (int32_t) s);
+	appendToKey(key, bin);
+	appendToKey(key, (int32_t) circle_crop);
+
+	appendToKey(key, (int64_t) out.xdim);
+	appendToKey(key, (int64_t) out.ydim);
+	appendToKey(key, (int64_t) out.zdim);
+
+	appendToKey(key, (int32_t) fc);
+
+	for (int f = 0; f < fc; f++)
+	{
+		const d2Vector centre = tomogram.projectPoint(trajectory[f], f);
+
+		appendToKey(key, (int32_t) isVisible[f]);
+		appendToKey(key, centre.x);
+		appendToKey(key, centre.y);
+
+		for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 4; j++)
+		{
+			appendToKey(key, tomogram.projectionMatrices[f](i,j));
+		}
+	}
+
+	return key;
+}
+
+bool ParticleStackCache::read(
+		const std::string& filename,
+		const std::string& key,
+		RawImage<fComplex>& out,
+		std::vector<d4Matrix>& projOut) const
+{
+	std::ifstream ifs(filename, std::ios::binary);
+
+	if (!ifs) return false;
+
+	uint64_t keyLength;
+	ifs.read((char*) &keyLength, sizeof(uint64_t));
+
+	if (!ifs || keyLength != key.length()) return false;
+
+	std::string storedKey(keyLength, '\0');
+	ifs.read(&storedKey[0], keyLength);
+
+	if (!ifs || storedKey != key) return false;
+
+	const int fc = out.zdim;
+
+	std::vector<d4Matrix> storedProj(fc);
+
+	for (int f = 0; f < fc; f++)
+	{
+		for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 4; j++)
+		{
+			ifs.read((char*) &storedProj[f](i,j), sizeof(double));
+		}
+	}
+
+	const size_t bytes = out.xdim * out.ydim * out.zdim * sizeof(fComplex);
+
+	ifs.read((char*) out.data, bytes);
+
+	if (!ifs) return false;
+
+	projOut = storedProj;
+
+	return true;
+}
+
+bool ParticleStackCache::write(
+		const std::string& filename,
+		const std::string& key,
+		const RawImage<fComplex>& out,
+		const std::vector<d4Matrix>& projOut)
+{
+	const std::string::size_type slash = filename.find_last_of('/');
+
+	if (slash != std::string::npos)
+	{
+		const std::string dir = filename.substr(0, slash);
+
+		#pragma omp critical(ParticleStackCache_makeDir)
+		{
+			if (knownDirectories.find(dir) == knownDirectories.end())
+			{
+				if (system(("mkdir -p " + dir).c_str()) == 0)
+				{
+					knownDirectories.insert(dir);
+				}
+			}
+		}
+	}
+
+	// Other threads or processes must never see a partly written file
+	const std::string tempFilename = filename + ".tmp"
+		+ ZIO::itoa(getpid()) + "_" + ZIO::itoa(omp_get_thread_num());
+
+	std::ofstream ofs(tempFilename, std::ios::binary);
+
+	if (!ofs) return false;
+
+	const uint64_t keyLength = key.length();
+
+	ofs.write((const char*) &keyLength, sizeof(uint64_t));
+	ofs.write(key.data(), keyLength);
+
+	for (int f = 0; f < out.zdim; f++)
+	{
+		for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 4; j++)
+		{
+			ofs.write((const char*) &projOut[f](i,j), sizeof(double));
+		}
+	}
+
+	ofs.write((const char*) out.data, out.xdim * out.ydim * out.zdim * sizeof(fComplex));
+
+	ofs.close();
+
+	if (!ofs || rename(tempFilename.c_str(), filename.c_str()) != 0)
+	{
+		remove(tempFilename.c_str());
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,79 @@
+#ifndef PARTICLE_STACK_CACHE_H
+#define PARTICLE_STACK_CACHE_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <src/jaz/image/raw_image.h>
+#include <src/jaz/math/t_complex.h>
+#include <src/jaz/gravis/t3Vector.h>
+#include <src/jaz/gravis/t4Matrix.h>
+
+class Tomogram;
+
+/* Keeps the particle tilt stacks extracted by TomoExtraction::extractAt3D_Fourier on disk,
+   so that later runs (or other programs) do not have to extract them again.
+
+   Every particle is stored in its own file, named after the particle, the box size and the binning.
+   The file also contains everything the extracted stack depends on: the tilt-series file
+   (name, size and modification time), the box size, binning and circular crop, and for every frame
+   the visibility, the projected particle position and the projection matrix. The projected position
+   includes the 2D deformations and the particle motion. If any of these have changed,
+   the stack is extracted again and the file is overwritten.
+
+   An empty directory name disables the cache. */
+class ParticleStackCache
+{
+	public:
+
+		ParticleStackCache(std::string directory = "");
+
+
+		bool isActive() const;
+
+		// Same as TomoExtraction::extractAt3D_Fourier, applied to tomogram.stack.
+		// Safe to call from several threads at once, as long as they work on different particles.
+		void extractAt3D_Fourier(
+				const std::string& particleName,
+				const Tomogram& tomogram,
+				int s, double bin,
+				const std::vector<gravis::d3Vector>& trajectory,
+				const std::vector<bool>& isVisible,
+				RawImage<fComplex>& out,
+				std::vector<gravis::d4Matrix>& projOut,
+				int num_threads = 1,
+				bool circle_crop = true);
+
+		void printStatistics() const;
+
+
+	private:
+
+		std::string directory;
+		long int hits, misses, writeFailures;
+		std::set<std::string> knownDirectories;
+
+		std::string getFilename(const std::string& particleName, int s, double bin) const;
+
+		std::string makeKey(
+				const Tomogram& tomogram,
+				int s, double bin,
+				const std::vector<gravis::d3Vector>& trajectory,
+				const std::vector<bool>& isVisible,
+				const RawImage<fComplex>& out,
+				bool circle_crop) const;
+
+		bool read(
+				const std::string& filename,
+				const std::string& key,
+				RawImage<fComplex>& out,
+				std::vector<gravis::d4Matrix>& projOut) const;
+
+		bool write(
+				const std::string& filename,
+				const std::string& key,
+				const RawImage<fComplex>& out,
+				const std::vector<gravis::d4Matrix>& projOut);
+};
+
+#endif
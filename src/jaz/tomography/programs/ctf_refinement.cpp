@@ -12,6 +12,7 @@
 #include <src/jaz/tomography/prediction.h>
 #include <src/jaz/tomography/projection/projection.h>
 #include <src/jaz/tomography/tomogram.h>
+#include <src/jaz/tomography/tomogram_loader.h>
 #include <src/jaz/tomography/tilt_geometry.h>
 #include <src/jaz/math/Zernike_helper.h>
 #include <src/jaz/optimization/nelder_mead.h>
@@ -111,6 +112,7 @@ void CtfRefinementProgram::parseInput()
 	min_frame = textToInteger(parser.getOption("--min_frame", "First frame to consider", "0"));
 	max_frame = textToInteger(parser.getOption("--max_frame", "Last frame to consider", "-1"));
 	freqCutoffFract = textToDouble(parser.getOption("--cutoff_fract", "Ignore shells for which the relative dose or frequency weight falls below this fraction of the average", "0.02"));
+	do_prefetch = parser.checkOption("--prefetch", "Read the next tilt series while the current one is being processed (requires memory for two tilt series)");
 
 	Log::readParams(parser);
 
@@ -158,6 +160,28 @@ void CtfRefinementProgram::processTomograms(
 		Log::beginProgress("Processing tomograms", ttc);
 	}
 
+	const int gc = particleSet.numberOfOpticsGroups();
+
+	std::vector<int> loadOrder;
+
+	for (int tt = 0; tt < ttc; tt++)
+	{
+		const int t = tomoIndices[tt];
+		const std::string tomogram_name = tomogramSet.getTomogramName(t);
+
+		if (particles[t].size() > 0 && !(only_do_unfinished &&
+				defocusAlreadyDone(tomogram_name) &&
+				scaleAlreadyDone(tomogram_name) &&
+				aberrationsAlreadyDone(tomogram_name, gc)) )
+		{
+			loadOrder.push_back(t);
+		}
+	}
+
+	// The frequency weights are estimated from the entire tilt images,
+	// so the tilt series are always read completely
+	TomogramLoader tomogramLoader(tomogramSet, loadOrder, do_prefetch);
+
 	for (int tt = 0; tt < ttc; tt++)
 	{
 		if (verbosity > 0 && !per_tomogram_progress)
@@ -173,7 +197,6 @@ void CtfRefinementProgram::processTomograms(
 		if (pc == 0) continue;
 
 		const std::string tomogram_name = tomogramSet.getTomogramName(t);
-		const int gc = particleSet.numberOfOpticsGroups();
 
 		if (only_do_unfinished &&
 				defocusAlreadyDone(tomogram_name) &&
@@ -191,7 +214,7 @@ void CtfRefinementProgram::processTomograms(
 			Log::print("Loading");
 		}
 
-		Tomogram tomogram = tomogramSet.loadTomogram(t, true);
+		Tomogram tomogram = tomogramLoader.load(t);
 		tomogram.validateParticleOptics(particles[t], particleSet);
 
 		const int fc = tomogram.frameCount;
@@ -25,7 +25,8 @@ class CtfRefinementProgram : public RefinementProgram
 				do_reset_to_common, do_regularise_defocus,
 				do_refine_scale, do_refine_aberrations,
 				do_fit_Lambert_per_tomo, do_fit_Lambert_globally,
-				do_even_aberrations, do_odd_aberrations;
+				do_even_aberrations, do_odd_aberrations,
+				do_prefetch;
 
 			int deltaSteps, n_even, n_odd, min_frame, max_frame;
 			double minDelta, maxDelta, lambda_reg, k_min_Ang, freqCutoffFract;
@@ -15,6 +15,7 @@
 #include <src/jaz/optics/tomo_mag_fit.h>
 #include <src/jaz/tomography/projection/fwd_projection.h>
 #include <src/jaz/tomography/local_particle_refinement.h>
+#include <src/jaz/tomography/particle_stack_cache.h>
 #include <src/jaz/math/Tait_Bryan_angles.h>
 
 #include <src/jaz/math/Euler_angles_relion.h>
@@ -48,6 +49,7 @@ void LocalParticleRefineProgram::readParams()
 	verbose_opt = parser.checkOption("--verbose_opt", "Print out the cost function after each iteration (for the first thread)");
 	min_frame = textToInteger(parser.getOption("--min_frame", "First frame to consider", "0"));
 	max_frame = textToInteger(parser.getOption("--max_frame", "Last frame to consider", "-1"));
+	stackCacheDir = parser.getOption("--stack_cache", "Directory in which extracted particle tilt stacks are kept for later runs", "");
 
 	Log::readParams(parser);
 
@@ -69,6 +71,8 @@ void LocalParticleRefineProgram::run()
 
 		AberrationsCache aberrationsCache(particleSet.optTable, boxSize, particleSet.getOriginalPixelSize(0));
 
+		ParticleStackCache stackCache(stackCacheDir);
+
 	Log::endSection();
 
 	for (int t = 0; t < tc; t++)
@@ -112,7 +116,7 @@ void LocalParticleRefineProgram::run()
 			LocalParticleRefinement refinement(
 					particles[t][p], particleSet, tomogram, referenceMap,
 					freqWeights, doseWeights, aberrationsCache, dose_cutoff,
-					min_frame, max_frame);
+					min_frame, max_frame, &stackCache);
 
 			const std::vector<double> initial {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
 
@@ -146,6 +150,8 @@ void LocalParticleRefineProgram::run()
 		Log::endSection();
 	}
 
+	stackCache.printStatistics();
+
 	particleSet.write(outDir+"particles.star");
 
 	optimisationSet.particles = outDir+"particles.star";
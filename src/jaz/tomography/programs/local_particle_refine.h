@@ -17,6 +17,7 @@ class LocalParticleRefineProgram : public RefinementProgram
 			int max_iterations, min_frame, max_frame;
 			double eps, xtol, dose_cutoff;
 			bool verbose_opt;
+			std::string stackCacheDir;
 
 		void readParams();
 		void run();
@@ -1,6 +1,7 @@
 #include "reconstruct_particle.h"
 #include <src/jaz/tomography/projection/projection.h>
 #include <src/jaz/tomography/projection/Fourier_backprojection.h>
+#include <src/jaz/tomography/projection/slab_locks.h>
 #include <src/jaz/tomography/reconstruction.h>
 #include <src/jaz/image/centering.h>
 #include <src/jaz/image/padding.h>
@@ -10,6 +11,8 @@
 #include <src/jaz/tomography/tomo_ctf_helper.h>
 #include <src/jaz/tomography/tomogram.h>
 #include <src/jaz/tomography/tomogram_set.h>
+#include <src/jaz/tomography/tomogram_loader.h>
+#include <src/jaz/tomography/particle_stack_cache.h>
 #include <src/jaz/tomography/particle_set.h>
 #include <src/jaz/optics/damage.h>
 #include <src/jaz/optics/aberrations_cache.h>
@@ -18,6 +21,7 @@
 #include <src/time.h>
 #include <mpi.h>
 #include <iostream>
+#include <memory>
 
 
 using namespace gravis;
@@ -72,16 +76,20 @@ void ReconstructParticleProgram::readBasicParameters(int argc, char *argv[])
 	helical_rise = textToFloat(parser.getOption("--helical_rise", "Helical rise (in Angstroms)", "0."));
 	helical_twist = textToFloat(parser.getOption("--helical_twist", "Helical twist (in degrees, + for right-handedness)", "0."));
 
-	max_mem_GB = textToInteger(parser.getOption("--mem", "Max. amount of memory (in GB) to use for accumulation (--j_out will be reduced)", "-1"));
+	max_mem_GB = textToInteger(parser.getOption("--mem", "Max. amount of memory (in GB) to use for accumulation (only checked, since it does not depend on the number of threads)", "-1"));
 
 	only_do_unfinished = parser.checkOption("--only_do_unfinished", "Only process undone subtomograms");
 	no_backup = parser.checkOption("--no_backup", "Do not make backups (makes it impossible to use --only_do_unfinished)");
 
 	do_circle_crop = !parser.checkOption("--no_circle_crop", "Do not crop 2D images to a circle prior to insertion");
 
+	do_prefetch = parser.checkOption("--prefetch", "Read the next tilt series while the current one is being processed (requires memory for two tilt series)");
+	read_regions = parser.checkOption("--read_regions", "Only read the rows of the tilt images that contain particles (ignored with --whiten)");
+	stackCacheDir = parser.getOption("--stack_cache", "Directory in which extracted particle tilt stacks are kept for later runs", "");
+
 	num_threads = textToInteger(parser.getOption("--j", "Number of OMP threads", "6"));
-	inner_threads = textToInteger(parser.getOption("--j_in", "Number of inner threads (slower, needs less memory)", "3"));
-	outer_threads = textToInteger(parser.getOption("--j_out", "Number of outer threads (faster, needs more memory)", "2"));
+	inner_threads = textToInteger(parser.getOption("--j_in", "Number of inner threads (used for extracting and inserting each particle)", "3"));
+	outer_threads = textToInteger(parser.getOption("--j_out", "Number of outer threads (particles processed in parallel)", "2"));
 
 	no_reconstruction = parser.checkOption("--no_recon", "Do not reconstruct the volume, only backproject (for benchmarking purposes)");
 	freqCutoffFract = textToDouble(parser.getOption("--cutoff_fract", "Ignore shells for which the dose weight falls below this value", "0.01"));
@@ -120,36 +128,28 @@ void ReconstructParticleProgram::run()
 	
 	const long int voxelNum = (long int) sh * (long int) s * (long int) s;
 
-	const double GB_per_thread =
+	// All threads insert into the same two half-volumes,
+	// so the memory needed for accumulation does not depend on --j_out
+	const double GB_accumulation =
 			2.0 * voxelNum * 3.0 * sizeof(double)   // two halves  *  box size  *  (data (x2) + ctf)
 			/ (1024.0 * 1024.0 * 1024.0);           // in GB
 
-	if (max_mem_GB > 0)
+	if (max_mem_GB > 0 && GB_accumulation > max_mem_GB)
 	{
-		const double maxThreads = max_mem_GB / GB_per_thread;
-		
-		if (maxThreads < outer_threads)
-		{
-			int lastOuterThreads = outer_threads;
-			outer_threads = (int) maxThreads;
-		
-			Log::print("Outer thread number reduced from " + ZIO::itoa(lastOuterThreads) + 
-					  " to " + ZIO::itoa(outer_threads) + " due to memory constraints (--mem).");
-		}
+		Log::warn("The accumulation needs " + ZIO::itoa(GB_accumulation) +
+				  " GB, which is more than allowed by --mem (" + ZIO::itoa(max_mem_GB) + " GB).");
 	}
-	
-	const int outCount = 2 * outer_threads;
-		
-	Log::print("Memory required for accumulation: " + ZIO::itoa(GB_per_thread  * outer_threads) + " GB");
-	
-	std::vector<BufferedImage<double>> ctfImgFS(outCount);
-	std::vector<BufferedImage<dComplex>> dataImgFS(outCount);
-	
-	for (int i = 0; i < outCount; i++)
-	{	
+
+	Log::print("Memory required for accumulation: " + ZIO::itoa(GB_accumulation) + " GB");
+
+	std::vector<BufferedImage<double>> ctfImgFS(2);
+	std::vector<BufferedImage<dComplex>> dataImgFS(2);
+
+	for (int i = 0; i < 2; i++)
+	{
 		dataImgFS[i] = BufferedImage<dComplex>(sh,s,s);
 		ctfImgFS[i] = BufferedImage<double>(sh,s,s);
-		
+
 		dataImgFS[i].fill(dComplex(0.0, 0.0));
 		ctfImgFS[i].fill(0.0);
 	}
@@ -252,6 +252,26 @@ void ReconstructParticleProgram::processTomograms(
 		}
 	}
 
+	std::vector<int> loadOrder;
+
+	for (int tt = ttIni; tt < tc; tt++)
+	{
+		if (particles[tomoIndices[tt]].size() > 0)
+		{
+			loadOrder.push_back(tomoIndices[tt]);
+		}
+	}
+
+	TomogramLoader tomogramLoader(tomoSet, loadOrder, do_prefetch);
+
+	// Whitening looks at the entire tilt images
+	if (read_regions && !do_whiten)
+	{
+		tomogramLoader.setRegionsOfInterest(particleSet, particles, s02D);
+	}
+
+	ParticleStackCache stackCache(stackCacheDir);
+
 	for (int tt = ttIni; tt < tc; tt++)
 	{
 		if (run_from_GUI && pipeline_control_check_abort_job())
@@ -281,7 +301,7 @@ void ReconstructParticleProgram::processTomograms(
 			}
 		}
 
-		Tomogram tomogram = tomoSet.loadTomogram(t, true);
+		Tomogram tomogram = tomogramLoader.load(t);
 		tomogram.validateParticleOptics(particles[t], particleSet);
 
 		const int fc = tomogram.frameCount;
@@ -317,6 +337,14 @@ void ReconstructParticleProgram::processTomograms(
 			Log::beginProgress("Backprojecting", (int)ceil(pc/(double)outer_threads));
 		}
 
+		// Several slabs per thread, so that threads rarely have to wait for one another
+		std::vector<std::shared_ptr<SlabLocks>> slabLocks(2);
+
+		for (int half = 0; half < 2; half++)
+		{
+			slabLocks[half] = std::make_shared<SlabLocks>(s, 4 * outer_threads * inner_threads);
+		}
+
 		#pragma omp parallel for num_threads(outer_threads)
 		for (int p = 0; p < pc; p++)
 		{
@@ -345,8 +373,8 @@ void ReconstructParticleProgram::processTomograms(
 
 			const bool circle_crop = do_circle_crop;
 
-			TomoExtraction::extractAt3D_Fourier(
-					tomogram.stack, s02D, binning, tomogram, traj, isVisible,
+			stackCache.extractAt3D_Fourier(
+					particleSet.getName(part_id), tomogram, s02D, binning, traj, isVisible,
 					particleStack[th], projCut, inner_threads, circle_crop);
 
 
@@ -404,37 +432,38 @@ void ReconstructParticleProgram::processTomograms(
 				weightStack[th] *= noiseWeights;
 			}
 
-			for (int f = 0; f < fc; f++)
+			SlabLocks& locks = *slabLocks[halfSet];
+
+			const int firstSlab = (th * locks.getSlabCount()) / outer_threads;
+
+			// The inner threads insert the same particle into disjoint sets of slabs
+			#pragma omp parallel num_threads(inner_threads)
 			{
-				if (isVisible[f])
+				locks.forEachSlab(
+					firstSlab, omp_get_thread_num(), omp_get_num_threads(),
+					[&](int z0, int z1)
 				{
-					FourierBackprojection::backprojectSlice_backward(
-						xRanges(0,f),
-						particleStack[th].getSliceRef(f),
-						weightStack[th].getSliceRef(f),
-						projPart[f],
-						dataImgFS[2*th + halfSet],
-						ctfImgFS[2*th + halfSet],
-						inner_threads);
-				}
+					for (int f = 0; f < fc; f++)
+					{
+						if (isVisible[f])
+						{
+							FourierBackprojection::backprojectSlab_backward(
+								xRanges(0,f),
+								particleStack[th].getSliceRef(f),
+								weightStack[th].getSliceRef(f),
+								projPart[f],
+								dataImgFS[halfSet],
+								ctfImgFS[halfSet],
+								z0, z1);
+						}
+					}
+				});
 			}
 
 		} // particles
 
 		if (!no_backup)
 		{
-			for (int i = 2; i < dataImgFS.size(); i++)
-			{
-				dataImgFS[i%2] += dataImgFS[i];
-				ctfImgFS[i%2]  += ctfImgFS[i];
-			}
-
-			for (int i = 2; i < dataImgFS.size(); i++)
-			{
-				dataImgFS[i].fill(dComplex(0.0, 0.0));
-				ctfImgFS[i].fill(0.0);
-			}
-
 			//Save temporary files
 
 			for (int half = 0; half < 2; half++)
@@ -478,18 +507,14 @@ void ReconstructParticleProgram::processTomograms(
 
 	} // tomograms
 
-	if (no_backup)
+	if (verbosity > 0 && !per_tomogram_progress)
 	{
-		for (int i = 2; i < dataImgFS.size(); i++)
-		{
-			dataImgFS[i%2] += dataImgFS[i];
-			ctfImgFS[i%2]  += ctfImgFS[i];
-		}
+		Log::endProgress();
 	}
 
-	if (verbosity > 0 && !per_tomogram_progress)
+	if (verbosity > 0)
 	{
-		Log::endProgress();
+		stackCache.printStatistics();
 	}
 }
 
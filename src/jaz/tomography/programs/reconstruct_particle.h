@@ -19,13 +19,14 @@ class ReconstructParticleProgram
 		
 
 			OptimisationSet optimisationSet;
-			std::string outDir, symmName, tmpOutRoot;
+			std::string outDir, symmName, tmpOutRoot, stackCacheDir;
 
 			
 			bool
 				do_whiten, no_reconstruction, only_do_unfinished,
 				run_from_GUI, run_from_MPI,
-				no_backup, do_circle_crop;
+				no_backup, do_circle_crop,
+				do_prefetch, read_regions;
 
 			int boxSize, cropSize, num_threads, outer_threads, inner_threads, max_mem_GB;
 
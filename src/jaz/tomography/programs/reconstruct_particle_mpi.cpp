@@ -85,41 +85,30 @@ void ReconstructParticleProgramMpi::run()
 
 	const long int voxelNum = (long int) sh * (long int) s * (long int) s;
 
-	const double GB_per_thread =
+	// All threads insert into the same two half-volumes,
+	// so the memory needed for accumulation does not depend on --j_out
+	const double GB_accumulation =
 			2.0 * voxelNum * 3.0 * sizeof(double)   // two halves  *  box size  *  (data (x2) + ctf)
 			/ (1024.0 * 1024.0 * 1024.0);           // in GB
 
-	if (max_mem_GB > 0)
+	if (verb > 0)
 	{
-		const double maxThreads = max_mem_GB / GB_per_thread;
-
-		if (maxThreads < outer_threads)
+		if (max_mem_GB > 0 && GB_accumulation > max_mem_GB)
 		{
-			int lastOuterThreads = outer_threads;
-			outer_threads = (int) maxThreads;
-
-			if (verb > 0)
-			{
-				Log::print("Outer thread number reduced from " + ZIO::itoa(lastOuterThreads) +
-					  " to " + ZIO::itoa(outer_threads) + " due to memory constraints (--mem).");
-			}
+			Log::warn("The accumulation needs " + ZIO::itoa(GB_accumulation) +
+					  " GB, which is more than allowed by --mem (" + ZIO::itoa(max_mem_GB) + " GB).");
 		}
-	}
-
-	const int outCount = 2 * outer_threads; // One more count for the accumulated sum
 
-	if (verb > 0)
-	{
-		Log::print("Memory required for accumulation: " + ZIO::itoa(GB_per_thread  * outer_threads) + " GB");
+		Log::print("Memory required for accumulation: " + ZIO::itoa(GB_accumulation) + " GB");
 	}
 
-	std::vector<BufferedImage<double>> ctfImgFS(outCount);
-	std::vector<BufferedImage<dComplex>> dataImgFS(outCount);
+	std::vector<BufferedImage<double>> ctfImgFS(2);
+	std::vector<BufferedImage<dComplex>> dataImgFS(2);
 
-	for (int i = 0; i < outCount; i++)
+	for (int i = 0; i < 2; i++)
 	{
 		dataImgFS[i] = BufferedImage<dComplex>(sh,s,s);
-		ctfImgFS[i] = BufferedImage<double>(sh,s,s),
+		ctfImgFS[i] = BufferedImage<double>(sh,s,s);
 
 		dataImgFS[i].fill(dComplex(0.0, 0.0));
 		ctfImgFS[i].fill(0.0);
@@ -4,6 +4,8 @@
 #include <src/jaz/tomography/projection/Fourier_backprojection.h>
 #include <src/jaz/tomography/reconstruction.h>
 #include <src/jaz/tomography/tomogram_set.h>
+#include <src/jaz/tomography/tomogram_loader.h>
+#include <src/jaz/tomography/particle_stack_cache.h>
 #include <src/jaz/tomography/tomo_ctf_helper.h>
 #include <src/jaz/tomography/projection/point_insertion.h>
 #include <src/jaz/image/centering.h>
@@ -80,6 +82,10 @@ void SubtomoProgram::readBasicParameters(IOParser& parser)
 
 	write_float16  = parser.checkOption("--float16", "Write in half-precision 16 bit floating point numbers (MRC mode 12), instead of 32 bit (MRC mode 0).");
 
+	do_prefetch = parser.checkOption("--prefetch", "Read the next tilt series while the current one is being processed (requires memory for two tilt series)");
+	read_regions = parser.checkOption("--read_regions", "Only read the rows of the tilt images that contain particles (ignored with --whiten)");
+	stackCacheDir = parser.getOption("--stack_cache", "Directory in which extracted particle tilt stacks are kept for later runs", "");
+
 
 	diag = parser.checkOption("--diag", "Write out diagnostic information");
 
@@ -384,6 +390,26 @@ void SubtomoProgram::processTomograms(
 	const int sh2D = s2D / 2 + 1;
 	const int sh3D = s3D / 2 + 1;
 
+	std::vector<int> loadOrder;
+
+	for (int tt = 0; tt < tc; tt++)
+	{
+		if (particles[tomoIndices[tt]].size() > 0)
+		{
+			loadOrder.push_back(tomoIndices[tt]);
+		}
+	}
+
+	TomogramLoader tomogramLoader(tomogramSet, loadOrder, do_prefetch);
+
+	// Whitening looks at the entire tilt images
+	if (read_regions && !do_whiten)
+	{
+		tomogramLoader.setRegionsOfInterest(particleSet, particles, s02D, !apply_offsets);
+	}
+
+	ParticleStackCache stackCache(stackCacheDir);
+
 	for (int tt = 0; tt < tc; tt++)
 	{
 		const int t = tomoIndices[tt];
@@ -410,7 +436,7 @@ void SubtomoProgram::processTomograms(
 			Log::print("Loading");
 		}
 
-		Tomogram tomogram = tomogramSet.loadTomogram(t, true);
+		Tomogram tomogram = tomogramLoader.load(t);
 		tomogram.validateParticleOptics(particles[t], particleSet);
 
 		const int fc = tomogram.frameCount;
@@ -487,8 +513,8 @@ void SubtomoProgram::processTomograms(
 			BufferedImage<fComplex> particleStack = BufferedImage<fComplex>(sh2D,s2D,fc);
 			BufferedImage<float> weightStack(sh2D,s2D,fc);
 
-			TomoExtraction::extractAt3D_Fourier(
-					tomogram.stack, s02D, binning, tomogram, traj, isVisible,
+			stackCache.extractAt3D_Fourier(
+					particleSet.getName(part_id), tomogram, s02D, binning, traj, isVisible,
 					particleStack, projCut, inner_thread_num, do_circle_precrop);
 
 			if (!do_ctf) weightStack.fill(1.f);
@@ -717,6 +743,11 @@ void SubtomoProgram::processTomograms(
 			Log::endSection(); // tomogram
 		}
 	}
+
+	if (verbosity > 0)
+	{
+		stackCache.printStatistics();
+	}
 }
 
 BufferedImage<float> SubtomoProgram::cropAndTaper(const BufferedImage<float>& imgFS, int boundary, int num_threads) const
@@ -23,7 +23,7 @@ class SubtomoProgram
 		
 			OptimisationSet optimisationSet;
 
-			std::string outDir;
+			std::string outDir, stackCacheDir;
 			
 			int 
 				boxSize, 
@@ -61,6 +61,8 @@ class SubtomoProgram
 				apply_offsets,
                 apply_orientations,
 				write_float16,
+				do_prefetch,
+				read_regions,
 				run_from_GUI,
 				run_from_MPI;
 
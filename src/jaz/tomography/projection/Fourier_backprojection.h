@@ -56,6 +56,19 @@ class FourierBackprojection
 			RawImage<DestType>& destCTF,
 			int num_threads);
 
+		// Same as above, but only into the planes z0 <= z < z1 of destFS and in the calling thread,
+		// so that several threads can insert into the same volume at once, each into its own slab.
+		// destCTF is assumed to have the same size as destFS.
+		template <typename SrcType, typename DestType>
+		static void backprojectSlab_backward(
+			int maxFreq,
+			const RawImage<tComplex<SrcType>>& dataFS,
+			const RawImage<SrcType>& weight,
+			const gravis::d4Matrix& proj,
+			RawImage<tComplex<DestType>>& destFS,
+			RawImage<DestType>& destCTF,
+			int z0, int z1);
+
 		template <typename SrcType, typename DestType>
 		static void backprojectSlice_backward_withMultiplicity(
 			const RawImage<tComplex<SrcType>>& dataFS,
@@ -377,6 +390,31 @@ void FourierBackprojection::backprojectSlice_backward(
 				RawImage<tComplex<DestType>>& destFS,
 				RawImage<DestType>& destCTF,
 				int num_threads)
+{
+	const int d3 = destFS.zdim;
+
+	if (!destCTF.hasSize(destFS.xdim, destFS.ydim, d3))
+	{
+		REPORT_ERROR_STR("FourierBackprojection::backprojectSlice_backward: destCTF has wrong size ("
+						 << destCTF.getSizeString() << " instead of " << destFS.getSizeString() << ")");
+	}
+
+	#pragma omp parallel for num_threads(num_threads)
+	for (long int z = 0; z < d3; z++)
+	{
+		backprojectSlab_backward(maxFreq, dataFS, weight, proj, destFS, destCTF, z, z+1);
+	}
+}
+
+template <typename SrcType, typename DestType>
+void FourierBackprojection::backprojectSlab_backward(
+				int maxFreq,
+				const RawImage<tComplex<SrcType>>& dataFS,
+				const RawImage<SrcType>& weight,
+				const gravis::d4Matrix& proj,
+				RawImage<tComplex<DestType>>& destFS,
+				RawImage<DestType>& destCTF,
+				int z0, int z1)
 {
 	const int wh2 = dataFS.xdim;
 	const int h2 = dataFS.ydim;
@@ -385,12 +423,6 @@ void FourierBackprojection::backprojectSlice_backward(
 	const int h3 = destFS.ydim;
 	const int d3 = destFS.zdim;
 
-	if (!destCTF.hasSize(wh3, h3, d3))
-	{
-		REPORT_ERROR_STR("FourierBackprojection::backprojectSlice_backward: destCTF has wrong size ("
-						 << destCTF.getSizeString() << " instead of " << destCTF.getSizeString() << ")");
-	}
-
 	gravis::d3Matrix A(proj(0,0), proj(0,1), proj(0,2),
 					   proj(1,0), proj(1,1), proj(1,2),
 					   proj(2,0), proj(2,1), proj(2,2) );
@@ -398,8 +430,7 @@ void FourierBackprojection::backprojectSlice_backward(
 	gravis::d3Matrix projInvTransp = A.invert().transpose();
 	gravis::d3Vector normal(projInvTransp(2,0), projInvTransp(2,1), projInvTransp(2,2));
 
-	#pragma omp parallel for num_threads(num_threads)
-	for (long int z = 0; z < d3; z++)
+	for (long int z = z0; z < z1; z++)
 	for (long int y = 0; y < h3; y++)
 	{
 		const double yy = y >= h3/2? y - h3 : y;
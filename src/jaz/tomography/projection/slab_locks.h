@@ -0,0 +1,117 @@
+#ifndef SLAB_LOCKS_H
+#define SLAB_LOCKS_H
+
+#include <omp.h>
+#include <vector>
+
+/* Splits a volume into slabs of whole z-planes, each with its own lock.
+   This allows many threads to insert into the same Fourier volume at once
+   (see FourierBackprojection::backprojectSlab_backward), instead of
+   every thread needing a volume of its own. */
+class SlabLocks
+{
+	public:
+
+		SlabLocks(int depth, int slabCount)
+		:	depth(depth),
+			slabCount(slabCount < 1? 1 : (slabCount > depth? depth : slabCount)),
+			locks(this->slabCount)
+		{
+			for (int i = 0; i < this->slabCount; i++)
+			{
+				omp_init_lock(&locks[i]);
+			}
+		}
+
+		~SlabLocks()
+		{
+			for (int i = 0; i < slabCount; i++)
+			{
+				omp_destroy_lock(&locks[i]);
+			}
+		}
+
+		int getSlabCount() const
+		{
+			return slabCount;
+		}
+
+		int getBegin(int slab) const
+		{
+			return (int)((slab * (long int) depth) / slabCount);
+		}
+
+		int getEnd(int slab) const
+		{
+			return getBegin(slab + 1);
+		}
+
+		/* Call f(z0, z1) for every slab [z0, z1) while holding its lock.
+		   Different threads should pass different firstSlab values, so that they start on different slabs.
+		   Slabs that are currently locked by other threads are postponed rather than waited for. */
+		template <class Function>
+		void forEachSlab(int firstSlab, Function f)
+		{
+			forEachSlab(firstSlab, 0, 1, f);
+		}
+
+		/* As above, but only for every partCount-th slab, counted from firstSlab + part.
+		   This allows partCount threads to share the work on one image:
+		   each passes the same firstSlab and its own part. */
+		template <class Function>
+		void forEachSlab(int firstSlab, int part, int partCount, Function f)
+		{
+			std::vector<int> pending;
+
+			for (int i = part; i < slabCount; i += partCount)
+			{
+				pending.push_back((firstSlab + i) % slabCount);
+			}
+
+			while (!pending.empty())
+			{
+				bool progress = false;
+
+				for (int i = 0; i < (int) pending.size();)
+				{
+					const int slab = pending[i];
+
+					if (omp_test_lock(&locks[slab]))
+					{
+						f(getBegin(slab), getEnd(slab));
+						omp_unset_lock(&locks[slab]);
+
+						pending.erase(pending.begin() + i);
+						progress = true;
+					}
+					else
+					{
+						i++;
+					}
+				}
+
+				if (!progress)
+				{
+					// all remaining slabs are busy: wait for the first one
+					const int slab = pending[0];
+
+					omp_set_lock(&locks[slab]);
+					f(getBegin(slab), getEnd(slab));
+					omp_unset_lock(&locks[slab]);
+
+					pending.erase(pending.begin());
+				}
+			}
+		}
+
+
+	private:
+
+		int depth, slabCount;
+		std::vector<omp_lock_t> locks;
+
+		SlabLocks(const SlabLocks&);
+		SlabLocks& operator = (const SlabLocks&);
+};
+
+#endif
@@ -0,0 +1,331 @@
+#include "tomogram_loader.h"
+#include "tomogram_set.h"
+#include <src/error.h>
+#include <stdio.h>
+#include <cmath>
+
+using namespace gravis;
+
+
+TomogramLoader::TomogramLoader(
+		const TomogramSet& tomogramSet,
+		const std::vector<int>& tomogramIndices,
+		bool prefetch)
+:	tomogramSet(tomogramSet),
+	tomogramIndices(tomogramIndices),
+	prefetch(prefetch),
+	particleSet(0),
+	particles(0),
+	boxSize(0),
+	from_original_coordinate(false),
+	pendingIndex(-1)
+{
+}
+
+TomogramLoader::~TomogramLoader()
+{
+	finishReading();
+}
+
+void TomogramLoader::setRegionsOfInterest(
+		const ParticleSet& particleSet,
+		const std::vector<std::vector<ParticleIndex>>& particles,
+		int boxSize,
+		bool from_original_coordinate)
+{
+	this->particleSet = &particleSet;
+	this->particles = &particles;
+	this->boxSize = boxSize;
+	this->from_original_coordinate = from_original_coordinate;
+}
+
+Tomogram TomogramLoader::load(int index)
+{
+	Tomogram out = tomogramSet.loadTomogram(index, false);
+
+	if (pendingIndex != index)
+	{
+		startReading(index);
+	}
+
+	finishReading();
+
+	if (pendingError)
+	{
+		std::exception_ptr error = pendingError;
+		pendingError = std::exception_ptr();
+		std::rethrow_exception(error);
+	}
+
+	moveStack(*pendingStack, out.stack);
+	pendingStack.reset();
+
+	out.hasImage = true;
+
+	if (prefetch)
+	{
+		for (int i = 0; i + 1 < tomogramIndices.size(); i++)
+		{
+			if (tomogramIndices[i] == index)
+			{
+				startReading(tomogramIndices[i+1]);
+				break;
+			}
+		}
+	}
+
+	return out;
+}
+
+void TomogramLoader::startReading(int index)
+{
+	finishReading();
+
+	// The metadata are read here, on the calling thread,
+	// so that the background thread only touches the file
+	Tomogram tomogram = tomogramSet.loadTomogram(index, false);
+
+	pendingIndex = index;
+	pendingStack = std::make_shared<BufferedImage<float>>();
+	pendingError = std::exception_ptr();
+
+	pendingThread = std::thread(
+		&TomogramLoader::readStack,
+		tomogram.tiltSeriesFilename,
+		findRowsNeeded(tomogram, index),
+		pendingStack,
+		&pendingError);
+}
+
+void TomogramLoader::finishReading()
+{
+	if (pendingThread.joinable())
+	{
+		pendingThread.join();
+	}
+
+	pendingIndex = -1;
+}
+
+std::vector<std::vector<bool>> TomogramLoader::findRowsNeeded(
+		const Tomogram& tomogram, int index) const
+{
+	if (particleSet == 0)
+	{
+		return std::vector<std::vector<bool>>(0);
+	}
+
+	const int fc = tomogram.frameCount;
+	const int h = tomogram.imageSize.y;
+	const int s = boxSize;
+
+	std::vector<std::vector<bool>> out(fc, std::vector<bool>(h, false));
+
+	const std::vector<ParticleIndex>& tomogramParticles = (*particles)[index];
+
+	for (int p = 0; p < tomogramParticles.size(); p++)
+	{
+		const std::vector<d3Vector> traj = particleSet->getTrajectoryInPixels(
+			tomogramParticles[p], fc, tomogram.optics.pixelSize, from_original_coordinate);
+
+		if (traj.size() < fc)
+		{
+			// this will be reported by the program: just read everything
+			return std::vector<std::vector<bool>>(0);
+		}
+
+		for (int f = 0; f < fc; f++)
+		{
+			const d2Vector centre = tomogram.projectPoint(traj[f], f);
+
+			// the rows touched by TomoExtraction::extractSquares,
+			// as called by TomoExtraction::extractAt2D_Fourier
+			int y0 = (int)round(centre.y) - s/2;
+			int y1 = y0 + s - 1;
+
+			if (y0 < 0) y0 = 0;
+			else if (y0 >= h) y0 = h - 1;
+
+			if (y1 < 0) y1 = 0;
+			else if (y1 >= h) y1 = h - 1;
+
+			for (int y = y0; y <= y1; y++)
+			{
+				out[f][y] = true;
+			}
+		}
+	}
+
+	return out;
+}
+
+void TomogramLoader::readStack(
+		std::string filename,
+		std::vector<std::vector<bool>> rowsNeeded,
+		std::shared_ptr<BufferedImage<float>> stack,
+		std::exception_ptr* error)
+{
+	try
+	{
+		if (rowsNeeded.empty() || !readMrcRows(filename, rowsNeeded, *stack))
+		{
+			stack->read(filename);
+		}
+	}
+	catch (...)
+	{
+		*error = std::current_exception();
+	}
+}
+
+bool TomogramLoader::readMrcRows(
+		const std::string& filename,
+		const std::vector<std::vector<bool>>& rowsNeeded,
+		BufferedImage<float>& stack)
+{
+	std::string::size_type dot = filename.find_last_of('.');
+
+	if (dot == std::string::npos)
+	{
+		return false;
+	}
+
+	const std::string ending = filename.substr(dot+1);
+
+	if (ending != "mrc" && ending != "mrcs" && ending != "st")
+	{
+		return false;
+	}
+
+	FILE* file = fopen(filename.c_str(), "rb");
+
+	if (file == NULL)
+	{
+		return false;
+	}
+
+	int header[256];
+
+	if (fread(header, sizeof(int), 256, file) != 256)
+	{
+		fclose(file);
+		return false;
+	}
+
+	const int w = header[0];
+	const int h = header[1];
+	const int fc = header[2];
+	const int mode = header[3];
+	const int extendedHeaderSize = header[23];
+
+	int bytesPerPixel;
+
+	switch (mode)
+	{
+		case 0: bytesPerPixel = 1; break; // signed char
+		case 1: bytesPerPixel = 2; break; // short
+		case 2: bytesPerPixel = 4; break; // float
+		case 6: bytesPerPixel = 2; break; // unsigned short
+		default: bytesPerPixel = 0;
+	}
+
+	// Everything else (including byte-swapped files) is left to the usual reader
+	if (bytesPerPixel == 0 || w <= 0 || h <= 0 || extendedHeaderSize < 0
+			|| fc != rowsNeeded.size() || h != rowsNeeded[0].size())
+	{
+		fclose(file);
+		return false;
+	}
+
+	stack.resize(w, h, fc);
+
+	std::vector<char> buffer;
+
+	for (int f = 0; f < fc; f++)
+	{
+		int y = 0;
+
+		while (y < h)
+		{
+			if (!rowsNeeded[f][y])
+			{
+				for (int x = 0; x < w; x++)
+				{
+					stack(x,y,f) = 0.f;
+				}
+
+				y++;
+				continue;
+			}
+
+			int y1 = y;
+
+			while (y1 < h && rowsNeeded[f][y1])
+			{
+				y1++;
+			}
+
+			const size_t pixels = (y1 - y) * (size_t) w;
+			const size_t offset = 1024 + (size_t) extendedHeaderSize
+					+ ((f * (size_t) h + y) * w) * bytesPerPixel;
+
+			buffer.resize(pixels * bytesPerPixel);
+
+			if (fseeko(file, offset, SEEK_SET) != 0
+					|| fread(&buffer[0], bytesPerPixel, pixels, file) != pixels)
+			{
+				fclose(file);
+				REPORT_ERROR_STR("TomogramLoader::readMrcRows: unable to read rows "
+					<< y << " to " << (y1 - 1) << " of frame " << f << " from " << filename);
+			}
+
+			float* dest = &stack(0,y,f);
+
+			switch (mode)
+			{
+				case 0:
+				{
+					const signed char* src = (const signed char*) &buffer[0];
+					for (size_t i = 0; i < pixels; i++) dest[i] = (float) src[i];
+					break;
+				}
+				case 1:
+				{
+					const short* src = (const short*) &buffer[0];
+					for (size_t i = 0; i < pixels; i++) dest[i] = (float) src[i];
+					break;
+				}
+				case 2:
+				{
+					const float* src = (const float*) &buffer[0];
+					for (size_t i = 0; i < pixels; i++) dest[i] = src[i];
+					break;
+				}
+				case 6:
+				{
+					const unsigned short* src = (const unsigned short*) &buffer[0];
+					for (size_t i = 0; i < pixels; i++) dest[i] = (float) src[i];
+					break;
+				}
+			}
+
+			y = y1;
+		}
+	}
+
+	fclose(file);
+
+	return true;
+}
+
+void TomogramLoader::moveStack(BufferedImage<float>& source, BufferedImage<float>& destination)
+{
+	destination.xdim = source.xdim;
+	destination.ydim = source.ydim;
+	destination.zdim = source.zdim;
+	destination.dataVec.swap(source.dataVec);
+	destination.data = destination.dataVec.empty()? 0 : &(destination.dataVec[0]);
+
+	source.xdim = source.ydim = source.zdim = 0;
+	source.data = 0;
+}
@@ -0,0 +1,89 @@
+#ifndef TOMOGRAM_LOADER_H
+#define TOMOGRAM_LOADER_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <exception>
+#include <src/jaz/image/buffered_image.h>
+#include "tomogram.h"
+#include "particle_set.h"
+
+class TomogramSet;
+
+/* Loads the tilt series of a sequence of tomograms.
+
+   With prefetching, the tilt series of the next tomogram in the sequence is
+   read by a background thread while the current one is being processed.
+   This requires memory for two tilt series.
+
+   With regions of interest, only the rows of each tilt image that are covered by the
+   (clamped) extraction boxes of the particles are read, and all other pixels are set to zero.
+   This is only valid for programs that do not look at the tilt images anywhere else
+   (e.g. for whitening). Stacks that are not plain MRC files are always read completely.
+
+   The metadata are always taken from the TomogramSet at the time of the call to load. */
+class TomogramLoader
+{
+	public:
+
+		TomogramLoader(
+				const TomogramSet& tomogramSet,
+				const std::vector<int>& tomogramIndices,
+				bool prefetch);
+
+		~TomogramLoader();
+
+
+		void setRegionsOfInterest(
+				const ParticleSet& particleSet,
+				const std::vector<std::vector<ParticleIndex>>& particles,
+				int boxSize,
+				bool from_original_coordinate = false);
+
+		/* Equivalent to tomogramSet.loadTomogram(index, true).
+		   Starts reading the tomogram following index in the sequence. */
+		Tomogram load(int index);
+
+
+	private:
+
+		const TomogramSet& tomogramSet;
+		std::vector<int> tomogramIndices;
+		bool prefetch;
+
+		const ParticleSet* particleSet;
+		const std::vector<std::vector<ParticleIndex>>* particles;
+		int boxSize;
+		bool from_original_coordinate;
+
+		int pendingIndex;
+		std::thread pendingThread;
+		std::shared_ptr<BufferedImage<float>> pendingStack;
+		std::exception_ptr pendingError;
+
+
+		void startReading(int index);
+		void finishReading();
+
+		std::vector<std::vector<bool>> findRowsNeeded(const Tomogram& tomogram, int index) const;
+
+		static void readStack(
+				std::string filename,
+				std::vector<std::vector<bool>> rowsNeeded,
+				std::shared_ptr<BufferedImage<float>> stack,
+				std::exception_ptr* error);
+
+		static bool readMrcRows(
+				const std::string& filename,
+				const std::vector<std::vector<bool>>& rowsNeeded,
+				BufferedImage<float>& stack);
+
+		static void moveStack(BufferedImage<float>& source, BufferedImage<float>& destination);
+
+		TomogramLoader(const TomogramLoader&);
+		TomogramLoader& operator = (const TomogramLoader&);
+};
+
+#endif
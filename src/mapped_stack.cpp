@@ -0,0 +1,182 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "src/mapped_stack.h"
+
+MappedStackReader::MappedStackReader(int max_open_stacks)
+: max_open(max_open_stacks), use_counter(0)
+{
+	if (max_open < 1)
+		max_open = 1;
+}
+
+MappedStackReader::~MappedStackReader()
+{
+	clear();
+}
+
+bool MappedStackReader::canRead(const FileName &fn_img)
+{
+	long int n;
+	FileName fn_stack;
+	fn_img.decompose(n, fn_stack);
+	if (n < 1)
+		return false;
+
+	// Image::read treats N@file.mrc as a volume (or a single image), not as a stack
+	return (fn_stack.getFileFormat() == "mrcs");
+}
+
+void MappedStackReader::clear()
+{
+	for (size_t i = 0; i < stacks.size(); i++)
+		close(stacks[i]);
+	stacks.clear();
+}
+
+MappedStackReader& MappedStackReader::forThisThread()
+{
+	static thread_local MappedStackReader reader;
+	return reader;
+}
+
+void MappedStackReader::close(Stack &stack)
+{
+	if (stack.map != NULL)
+		munmap(stack.map, stack.mapped_size);
+	stack.map = NULL;
+}
+
+const MappedStackReader::Stack& MappedStackReader::open(const FileName &fn_stack)
+{
+	use_counter++;
+
+	for (size_t i = 0; i < stacks.size(); i++)
+	{
+		if (stacks[i].name == fn_stack)
+		{
+			stacks[i].last_used = use_counter;
+			return stacks[i];
+		}
+	}
+
+	// Unmap the least recently used stack if too many are open
+	if (stacks.size() >= max_open)
+	{
+		size_t lru = 0;
+		for (size_t i = 1; i < stacks.size(); i++)
+			if (stacks[i].last_used < stacks[lru].last_used)
+				lru = i;
+		close(stacks[lru]);
+		stacks.erase(stacks.begin() + lru);
+	}
+
+	// file.mrc:mrcs means "it's called .mrc, but it's really a stack"
+	FileName fn_file = fn_stack.removeFileFormat();
+
+	int fd = ::open(fn_file.c_str(), O_RDONLY);
+	if (fd == -1)
+		REPORT_ERROR("MappedStackReader: cannot open " + fn_file);
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size < MRCSIZE)
+	{
+		::close(fd);
+		REPORT_ERROR("MappedStackReader: " + fn_file + " is too small to be an MRC file");
+	}
+
+	Stack stack;
+	stack.name = fn_stack;
+	stack.mapped_size = file_stat.st_size;
+	stack.map = (char *) mmap(NULL, stack.mapped_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping stays valid after closing the descriptor
+	::close(fd);
+	if (stack.map == MAP_FAILED)
+		REPORT_ERROR("MappedStackReader: mmap of " + fn_file + " failed");
+
+	// Same header parsing as Image::readMRC, without filling a main header for every image
+	Image<RFLOAT>::MRChead header;
+	memcpy(&header, stack.map, MRCSIZE);
+
+	stack.swap = 0;
+	if ((abs(header.mode) > SWAPTRIG) || (abs(header.nx) > SWAPTRIG))
+	{
+		stack.swap = 1;
+		char *b = (char *) &header;
+		int extent = MRCSIZE - 800; // exclude labels from swapping
+		for (int i = 0; i < extent; i += 4)
+			swapbytes(b + i, 4);
+	}
+
+	stack.xdim = header.nx;
+	stack.ydim = header.ny;
+	stack.ndim = header.nz;
+
+	switch (header.mode)
+	{
+	case 0:
+		stack.datatype = SChar;
+		break;
+	case 1:
+		stack.datatype = SShort;
+		break;
+	case 2:
+		stack.datatype = Float;
+		break;
+	case 6:
+		stack.datatype = UShort;
+		break;
+	case 12:
+		stack.datatype = Float16;
+		break;
+	case 101:
+		if ((stack.xdim * stack.ydim) % 2 != 0)
+		{
+			close(stack);
+			REPORT_ERROR("Currently we support 4-bit MRC (mode 101) only when nx * ny is an even number.");
+		}
+		stack.datatype = UHalf;
+		break;
+	default:
+		close(stack);
+		REPORT_ERROR("MappedStackReader: unsupported MRC mode " + integerToString(header.mode) + " in " + fn_file);
+	}
+
+	stack.offset = MRCSIZE + header.nsymbt;
+	if (stack.datatype == UHalf)
+		stack.pagesize = stack.xdim * stack.ydim / 2;
+	else
+		stack.pagesize = stack.xdim * stack.ydim * gettypesize(stack.datatype);
+
+	if (stack.offset + stack.ndim * stack.pagesize > stack.mapped_size)
+	{
+		close(stack);
+		REPORT_ERROR("MappedStackReader: " + fn_file + " is shorter than its header says");
+	}
+
+	stack.last_used = use_counter;
+	stacks.push_back(stack);
+
+	return stacks.back();
+}
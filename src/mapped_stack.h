@@ -0,0 +1,105 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef MAPPED_STACK_H_
+#define MAPPED_STACK_H_
+
+#include <vector>
+#include "src/image.h"
+
+/** Memory-mapped reader for MRC particle stacks
+ *
+ * Image<T>::read() opens the file, reads and parses the header, seeks and reads
+ * for every single image of a stack. This reader keeps the most recently used
+ * stacks mapped, together with their parsed headers, so that reading another
+ * image of the same stack is a copy (and cast) out of the page cache.
+ *
+ * A reader is not thread-safe: use one per thread, e.g. through forThisThread().
+ */
+class MappedStackReader
+{
+public:
+
+	MappedStackReader(int max_open_stacks = 32);
+	~MappedStackReader();
+
+	/** Can this image (in RELION's number\@stack notation) be read from a mapped stack?
+	 *  Only images with an explicit number in .mrcs stacks (or file.mrc:mrcs) are.
+	 */
+	static bool canRead(const FileName &fn_img);
+
+	/** Read an image in number\@stack notation. The origin is not set. */
+	template<typename T>
+	void read(const FileName &fn_img, Image<T> &img)
+	{
+		long int n;
+		FileName fn_stack;
+		fn_img.decompose(n, fn_stack);
+		if (n < 1)
+			REPORT_ERROR("MappedStackReader::read: no image number in " + fn_img);
+		read(fn_stack, n - 1, img);
+	}
+
+	/** Read image n (counting from 0) of an MRC stack. The origin is not set. */
+	template<typename T>
+	void read(const FileName &fn_stack, long int n, Image<T> &img)
+	{
+		const Stack &stack = open(fn_stack);
+		if (n < 0 || n >= stack.ndim)
+			REPORT_ERROR("MappedStackReader::read: image number " + integerToString(n + 1)
+			             + " exceeds stack size " + integerToString(stack.ndim) + " of " + fn_stack);
+
+		img.readFromMemory(stack.map + stack.offset + n * stack.pagesize,
+		                   stack.xdim, stack.ydim, 1, stack.datatype, stack.swap);
+	}
+
+	/** Unmap all stacks */
+	void clear();
+
+	/** The reader of the calling thread */
+	static MappedStackReader& forThisThread();
+
+private:
+
+	struct Stack
+	{
+		FileName name;
+		char *map;
+		size_t mapped_size, offset, pagesize;
+		long int xdim, ydim, ndim;
+		DataType datatype;
+		int swap;
+		long int last_used;
+	};
+
+	std::vector<Stack> stacks;
+	int max_open;
+	long int use_counter;
+
+	// Map a stack and parse its header, or return the cached one
+	const Stack& open(const FileName &fn_stack);
+	void close(Stack &stack);
+
+	// Not copyable: the mappings are owned by the reader
+	MappedStackReader(const MappedStackReader&);
+	MappedStackReader& operator=(const MappedStackReader&);
+};
+
+#endif /* MAPPED_STACK_H_ */
@@ -44,67 +44,96 @@
 
 #include "src/metadata_table.h"
 #include "src/metadata_label.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <omp.h>
+
+int MetaDataTable::nr_read_threads = 1;
+
+MetaDataStringPool::MetaDataStringPool()
+{
+	for (int i = 0; i < nr_shards; i++)
+		omp_init_lock(&locks[i]);
+
+	blank = intern("");
+}
+
+MetaDataStringPool::~MetaDataStringPool()
+{
+	for (int i = 0; i < nr_shards; i++)
+		omp_destroy_lock(&locks[i]);
+}
+
+const std::string* MetaDataStringPool::intern(const std::string &value)
+{
+	// Different threads mostly insert into different shards
+	const int shard = std::hash<std::string>()(value) % nr_shards;
+
+	omp_set_lock(&locks[shard]);
+	const std::string *result = &(*shards[shard].insert(value).first);
+	omp_unset_lock(&locks[shard]);
+
+	return result;
+}
 
 MetaDataTable::MetaDataTable()
-:	objects(0),
+:	nr_objects(0),
 	label2offset(EMDL_LAST_LABEL, -1),
 	current_objectID(0),
-	doubleLabels(0),
-	intLabels(0),
-	boolLabels(0),
-	stringLabels(0),
-	doubleVectorLabels(0),
-	unknownLabels(0),
 	isList(false),
 	name(""),
 	comment(""),
 	version(CURRENT_MDT_VERSION),
-	activeLabels(0)
+	activeLabels(0),
+	mappedStar(NULL),
+	mappedStarSize(0)
 {
 }
 
 MetaDataTable::MetaDataTable(const MetaDataTable &MD)
-:	objects(MD.objects.size()),
+:	doubleColumns(MD.doubleColumns),
+	intColumns(MD.intColumns),
+	boolColumns(MD.boolColumns),
+	stringColumns(MD.stringColumns),
+	doubleVectorColumns(MD.doubleVectorColumns),
+	unknownColumns(MD.unknownColumns),
+	nr_objects(MD.nr_objects),
+	stringPool(MD.stringPool),
 	label2offset(MD.label2offset),
 	unknownLabelPosition2Offset(MD.unknownLabelPosition2Offset),
 	unknownLabelNames(MD.unknownLabelNames),
 	current_objectID(0),
-	doubleLabels(MD.doubleLabels),
-	intLabels(MD.intLabels),
-	boolLabels(MD.boolLabels),
-	stringLabels(MD.stringLabels),
-	doubleVectorLabels(MD.doubleVectorLabels),
-	unknownLabels(MD.unknownLabels),
 	isList(MD.isList),
 	name(MD.name),
 	comment(MD.comment),
 	version(MD.version),
-	activeLabels(MD.activeLabels)
+	activeLabels(MD.activeLabels),
+	mappedStar(NULL),
+	mappedStarSize(0)
 {
-	for (size_t idx = 0; idx < MD.objects.size(); idx++)
-	{
-		objects[idx] = new MetaDataContainer(*(MD.objects[idx]));
-		objects[idx]->table = this;
-	}
 }
 
 MetaDataTable& MetaDataTable::operator = (const MetaDataTable &MD)
 {
 	if (this != &MD)
 	{
-		clear();
+		doubleColumns = MD.doubleColumns;
+		intColumns = MD.intColumns;
+		boolColumns = MD.boolColumns;
+		stringColumns = MD.stringColumns;
+		doubleVectorColumns = MD.doubleVectorColumns;
+		unknownColumns = MD.unknownColumns;
+		nr_objects = MD.nr_objects;
+		stringPool = MD.stringPool;
 
-		objects.resize(MD.objects.size());
 		label2offset = MD.label2offset;
 		unknownLabelPosition2Offset = MD.unknownLabelPosition2Offset;
 		unknownLabelNames = MD.unknownLabelNames;
 		current_objectID = 0;
-		doubleLabels = MD.doubleLabels;
-		intLabels = MD.intLabels;
-		boolLabels = MD.boolLabels;
-		stringLabels = MD.stringLabels;
-		doubleVectorLabels = MD.doubleVectorLabels;
-		unknownLabels = MD.unknownLabels;
 
 		isList = MD.isList;
 		name = MD.name;
@@ -112,12 +141,6 @@ MetaDataTable& MetaDataTable::operator = (const MetaDataTable &MD)
 		version = MD.version;
 
 		activeLabels = MD.activeLabels;
-
-		for (long int idx = 0; idx < MD.objects.size(); idx++)
-		{
-			objects[idx] = new MetaDataContainer(this, MD.objects[idx]);
-			objects[idx]->table = this;
-		}
 	}
 
 	return *this;
@@ -130,41 +153,44 @@ void MetaDataTable::setIsList(bool is_list)
 
 MetaDataTable::~MetaDataTable()
 {
-	for (long i = 0; i < objects.size(); i++)
-	{
-		delete objects[i];
-	}
+}
+
+MetaDataStringPool& MetaDataTable::getStringPool()
+{
+	if (!stringPool)
+		stringPool.reset(new MetaDataStringPool());
+
+	return *stringPool;
 }
 
 bool MetaDataTable::isEmpty() const
 {
-	return (objects.size()==0);
+	return (nr_objects == 0);
 }
 
 size_t MetaDataTable::numberOfObjects() const
 {
-	return objects.size();
+	return nr_objects;
 }
 
 void MetaDataTable::clear()
 {
-	for (long i = 0; i < objects.size(); i++)
-	{
-		delete objects[i];
-	}
-	objects.clear();
+	doubleColumns.clear();
+	intColumns.clear();
+	boolColumns.clear();
+	stringColumns.clear();
+	doubleVectorColumns.clear();
+	unknownColumns.clear();
+	nr_objects = 0;
+
+	// Do not keep the strings of the old content alive (copies of this table still hold on to them)
+	stringPool.reset();
 
 	label2offset = std::vector<long>(EMDL_LAST_LABEL, -1);
 	current_objectID = 0;
 	unknownLabelPosition2Offset.clear();
 	unknownLabelNames.clear();
 
-	doubleLabels = 0;
-	intLabels = 0;
-	boolLabels = 0;
-	stringLabels = 0;
-	unknownLabels = 0;
-
 	isList = false;
 	name = "";
 	comment = "";
@@ -221,6 +247,33 @@ std::string MetaDataTable::getUnknownLabelNameAt(int i) const
 	return unknownLabelNames[unknownLabelPosition2Offset[i]];
 }
 
+// Format a double as it is written into STAR files (buffer must hold 13 chars)
+static void doubleToSTAR(double v, char *buffer)
+{
+	if ((ABS(v) > 0. && ABS(v) < 0.001) || ABS(v) > 100000.)
+	{
+		if (v < 0.)
+		{
+			snprintf(buffer,13, "%12.5e", v);
+		}
+		else
+		{
+			snprintf(buffer,13, "%12.6e", v);
+		}
+	}
+	else
+	{
+		if (v < 0.)
+		{
+			snprintf(buffer,13, "%12.5f", v);
+		}
+		else
+		{
+			snprintf(buffer,13, "%12.6f", v);
+		}
+	}
+}
+
 bool MetaDataTable::getValueToString(EMDLabel label, std::string &value, long objectID, bool escape) const
 {
 	// SHWS 18jul2018: this function previously had a stringstream, but it greatly slowed down
@@ -250,28 +303,7 @@ bool MetaDataTable::getValueToString(EMDLabel label, std::string &value, long ob
 			double v;
 			if(!getValue(label, v, objectID)) return false;
 
-			if ((ABS(v) > 0. && ABS(v) < 0.001) || ABS(v) > 100000.)
-			{
-				if (v < 0.)
-				{
-					snprintf(buffer,13, "%12.5e", v);
-				}
-				else
-				{
-					snprintf(buffer,13, "%12.6e", v);
-				}
-			}
-			else
-			{
-				if (v < 0.)
-				{
-					snprintf(buffer,13, "%12.5f", v);
-				}
-				else
-				{
-					snprintf(buffer,13, "%12.6f", v);
-				}
-			}
+			doubleToSTAR(v, buffer);
 		}
 		else if (EMDL::isInt(label))
 		{
@@ -377,7 +409,7 @@ bool MetaDataTable::setUnknownValue(int labelPosition, const std::string &value)
 
 	if (offset > -1)
 	{
-		objects[current_objectID]->unknowns[offset] = value;
+		unknownColumns[offset][current_objectID] = stringPool->intern(value);
 		return true;
 	}
 	else
@@ -386,6 +418,30 @@ bool MetaDataTable::setUnknownValue(int labelPosition, const std::string &value)
 	}
 }
 
+// Parse a vector in the format [1.0,2.0,3.0]
+static void doubleVectorFromString(const std::string &value, std::vector<double> &v)
+{
+	v.clear();
+	v.reserve(32);
+
+	char* temp = new char[value.size()+1];
+	strcpy(temp, value.c_str());
+
+	char* token;
+	char* rest = temp;
+
+	while ((token = strtok_r(rest, "[,]", &rest)) != 0)
+	{
+		double d;
+		std::stringstream sts(token);
+		sts >> d;
+
+		v.push_back(d);
+	}
+
+	delete[] temp;
+}
+
 bool MetaDataTable::setValueFromString(
 		EMDLabel label, const std::string &value, long int objectID)
 {
@@ -418,24 +474,7 @@ bool MetaDataTable::setValueFromString(
 		else if (EMDL::isDoubleVector(label))
 		{
 			std::vector<double> v;
-			v.reserve(32);
-
-			char* temp = new char[value.size()+1];
-			strcpy(temp, value.c_str());
-
-			char* token;
-			char* rest = temp;
-
-			while ((token = strtok_r(rest, "[,]", &rest)) != 0)
-			{
-				double d;
-				std::stringstream sts(token);
-				sts >> d;
-
-				v.push_back(d);
-			}
-
-			delete[] temp;
+			doubleVectorFromString(value, v);
 
 			return setValue(label, v, objectID);
 		}
@@ -445,68 +484,69 @@ bool MetaDataTable::setValueFromString(
 	return false;
 }
 
-// comparators used for sorting
+// comparators used for sorting: they compare the values of two rows in a single column
 
 struct MdDoubleComparator
 {
-	MdDoubleComparator(long index) : index(index) {}
+	MdDoubleComparator(const std::vector<double> &column) : column(column) {}
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	bool operator()(long lh, long rh) const
 	{
-		return lh->doubles[index] < rh->doubles[index];
+		return column[lh] < column[rh];
 	}
 
-	long index;
+	const std::vector<double> &column;
 };
 
 struct MdIntComparator
 {
-	MdIntComparator(long index) : index(index) {}
+	MdIntComparator(const std::vector<long> &column) : column(column) {}
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	bool operator()(long lh, long rh) const
 	{
-		return lh->ints[index] < rh->ints[index];
+		return column[lh] < column[rh];
 	}
 
-	long index;
+	const std::vector<long> &column;
 };
 
 struct MdStringComparator
 {
-	MdStringComparator(long index) : index(index) {}
+	MdStringComparator(const std::vector<const std::string*> &column) : column(column) {}
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	bool operator()(long lh, long rh) const
 	{
-		return lh->strings[index] < rh->strings[index];
+		// Interned strings: equal values share the same pointer
+		return column[lh] != column[rh] && *column[lh] < *column[rh];
 	}
 
-	long index;
+	const std::vector<const std::string*> &column;
 };
 
 struct MdStringAfterAtComparator
 {
-	MdStringAfterAtComparator(long index) : index(index) {}
+	MdStringAfterAtComparator(const std::vector<const std::string*> &column) : column(column) {}
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	bool operator()(long lh, long rh) const
 	{
-		std::string slh = lh->strings[index];
-		std::string srh = rh->strings[index];
+		std::string slh = *column[lh];
+		std::string srh = *column[rh];
 		slh = slh.substr(slh.find("@")+1);
 		srh = srh.substr(srh.find("@")+1);
 		return slh < srh;
 	}
 
-	long index;
+	const std::vector<const std::string*> &column;
 };
 
 struct MdStringBeforeAtComparator
 {
-	MdStringBeforeAtComparator(long index) : index(index) {}
+	MdStringBeforeAtComparator(const std::vector<const std::string*> &column) : column(column) {}
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	bool operator()(long lh, long rh) const
 	{
-		std::string slh = lh->strings[index];
-		std::string srh = rh->strings[index];
+		std::string slh = *column[lh];
+		std::string srh = *column[rh];
 		slh = slh.substr(0, slh.find("@"));
 		srh = srh.substr(0, srh.find("@"));
 		std::stringstream stslh, stsrh;
@@ -519,11 +559,13 @@ struct MdStringBeforeAtComparator
 		return ilh < irh;
 	}
 
-	long index;
+	const std::vector<const std::string*> &column;
 };
 
 void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bool do_random)
 {
+	const long off = label2offset[name];
+
 	if (do_random)
 	{
 		srand (time(NULL));			  /* initialize random seed: */
@@ -532,12 +574,14 @@ void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bo
 	{
 		REPORT_ERROR("MetadataTable::sort%% ERROR: can only sorted numbers");
 	}
+	else if (off < 0 && nr_objects > 0)
+	{
+		REPORT_ERROR("MetadataTable::sort ERROR: the table does not contain " + EMDL::label2Str(name));
+	}
 
-	std::vector<std::pair<double,long int> > vp;
-	vp.reserve(objects.size());
-	long int i = 0;
+	std::vector<std::pair<double,long int> > vp(nr_objects);
 
-	FOR_ALL_OBJECTS_IN_METADATA_TABLE(*this)
+	for (long int i = 0; i < nr_objects; i++)
 	{
 		double dval;
 		if (do_random)
@@ -546,17 +590,14 @@ void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bo
 		}
 		else if (EMDL::isInt(name))
 		{
-			long val;
-			getValue(name, val);
-			dval = (double) val;
+			dval = (double)intColumns[off][i];
 		}
 		else // EMDL::isDouble(name)
 		{
-			getValue(name, dval);
+			dval = doubleColumns[off][i];
 		}
 
-		vp.push_back(std::make_pair(dval, i));
-		i++;
+		vp[i] = std::make_pair(dval, i);
 	}
 
 	std::sort(vp.begin(), vp.end());
@@ -574,14 +615,14 @@ void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bo
 	else
 	{
 		// Change the actual order in the MetaDataTable
-		std::vector<MetaDataContainer*> objs(objects.size());
+		std::vector<long> order(nr_objects);
 
 		for (long j = 0; j < vp.size(); j++)
 		{
-			objs[j] = objects[vp[j].second];
+			order[j] = vp[j].second;
 		}
 
-		objects = objs;
+		permuteObjects(order);
 	}
 	// reset pointer to the beginning of the table
 	firstObject();
@@ -589,30 +630,42 @@ void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bo
 
 void MetaDataTable::newSort(const EMDLabel label, bool do_reverse, bool do_sort_after_at, bool do_sort_before_at)
 {
+	const long off = label2offset[label];
+	if (off < 0)
+	{
+		if (nr_objects > 0)
+			REPORT_ERROR("Cannot sort on a label that is not in the table: " + EMDL::label2Str(label));
+		return;
+	}
+
+	std::vector<long> order(nr_objects);
+	for (long i = 0; i < nr_objects; i++)
+		order[i] = i;
+
 	if (EMDL::isString(label))
 	{
 		if (do_sort_after_at)
 		{
-			std::stable_sort(objects.begin(), objects.end(),
-							 MdStringAfterAtComparator(label2offset[label]));
+			std::stable_sort(order.begin(), order.end(),
+							 MdStringAfterAtComparator(stringColumns[off]));
 		}
 		else if (do_sort_before_at)
 		{
-			std::stable_sort(objects.begin(), objects.end(),
-							 MdStringBeforeAtComparator(label2offset[label]));
+			std::stable_sort(order.begin(), order.end(),
+							 MdStringBeforeAtComparator(stringColumns[off]));
 		}
 		else
 		{
-			std::stable_sort(objects.begin(), objects.end(), MdStringComparator(label2offset[label]));
+			std::stable_sort(order.begin(), order.end(), MdStringComparator(stringColumns[off]));
 		}
 	}
 	else if (EMDL::isDouble(label))
 	{
-		std::stable_sort(objects.begin(), objects.end(), MdDoubleComparator(label2offset[label]));
+		std::stable_sort(order.begin(), order.end(), MdDoubleComparator(doubleColumns[off]));
 	}
 	else if (EMDL::isInt(label))
 	{
-		std::stable_sort(objects.begin(), objects.end(), MdIntComparator(label2offset[label]));
+		std::stable_sort(order.begin(), order.end(), MdIntComparator(intColumns[off]));
 	}
 	else
 	{
@@ -621,8 +674,10 @@ void MetaDataTable::newSort(const EMDLabel label, bool do_reverse, bool do_sort_
 
 	if (do_reverse)
 	{
-		std::reverse(objects.begin(), objects.end());
+		std::reverse(order.begin(), order.end());
 	}
+
+	permuteObjects(order);
 }
 
 // Will be removed in 3.2
@@ -633,10 +688,13 @@ bool MetaDataTable::labelExists(EMDLabel name) const
 
 bool MetaDataTable::containsLabel(const EMDLabel label, std::string unknownLabel) const
 {
+	// Known labels have an offset if and only if they are active
+	if (label != EMDL_UNKNOWN_LABEL)
+		return (label >= 0 && label < EMDL_LAST_LABEL && label2offset[label] > -1);
+
 	for (int i = 0; i < activeLabels.size(); i++)
 	{
-		if (activeLabels[i] == label &&
-		    (label != EMDL_UNKNOWN_LABEL || getUnknownLabelNameAt(i) == unknownLabel))
+		if (activeLabels[i] == label && getUnknownLabelNameAt(i) == unknownLabel)
 			return true;
 	}
 
@@ -677,70 +735,35 @@ void MetaDataTable::addLabel(EMDLabel label, std::string unknownLabel)
 
 		if (EMDL::isDouble(label))
 		{
-			id = doubleLabels;
-
-			for (long i = 0; i < objects.size(); i++)
-			{
-				objects[i]->doubles.push_back(0);
-			}
-
-			doubleLabels++;
+			id = doubleColumns.size();
+			doubleColumns.push_back(std::vector<double>(nr_objects, 0));
 		}
 		else if (EMDL::isInt(label))
 		{
-			id = intLabels;
-
-			for (long i = 0; i < objects.size(); i++)
-			{
-				objects[i]->ints.push_back(0);
-			}
-
-			intLabels++;
+			id = intColumns.size();
+			intColumns.push_back(std::vector<long>(nr_objects, 0));
 		}
 		else if (EMDL::isBool(label))
 		{
-			id = boolLabels;
-
-			for (long i = 0; i < objects.size(); i++)
-			{
-				objects[i]->bools.push_back(false);
-			}
-
-			boolLabels++;
+			id = boolColumns.size();
+			boolColumns.push_back(std::vector<char>(nr_objects, false));
 		}
 		else if (EMDL::isString(label))
 		{
-			id = stringLabels;
-
-			for (long i = 0; i < objects.size(); i++)
-			{
-				objects[i]->strings.push_back("empty");
-			}
-
-			stringLabels++;
+			id = stringColumns.size();
+			stringColumns.push_back(std::vector<const std::string*>(nr_objects, getStringPool().intern("empty")));
 		}
 		else if (EMDL::isDoubleVector(label))
 		{
-			id = doubleVectorLabels;
-
-			for (long i = 0; i < objects.size(); i++)
-			{
-				objects[i]->doubleVectors.push_back(std::vector<double>());
-			}
-
-			doubleVectorLabels++;
+			id = doubleVectorColumns.size();
+			doubleVectorColumns.push_back(std::vector<std::vector<double> >(nr_objects));
 		}
 		else if (EMDL::isUnknown(label))
 		{
-			id = unknownLabels;
-
-			for (long i = 0; i < objects.size(); i++)
-			{
-				objects[i]->unknowns.push_back("empty");
-			}
+			id = unknownColumns.size();
+			unknownColumns.push_back(std::vector<const std::string*>(nr_objects, getStringPool().intern("empty")));
 
 			unknownLabelNames.push_back(unknownLabel);
-			unknownLabels++;
 		}
 
 		activeLabels.push_back(label);
@@ -784,15 +807,14 @@ void MetaDataTable::append(const MetaDataTable& mdt)
 	}
 
 	// Now append
-	objects.reserve(objects.size() + mdt.numberOfObjects());
-	for (long i = 0; i < mdt.objects.size(); i++)
+	std::vector<long> objectIDs(mdt.nr_objects);
+	for (long i = 0; i < mdt.nr_objects; i++)
 	{
-		objects.push_back(new MetaDataContainer(
-			this, doubleLabels, intLabels, boolLabels, stringLabels, doubleVectorLabels, unknownLabels));
-
-		setObjectUnsafe(mdt.getObject(i), objects.size() - 1);
+		objectIDs[i] = i;
 	}
 
+	addObjects(mdt, objectIDs);
+
 	// reset pointer to the beginning of the table
 	firstObject();
 }
@@ -804,7 +826,35 @@ MetaDataContainer* MetaDataTable::getObject(long objectID) const
 
 	checkObjectID(objectID,  "MetaDataTable::getObject");
 
-	return objects[objectID];
+	// One row per thread, so that several threads can read from the same table
+	static thread_local MetaDataContainer row;
+	row.table = const_cast<MetaDataTable*>(this);
+
+	row.doubles.resize(doubleColumns.size());
+	for (long c = 0; c < doubleColumns.size(); c++)
+		row.doubles[c] = doubleColumns[c][objectID];
+
+	row.ints.resize(intColumns.size());
+	for (long c = 0; c < intColumns.size(); c++)
+		row.ints[c] = intColumns[c][objectID];
+
+	row.bools.resize(boolColumns.size());
+	for (long c = 0; c < boolColumns.size(); c++)
+		row.bools[c] = (boolColumns[c][objectID] != 0);
+
+	row.strings.resize(stringColumns.size());
+	for (long c = 0; c < stringColumns.size(); c++)
+		row.strings[c] = *stringColumns[c][objectID];
+
+	row.doubleVectors.resize(doubleVectorColumns.size());
+	for (long c = 0; c < doubleVectorColumns.size(); c++)
+		row.doubleVectors[c] = doubleVectorColumns[c][objectID];
+
+	row.unknowns.resize(unknownColumns.size());
+	for (long c = 0; c < unknownColumns.size(); c++)
+		row.unknowns[c] = *unknownColumns[c][objectID];
+
+	return &row;
 }
 
 void MetaDataTable::setObject(MetaDataContainer* data, long objectID)
@@ -828,13 +878,33 @@ void MetaDataTable::setValuesOfDefinedLabels(MetaDataContainer* data, long objec
 
 void MetaDataTable::reserve(size_t capacity)
 {
-	objects.reserve(capacity);
+	for (long c = 0; c < doubleColumns.size(); c++)
+		doubleColumns[c].reserve(capacity);
+	for (long c = 0; c < intColumns.size(); c++)
+		intColumns[c].reserve(capacity);
+	for (long c = 0; c < boolColumns.size(); c++)
+		boolColumns[c].reserve(capacity);
+	for (long c = 0; c < stringColumns.size(); c++)
+		stringColumns[c].reserve(capacity);
+	for (long c = 0; c < doubleVectorColumns.size(); c++)
+		doubleVectorColumns[c].reserve(capacity);
+	for (long c = 0; c < unknownColumns.size(); c++)
+		unknownColumns[c].reserve(capacity);
 }
 
-void MetaDataTable::setObjectUnsafe(MetaDataContainer* data, long objectID)
+long MetaDataTable::unknownLabelOffset(const std::string &unknownLabel) const
 {
-	MetaDataContainer* obj = objects[objectID];
+	for (int j = 0; j < unknownLabelNames.size(); j++)
+	{
+		if (unknownLabelNames[j] == unknownLabel)
+			return j;
+	}
+
+	return -1;
+}
 
+void MetaDataTable::setObjectUnsafe(MetaDataContainer* data, long objectID)
+{
 	for (long i = 0; i < data->table->activeLabels.size(); i++)
 	{
 		EMDLabel label = data->table->activeLabels[i];
@@ -848,72 +918,202 @@ void MetaDataTable::setObjectUnsafe(MetaDataContainer* data, long objectID)
 
 			if (EMDL::isDouble(label))
 			{
-				obj->doubles[myOff] = data->doubles[srcOff];
+				doubleColumns[myOff][objectID] = data->doubles[srcOff];
 			}
 			else if (EMDL::isInt(label))
 			{
-				obj->ints[myOff] = data->ints[srcOff];
+				intColumns[myOff][objectID] = data->ints[srcOff];
 			}
 			else if (EMDL::isBool(label))
 			{
-				obj->bools[myOff] = data->bools[srcOff];
+				boolColumns[myOff][objectID] = data->bools[srcOff];
 			}
 			else if (EMDL::isString(label))
 			{
-				obj->strings[myOff] = data->strings[srcOff];
+				stringColumns[myOff][objectID] = stringPool->intern(data->strings[srcOff]);
 			}
 			else if (EMDL::isDoubleVector(label))
 			{
-				obj->doubleVectors[myOff] = data->doubleVectors[srcOff];
+				doubleVectorColumns[myOff][objectID] = data->doubleVectors[srcOff];
 			}
 		}
 		else
 		{
 			std::string unknownLabel = data->table->getUnknownLabelNameAt(i);
 			long srcOff = data->table->unknownLabelPosition2Offset[i];
-			long myOff = -1;
+			long myOff = unknownLabelOffset(unknownLabel);
+
+			if (myOff < 0)
+				REPORT_ERROR("MetaDataTable::setObjectUnsafe: logic error. cannot find srcOff.");
+
+			unknownColumns[myOff][objectID] = stringPool->intern(data->unknowns[srcOff]);
+		}
+	}
+}
+
+// Copy the rows 'rows' of 'src' to 'dest', starting at dest[first]
+template<class T>
+static void gatherColumn(const std::vector<T> &src, const std::vector<long> &rows, std::vector<T> &dest, long first)
+{
+	for (long i = 0; i < rows.size(); i++)
+	{
+		dest[first + i] = src[rows[i]];
+	}
+}
+
+// Same for strings, which may have to be copied into a different pool
+static void gatherColumn(const std::vector<const std::string*> &src, const std::vector<long> &rows,
+                         std::vector<const std::string*> &dest, long first, MetaDataStringPool *pool)
+{
+	if (pool == NULL)
+	{
+		gatherColumn(src, rows, dest, first);
+	}
+	else
+	{
+		for (long i = 0; i < rows.size(); i++)
+		{
+			dest[first + i] = pool->intern(*src[rows[i]]);
+		}
+	}
+}
+
+void MetaDataTable::addObjects(const MetaDataTable &MD, const std::vector<long> &objectIDs)
+{
+	if (objectIDs.size() == 0)
+		return;
+
+	for (long i = 0; i < objectIDs.size(); i++)
+	{
+		MD.checkObjectID(objectIDs[i], "MetaDataTable::addObjects");
+	}
+
+	addMissingLabels(&MD);
+
+	const long first = nr_objects;
+	resizeObjects(nr_objects + objectIDs.size());
 
-			for (int j = 0; j < unknownLabelNames.size(); j++)
+	// Strings can be shared between tables that use the same pool
+	MetaDataStringPool *pool = (MD.stringPool == stringPool) ? NULL : stringPool.get();
+
+	for (long i = 0; i < MD.activeLabels.size(); i++)
+	{
+		EMDLabel label = MD.activeLabels[i];
+
+		if (label != EMDL_UNKNOWN_LABEL)
+		{
+			long myOff = label2offset[label];
+			long srcOff = MD.label2offset[label];
+
+			if (EMDL::isDouble(label))
 			{
-				if (unknownLabelNames[j] == unknownLabel)
-				{
-					myOff = j;
-					break;
-				}
+				gatherColumn(MD.doubleColumns[srcOff], objectIDs, doubleColumns[myOff], first);
+			}
+			else if (EMDL::isInt(label))
+			{
+				gatherColumn(MD.intColumns[srcOff], objectIDs, intColumns[myOff], first);
+			}
+			else if (EMDL::isBool(label))
+			{
+				gatherColumn(MD.boolColumns[srcOff], objectIDs, boolColumns[myOff], first);
+			}
+			else if (EMDL::isString(label))
+			{
+				gatherColumn(MD.stringColumns[srcOff], objectIDs, stringColumns[myOff], first, pool);
 			}
+			else if (EMDL::isDoubleVector(label))
+			{
+				gatherColumn(MD.doubleVectorColumns[srcOff], objectIDs, doubleVectorColumns[myOff], first);
+			}
+		}
+		else
+		{
+			long srcOff = MD.unknownLabelPosition2Offset[i];
+			long myOff = unknownLabelOffset(MD.getUnknownLabelNameAt(i));
 
 			if (myOff < 0)
-				REPORT_ERROR("MetaDataTable::setObjectUnsafe: logic error. cannot find srcOff.");
+				REPORT_ERROR("MetaDataTable::addObjects: logic error. cannot find srcOff.");
 
-			obj->unknowns[myOff] = data->unknowns[srcOff];
+			gatherColumn(MD.unknownColumns[srcOff], objectIDs, unknownColumns[myOff], first, pool);
 		}
 	}
+
+	current_objectID = nr_objects - 1;
+}
+
+void MetaDataTable::resizeObjects(long new_nr_objects)
+{
+	for (long c = 0; c < doubleColumns.size(); c++)
+		doubleColumns[c].resize(new_nr_objects, 0);
+	for (long c = 0; c < intColumns.size(); c++)
+		intColumns[c].resize(new_nr_objects, 0);
+	for (long c = 0; c < boolColumns.size(); c++)
+		boolColumns[c].resize(new_nr_objects, false);
+	for (long c = 0; c < stringColumns.size(); c++)
+		stringColumns[c].resize(new_nr_objects, stringPool->blank);
+	for (long c = 0; c < doubleVectorColumns.size(); c++)
+		doubleVectorColumns[c].resize(new_nr_objects);
+	for (long c = 0; c < unknownColumns.size(); c++)
+		unknownColumns[c].resize(new_nr_objects, stringPool->blank);
+
+	nr_objects = new_nr_objects;
+}
+
+// Replace 'column' by its rows 'order'
+template<class T>
+static void permuteColumn(std::vector<T> &column, const std::vector<long> &order)
+{
+	std::vector<T> permuted(order.size());
+	gatherColumn(column, order, permuted, 0);
+	column.swap(permuted);
+}
+
+void MetaDataTable::permuteObjects(const std::vector<long> &order)
+{
+	// This includes the columns of deactivated labels, which keep their offsets
+	for (long c = 0; c < doubleColumns.size(); c++)
+		permuteColumn(doubleColumns[c], order);
+	for (long c = 0; c < intColumns.size(); c++)
+		permuteColumn(intColumns[c], order);
+	for (long c = 0; c < boolColumns.size(); c++)
+		permuteColumn(boolColumns[c], order);
+	for (long c = 0; c < stringColumns.size(); c++)
+		permuteColumn(stringColumns[c], order);
+	for (long c = 0; c < doubleVectorColumns.size(); c++)
+		permuteColumn(doubleVectorColumns[c], order);
+	for (long c = 0; c < unknownColumns.size(); c++)
+		permuteColumn(unknownColumns[c], order);
+
+	nr_objects = order.size();
 }
 
 void MetaDataTable::addObject()
 {
-	objects.push_back(new MetaDataContainer(
-		this, doubleLabels, intLabels, boolLabels, stringLabels, doubleVectorLabels, unknownLabels));
+	resizeObjects(nr_objects + 1);
 
-	current_objectID = objects.size()-1;
+	current_objectID = nr_objects - 1;
 }
 
 void MetaDataTable::addObject(MetaDataContainer* data)
 {
-	objects.push_back(new MetaDataContainer(
-		this, doubleLabels, intLabels, boolLabels, stringLabels, doubleVectorLabels, unknownLabels));
+	resizeObjects(nr_objects + 1);
 
-	setObject(data, objects.size()-1);
-	current_objectID = objects.size()-1;
+	setObject(data, nr_objects - 1);
+	current_objectID = nr_objects - 1;
 }
 
 void MetaDataTable::addValuesOfDefinedLabels(MetaDataContainer* data)
 {
-	objects.push_back(new MetaDataContainer(
-		this, doubleLabels, intLabels, boolLabels, stringLabels, doubleVectorLabels, unknownLabels));
+	resizeObjects(nr_objects + 1);
+
+	setValuesOfDefinedLabels(data, nr_objects - 1);
+	current_objectID = nr_objects - 1;
+}
 
-	setValuesOfDefinedLabels(data, objects.size()-1);
-	current_objectID = objects.size()-1;
+template<class T>
+static void eraseFromColumn(std::vector<T> &column, long i)
+{
+	column.erase(column.begin() + i);
 }
 
 void MetaDataTable::removeObject(long objectID)
@@ -922,10 +1122,21 @@ void MetaDataTable::removeObject(long objectID)
 
 	checkObjectID(i, "MetaDataTable::removeObject");
 
-	delete objects[i];
-	objects.erase(objects.begin() + i);
+	for (long c = 0; c < doubleColumns.size(); c++)
+		eraseFromColumn(doubleColumns[c], i);
+	for (long c = 0; c < intColumns.size(); c++)
+		eraseFromColumn(intColumns[c], i);
+	for (long c = 0; c < boolColumns.size(); c++)
+		eraseFromColumn(boolColumns[c], i);
+	for (long c = 0; c < stringColumns.size(); c++)
+		eraseFromColumn(stringColumns[c], i);
+	for (long c = 0; c < doubleVectorColumns.size(); c++)
+		eraseFromColumn(doubleVectorColumns[c], i);
+	for (long c = 0; c < unknownColumns.size(); c++)
+		eraseFromColumn(unknownColumns[c], i);
+	nr_objects--;
 
-	current_objectID = objects.size() - 1;
+	current_objectID = nr_objects - 1;
 }
 
 long int MetaDataTable::firstObject()
@@ -938,7 +1149,7 @@ long int MetaDataTable::nextObject()
 {
 	current_objectID++;
 
-	if (current_objectID >= objects.size())
+	if (current_objectID >= nr_objects)
 	{
 		return NO_MORE_OBJECTS;
 	}
@@ -963,6 +1174,8 @@ long int MetaDataTable::readStarLoop(std::ifstream& in, bool do_only_count)
 	//Read column labels
 	int labelPosition = 0;
 	std::string line, token;
+	std::streampos line_start = in.tellg();
+	bool found_data = false;
 
 	// First read all the column labels
 	while (getline(in, line, '\n'))
@@ -970,7 +1183,10 @@ long int MetaDataTable::readStarLoop(std::ifstream& in, bool do_only_count)
 		line = simplify(line);
 		// TODO: handle comments...
 		if (line[0] == '#' || line[0] == '\0' || line[0] == ';')
+		{
+			line_start = in.tellg();
 			continue;
+		}
 
 		if (line[0] == '_') // label definition line
 		{
@@ -994,13 +1210,20 @@ long int MetaDataTable::readStarLoop(std::ifstream& in, bool do_only_count)
 		}
 		else // found first data line
 		{
+			found_data = true;
 			break;
 		}
+
+		line_start = in.tellg();
 	}
 
+	// Fast path: tokenize the rows directly from the memory-mapped file
+	if (found_data && mappedStar != NULL && line_start >= 0)
+		return readStarLoopMapped(in, (size_t)line_start, do_only_count);
+
 	// Then fill the table (dont read another line until the one from above has been handled)
 	bool is_first = true;
-	long int nr_objects = 0;
+	long int nr_rows = 0;
 	const int num_labels = activeLabels.size();
 
 	while (is_first || getline(in, line, '\n'))
@@ -1012,7 +1235,7 @@ long int MetaDataTable::readStarLoop(std::ifstream& in, bool do_only_count)
 		if (line[0] == '\0')
 			break;
 
-		nr_objects++;
+		nr_rows++;
 		if (!do_only_count)
 		{
 			// Add a new line to the table
@@ -1049,158 +1272,1034 @@ long int MetaDataTable::readStarLoop(std::ifstream& in, bool do_only_count)
 		}
 	}
 
-	return nr_objects;
-}
+	return nr_rows;
+}
+
+// Characters that simplify() removes or turns into spaces
+static inline bool isBlankInSTAR(char c)
+{
+	return (c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\b' || c == '\r' || c == '\f' || c == '\a');
+}
+
+// Column of a STAR loop, resolved once before parsing the rows
+struct StarLoopColumn
+{
+	enum Type {DOUBLE, INT, BOOL, STRING, DOUBLE_VECTOR} type;
+	std::vector<double> *doubles;
+	std::vector<long> *ints;
+	std::vector<char> *bools;
+	std::vector<const std::string*> *strings; // also for unknown labels
+	std::vector<std::vector<double> > *doubleVectors;
+};
+
+// A complete decimal number ([sign] digits [. digits] [e [sign] digits]):
+// for those, strtod/strtol give the same as the istream in setValueFromString
+static bool isPlainNumberInSTAR(const char *c)
+{
+	if (*c == '-' || *c == '+')
+		c++;
+
+	int nr_digits = 0;
+	for (; *c >= '0' && *c <= '9'; c++)
+		nr_digits++;
+	if (*c == '.')
+	{
+		for (c++; *c >= '0' && *c <= '9'; c++)
+			nr_digits++;
+	}
+	if (nr_digits == 0)
+		return false;
+
+	if (*c == 'e' || *c == 'E')
+	{
+		c++;
+		if (*c == '-' || *c == '+')
+			c++;
+		if (!(*c >= '0' && *c <= '9'))
+			return false;
+		while (*c >= '0' && *c <= '9')
+			c++;
+	}
+
+	return (*c == '\0');
+}
+
+static void setStarLoopValue(const StarLoopColumn &column, long row, const char *token, size_t len, MetaDataStringPool &pool)
+{
+	switch (column.type)
+	{
+	case StarLoopColumn::STRING:
+		(*column.strings)[row] = pool.intern(std::string(token, len));
+		break;
+	case StarLoopColumn::DOUBLE_VECTOR:
+		doubleVectorFromString(std::string(token, len), (*column.doubleVectors)[row]);
+		break;
+	default:
+	{
+		// Numbers are short: copy them so that strtod/strtol never run past the end of the mapping
+		char buffer[64];
+		std::string long_token;
+		const char *number = buffer;
+		if (len < sizeof(buffer))
+		{
+			memcpy(buffer, token, len);
+			buffer[len] = '\0';
+		}
+		else
+		{
+			long_token.assign(token, len);
+			number = long_token.c_str();
+		}
+
+		if (!isPlainNumberInSTAR(number))
+		{
+			// e.g. nan, inf or 0x10: strtod would accept those, setValueFromString does not
+			std::istringstream i(number);
+			if (column.type == StarLoopColumn::DOUBLE)
+			{
+				double v = 0.;
+				i >> v;
+				(*column.doubles)[row] = v;
+			}
+			else if (column.type == StarLoopColumn::INT)
+			{
+				long v = 0;
+				i >> v;
+				(*column.ints)[row] = v;
+			}
+			else
+			{
+				bool v = false;
+				i >> v;
+				(*column.bools)[row] = v;
+			}
+		}
+		else if (column.type == StarLoopColumn::DOUBLE)
+			(*column.doubles)[row] = strtod(number, NULL);
+		else if (column.type == StarLoopColumn::INT)
+			(*column.ints)[row] = strtol(number, NULL, 10);
+		else
+			(*column.bools)[row] = (strtol(number, NULL, 10) != 0);
+	}
+	}
+}
+
+long int MetaDataTable::readStarLoopMapped(std::ifstream& in, size_t data_start, bool do_only_count)
+{
+	const char *data = mappedStar;
+	const size_t size = mappedStarSize;
+
+	// Find all rows: the loop ends at the first blank line (or at the end of the file)
+	std::vector<size_t> row_start, row_end;
+	size_t pos = data_start;
+	while (pos < size)
+	{
+		const char *newline = (const char*) memchr(data + pos, '\n', size - pos);
+		const size_t line_end = (newline == NULL) ? size : newline - data;
+
+		bool is_blank = true;
+		for (size_t c = pos; c < line_end; c++)
+		{
+			if (!isBlankInSTAR(data[c]))
+			{
+				is_blank = false;
+				break;
+			}
+		}
+
+		if (!is_blank)
+		{
+			row_start.push_back(pos);
+			row_end.push_back(line_end);
+		}
+
+		pos = (newline == NULL) ? size : line_end + 1;
+		if (is_blank)
+			break;
+	}
+
+	// Leave the stream where readStarLoop would have left it
+	in.clear();
+	in.seekg(pos);
+
+	const long int nr_rows = row_start.size();
+	if (do_only_count)
+		return nr_rows;
+
+	const long int first_object = nr_objects;
+	resizeObjects(first_object + nr_rows);
+
+	// No labels are added below, so the column pointers remain valid
+	const int num_labels = activeLabels.size();
+	std::vector<StarLoopColumn> columns(num_labels);
+	for (int i = 0; i < num_labels; i++)
+	{
+		const EMDLabel label = activeLabels[i];
+		const long offset = label2offset[label];
+		if (label == EMDL_UNKNOWN_LABEL)
+		{
+			columns[i].type = StarLoopColumn::STRING;
+			columns[i].strings = &unknownColumns[unknownLabelPosition2Offset[i]];
+		}
+		else if (EMDL::isString(label))
+		{
+			columns[i].type = StarLoopColumn::STRING;
+			columns[i].strings = &stringColumns[offset];
+		}
+		else if (EMDL::isDouble(label))
+		{
+			columns[i].type = StarLoopColumn::DOUBLE;
+			columns[i].doubles = &doubleColumns[offset];
+		}
+		else if (EMDL::isInt(label))
+		{
+			columns[i].type = StarLoopColumn::INT;
+			columns[i].ints = &intColumns[offset];
+		}
+		else if (EMDL::isBool(label))
+		{
+			columns[i].type = StarLoopColumn::BOOL;
+			columns[i].bools = &boolColumns[offset];
+		}
+		else
+		{
+			columns[i].type = StarLoopColumn::DOUBLE_VECTOR;
+			columns[i].doubleVectors = &doubleVectorColumns[offset];
+		}
+	}
+
+	MetaDataStringPool &pool = getStringPool();
+
+	// Errors cannot be thrown from inside the parallel region: remember the first bad row
+	long int error_row = nr_rows;
+	int error_nr_columns = 0;
+
+	#pragma omp parallel for num_threads(nr_read_threads) schedule(static)
+	for (long int r = 0; r < nr_rows; r++)
+	{
+		const long int row = first_object + r;
+		const char *p = data + row_start[r];
+		const char *end = data + row_end[r];
+		int labelPosition = 0;
+		bool use_slow_path = false;
+
+		while (true)
+		{
+			while (p < end && (*p == ' ' || *p == '\t'))
+				p++;
+			if (p >= end || *p == '#')
+				break;
+
+			// Quoted strings and control characters: leave those to simplify() and nextTokenInSTAR() below
+			if (*p == '"' || *p == '\'')
+			{
+				use_slow_path = true;
+				break;
+			}
+
+			const char *token = p;
+			while (p < end && *p != ' ' && *p != '\t')
+			{
+				if (isBlankInSTAR(*p))
+					use_slow_path = true;
+				p++;
+			}
+			if (use_slow_path)
+				break;
+
+			if (labelPosition < num_labels)
+				setStarLoopValue(columns[labelPosition], row, token, p - token, pool);
+			labelPosition++;
+		}
+
+		if (use_slow_path)
+		{
+			std::string line = simplify(std::string(data + row_start[r], row_end[r] - row_start[r]));
+			std::string value;
+			int line_pos = 0;
+			labelPosition = 0;
+			while (nextTokenInSTAR(line, line_pos, value))
+			{
+				if (labelPosition < num_labels)
+					setStarLoopValue(columns[labelPosition], row, value.c_str(), value.size(), pool);
+				labelPosition++;
+			}
+		}
+
+		// For backward-compatibility for cases like "fn_mtf <empty>", don't die if num_labels == 2.
+		if (labelPosition > num_labels || (labelPosition < num_labels && num_labels > 2))
+		{
+			#pragma omp critical(MetaDataTable_readStarLoopMapped)
+			{
+				if (r < error_row)
+				{
+					error_row = r;
+					error_nr_columns = labelPosition;
+				}
+			}
+		}
+	}
+
+	current_objectID = nr_objects - 1;
+
+	if (error_row < nr_rows)
+	{
+		std::cerr << "Error in line: " << std::string(data + row_start[error_row], row_end[error_row] - row_start[error_row]) << std::endl;
+		if (error_nr_columns > num_labels)
+			REPORT_ERROR("A line in the STAR file contains more columns than the number of labels.");
+		else
+			REPORT_ERROR("A line in the STAR file contains fewer columns than the number of labels. Expected = " + integerToString(num_labels) + " Found = " +  integerToString(error_nr_columns));
+	}
+
+	return nr_rows;
+}
+
+bool MetaDataTable::readStarList(std::ifstream& in)
+{
+	setIsList(true);
+	addObject();
+	long int objectID = nr_objects - 1;
+
+	std::string line, firstword, value;
+
+	bool also_has_loop = false;
+
+	// Read data and fill structures accordingly
+	int labelPosition = 0;
+	int lastGoodPos = in.tellg();
+
+	while (getline(in, line, '\n'))
+	{
+		int pos = 0;
+		// Ignore empty lines
+		if (!nextTokenInSTAR(line, pos, firstword))
+			continue;
+
+		// Get label-value pairs
+		if (firstword[0] == '_')
+		{
+			std::string token = firstword.substr(1); // get rid of leading underscore
+			EMDLabel label = EMDL::str2Label(token);
+			if (!nextTokenInSTAR(line, pos, value))
+				REPORT_ERROR("MetaDataTable::readStarList: did not encounter a single word after "+firstword);
+
+			if (label == EMDL_UNDEFINED)
+			{
+				label = EMDL_UNKNOWN_LABEL;
+				addLabel(label, token);
+				setUnknownValue(labelPosition, value);
+				std::cerr << " + WARNING: will ignore (but maintain) values for the unknown label: " << token << std::endl;
+			}
+			else
+			{
+				addLabel(label);
+				setValueFromString(label, value, objectID);
+			}
+			labelPosition++;
+
+			lastGoodPos = in.tellg();
+		}
+		// Check whether there is a comment or an empty line
+		else if (firstword[0] == '#' || firstword[0] == ';')
+		{
+			// TODO: handle comments?
+			continue;
+		}
+		// Check whether a loop structure comes after this list
+		else if (firstword.find("loop_") == 0)
+		{
+			also_has_loop = true;
+			return also_has_loop;
+		}
+		// Check whether this data blocks ends (because a next one is there)
+		else if (firstword.find("data_") == 0)
+		{
+			// Should I reverse the pointer one line?
+			// - Yes, please!!   -- JZ
+
+			in.seekg(lastGoodPos);
+			return also_has_loop;
+		}
+	}
+	// Reached the end of the file
+	return also_has_loop;
+}
+
+long int MetaDataTable::readStar(std::ifstream& in, const std::string &name, bool do_only_count)
+{
+	std::string line, token, value;
+	clear();
+	bool also_has_loop;
+
+	// Start reading the ifstream at the top
+	in.seekg(0);
+
+	// Set the version to 30000 by default, in case there is no version tag
+	// (version tags were introduced in version 31000)
+	version = 30000;
+
+	// Proceed until the next data_ or _loop statement
+	// The loop statement may be necessary for data blocks that have a list AND a table inside them
+	while (getline(in, line, '\n'))
+	{
+		if (line.size() >= 2 && line[line.size() - 1] == '\r')
+		{
+			if (name != "") std::cerr << " table name= " << name << std::endl;
+			std::cerr << " line= " << line << std::endl;
+			REPORT_ERROR("RELION does not support CR+LF as a new line code. Didn't you edit a STAR file in Windows? Convert it to the UNIX style (LF only) by for example `dos2unix` command.");
+		}
+
+		trim(line);
+		if (line.find("# version ") != std::string::npos)
+		{
+			token = line.substr(line.find("# version ") + std::string("# version ").length());
+
+			std::istringstream sts(token);
+			sts >> version;
+		}
+
+		// Find data_ lines
+		if (line.find("data_") != std::string::npos)
+		{
+			token = line.substr(line.find("data_") + 5);
+			// If a name has been given, only read data_thatname
+			// Otherwise, just read the first data_ block
+			if (name == "" || name == token)
+			{
+				setName(token);
+				// Get the next item that starts with "_somelabel" or with "loop_"
+				int current_pos = in.tellg();
+				while (getline(in, line, '\n'))
+				{
+					if (line.find("loop_") != std::string::npos)
+					{
+						return readStarLoop(in, do_only_count);
+					}
+					else if (line[0] == '_')
+					{
+						// go back one line in the ifstream
+						in.seekg(current_pos);
+						also_has_loop = readStarList(in);
+						return (also_has_loop) ? 0 : 1;
+					}
+				}
+			}
+		}
+	}
+
+	// Clear the eofbit so we can perform more actions on the stream.
+	in.clear();
+
+	return 0;
+}
+
+void MetaDataTable::setReadThreads(int nr_threads)
+{
+	nr_read_threads = XMIPP_MAX(1, nr_threads);
+}
+
+MappedStarFile::MappedStarFile(const std::string &fn)
+:	data(NULL),
+	size(0)
+{
+	int fd = open(fn.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+
+	struct stat file_status;
+	if (fstat(fd, &file_status) == 0 && S_ISREG(file_status.st_mode) && file_status.st_size > 0)
+	{
+		void *ptr = mmap(NULL, file_status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ptr != MAP_FAILED)
+		{
+			data = (const char*) ptr;
+			size = file_status.st_size;
+			// The rows are parsed front to back
+			madvise(ptr, size, MADV_SEQUENTIAL);
+		}
+	}
+
+	// The mapping stays valid after closing the file
+	close(fd);
+}
+
+MappedStarFile::~MappedStarFile()
+{
+	if (data != NULL)
+		munmap((void*) data, size);
+}
+
+// Binary companion files (see MetaDataTable::getBinaryStarName)
+//
+// header:    magic, byte order mark, format version, size, modification time and a hash of the contents of the STAR file
+// blocks:    the data of all columns, followed by a directory with the label, type, offset and size of each column
+// index:     the name and the offset of the directory of all blocks
+// footer:    the offset of the index
+
+static const char BINARY_STAR_MAGIC[8] = {'R', 'L', 'N', 'B', 'S', 'T', 'A', 'R'};
+static const uint32_t BINARY_STAR_BYTE_ORDER = 0x01020304;
+static const uint32_t BINARY_STAR_VERSION = 2;
+static const int BINARY_STAR_SIGNATURE_SIZE = 4;
+
+enum BinaryStarType
+{
+	BINARY_STAR_DOUBLE,
+	BINARY_STAR_INT,
+	BINARY_STAR_BOOL,
+	BINARY_STAR_STRING,
+	BINARY_STAR_DOUBLE_VECTOR,
+	BINARY_STAR_UNKNOWN
+};
+
+static BinaryStarType binaryStarTypeOf(EMDLabel label)
+{
+	if (label == EMDL_UNKNOWN_LABEL)
+		return BINARY_STAR_UNKNOWN;
+	else if (EMDL::isDouble(label))
+		return BINARY_STAR_DOUBLE;
+	else if (EMDL::isInt(label))
+		return BINARY_STAR_INT;
+	else if (EMDL::isBool(label))
+		return BINARY_STAR_BOOL;
+	else if (EMDL::isString(label))
+		return BINARY_STAR_STRING;
+	else
+		return BINARY_STAR_DOUBLE_VECTOR;
+}
+
+// FNV-1a over 8 bytes at a time: every changed word changes the hash
+static uint64_t hashStarText(const char *data, size_t size)
+{
+	const uint64_t prime = 1099511628211ULL;
+	uint64_t hash = 14695981039346656037ULL;
+
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(uint64_t));
+		hash = (hash ^ word) * prime;
+	}
+	for (; i < size; i++)
+		hash = (hash ^ (unsigned char) data[i]) * prime;
+
+	return hash;
+}
+
+// Size, modification time and a hash of the contents of a STAR file: the binary companion is only valid for these.
+// The hash catches rewrites of the same size within the resolution of the modification time (e.g. 1 s on some file systems).
+static bool getStarSignature(const FileName &fn_star, int64_t signature[BINARY_STAR_SIGNATURE_SIZE])
+{
+	struct stat file_status;
+	if (stat(fn_star.c_str(), &file_status) != 0)
+		return false;
+
+	signature[0] = file_status.st_size;
+	signature[1] = file_status.st_mtime;
+#ifdef __APPLE__
+	signature[2] = file_status.st_mtimespec.tv_nsec;
+#else
+	signature[2] = file_status.st_mtim.tv_nsec;
+#endif
+
+	MappedStarFile mapped(fn_star);
+	if (mapped.size != file_status.st_size)
+		return false;
+	signature[3] = (int64_t) hashStarText(mapped.data, mapped.size);
+
+	return true;
+}
+
+template<class T>
+static void writeBinaryValue(std::ostream &out, const T &value)
+{
+	out.write((const char*) &value, sizeof(T));
+}
+
+static void writeBinaryString(std::ostream &out, const std::string &value)
+{
+	writeBinaryValue(out, (uint32_t) value.size());
+	out.write(value.data(), value.size());
+}
+
+// String columns are written as a dictionary of distinct values and one index per row
+static void writeBinaryStringColumn(std::ostream &out, const std::vector<const std::string*> &column)
+{
+	std::map<const std::string*, uint32_t> dictionary;
+	std::vector<const std::string*> values;
+	std::vector<uint32_t> ids(column.size());
+
+	for (size_t i = 0; i < column.size(); i++)
+	{
+		std::map<const std::string*, uint32_t>::iterator it = dictionary.find(column[i]);
+		if (it == dictionary.end())
+		{
+			it = dictionary.insert(std::make_pair(column[i], (uint32_t) values.size())).first;
+			values.push_back(column[i]);
+		}
+		ids[i] = it->second;
+	}
+
+	writeBinaryValue(out, (uint32_t) values.size());
+	for (size_t i = 0; i < values.size(); i++)
+		writeBinaryString(out, *values[i]);
+	out.write((const char*) ids.data(), ids.size() * sizeof(uint32_t));
+}
+
+// Reads from a mapped binary companion; 'ok' becomes false at the first attempt to read beyond 'size'
+struct BinaryStarReader
+{
+	const char *data;
+	size_t size, pos;
+	bool ok;
+
+	BinaryStarReader(const char *data, size_t size, size_t pos)
+	:	data(data), size(size), pos(pos), ok(pos <= size)
+	{}
+
+	const char* skip(size_t n)
+	{
+		if (!ok || n > size - pos)
+		{
+			ok = false;
+			return NULL;
+		}
+
+		const char *p = data + pos;
+		pos += n;
+		return p;
+	}
+
+	template<class T>
+	T get()
+	{
+		T value = T();
+		const char *p = skip(sizeof(T));
+		if (p != NULL)
+			memcpy(&value, p, sizeof(T));
+		return value;
+	}
+
+	std::string getString()
+	{
+		const uint32_t len = get<uint32_t>();
+		const char *p = skip(len);
+		return (p == NULL) ? std::string() : std::string(p, len);
+	}
+};
+
+// A memory-mapped binary companion and its index of data blocks
+class BinaryStarFile
+{
+public:
+	MappedStarFile mapped;
+	std::vector<std::string> blockNames;
+	std::vector<size_t> blockOffsets;
+
+	// Whether the file exists and belongs to the current version of the STAR file
+	bool valid;
+
+	BinaryStarFile(const FileName &fn_star)
+	:	mapped(MetaDataTable::getBinaryStarName(fn_star)),
+		valid(false)
+	{
+		if (mapped.data == NULL)
+			return;
+
+		BinaryStarReader header(mapped.data, mapped.size, 0);
+		const char *magic = header.skip(sizeof(BINARY_STAR_MAGIC));
+		const uint32_t byte_order = header.get<uint32_t>();
+		const uint32_t format_version = header.get<uint32_t>();
+
+		int64_t signature[BINARY_STAR_SIGNATURE_SIZE], star_signature[BINARY_STAR_SIGNATURE_SIZE];
+		for (int i = 0; i < BINARY_STAR_SIGNATURE_SIZE; i++)
+			signature[i] = header.get<int64_t>();
+
+		if (!header.ok || memcmp(magic, BINARY_STAR_MAGIC, sizeof(BINARY_STAR_MAGIC)) != 0 ||
+		    byte_order != BINARY_STAR_BYTE_ORDER || format_version != BINARY_STAR_VERSION)
+			return;
+
+		// The STAR file has been changed since the binary file was written
+		if (!getStarSignature(fn_star, star_signature) ||
+		    memcmp(signature, star_signature, sizeof(signature)) != 0)
+			return;
+
+		if (mapped.size < sizeof(uint64_t))
+			return;
+
+		BinaryStarReader footer(mapped.data, mapped.size, mapped.size - sizeof(uint64_t));
+		BinaryStarReader index(mapped.data, mapped.size, footer.get<uint64_t>());
+		const uint32_t nr_blocks = index.get<uint32_t>();
+		for (uint32_t i = 0; i < nr_blocks && index.ok; i++)
+		{
+			blockNames.push_back(index.getString());
+			blockOffsets.push_back(index.get<uint64_t>());
+		}
+
+		valid = footer.ok && index.ok;
+	}
+
+	// The first block called 'name' (or the first block if name is empty)
+	bool findBlock(const std::string &name, size_t &offset) const
+	{
+		for (size_t i = 0; i < blockNames.size(); i++)
+		{
+			if (name == "" || blockNames[i] == name)
+			{
+				offset = blockOffsets[i];
+				return true;
+			}
+		}
+
+		return false;
+	}
+};
+
+static bool binaryStarEnabled()
+{
+	const char *env = getenv("RELION_BINARY_STAR");
+	return (env != NULL && strcmp(env, "") != 0 && strcmp(env, "0") != 0);
+}
+
+FileName MetaDataTable::getBinaryStarName(const FileName &fn_star)
+{
+	return fn_star.removeFileFormat().withoutExtension() + ".bstar";
+}
+
+void MetaDataTable::writeBinaryStar(const FileName &fn_star, const std::vector<const MetaDataTable*> &tables)
+{
+	if (!binaryStarEnabled())
+		return;
+
+	int64_t signature[BINARY_STAR_SIGNATURE_SIZE];
+	if (!getStarSignature(fn_star.removeFileFormat(), signature))
+		return;
+
+	FileName fn_bin = getBinaryStarName(fn_star);
+	FileName fn_tmp = fn_bin + ".tmp";
+	std::ofstream out(fn_tmp.c_str(), std::ios::out | std::ios::binary);
+	if (!out)
+	{
+		std::cerr << " + WARNING: cannot write binary STAR file " << fn_tmp << std::endl;
+		return;
+	}
+
+	out.write(BINARY_STAR_MAGIC, sizeof(BINARY_STAR_MAGIC));
+	writeBinaryValue(out, BINARY_STAR_BYTE_ORDER);
+	writeBinaryValue(out, BINARY_STAR_VERSION);
+	for (int i = 0; i < BINARY_STAR_SIGNATURE_SIZE; i++)
+		writeBinaryValue(out, signature[i]);
 
-bool MetaDataTable::readStarList(std::ifstream& in)
-{
-	setIsList(true);
-	addObject();
-	long int objectID = objects.size() - 1;
+	std::vector<std::string> names;
+	std::vector<uint64_t> offsets;
+	for (size_t i = 0; i < tables.size(); i++)
+	{
+		// write() skips empty tables as well
+		if (tables[i]->isEmpty())
+			continue;
 
-	std::string line, firstword, value;
+		names.push_back(tables[i]->getName());
+		offsets.push_back(tables[i]->writeBinaryBlock(out));
+	}
 
-	bool also_has_loop = false;
+	const uint64_t index_offset = out.tellp();
+	writeBinaryValue(out, (uint32_t) names.size());
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		writeBinaryString(out, names[i]);
+		writeBinaryValue(out, offsets[i]);
+	}
+	writeBinaryValue(out, index_offset);
 
-	// Read data and fill structures accordingly
-	int labelPosition = 0;
-	int lastGoodPos = in.tellg();
+	out.close();
+	if (out.fail())
+	{
+		std::cerr << " + WARNING: cannot write binary STAR file " << fn_tmp << std::endl;
+		std::remove(fn_tmp.c_str());
+		return;
+	}
 
-	while (getline(in, line, '\n'))
+	std::rename(fn_tmp.c_str(), fn_bin.c_str());
+}
+
+size_t MetaDataTable::writeBinaryBlock(std::ostream &out) const
+{
+	std::vector<std::string> column_names;
+	std::vector<uint8_t> column_types;
+	std::vector<uint64_t> column_offsets, column_sizes;
+
+	for (long i = 0; i < activeLabels.size(); i++)
 	{
-		int pos = 0;
-		// Ignore empty lines
-		if (!nextTokenInSTAR(line, pos, firstword))
+		EMDLabel label = activeLabels[i];
+
+		// These are not read back from the text either
+		if (label == EMDL_COMMENT || label == EMDL_SORTED_IDX)
 			continue;
 
-		// Get label-value pairs
-		if (firstword[0] == '_')
+		const uint64_t offset = out.tellp();
+		const BinaryStarType type = binaryStarTypeOf(label);
+
+		if (type == BINARY_STAR_UNKNOWN)
 		{
-			std::string token = firstword.substr(1); // get rid of leading underscore
-			EMDLabel label = EMDL::str2Label(token);
-			if (!nextTokenInSTAR(line, pos, value))
-				REPORT_ERROR("MetaDataTable::readStarList: did not encounter a single word after "+firstword);
+			column_names.push_back(getUnknownLabelNameAt(i));
+			writeBinaryStringColumn(out, unknownColumns[unknownLabelPosition2Offset[i]]);
+		}
+		else
+		{
+			column_names.push_back(EMDL::label2Str(label));
+			const long off = label2offset[label];
 
-			if (label == EMDL_UNDEFINED)
+			if (type == BINARY_STAR_DOUBLE)
 			{
-				label = EMDL_UNKNOWN_LABEL;
-				addLabel(label, token);
-				setUnknownValue(labelPosition, value);
-				std::cerr << " + WARNING: will ignore (but maintain) values for the unknown label: " << token << std::endl;
+				// Store the numbers as they are printed into the STAR file
+				std::vector<double> values(nr_objects);
+				char buffer[14];
+				for (long j = 0; j < nr_objects; j++)
+				{
+					doubleToSTAR(doubleColumns[off][j], buffer);
+					values[j] = strtod(buffer, NULL);
+				}
+				out.write((const char*) values.data(), nr_objects * sizeof(double));
+			}
+			else if (type == BINARY_STAR_INT)
+			{
+				std::vector<int64_t> values(intColumns[off].begin(), intColumns[off].end());
+				out.write((const char*) values.data(), nr_objects * sizeof(int64_t));
+			}
+			else if (type == BINARY_STAR_BOOL)
+			{
+				std::vector<uint8_t> values(nr_objects);
+				for (long j = 0; j < nr_objects; j++)
+					values[j] = (boolColumns[off][j] != 0);
+				out.write((const char*) values.data(), nr_objects);
+			}
+			else if (type == BINARY_STAR_STRING)
+			{
+				writeBinaryStringColumn(out, stringColumns[off]);
 			}
 			else
 			{
-				addLabel(label);
-				setValueFromString(label, value, objectID);
+				for (long j = 0; j < nr_objects; j++)
+				{
+					std::string text;
+					std::vector<double> values;
+					getValueToString(label, text, j);
+					doubleVectorFromString(text, values);
+
+					writeBinaryValue(out, (uint32_t) values.size());
+					if (values.size() > 0)
+						out.write((const char*) &values[0], values.size() * sizeof(double));
+				}
 			}
-			labelPosition++;
-
-			lastGoodPos = in.tellg();
-		}
-		// Check whether there is a comment or an empty line
-		else if (firstword[0] == '#' || firstword[0] == ';')
-		{
-			// TODO: handle comments?
-			continue;
-		}
-		// Check whether a loop structure comes after this list
-		else if (firstword.find("loop_") == 0)
-		{
-			also_has_loop = true;
-			return also_has_loop;
 		}
-		// Check whether this data blocks ends (because a next one is there)
-		else if (firstword.find("data_") == 0)
-		{
-			// Should I reverse the pointer one line?
-			// - Yes, please!!   -- JZ
 
-			in.seekg(lastGoodPos);
-			return also_has_loop;
-		}
+		column_types.push_back(type);
+		column_offsets.push_back(offset);
+		column_sizes.push_back((uint64_t) out.tellp() - offset);
 	}
-	// Reached the end of the file
-	return also_has_loop;
+
+	// As read back from the version tag in the text
+	const int32_t block_version = (version >= 30000) ? getCurrentVersion() : 30000;
+
+	const size_t directory_offset = out.tellp();
+	writeBinaryString(out, name);
+	writeBinaryValue(out, block_version);
+	writeBinaryValue(out, (uint8_t) isList);
+	writeBinaryValue(out, (int64_t) nr_objects);
+	writeBinaryValue(out, (uint32_t) column_names.size());
+	for (size_t c = 0; c < column_names.size(); c++)
+	{
+		writeBinaryString(out, column_names[c]);
+		writeBinaryValue(out, column_types[c]);
+		writeBinaryValue(out, column_offsets[c]);
+		writeBinaryValue(out, column_sizes[c]);
+	}
+
+	return directory_offset;
 }
 
-long int MetaDataTable::readStar(std::ifstream& in, const std::string &name, bool do_only_count)
+bool MetaDataTable::readBinaryBlock(const char *data, size_t size, size_t offset, bool do_only_count,
+                                    const std::vector<EMDLabel> *labels, long int &nr_read)
 {
-	std::string line, token, value;
 	clear();
-	bool also_has_loop;
 
-	// Start reading the ifstream at the top
-	in.seekg(0);
+	BinaryStarReader directory(data, size, offset);
+	const std::string block_name = directory.getString();
+	const int32_t block_version = directory.get<int32_t>();
+	const bool block_is_list = (directory.get<uint8_t>() != 0);
+	const int64_t block_nr_objects = directory.get<int64_t>();
+	const uint32_t nr_columns = directory.get<uint32_t>();
 
-	// Set the version to 30000 by default, in case there is no version tag
-	// (version tags were introduced in version 31000)
-	version = 30000;
+	if (!directory.ok || block_nr_objects < 0)
+		return false;
 
-	// Proceed until the next data_ or _loop statement
-	// The loop statement may be necessary for data blocks that have a list AND a table inside them
-	while (getline(in, line, '\n'))
+	setName(block_name);
+	setVersion(block_version);
+	setIsList(block_is_list);
+
+	// As readStar: lists are always read, for loops only the labels are set when counting
+	const bool do_read_rows = (!do_only_count || isList);
+	nr_read = isList ? 1 : block_nr_objects;
+	if (do_read_rows)
+		resizeObjects(block_nr_objects);
+
+	for (uint32_t c = 0; c < nr_columns; c++)
 	{
-		if (line.size() >= 2 && line[line.size() - 1] == '\r')
+		const std::string label_name = directory.getString();
+		const uint8_t type = directory.get<uint8_t>();
+		const uint64_t column_offset = directory.get<uint64_t>();
+		const uint64_t column_size = directory.get<uint64_t>();
+
+		if (!directory.ok)
 		{
-			if (name != "") std::cerr << " table name= " << name << std::endl;
-			std::cerr << " line= " << line << std::endl;
-			REPORT_ERROR("RELION does not support CR+LF as a new line code. Didn't you edit a STAR file in Windows? Convert it to the UNIX style (LF only) by for example `dos2unix` command.");
+			clear();
+			return false;
 		}
 
-		trim(line);
-		if (line.find("# version ") != std::string::npos)
+		EMDLabel label = EMDL_UNKNOWN_LABEL;
+		if (type != BINARY_STAR_UNKNOWN)
 		{
-			token = line.substr(line.find("# version ") + std::string("# version ").length());
+			label = EMDL::str2Label(label_name);
 
-			std::istringstream sts(token);
-			sts >> version;
+			// Written by a different version of RELION
+			if (label == EMDL_UNDEFINED || binaryStarTypeOf(label) != type)
+			{
+				clear();
+				return false;
+			}
 		}
 
-		// Find data_ lines
-		if (line.find("data_") != std::string::npos)
+		if (labels != NULL &&
+		    (label == EMDL_UNKNOWN_LABEL || std::find(labels->begin(), labels->end(), label) == labels->end()))
+			continue;
+
+		if (label == EMDL_UNKNOWN_LABEL)
+			std::cerr << " + WARNING: will ignore (but maintain) values for the unknown label: " << label_name << std::endl;
+
+		addLabel(label, label_name);
+
+		if (!do_read_rows)
+			continue;
+
+		BinaryStarReader column(data, size, column_offset);
+		const char *column_data = column.skip(column_size);
+		column = BinaryStarReader(column_data, column_size, 0);
+		bool ok = (column_data != NULL);
+
+		if (ok && (type == BINARY_STAR_STRING || type == BINARY_STAR_UNKNOWN))
 		{
-			token = line.substr(line.find("data_") + 5);
-			// If a name has been given, only read data_thatname
-			// Otherwise, just read the first data_ block
-			if (name == "" || name == token)
+			std::vector<const std::string*> &dest = (type == BINARY_STAR_STRING) ?
+				stringColumns[label2offset[label]] : unknownColumns[unknownColumns.size() - 1];
+
+			const uint32_t nr_values = column.get<uint32_t>();
+			std::vector<const std::string*> values;
+			for (uint32_t i = 0; i < nr_values && column.ok; i++)
+				values.push_back(getStringPool().intern(column.getString()));
+
+			const uint32_t *ids = (const uint32_t*) column.skip(nr_objects * sizeof(uint32_t));
+			ok = column.ok;
+			for (long i = 0; ok && i < nr_objects; i++)
 			{
-				setName(token);
-				// Get the next item that starts with "_somelabel" or with "loop_"
-				int current_pos = in.tellg();
-				while (getline(in, line, '\n'))
+				uint32_t id;
+				memcpy(&id, ids + i, sizeof(uint32_t));
+				ok = (id < values.size());
+				if (ok)
+					dest[i] = values[id];
+			}
+		}
+		else if (ok && type == BINARY_STAR_DOUBLE)
+		{
+			const char *values = column.skip(nr_objects * sizeof(double));
+			ok = column.ok;
+			if (ok && nr_objects > 0)
+				memcpy(&doubleColumns[label2offset[label]][0], values, nr_objects * sizeof(double));
+		}
+		else if (ok && type == BINARY_STAR_INT)
+		{
+			const char *values = column.skip(nr_objects * sizeof(int64_t));
+			ok = column.ok;
+			std::vector<long> &dest = intColumns[label2offset[label]];
+			for (long i = 0; ok && i < nr_objects; i++)
+			{
+				int64_t value;
+				memcpy(&value, values + i * sizeof(int64_t), sizeof(int64_t));
+				dest[i] = value;
+			}
+		}
+		else if (ok && type == BINARY_STAR_BOOL)
+		{
+			const char *values = column.skip(nr_objects);
+			ok = column.ok;
+			if (ok && nr_objects > 0)
+				memcpy(&boolColumns[label2offset[label]][0], values, nr_objects);
+		}
+		else if (ok && type == BINARY_STAR_DOUBLE_VECTOR)
+		{
+			std::vector<std::vector<double> > &dest = doubleVectorColumns[label2offset[label]];
+			for (long i = 0; column.ok && i < nr_objects; i++)
+			{
+				const uint32_t n = column.get<uint32_t>();
+				const char *values = column.skip(n * sizeof(double));
+				if (column.ok)
 				{
-					if (line.find("loop_") != std::string::npos)
-					{
-						return readStarLoop(in, do_only_count);
-					}
-					else if (line[0] == '_')
-					{
-						// go back one line in the ifstream
-						in.seekg(current_pos);
-						also_has_loop = readStarList(in);
-						return (also_has_loop) ? 0 : 1;
-					}
+					dest[i].resize(n);
+					if (n > 0)
+						memcpy(&dest[i][0], values, n * sizeof(double));
 				}
 			}
+			ok = column.ok;
+		}
+
+		if (!ok)
+		{
+			clear();
+			return false;
 		}
 	}
 
-	// Clear the eofbit so we can perform more actions on the stream.
-	in.clear();
+	current_objectID = nr_objects - 1;
 
-	return 0;
+	return true;
 }
 
 std::vector<MetaDataTable> MetaDataTable::readAll(const std::string &in, int expectedNumber, bool do_only_count)
 {
+	BinaryStarFile binary(in);
+	if (binary.valid)
+	{
+		std::vector<MetaDataTable> out(binary.blockOffsets.size());
+
+		bool ok = true;
+		for (size_t i = 0; ok && i < out.size(); i++)
+		{
+			long int nr_read;
+			ok = out[i].readBinaryBlock(binary.mapped.data, binary.mapped.size, binary.blockOffsets[i],
+			                            do_only_count, NULL, nr_read);
+		}
+
+		if (ok)
+			return out;
+	}
+
 	std::ifstream ifs(in);
-	return readAll(ifs, expectedNumber, do_only_count);
+	MappedStarFile mapped(in);
+	return readAll(ifs, expectedNumber, do_only_count, mapped.data, mapped.size);
 }
 
 std::vector<MetaDataTable> MetaDataTable::readAll(
 		std::ifstream &in,
 		int expectedNumber,
 		bool do_only_count)
+{
+	return readAll(in, expectedNumber, do_only_count, NULL, 0);
+}
+
+std::vector<MetaDataTable> MetaDataTable::readAll(
+		std::ifstream &in,
+		int expectedNumber,
+		bool do_only_count,
+		const char *mapped_star,
+		size_t mapped_star_size)
 {
 	std::vector<MetaDataTable> out(0);
 	out.reserve(expectedNumber);
@@ -1244,7 +2343,11 @@ std::vector<MetaDataTable> MetaDataTable::readAll(
 			{
 				if (line.find("loop_") != std::string::npos)
 				{
+					mdt.mappedStar = mapped_star;
+					mdt.mappedStarSize = mapped_star_size;
 					mdt.readStarLoop(in, do_only_count);
+					mdt.mappedStar = NULL;
+					mdt.mappedStarSize = 0;
 					break;
 				}
 				else if (line[0] == '_')
@@ -1261,6 +2364,16 @@ std::vector<MetaDataTable> MetaDataTable::readAll(
 	return out;
 }
 long int MetaDataTable::read(const FileName &filename, const std::string &name, bool do_only_count)
+{
+	return readFile(filename, name, do_only_count, NULL);
+}
+
+long int MetaDataTable::read(const FileName &filename, const std::string &name, const std::vector<EMDLabel> &labels)
+{
+	return readFile(filename, name, false, &labels);
+}
+
+long int MetaDataTable::readFile(const FileName &filename, const std::string &name, bool do_only_count, const std::vector<EMDLabel> *labels)
 {
 
 	// Clear current table
@@ -1276,10 +2389,72 @@ long int MetaDataTable::read(const FileName &filename, const std::string &name,
 		REPORT_ERROR( (std::string) "MetaDataTable::read: File " + fn_read + " does not exist" );
 	}
 
-	const long int ret = readStar(in, name, do_only_count);
+	long int ret;
+
+	// Use the binary companion if it has been written for this version of the STAR file
+	BinaryStarFile binary(fn_read);
+	if (binary.valid)
+	{
+		size_t offset;
+		if (!binary.findBlock(name, offset))
+		{
+			return 0;
+		}
+		else if (readBinaryBlock(binary.mapped.data, binary.mapped.size, offset, do_only_count, labels, ret))
+		{
+			firstObject();
+			return ret;
+		}
+	}
+
+	// Map the file into memory, so that readStarLoop can tokenize the rows in place
+	MappedStarFile mapped(fn_read);
+	mappedStar = mapped.data;
+	mappedStarSize = mapped.size;
+
+	try
+	{
+		ret = readStar(in, name, do_only_count);
+	}
+	catch (...)
+	{
+		mappedStar = NULL;
+		mappedStarSize = 0;
+		throw;
+	}
+
+	mappedStar = NULL;
+	mappedStarSize = 0;
 
 	in.close();
 
+	if (labels != NULL)
+	{
+		// Drop all other columns
+		for (int i = activeLabels.size() - 1; i >= 0; i--)
+		{
+			EMDLabel label = activeLabels[i];
+			if (label == EMDL_UNKNOWN_LABEL)
+				deactivateLabel(label, getUnknownLabelNameAt(i));
+			else if (std::find(labels->begin(), labels->end(), label) == labels->end())
+				deactivateLabel(label);
+		}
+
+		if (nr_objects > 0)
+		{
+			std::vector<long> objectIDs(nr_objects);
+			for (long i = 0; i < nr_objects; i++)
+				objectIDs[i] = i;
+
+			MetaDataTable selected;
+			selected.addObjects(*this, objectIDs);
+			selected.setName(getName());
+			selected.setVersion(getVersion());
+			selected.setIsList(isList);
+			*this = selected;
+		}
+	}
+
 	// Go to the first object
 	firstObject();
 
@@ -1329,7 +2504,7 @@ void MetaDataTable::write(std::ostream& out) const
 		}
 
 		// Write actual data block
-		for (long int idx = 0; idx < objects.size(); idx++)
+		for (long int idx = 0; idx < nr_objects; idx++)
 		{
 			std::string entryComment = "";
 
@@ -1342,7 +2517,7 @@ void MetaDataTable::write(std::ostream& out) const
 					out.width(10);
 					std::string token, val;
 					long offset = unknownLabelPosition2Offset[i];
-					val = objects[idx]->unknowns[offset];
+					val = *unknownColumns[offset][idx];
 					escapeStringForSTAR(val);
 					out << val << " ";
 				}
@@ -1402,7 +2577,7 @@ void MetaDataTable::write(std::ostream& out) const
 			{
 				std::string labelName = getUnknownLabelNameAt(i);
 				int w = labelName.length();
-				out << "_" << labelName << std::setw(12 + maxWidth - w) << " " << objects[0]->unknowns[unknownLabelPosition2Offset[i]] << "\n";
+				out << "_" << labelName << std::setw(12 + maxWidth - w) << " " << *unknownColumns[unknownLabelPosition2Offset[i]][0] << "\n";
 			}
 			else if (l != EMDL_COMMENT)
 			{
@@ -1437,6 +2612,8 @@ void MetaDataTable::write(const FileName &fn_out) const
 	// Rename to prevent errors with programs in pipeliner reading in incomplete STAR files
 	std::rename(fn_tmp.c_str(), fn_out.c_str());
 
+	writeBinaryStar(fn_out, std::vector<const MetaDataTable*>(1, this));
+
 }
 
 void MetaDataTable::columnHistogram(EMDLabel label, std::vector<RFLOAT> &histX, std::vector<RFLOAT> &histY,
@@ -1447,33 +2624,30 @@ void MetaDataTable::columnHistogram(EMDLabel label, std::vector<RFLOAT> &histX,
 	if (!containsLabel(label))
 		REPORT_ERROR("ERROR: The column specified is not present in the MetaDataTable.");
 
-	std::vector<RFLOAT> values;
-	FOR_ALL_OBJECTS_IN_METADATA_TABLE(*this)
+	const long off = label2offset[label];
+	std::vector<RFLOAT> values(nr_objects);
+	if (EMDL::isDouble(label))
 	{
-		RFLOAT val;
-		if (EMDL::isDouble(label))
-		{
-			getValue(label, val);
-		}
-		else if (EMDL::isInt(label))
-		{
-			long aux;
-			getValue(label, aux);
-			val = aux;
-		}
-		else if (EMDL::isBool(label))
-		{
-			bool aux;
-			getValue(label, aux);
-			val = aux ? 1 : 0;
-		}
-		else
-		{
-			REPORT_ERROR("Cannot use --stat_column for this type of column");
-		}
-		values.push_back(val);
+		const std::vector<double> &column = doubleColumns[off];
+		for (long i = 0; i < nr_objects; i++)
+			values[i] = column[i];
+	}
+	else if (EMDL::isInt(label))
+	{
+		const std::vector<long> &column = intColumns[off];
+		for (long i = 0; i < nr_objects; i++)
+			values[i] = column[i];
+	}
+	else if (EMDL::isBool(label))
+	{
+		const std::vector<char> &column = boolColumns[off];
+		for (long i = 0; i < nr_objects; i++)
+			values[i] = column[i] ? 1 : 0;
+	}
+	else
+	{
+		REPORT_ERROR("Cannot use --stat_column for this type of column");
 	}
-
 
 	std::string title = EMDL::label2Str(label);
 	histogram(values, histX, histY, verb, title, plot2D, nr_bin, hist_min, hist_max, do_fractional_instead, do_cumulative_instead);
@@ -1614,48 +2788,32 @@ void MetaDataTable::addToCPlot2D(CPlot2D *plot2D, EMDLabel xaxis, EMDLabel yaxis
 	dataSet.SetDatasetColor(red, green, blue);
 	dataSet.SetDatasetTitle(EMDL::label2Str(yaxis));
 
-	double mydbl;
-	long int myint;
+	const long offx = (xaxis == EMDL_UNDEFINED) ? -1 : label2offset[xaxis];
+	if (xaxis != EMDL_UNDEFINED && offx < 0)
+		REPORT_ERROR("MetaDataTable::addToCPlot2D ERROR: cannot find x-axis label");
+	if (xaxis != EMDL_UNDEFINED && !EMDL::isDouble(xaxis) && !EMDL::isInt(xaxis))
+		REPORT_ERROR("MetaDataTable::addToCPlot2D ERROR: can only plot x-axis double, int or long int");
+
+	const long offy = label2offset[yaxis];
+	if (offy < 0)
+		REPORT_ERROR("MetaDataTable::addToCPlot2D ERROR: cannot find y-axis label");
+	if (!EMDL::isDouble(yaxis) && !EMDL::isInt(yaxis))
+		REPORT_ERROR("MetaDataTable::addToCPlot2D ERROR: can only plot y-axis double, int or long int");
+
 	double xval, yval;
-	for (long int idx = 0; idx < objects.size(); idx++)
+	for (long int idx = 0; idx < nr_objects; idx++)
 	{
-		const long offx = label2offset[xaxis];
-		if (offx < 0)
-			REPORT_ERROR("MetaDataTable::addToCPlot2D ERROR: cannot find x-axis label");
-
 		if (xaxis == EMDL_UNDEFINED)
-		{
 			xval = idx+1;
-		}
 		else if (EMDL::isDouble(xaxis))
-		{
-			objects[idx]->getValue(offx, mydbl);
-			xval = mydbl;
-		}
-		else if (EMDL::isInt(xaxis))
-		{
-			objects[idx]->getValue(offx, myint);
-			xval = myint;
-		}
+			xval = doubleColumns[offx][idx];
 		else
-			REPORT_ERROR("MetaDataTable::addToCPlot2D ERROR: can only plot x-axis double, int or long int");
-
-		const long offy = label2offset[yaxis];
-		if (offy < 0)
-			REPORT_ERROR("MetaDataTable::addToCPlot2D ERROR: cannot find y-axis label");
+			xval = intColumns[offx][idx];
 
 		if (EMDL::isDouble(yaxis))
-		{
-			objects[idx]->getValue(offy, mydbl);
-			yval = mydbl;
-		}
-		else if (EMDL::isInt(yaxis))
-		{
-			objects[idx]->getValue(offy, myint);
-			yval = myint;
-		}
+			yval = doubleColumns[offy][idx];
 		else
-			REPORT_ERROR("MetaDataTable::addToCPlot2D ERROR: can only plot y-axis double, int or long int");
+			yval = intColumns[offy][idx];
 
 		CDataPoint point(xval, yval);
 		dataSet.AddDataPoint(point);
@@ -1680,16 +2838,21 @@ void MetaDataTable::printLabels(std::ostream &ost)
 
 void MetaDataTable::randomiseOrder()
 {
-	std::random_shuffle(objects.begin(), objects.end());
+	std::vector<long> order(nr_objects);
+	for (long i = 0; i < nr_objects; i++)
+		order[i] = i;
+
+	std::random_shuffle(order.begin(), order.end());
+	permuteObjects(order);
 }
 
 void MetaDataTable::checkObjectID(long id, std::string caller) const
 {
-	if (id >= objects.size() || id < 0)
+	if (id >= nr_objects || id < 0)
 	{
 		std::stringstream sts0, sts1;
 		sts0 << id;
-		sts1 << objects.size();
+		sts1 << nr_objects;
 		REPORT_ERROR(caller+": object " + sts0.str()
 					 + " out of bounds! (" + sts1.str() + " objects present)");
 	}
@@ -1735,7 +2898,7 @@ void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
 	double myd1, myd2, mydy1 = 0., mydy2 = 0., mydz1 = 0., mydz2 = 0.;
 
 	// loop over MD1
-	std::vector<long int> to_remove_from_only2;
+	std::vector<long int> to_remove_from_only2, in_both, only_in_1, only_in_2;
 	for (long int current_object1 = MD1.firstObject();
 				  current_object1 != MetaDataTable::NO_MORE_OBJECTS && current_object1 != MetaDataTable::NO_OBJECTS_STORED;
 				  current_object1 = MD1.nextObject())
@@ -1768,7 +2931,7 @@ void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
 				{
 					have_in_2 = true;
 					to_remove_from_only2.push_back(current_object2);
-					MDboth.addObject(MD1.getObject());
+					in_both.push_back(current_object1);
 					break;
 				}
 			}
@@ -1779,7 +2942,7 @@ void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
 				{
 					have_in_2 = true;
 					to_remove_from_only2.push_back(current_object2);
-					MDboth.addObject(MD1.getObject());
+					in_both.push_back(current_object1);
 					break;
 				}
 			}
@@ -1801,7 +2964,7 @@ void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
 					//std::cerr << " current_object1= " << current_object1 << std::endl;
 					//std::cerr << " myd1= " << myd1 << " myd2= " << myd2 << " mydy1= " << mydy1 << " mydy2= " << mydy2 << " dist= "<<dist<<std::endl;
 					//std::cerr << " to be removed current_object2= " << current_object2 << std::endl;
-					MDboth.addObject(MD1.getObject());
+					in_both.push_back(current_object1);
 					break;
 				}
 			}
@@ -1809,7 +2972,7 @@ void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
 
 		if (!have_in_2)
 		{
-			MDonly1.addObject(MD1.getObject());
+			only_in_1.push_back(current_object1);
 		}
 	}
 
@@ -1830,9 +2993,13 @@ void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
 		if (!to_be_removed)
 		{
 			//std::cerr << " doNOT remove current_object2= " << current_object2 << std::endl;
-			MDonly2.addObject(MD2.getObject(current_object2));
+			only_in_2.push_back(current_object2);
 		}
 	}
+
+	MDboth.addObjects(MD1, in_both);
+	MDonly1.addObjects(MD1, only_in_1);
+	MDonly2.addObjects(MD2, only_in_2);
 }
 
 MetaDataTable MetaDataTable::combineMetaDataTables(std::vector<MetaDataTable> &MDin)
@@ -1942,7 +3109,7 @@ MetaDataTable subsetMetaDataTable(MetaDataTable &MDin, EMDLabel label, RFLOAT mi
 	if (!MDin.containsLabel(label))
 		REPORT_ERROR("subsetMetadataTable ERROR: input MetaDataTable does not contain label: " +  EMDL::label2Str(label));
 
-	MetaDataTable MDout;
+	std::vector<long> selected;
 	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDin)
 	{
 		bool do_include = false;
@@ -1961,11 +3128,14 @@ MetaDataTable subsetMetaDataTable(MetaDataTable &MDin, EMDLabel label, RFLOAT mi
 
 		if (do_include)
 		{
-			MDout.addObject(MDin.getObject(current_object));
+			selected.push_back(current_object);
 		}
 
 	}
 
+	MetaDataTable MDout;
+	MDout.addObjects(MDin, selected);
+
 	return MDout;
 
 }
@@ -1979,7 +3149,7 @@ MetaDataTable subsetMetaDataTable(MetaDataTable &MDin, EMDLabel label, std::stri
 	if (!MDin.containsLabel(label))
 		REPORT_ERROR("subsetMetadataTable ERROR: input MetaDataTable does not contain label: " +  EMDL::label2Str(label));
 
-	MetaDataTable MDout;
+	std::vector<long> selected;
 	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDin)
 	{
 		std::string val;
@@ -1989,10 +3159,13 @@ MetaDataTable subsetMetaDataTable(MetaDataTable &MDin, EMDLabel label, std::stri
 
 		if ((!exclude && found) || (exclude && !found))
 		{
-			MDout.addObject(MDin.getObject(current_object));
+			selected.push_back(current_object);
 		}
 	}
 
+	MetaDataTable MDout;
+	MDout.addObjects(MDin, selected);
+
 	return MDout;
 }
 
@@ -2076,21 +3249,24 @@ MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label,
 	}
 
 
-	MetaDataTable MDout, MDremoved;
-	long n_removed = 0;
+	std::vector<long> kept, removed;
 	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDin)
 	{
 		if (valid[current_object])
 		{
-			MDout.addObject(MDin.getObject(current_object));
+			kept.push_back(current_object);
 		}
 		else
 		{
-			MDremoved.addObject(MDin.getObject(current_object));
-			n_removed++;
+			removed.push_back(current_object);
 		}
 	}
 
+	MetaDataTable MDout, MDremoved;
+	MDout.addObjects(MDin, kept);
+	MDremoved.addObjects(MDin, removed);
+	long n_removed = removed.size();
+
 	if (fn_removed != "")
 		MDremoved.write(fn_removed);
 
@@ -30,6 +30,8 @@
 #define METADATA_TABLE_H
 
 #include <map>
+#include <memory>
+#include <unordered_set>
 #include <vector>
 #include <iostream>
 #include <iterator>
@@ -40,6 +42,7 @@
 #if !defined(__APPLE__)
 #include <malloc.h>
 #endif
+#include <omp.h>
 #include "src/funcs.h"
 #include "src/args.h"
 #include "src/CPlot2D.h"
@@ -68,24 +71,67 @@
 	    && current_object >= 0; \
 		current_object = (mdt_arg).nextObject())
 
+/* Read-only memory map of a whole file (data is NULL if the file cannot be mapped) */
+class MappedStarFile
+{
+public:
+	const char *data;
+	size_t size;
+
+	MappedStarFile(const std::string &fn);
+	~MappedStarFile();
+
+private:
+	MappedStarFile(const MappedStarFile &);
+	MappedStarFile& operator = (const MappedStarFile &);
+};
+
+/* Interned copies of the string values in one or more MetaDataTables.
+ * Copies of a table share its pool, so that a file name that occurs in many rows
+ * (e.g. rlnMicrographName) is stored only once. Strings are never removed from a pool;
+ * the pool is freed together with the last table that uses it (MetaDataTable::clear() lets go of it).
+ * intern() is thread-safe and the returned pointer remains valid for the lifetime of the pool. */
+class MetaDataStringPool
+{
+public:
+	// Interned empty string (the value of string cells in new rows)
+	const std::string *blank;
+
+	MetaDataStringPool();
+	~MetaDataStringPool();
+
+	const std::string* intern(const std::string &value);
+
+private:
+	static const int nr_shards = 16;
+	std::unordered_set<std::string> shards[nr_shards];
+	omp_lock_t locks[nr_shards];
+
+	MetaDataStringPool(const MetaDataStringPool &);
+	MetaDataStringPool& operator = (const MetaDataStringPool &);
+};
+
 /*	class MetaDataTable:
  *
  *	- stores a table of values for an arbitrary subset of predefined EMDLabels
  *	- each column corresponds to a label
  *	- each row represents a data point
- *	- the rows are stored in per-type contiguous blocks of memory
+ *	- the values of each column are stored in one contiguous array
  *
  *	2020/Nov/12:
- *	  This class is organized as an array (`objects`) of structures (`MetaDataContainer`).
- *
  *        `activeLabels` contains all valid labels.
- *        Even when a label is `deactivateLabel`-ed, the values remain in `MetaDataContainer`s.
+ *        Even when a label is `deactivateLabel`-ed, the values remain in its column.
  *        The label is only removed from `activeLabels`.
  *
- *        Each data type (int, double, etc) contains its own storage array inside `MetaDataContainer`.
+ *        Each data type (int, double, etc) has its own set of columns (`doubleColumns` etc).
  *        Thus, values in `label2offsets` are NOT unique. Accessing columns via a wrong type is
  *        very DANGEROUS. Use `cmake -DMDT_TYPE_CHECK=ON` to enable runtime checks.
  *
+ *	  The table is a structure of arrays (not an array of `MetaDataContainer`s), so that sorting,
+ *	  subset selection and histograms only touch the columns they need.
+ *	  String values are pointers into a `MetaDataStringPool`. `MetaDataContainer` is only used
+ *	  to pass whole rows between tables (`getObject`, `setObject`, `addObject`).
+ *
  *        Handling of labels unknown to RELION needs care.
  *        They all share the same label, EMD_UNKNOWN_LABEL. Thus, `addLabel`, `containsLabel`,
  *        `compareLabels` etc must check not only EMDLabel in `activeLabels` but also the
@@ -95,20 +141,33 @@
  *        Whenever `activeLabels` is modified, `unknownLabelPosition2Offset` MUST be updated accordingly.
  *        When the label for a column is EMD_UNKNOWN_LABEL, the corresponding element in
  *        `unknownLabelPosition2Offset` must store the offset in `unknownLabelNames` and
- *        `MetaDataContainer->unknowns`. Otherwise, the value does not matter.
+ *        `unknownColumns`. Otherwise, the value does not matter.
  */
 class MetaDataTable
 {
-	// Effectively stores all metadata
-	std::vector<MetaDataContainer*> objects;
-
-	// Maps labels to corresponding indices in the vectors in MetaDataContainer.
+	// Effectively stores all metadata: one array of nr_objects values per column.
+	// Bools are stored as chars, so that different rows can be set from different threads.
+	std::vector<std::vector<double> > doubleColumns;
+	std::vector<std::vector<long> > intColumns;
+	std::vector<std::vector<char> > boolColumns;
+	std::vector<std::vector<const std::string*> > stringColumns;
+	std::vector<std::vector<std::vector<double> > > doubleVectorColumns;
+	std::vector<std::vector<const std::string*> > unknownColumns;
+
+	// Number of rows
+	long nr_objects;
+
+	// Storage for the values in stringColumns and unknownColumns (shared with copies of this table).
+	// It is made together with the first string column, so tables without strings have none.
+	std::shared_ptr<MetaDataStringPool> stringPool;
+
+	// Maps labels to corresponding indices in the column vectors of their type.
 	// The length of label2offset is always equal to the number of defined labels (~320)
 	// e.g.:
 	// the value of "defocus-U" for row r is stored in:
-	//	 objects[r]->doubles[label2offset[EMDL_CTF_DEFOCUSU]]
+	//	 doubleColumns[label2offset[EMDL_CTF_DEFOCUSU]][r]
 	// the value of "image name" is stored in:
-	//	 objects[r]->strings[label2offset[EMDL_IMAGE_NAME]]
+	//	 *stringColumns[label2offset[EMDL_IMAGE_NAME]][r]
 	std::vector<long> label2offset;
 
 	/** What labels have been read from a docfile/metadata file
@@ -123,9 +182,6 @@ class MetaDataTable
 	// Current object id
 	long current_objectID;
 
-	// Number of labels of each type
-	long doubleLabels, intLabels, boolLabels, stringLabels, doubleVectorLabels, unknownLabels;
-
 	// Is this a 2D table or a 1D list?
 	bool isList;
 
@@ -138,6 +194,13 @@ class MetaDataTable
 	// The version number of the file format (multiplied by 10,000)
 	int version;
 
+	// Memory map of the STAR file that is being read (only set during read() and readAll())
+	const char *mappedStar;
+	size_t mappedStarSize;
+
+	// Number of threads to parse the rows of STAR loops with
+	static int nr_read_threads;
+
 public:
 
 	MetaDataTable();
@@ -230,7 +293,10 @@ public:
 	// insert all missing labels
 	void append(const MetaDataTable& app);
 
-	// Get metadatacontainer for objectID (current_objectID if objectID < 0)
+	/* getObject(objectID)
+	 *  Returns a copy of the values of object 'objectID' (current_objectID if objectID < 0).
+	 *  The copy belongs to the calling thread and is overwritten by its next call to getObject()
+	 *  (on any table), so pass it on to setObject() or addObject() straight away. */
 	MetaDataContainer* getObject(long objectID = -1) const;
 
 	/* setObject(data, objectID)
@@ -271,6 +337,12 @@ public:
 	 *  Afterwards, 'current_objectID' points to the newly added object.*/
 	void addValuesOfDefinedLabels(MetaDataContainer* data);
 
+	/* addObjects(MD, objectIDs)
+	 *  Adds copies of the objects 'objectIDs' of 'MD' (in that order), column by column.
+	 *  This is the same as calling addObject(MD.getObject(id)) for all IDs, but much faster.
+	 *  Afterwards, 'current_objectID' points to the last added object. */
+	void addObjects(const MetaDataTable &MD, const std::vector<long> &objectIDs);
+
 	/* removeObject(objectID)
 	 *  If objectID is not given, 'current_objectID' will be removed.
 	 *  'current_objectID' is set to the last object in the list. */
@@ -288,6 +360,10 @@ public:
 	// Read a STAR loop structure
 	long int readStarLoop(std::ifstream& in, bool do_only_count = false);
 
+	/* Set the number of threads that parse the rows of STAR loops in read() and readAll(const std::string&)
+	 * (these memory-map the file and tokenize the rows directly into the table) */
+	static void setReadThreads(int nr_threads);
+
 	/* Read a STAR list
 	 * The function returns true if the list is followed by a loop, false otherwise */
 	bool readStarList(std::ifstream& in);
@@ -319,6 +395,24 @@ public:
 	// Read a MetaDataTable (get file format from extension)
 	long int read(const FileName &filename, const std::string &name = "", bool do_only_count = false);
 
+	// Same, but only keep the columns for 'labels' (only those are loaded from a binary companion file)
+	long int read(const FileName &filename, const std::string &name, const std::vector<EMDLabel> &labels);
+
+	/* Binary companion of a STAR file (xxx.star -> xxx.bstar)
+	 *
+	 * When the environment variable RELION_BINARY_STAR is set (and not 0), write(const FileName&) and
+	 * writeBinaryStar() store all tables of a STAR file in a column-wise binary file as well.
+	 * read() and readAll(const std::string&) use the binary file instead of the text whenever it was
+	 * written for the current version of the STAR file (same size, modification time and contents),
+	 * and only load the columns that are needed.
+	 * The text STAR file remains the reference: the binary file holds exactly the values that
+	 * would be read back from the text (i.e. numbers are rounded as they are printed). */
+	static FileName getBinaryStarName(const FileName &fn_star);
+
+	// Write the binary companion of fn_star for 'tables' (the data blocks in fn_star, in that order).
+	// Call this after fn_star has been written completely. Does nothing if RELION_BINARY_STAR is not set.
+	static void writeBinaryStar(const FileName &fn_star, const std::vector<const MetaDataTable*> &tables);
+
 	// Write a MetaDataTable in STAR format
 	void write(std::ostream& out = std::cout) const;
 
@@ -373,6 +467,115 @@ private:
 	 *  Same as setObject, but assumes that all labels are present. */
 	void setObjectUnsafe(MetaDataContainer* data, long objId);
 
+	// Add or remove rows at the end of all columns (new rows get default values)
+	void resizeObjects(long new_nr_objects);
+
+	// The string pool, which is made here if the table does not have one yet (not thread-safe)
+	MetaDataStringPool& getStringPool();
+
+	// Re-order the rows: row i becomes the old row order[i]
+	void permuteObjects(const std::vector<long> &order);
+
+	// Offset in unknownColumns of an unknown label, -1 if it is not present
+	long unknownLabelOffset(const std::string &unknownLabel) const;
+
+	// Type-specific access to a single value (see label2offset)
+	void getCell(long off, long objectID, double &dest) const
+	{
+		dest = doubleColumns[off][objectID];
+	}
+	void getCell(long off, long objectID, float &dest) const
+	{
+		dest = (float)doubleColumns[off][objectID];
+	}
+	void getCell(long off, long objectID, int &dest) const
+	{
+		dest = (int)intColumns[off][objectID];
+	}
+	void getCell(long off, long objectID, long &dest) const
+	{
+		dest = intColumns[off][objectID];
+	}
+	void getCell(long off, long objectID, bool &dest) const
+	{
+		dest = (boolColumns[off][objectID] != 0);
+	}
+	void getCell(long off, long objectID, std::string &dest) const
+	{
+		const std::string &value = *stringColumns[off][objectID];
+		dest = (value == "\"\"") ? "" : value;
+	}
+	void getCell(long off, long objectID, std::vector<double> &dest) const
+	{
+		dest = doubleVectorColumns[off][objectID];
+	}
+	void getCell(long off, long objectID, std::vector<float> &dest) const
+	{
+		const std::vector<double> &value = doubleVectorColumns[off][objectID];
+		dest.resize(value.size());
+		std::copy(value.begin(), value.end(), dest.begin());
+	}
+
+	void setCell(long off, long objectID, const double &src)
+	{
+		doubleColumns[off][objectID] = src;
+	}
+	void setCell(long off, long objectID, const float &src)
+	{
+		doubleColumns[off][objectID] = src;
+	}
+	void setCell(long off, long objectID, const int &src)
+	{
+		intColumns[off][objectID] = src;
+	}
+	void setCell(long off, long objectID, const long &src)
+	{
+		intColumns[off][objectID] = src;
+	}
+	void setCell(long off, long objectID, const bool &src)
+	{
+		boolColumns[off][objectID] = src;
+	}
+	void setCell(long off, long objectID, const std::string &src)
+	{
+		stringColumns[off][objectID] = stringPool->intern((src.length() == 0) ? "\"\"" : src);
+	}
+	void setCell(long off, long objectID, const std::vector<double> &src)
+	{
+		doubleVectorColumns[off][objectID] = src;
+	}
+	void setCell(long off, long objectID, const std::vector<float> &src)
+	{
+		std::vector<double> &value = doubleVectorColumns[off][objectID];
+		value.resize(src.size());
+		std::copy(src.begin(), src.end(), value.begin());
+	}
+
+	/* readStarLoopMapped(in, data_start)
+	 *  Parse the rows of a STAR loop that start at byte data_start of mappedStar
+	 *  and leave 'in' after the loop, as readStarLoop would have done. */
+	long int readStarLoopMapped(std::ifstream& in, size_t data_start, bool do_only_count);
+
+	static std::vector<MetaDataTable> readAll(
+			std::ifstream& in,
+			int expectedNumber,
+			bool do_only_count,
+			const char *mapped_star,
+			size_t mapped_star_size);
+
+	/* readBinaryBlock(data, size, offset)
+	 *  Read the data block whose column directory starts at byte 'offset' of a mapped binary companion file.
+	 *  If labels is not NULL, only those columns are read.
+	 *  Returns false (leaving the table cleared) if the block cannot be used. */
+	bool readBinaryBlock(const char *data, size_t size, size_t offset, bool do_only_count,
+	                     const std::vector<EMDLabel> *labels, long int &nr_read);
+
+	// Write the columns and the column directory of this table; returns the offset of the directory
+	size_t writeBinaryBlock(std::ostream &out) const;
+
+	// Shared by both read() functions
+	long int readFile(const FileName &filename, const std::string &name, bool do_only_count, const std::vector<EMDLabel> *labels);
+
 };
 
 void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
@@ -446,7 +649,7 @@ bool MetaDataTable::getValue(EMDLabel label, T& value, long objectID) const
 			checkObjectID(objectID,  "MetaDataTable::getValue");
 		}
 
-		objects[objectID]->getValue(off, value);
+		getCell(off, objectID, value);
 		return true;
 	}
 	else
@@ -492,7 +695,7 @@ bool MetaDataTable::setValue(EMDLabel label, const T &value, long int objectID)
 
 	if (off > -1)
 	{
-		objects[objectID]->setValue(off, value);
+		setCell(off, objectID, value);
 		return true;
 	}
 	else
@@ -1497,7 +1497,8 @@ void MlModel::setFourierTransformMaps(bool update_tau2_spectra, int nr_threads,
 			Irefp = Iref[iclass];
 		}
 
-		if(PPrefRank.size() > 1)
+		// Only calculate the references this MPI rank is responsible for (see MlOptimiserMpi::initialiseWorkLoad)
+		if (!PPrefRank.empty())
 			do_heavy = PPrefRank[iclass];
 
 		if (update_tau2_spectra && iclass < nr_classes * nr_bodies)
@@ -1798,14 +1799,6 @@ void MlWsumModel::initZeros()
 
 }
 
-//#define DEBUG_PACK
-#ifdef DEBUG_PACK
-#define MAX_PACK_SIZE	  100000
-#else
-// Approximately 1024*1024*1024/8/2 ~ 0.5 Gb
-#define MAX_PACK_SIZE 67101000
-#endif
-
 void MlWsumModel::pack(MultidimArray<RFLOAT> &packed)
 {
 	unsigned long long packed_size = 0;
@@ -1998,7 +1991,7 @@ void MlWsumModel::unpack(MultidimArray<RFLOAT> &packed)
 }
 
 
-void MlWsumModel::pack(MultidimArray<RFLOAT> &packed, int &piece, int &nr_pieces, bool do_clear)
+void MlWsumModel::pack(MultidimArray<RFLOAT> &packed, int &piece, int &nr_pieces, bool do_clear, unsigned long long max_pack_size)
 {
 
 
@@ -2033,11 +2026,11 @@ void MlWsumModel::pack(MultidimArray<RFLOAT> &packed, int &piece, int &nr_pieces
 		idx_start = 0;
 		idx_stop = packed_size;
 	}
-	else if (packed_size > MAX_PACK_SIZE)
+	else if (packed_size > max_pack_size)
 	{
-		idx_start = (unsigned long long)piece * MAX_PACK_SIZE;
-		idx_stop = XMIPP_MIN(idx_start + MAX_PACK_SIZE, packed_size);
-		nr_pieces = CEIL((RFLOAT)packed_size/(RFLOAT)MAX_PACK_SIZE);
+		idx_start = (unsigned long long)piece * max_pack_size;
+		idx_stop = XMIPP_MIN(idx_start + max_pack_size, packed_size);
+		nr_pieces = CEIL((RFLOAT)packed_size/(RFLOAT)max_pack_size);
 	}
 	else
 	{
@@ -2184,7 +2177,7 @@ void MlWsumModel::pack(MultidimArray<RFLOAT> &packed, int &piece, int &nr_pieces
 
 }
 
-void MlWsumModel::unpack(MultidimArray<RFLOAT> &packed, int piece, bool do_clear)
+void MlWsumModel::unpack(MultidimArray<RFLOAT> &packed, int piece, bool do_clear, unsigned long long max_pack_size)
 {
 
 
@@ -2201,7 +2194,7 @@ void MlWsumModel::unpack(MultidimArray<RFLOAT> &packed, int piece, bool do_clear
 	}
 	else
 	{
-		idx_start = (unsigned long long)piece * MAX_PACK_SIZE;
+		idx_start = (unsigned long long)piece * max_pack_size;
 		idx_stop  = idx_start + (unsigned long long)MULTIDIM_SIZE(packed);
 	}
 	unsigned long long ori_idx = 0;
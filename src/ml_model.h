@@ -27,6 +27,14 @@
 #include "src/healpix_sampling.h"
 #include "src/gradient_optimisation.h"
 
+//#define DEBUG_PACK
+#ifdef DEBUG_PACK
+#define MAX_PACK_SIZE	  100000
+#else
+// Approximately 1024*1024*1024/8/2 ~ 0.5 Gb
+#define MAX_PACK_SIZE 67101000
+#endif
+
 #define ML_BLOB_ORDER 0
 #define ML_BLOB_RADIUS 1.9
 #define ML_BLOB_ALPHA 15
@@ -119,6 +127,7 @@ public:
 
 	// One projector for each class;
 	std::vector<Projector > PPref;
+	// If not empty: only calculate PPref[i] if PPrefRank[i] (it is sent by another MPI rank otherwise)
 	std::vector<bool> PPrefRank;
 
 	// One name for each group
@@ -534,12 +543,46 @@ public:
 
 	// Pack entire structure into one large MultidimArray<RFLOAT> for shipping over with MPI
 	// To save memory, the model itself will be cleared after packing.
-	// If the whole thing becomes bigger than 1Gb (see MAX_PACK_SIZE in ml_model.cpp), then break it up into pieces because MPI cannot handle very large messages
+	// If the whole thing becomes bigger than 1Gb (see MAX_PACK_SIZE), then break it up into pieces of max_pack_size elements because MPI cannot handle very large messages
 	// When broken up: nr_pieces > 1
-	void pack(MultidimArray<RFLOAT> &packed, int &piece, int &nr_pieces, bool do_clear=true);
+	void pack(MultidimArray<RFLOAT> &packed, int &piece, int &nr_pieces, bool do_clear=true, unsigned long long max_pack_size=MAX_PACK_SIZE);
 
 	// Fill the model again using unpack (this is the inverse operation from pack)
-	void unpack(MultidimArray<RFLOAT> &packed, int piece, bool do_clear=true);
+	// max_pack_size has to be the same as for pack
+	void unpack(MultidimArray<RFLOAT> &packed, int piece, bool do_clear=true, unsigned long long max_pack_size=MAX_PACK_SIZE);
+
+	// Sum the model over several processes, one piece at a time (see MlOptimiserMpi::combineAllWeightedSumsAllreduce)
+	// startReduce(packed) starts the reduction of a piece and finishReduce(packed) completes it.
+	// The next piece is packed in between, so that packing overlaps with the communication.
+	// Because the next piece is packed before the current one is unpacked, the model is not cleared while packing:
+	// unpack() only resizes arrays that start in the piece it unpacks.
+	template <class StartReduce, class FinishReduce>
+	void reduceInPieces(StartReduce startReduce, FinishReduce finishReduce, unsigned long long max_pack_size=MAX_PACK_SIZE)
+	{
+		MultidimArray<RFLOAT> Mpack[2];
+		int piece = 0;
+		int nr_pieces = 1;
+		int current = 0;
+
+		pack(Mpack[current], piece, nr_pieces, false, max_pack_size);
+		while (true)
+		{
+			// pack() has already incremented piece
+			int current_piece = piece - 1;
+			bool has_next_piece = (piece < nr_pieces);
+
+			startReduce(Mpack[current]);
+			if (has_next_piece)
+				pack(Mpack[1 - current], piece, nr_pieces, false, max_pack_size);
+			finishReduce(Mpack[current]);
+
+			unpack(Mpack[current], current_piece, true, max_pack_size);
+
+			if (!has_next_piece)
+				break;
+			current = 1 - current;
+		}
+	}
 
 };
 
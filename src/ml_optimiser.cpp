@@ -43,6 +43,7 @@
 #include "src/macros.h"
 #include "src/error.h"
 #include "src/ml_optimiser.h"
+#include "src/mapped_stack.h"
 #ifdef _CUDA_ENABLED
 #include "src/acc/cuda/cuda_ml_optimiser.h"
 #include <nvToolsExt.h>
@@ -104,6 +105,8 @@ void MlOptimiser::read(int argc, char **argv, int rank)
 	{
 		// Do this before reading in the data.star file below!
 		do_preread_images   = checkParameter(argc, argv, "--preread_images");
+		if (checkParameter(argc, argv, "--preread_bits"))
+			preread_bits = textToInteger(getParameter(argc, argv, "--preread_bits"));
 		do_parallel_disc_io = !checkParameter(argc, argv, "--no_parallel_disc_io");
 
 		parser.addSection("Continue options");
@@ -438,11 +441,15 @@ void MlOptimiser::parseContinue(int argc, char **argv)
 	int computation_section = parser.addSection("Computation");
 
 	x_pool = textToInteger(parser.getOption("--pool", "Number of images to pool for each thread task", "1"));
+	prefetch_pools = textToInteger(parser.getOption("--prefetch_pools", "Number of pools of particle images to read ahead in a separate I/O thread (0 to read them in the main thread)", "1"));
 	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to run in parallel (only useful on multi-core machines)", "1"));
 	do_parallel_disc_io = !parser.checkOption("--no_parallel_disc_io", "Do NOT let parallel (MPI) processes access the disc simultaneously (use this option with NFS)");
 	combine_weights_thru_disc = !parser.checkOption("--dont_combine_weights_via_disc", "Send the large arrays of summed weights through the MPI network, instead of writing large files to disc");
 	do_shifts_onthefly = parser.checkOption("--onthefly_shifts", "Calculate shifted images on-the-fly, do not store precalculated ones in memory");
 	do_preread_images  = parser.checkOption("--preread_images", "Use this to let the leader process read all particles into memory. Be careful you have enough RAM for large data sets!");
+	preread_bits = textToInteger(parser.getOption("--preread_bits", "Store pre-read particles with 32 (float), 16 (half-precision float) or 8 (quantised per image) bits per pixel", "32"));
+	if (preread_bits != 32 && preread_bits != 16 && preread_bits != 8)
+		REPORT_ERROR("ERROR: --preread_bits should be 32, 16 or 8");
 	fn_scratch = parser.getOption("--scratch_dir", "If provided, particle stacks will be copied to this local scratch disk prior to refinement.", "");
 	keep_free_scratch_Gb = textToFloat(parser.getOption("--keep_free_scratch", "Space available for copying particle stacks (in Gb)", "10"));
 	do_reuse_scratch = parser.checkOption("--reuse_scratch", "Re-use data on scratchdir, instead of wiping it and re-copying all data. This works only when ALL particles have already been cached.");
@@ -808,11 +815,15 @@ void MlOptimiser::parseInitial(int argc, char **argv)
 	// The number of threads is always read from the command line
 	int computation_section = parser.addSection("Computation");
 	x_pool = textToInteger(parser.getOption("--pool", "Number of images to pool for each thread task", "1"));
+	prefetch_pools = textToInteger(parser.getOption("--prefetch_pools", "Number of pools of particle images to read ahead in a separate I/O thread (0 to read them in the main thread)", "1"));
 	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to run in parallel (only useful on multi-core machines)", "1"));
 	combine_weights_thru_disc = !parser.checkOption("--dont_combine_weights_via_disc", "Send the large arrays of summed weights through the MPI network, instead of writing large files to disc");
 	do_shifts_onthefly = parser.checkOption("--onthefly_shifts", "Calculate shifted images on-the-fly, do not store precalculated ones in memory");
 	do_parallel_disc_io = !parser.checkOption("--no_parallel_disc_io", "Do NOT let parallel (MPI) processes access the disc simultaneously (use this option with NFS)");
 	do_preread_images  = parser.checkOption("--preread_images", "Use this to let the leader process read all particles into memory. Be careful you have enough RAM for large data sets!");
+	preread_bits = textToInteger(parser.getOption("--preread_bits", "Store pre-read particles with 32 (float), 16 (half-precision float) or 8 (quantised per image) bits per pixel", "32"));
+	if (preread_bits != 32 && preread_bits != 16 && preread_bits != 8)
+		REPORT_ERROR("ERROR: --preread_bits should be 32, 16 or 8");
 	fn_scratch = parser.getOption("--scratch_dir", "If provided, particle stacks will be copied to this local scratch disk prior to refinement.", "");
 	keep_free_scratch_Gb = textToFloat(parser.getOption("--keep_free_scratch", "Space available for copying particle stacks (in Gb)", "10"));
 	do_reuse_scratch = parser.checkOption("--reuse_scratch", "Re-use data on scratchdir, instead of wiping it and re-copying all data.");
@@ -1144,7 +1155,7 @@ void MlOptimiser::read(FileName fn_in, int rank, bool do_prevent_preread)
 	bool do_preread = (do_preread_images) ? (do_parallel_disc_io || rank == 0) : false;
 	if (do_prevent_preread) do_preread = false;
 	bool is_helical_segment = (do_helical_refine) || ((mymodel.ref_dim == 2) && (helical_tube_outer_diameter > 0.));
-	mydata.read(fn_data, false, false, do_preread, is_helical_segment);
+	mydata.read(fn_data, false, false, do_preread, is_helical_segment, 0, preread_bits);
 
 #ifdef DEBUG_READ
 	std::cerr<<"MlOptimiser::readStar before model."<<std::endl;
@@ -1496,7 +1507,7 @@ void MlOptimiser::initialise()
 
 	// And allow plans before expectation to run using allowed
 	// number of threads
-	fftw_plan_with_nthreads(nr_threads);
+	FourierTransformer::setPlannerThreads(nr_threads);
 #endif
 
 	initialiseGeneral();
@@ -1763,7 +1774,9 @@ void MlOptimiser::initialiseGeneral(int rank)
 		bool do_preread = (do_preread_images) ? (do_parallel_disc_io || rank == 0) : false;
 		bool is_helical_segment = (do_helical_refine) || ((mymodel.ref_dim == 2) && (helical_tube_outer_diameter > 0.));
 		int myverb = (rank==0) ? 1 : 0;
-		mydata.read(fn_data, true, false, do_preread, is_helical_segment, myverb); // true means ignore original particle name
+		// Parse the rows of large STAR files with all threads
+		MetaDataTable::setReadThreads(nr_threads);
+		mydata.read(fn_data, true, false, do_preread, is_helical_segment, myverb, preread_bits); // true means ignore original particle name
 
 		// Without this check, the program crashes later.
 		if (mydata.numberOfParticles() == 0)
@@ -2486,11 +2499,7 @@ void MlOptimiser::calculateSumOfPowerSpectraAndAverageImage(MultidimArray<RFLOAT
 			Image<RFLOAT> img;
 			if (do_preread_images && do_parallel_disc_io)
 			{
-				img().reshape(mydata.particles[part_id].images[img_id].img);
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mydata.particles[part_id].images[img_id].img)
-				{
-					DIRECT_MULTIDIM_ELEM(img(), n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(mydata.particles[part_id].images[img_id].img, n);
-				}
+				mydata.particles[part_id].images[img_id].getPrereadImage(img());
 			}
 			else
 			{
@@ -2860,7 +2869,11 @@ void MlOptimiser::initialLowPassFilterReferences()
 void MlOptimiser::iterateSetup()
 {
 	// Set up the thread task distributors for the particles and the orientations (will be resized later on)
-	exp_ipart_ThreadTaskDistributor = new ThreadTaskDistributor(nr_threads, 1);
+	exp_ipart_TaskDistributor = new WorkStealingTaskDistributor(nr_threads);
+
+	// The images of pooled particles are read in a separate I/O thread
+	if (prefetch_pools > 0 && do_parallel_disc_io && !do_preread_images)
+		image_prefetcher = new ImagePrefetcher(prefetch_pools);
 
 	omp_init_lock(&global_mutex);
 	for (int i = 0; i < NR_CLASS_MUTEXES; i++)
@@ -2870,7 +2883,12 @@ void MlOptimiser::iterateWrapUp()
 {
 
 	// delete barrier, threads and task distributors
-	delete exp_ipart_ThreadTaskDistributor;
+	delete exp_ipart_TaskDistributor;
+	if (image_prefetcher != NULL)
+	{
+		delete image_prefetcher;
+		image_prefetcher = NULL;
+	}
 
 	omp_destroy_lock(&global_mutex);
 	for (int i = 0; i < NR_CLASS_MUTEXES; i++)
@@ -3150,7 +3168,7 @@ void MlOptimiser::expectation()
 
 #ifdef MKLFFT
 	// Allow parallel FFTW execution
-	fftw_plan_with_nthreads(nr_threads);
+	FourierTransformer::setPlannerThreads(nr_threads);
 #endif
 
 	// Initialise some stuff
@@ -3318,7 +3336,7 @@ void MlOptimiser::expectation()
 
 #ifdef MKLFFT
 	// Single-threaded FFTW execution for code inside parallel processing loop
-	fftw_plan_with_nthreads(1);
+	FourierTransformer::setPlannerThreads(1);
 #endif
 
 	// Now perform real expectation over all particles
@@ -3379,6 +3397,9 @@ void MlOptimiser::expectation()
 		}
 		icheck++;
 
+		// Let the I/O thread read this pool and the next ones, while working on this one
+		prefetchPooledImages(my_pool_first_part_id, my_last_part_id);
+
 		// perform the actual expectation step on several particles
 		expectationSomeParticles(my_pool_first_part_id, my_pool_last_part_id);
 
@@ -3413,6 +3434,8 @@ void MlOptimiser::expectation()
 	if (verb > 0)
 		progress_bar(my_nr_particles);
 
+	reportExpectationStats(verb > 0);
+
 #ifdef _CUDA_ENABLED
 	if (do_gpu)
 	{
@@ -3529,7 +3552,7 @@ void MlOptimiser::expectation()
 #ifdef  MKLFFT
 	// Allow parallel FFTW execution to continue now that we are outside the parallel
 	// portion of expectation
-	fftw_plan_with_nthreads(nr_threads);
+	FourierTransformer::setPlannerThreads(nr_threads);
 #endif
 
 	// Clean up some memory
@@ -3805,14 +3828,29 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
 		}
 	}
 
-    // Only open/close stacks once
-    fImageHandler hFile;
-	long int dump;
-	FileName fn_img, fn_stack, fn_open_stack="";
-
-	// Store total number of particle images in this bunch of SomeParticles, and set translations and orientations for skip_align/rotate
-	long int my_metadata_offset = 0;
+	// Sjors 7 March 2016 to prevent too high disk access... Read in all pooled images simultaneously
+	// Don't do this for sub-tomograms to save RAM!
+	// With the image prefetcher, an I/O thread reads the images while the threads below already start working on them
+	bool do_pooled_read = (do_parallel_disc_io && !do_preread_images && mymodel.data_dim != 3);
 	exp_imgs.clear();
+	if (do_pooled_read)
+	{
+		// With prefetching, this pool may already have been queued by prefetchPooledImages()
+		if (image_prefetcher == NULL || !image_prefetcher->isCurrent(my_first_part_id))
+		{
+			std::vector<FileName> pooled_fn_imgs;
+			getPooledImageNames(my_first_part_id, my_last_part_id, pooled_fn_imgs, true);
+			if (image_prefetcher != NULL)
+			{
+				image_prefetcher->clear();
+				image_prefetcher->push(my_first_part_id, pooled_fn_imgs);
+			}
+			else
+				ImagePrefetcher::readImages(pooled_fn_imgs, exp_imgs);
+		}
+	}
+
+	// Set translations and orientations for skip_align/rotate
     int metadata_offset = 0;
     for (long int part_id_sorted = my_first_part_id; part_id_sorted <= my_last_part_id; part_id_sorted++)
 	{
@@ -3874,44 +3912,6 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
 		// Store total number of images in this bunch of SomeParticles
 		metadata_offset += mydata.numberOfImagesInParticle(part_id);
 
-		// Sjors 7 March 2016 to prevent too high disk access... Read in all pooled images simultaneously
-		// Don't do this for sub-tomograms to save RAM!
-		if (do_parallel_disc_io && !do_preread_images && mymodel.data_dim != 3)
-		{
-			// Read in the actual image from disc, only open/close common stacks once
-			// Read in all images, only open/close common stacks once
-			for (int img_id = 0; img_id < mydata.numberOfImagesInParticle(part_id); img_id++, my_metadata_offset++)
-			{
-
-				// Get the filename
-				if (!mydata.getImageNameOnScratch(part_id, img_id, fn_img))
-				{
-					std::istringstream split(exp_fn_img);
-					for (int i = 0; i <= my_metadata_offset; i++)
-					{
-						getline(split, fn_img);
-					}
-				}
-
-				// Only open again a new stackname
-				fn_img.decompose(dump, fn_stack);
-				if (fn_stack != fn_open_stack)
-				{
-					hFile.openFile(fn_stack, WRITE_READONLY);
-					fn_open_stack = fn_stack;
-				}
-				Image<RFLOAT> img;
-#ifdef DEBUG_BODIES
-				std::cerr << " fn_img= " << fn_img << " part_id= " << part_id << std::endl;
-#endif
-				img.readFromOpenFile(fn_img, hFile, -1, false);
-				img().setXmippOrigin();
-				exp_imgs.push_back(img());
-
-			} // end loop over all images in this particle
-
-		} // end if do_parallel_disc_io
-
 	} //end loop over part_id
 
 
@@ -3922,11 +3922,11 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
 	{
 		// GPU and traditional CPU case - use RELION's built-in task manager to
 		// process multiple particles at once
-		exp_ipart_ThreadTaskDistributor->resize(my_last_part_id - my_first_part_id + 1, 1);
-		exp_ipart_ThreadTaskDistributor->reset();
+		exp_ipart_TaskDistributor->reset(my_last_part_id - my_first_part_id + 1);
 		#pragma omp parallel for num_threads(nr_threads)
 		for (int thread_id = 0; thread_id < nr_threads; thread_id++)
 			globalThreadExpectationSomeParticles(this, thread_id);
+		exp_ipart_TaskDistributor->finish();
 	}
 #ifdef ALTCPU
 	else
@@ -3958,6 +3958,10 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
 	}  // do_cpu
 #endif  // ifdef ALTCPU
 
+	// Done with this pool: let the prefetcher move on to the next one
+	if (do_pooled_read && image_prefetcher != NULL)
+		image_prefetcher->release();
+
 	if (threadException != NULL)
 		throw *threadException;
 
@@ -3969,6 +3973,93 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
 }
 
 
+void MlOptimiser::getPooledImageNames(long int my_first_part_id, long int my_last_part_id, std::vector<FileName> &fn_imgs, bool do_current_pool)
+{
+	// Same names as in getMetaAndImageDataSubset: on the scratch disk if they were copied there
+	// exp_fn_img has one line per image of the current pool
+	std::istringstream split(exp_fn_img);
+	fn_imgs.clear();
+	for (long int part_id_sorted = my_first_part_id; part_id_sorted <= my_last_part_id; part_id_sorted++)
+	{
+		long int part_id = mydata.sorted_idx[part_id_sorted];
+		for (int img_id = 0; img_id < mydata.numberOfImagesInParticle(part_id); img_id++)
+		{
+			FileName fn_img;
+			if (do_current_pool)
+				getline(split, fn_img);
+			// The scratch disk of this node may differ from that of the MPI leader
+			if (!mydata.getImageNameOnScratch(part_id, img_id, fn_img) && !do_current_pool)
+				mydata.MDimg.getValue(EMDL_IMAGE_NAME, fn_img, mydata.particles[part_id].images[img_id].id);
+			if (fn_img == "")
+				REPORT_ERROR("MlOptimiser::getPooledImageNames BUG: no image name for particle " + integerToString(part_id));
+#ifdef DEBUG_BODIES
+			std::cerr << " fn_img= " << fn_img << " part_id= " << part_id << std::endl;
+#endif
+			fn_imgs.push_back(fn_img);
+		}
+	}
+}
+
+void MlOptimiser::prefetchPooledImages(long int my_first_part_id, long int my_last_part_id)
+{
+	if (image_prefetcher == NULL || !do_parallel_disc_io || do_preread_images || mymodel.data_dim == 3)
+		return;
+
+	// Queue the pools of nr_pool particles from my_first_part_id onwards, as far as the prefetcher allows
+	for (long int pool_first = my_first_part_id; pool_first <= my_last_part_id && image_prefetcher->canPush(); pool_first += nr_pool)
+	{
+		if (image_prefetcher->isQueued(pool_first))
+			continue;
+		long int pool_last = XMIPP_MIN(my_last_part_id, pool_first + nr_pool - 1);
+		std::vector<FileName> fn_imgs;
+		getPooledImageNames(pool_first, pool_last, fn_imgs, pool_first == my_first_part_id);
+		image_prefetcher->push(pool_first, fn_imgs);
+	}
+}
+
+void MlOptimiser::getPooledImage(long int my_metadata_offset, MultidimArray<RFLOAT> &img)
+{
+	if (image_prefetcher != NULL)
+		img = image_prefetcher->get(my_metadata_offset);
+	else
+		img = exp_imgs[my_metadata_offset];
+}
+
+void MlOptimiser::reportExpectationStats(bool do_print)
+{
+	if (image_prefetcher != NULL)
+	{
+		image_prefetcher->clear();
+		if (do_print && image_prefetcher->getReadTime() > 0.)
+			std::cout << " Reading particle images took " << image_prefetcher->getReadTime()
+			          << " sec in the background; threads waited " << image_prefetcher->getStallTime() << " sec for them" << std::endl;
+		image_prefetcher->resetStats();
+	}
+
+	if (exp_ipart_TaskDistributor != NULL)
+	{
+		double sum_busy = 0., sum_idle = 0., max_idle = 0.;
+		for (int thread_id = 0; thread_id < nr_threads; thread_id++)
+		{
+			sum_busy += exp_ipart_TaskDistributor->getBusyTime(thread_id);
+			sum_idle += exp_ipart_TaskDistributor->getIdleTime(thread_id);
+			max_idle = XMIPP_MAX(max_idle, exp_ipart_TaskDistributor->getIdleTime(thread_id));
+		}
+		if (do_print && nr_threads > 1 && sum_busy > 0.)
+		{
+			std::cout << " Threads were busy for " << ROUND(100. * sum_busy / (sum_busy + sum_idle)) << "% of the time ("
+			          << exp_ipart_TaskDistributor->getNrSteals() << " steals, longest idle time " << max_idle << " sec)" << std::endl;
+#ifdef TIMING
+			for (int thread_id = 0; thread_id < nr_threads; thread_id++)
+				std::cout << "  thread " << thread_id << ": busy " << exp_ipart_TaskDistributor->getBusyTime(thread_id)
+				          << " sec, idle " << exp_ipart_TaskDistributor->getIdleTime(thread_id) << " sec" << std::endl;
+#endif
+		}
+		exp_ipart_TaskDistributor->resetTimes();
+	}
+}
+
+
 void MlOptimiser::doThreadExpectationSomeParticles(int thread_id)
 {
 
@@ -3979,7 +4070,7 @@ void MlOptimiser::doThreadExpectationSomeParticles(int thread_id)
 #endif
 
 	size_t first_ipart = 0, last_ipart = 0;
-	while (exp_ipart_ThreadTaskDistributor->getTasks(first_ipart, last_ipart))
+	while (exp_ipart_TaskDistributor->getTasks(thread_id, first_ipart, last_ipart))
 	{
 //#define DEBUG_EXPSOMETHR
 #ifdef DEBUG_EXPSOMETHR
@@ -5659,13 +5750,7 @@ void MlOptimiser::getFourierTransformsAndCtfs(
 			// If all followers had preread images into RAM: get those now
 			if (do_preread_images)
 			{
-				img().reshape(mydata.particles[part_id].images[img_id].img);
-
-
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mydata.particles[part_id].images[img_id].img)
-				{
-					DIRECT_MULTIDIM_ELEM(img(), n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(mydata.particles[part_id].images[img_id].img, n);
-				}
+				mydata.particles[part_id].images[img_id].getPrereadImage(img());
 			}
 			else
 			{
@@ -5715,7 +5800,7 @@ void MlOptimiser::getFourierTransformsAndCtfs(
 				}
 				else
 				{
-					img() = exp_imgs[my_metadata_offset];
+					getPooledImage(my_metadata_offset, img());
 				}
 #endif
 			}
@@ -9980,11 +10065,7 @@ void MlOptimiser::getMetaAndImageDataSubset(long int first_part_id, long int las
 				Image<RFLOAT> img, rec_img;
 				if (do_preread_images)
 				{
-					img().reshape(mydata.particles[part_id].images[img_id].img);
-					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mydata.particles[part_id].images[img_id].img)
-					{
-						DIRECT_MULTIDIM_ELEM(img(), n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(mydata.particles[part_id].images[img_id].img, n);
-					}
+					mydata.particles[part_id].images[img_id].getPrereadImage(img());
 				}
 				else
 				{
@@ -37,6 +37,7 @@
 #include "src/time.h"
 #include "src/mask.h"
 #include "src/healpix_sampling.h"
+#include "src/image_prefetcher.h"
 #include "src/helix.h"
 #include "src/local_symmetry.h"
 #include "src/acc/settings.h"
@@ -461,6 +462,9 @@ public:
 	// Or preread all images into RAM on the leader node?
 	bool do_preread_images;
 
+	// Number of bits per pixel to store pre-read images with (32, 16 or 8)
+	int preread_bits;
+
 	// Place on scratch disk to copy particle stacks temporarily
 	FileName fn_scratch;
 
@@ -653,7 +657,11 @@ public:
 	int verb;
 
 	// Thread Managers for the expectation step: one for all (pooled) particles
-	ThreadTaskDistributor *exp_ipart_ThreadTaskDistributor;
+	WorkStealingTaskDistributor *exp_ipart_TaskDistributor;
+
+	// Background reader of the pooled particle images, and how many pools it may read ahead
+	ImagePrefetcher *image_prefetcher;
+	int prefetch_pools;
 
 	// Number of threads to run in parallel
 	int x_pool;
@@ -774,7 +782,9 @@ public:
             x_pool(1),
             nr_threads(0),
             do_shifts_onthefly(0),
-            exp_ipart_ThreadTaskDistributor(0),
+            exp_ipart_TaskDistributor(0),
+            image_prefetcher(0),
+            prefetch_pools(1),
             do_parallel_disc_io(0),
             sum_changes_optimal_orientations(0),
             do_solvent(0),
@@ -828,6 +838,7 @@ public:
             anticipate_oom(0),
             do_helical_refine(0),
             do_preread_images(0),
+            preread_bits(32),
             ignore_helical_symmetry(0),
             helical_twist_initial(0),
             helical_rise_initial(0),
@@ -980,6 +991,21 @@ public:
 	 */
 	void expectationSomeParticles(long int my_first_particle, long int my_last_particle);
 
+	/* Names of the images that expectationSomeParticles() reads from disc for these particles
+	 * For the current pool (do_current_pool), these come from exp_fn_img, as set by getMetaAndImageDataSubset() or sent by the MPI leader:
+	 * MPI followers do not keep the image names in mydata.MDimg. Later pools are named from mydata.MDimg.
+	 */
+	void getPooledImageNames(long int my_first_part_id, long int my_last_part_id, std::vector<FileName> &fn_imgs, bool do_current_pool);
+
+	/* Queue the next pools of particles for reading by the image prefetcher */
+	void prefetchPooledImages(long int my_first_part_id, long int my_last_part_id);
+
+	/* Get a pooled image read in expectationSomeParticles(), waiting for the image prefetcher if needed */
+	void getPooledImage(long int my_metadata_offset, MultidimArray<RFLOAT> &img);
+
+	/* Print (if do_print) and reset the image prefetching and thread load statistics of the expectation step */
+	void reportExpectationStats(bool do_print);
+
 	/* Perform expectation step for some particles using threads */
 	void doThreadExpectationSomeParticles(int thread_id);
 
@@ -62,6 +62,14 @@ void MlOptimiserMpi::read(int argc, char **argv)
     int mpi_section = parser.addSection("MPI options");
     halt_all_followers_except_this = textToInteger(parser.getOption("--halt_all_followers_except", "For debugging: keep all followers except this one waiting", "-1"));
     do_keep_debug_reconstruct_files  = parser.checkOption("--keep_debug_reconstruct_files", "For debugging: keep temporary data and weight files for debug-reconstructions.");
+    do_combine_weights_allreduce = parser.checkOption("--combine_weights_allreduce", "Combine weighted sums through a pipelined MPI allreduce within each half-set, instead of passing them along all followers (only with --dont_combine_weights_via_disc)");
+    do_node_shared_memory = parser.checkOption("--node_shared_memory", "Followers on the same node share one copy of the references (MPI-3 shared memory), and reduce their weighted sums on the node before reducing between nodes (the latter only with --combine_weights_allreduce)");
+#if MPI_VERSION < 3
+    if (do_node_shared_memory)
+    	REPORT_ERROR("ERROR: --node_shared_memory requires an MPI-3 library");
+#endif
+    nodeC = nodeLeadersC = MPI_COMM_NULL;
+    node_rank = node_index = 0;
 
     // Don't put any output to screen for mpi followers
     ori_verb = verb;
@@ -106,6 +114,10 @@ void MlOptimiserMpi::initialise()
 	}
 
 	grad_pseudo_halfsets = gradient_refine && !do_split_random_halves;
+
+	if (do_node_shared_memory)
+		setupNodeCommunicators();
+
 #ifdef _CUDA_ENABLED
     /************************************************************************/
 	//Setup GPU related resources
@@ -484,7 +496,7 @@ will still yield good performance and possibly a more stable execution. \n" << s
 
 	// And allow plans before expectation to run using allowed
 	// number of threads
-	fftw_plan_with_nthreads(nr_threads);
+	FourierTransformer::setPlannerThreads(nr_threads);
 #endif
 
 	MlOptimiser::initialiseGeneral(node->rank);
@@ -692,7 +704,8 @@ void MlOptimiserMpi::initialiseWorkLoad()
 
 	if(!do_split_random_halves)
 	{
-		if(!node->isLeader())
+		// With a single reference, all followers calculate it, unless they share it on the node
+		if(!node->isLeader() && (mymodel.PPref.size() > 1 || do_node_shared_memory))
 		{
 			/* Set up a bool-array with reference responsibilities for each rank. That is;
 			 * if(PPrefRank[i]==true)  //on this rank
@@ -707,12 +720,141 @@ void MlOptimiserMpi::initialiseWorkLoad()
 		}
 		MPI_Barrier(MPI_COMM_WORLD);
 	}
+	else if (do_node_shared_memory && !node->isLeader())
+	{
+		// Only the first follower of each half-set on a node calculates the references; the others will share its copy
+		mymodel.PPrefRank.assign(mymodel.PPref.size(), node_rank == 0);
+	}
 //#define DEBUG_WORKLOAD
 #ifdef DEBUG_WORKLOAD
 	std::cerr << " node->rank= " << node->rank << " my_first_particle_id= " << my_first_particle_id << " my_last_particle_id= " << my_last_particle_id << std::endl;
 #endif
 }
 
+void MlOptimiserMpi::setupNodeCommunicators()
+{
+#if MPI_VERSION >= 3
+	if (node->isLeader())
+		return;
+
+	// Followers of the same half-set (as in combineAllWeightedSumsAllreduce) that can share memory
+	int nr_halfsets = (do_split_random_halves) ? 2 : 1;
+	int halfset = (node->rank - 1) % nr_halfsets;
+	MPI_Comm sharedC;
+	int result = MPI_Comm_split_type(node->followerC, MPI_COMM_TYPE_SHARED, node->followerRank, MPI_INFO_NULL, &sharedC);
+	if (result != MPI_SUCCESS)
+		node->report_MPI_ERROR(result);
+	result = MPI_Comm_split(sharedC, halfset, node->followerRank, &nodeC);
+	if (result != MPI_SUCCESS)
+		node->report_MPI_ERROR(result);
+	MPI_Comm_free(&sharedC);
+	MPI_Comm_rank(nodeC, &node_rank);
+
+	// The first follower of each group talks to the other nodes
+	result = MPI_Comm_split(node->followerC, (node_rank == 0) ? halfset : MPI_UNDEFINED, node->followerRank, &nodeLeadersC);
+	if (result != MPI_SUCCESS)
+		node->report_MPI_ERROR(result);
+	if (node_rank == 0)
+		MPI_Comm_rank(nodeLeadersC, &node_index);
+	MPI_Bcast(&node_index, 1, MPI_INT, 0, nodeC);
+
+	int node_size;
+	MPI_Comm_size(nodeC, &node_size);
+	if (node->rank == 1 && ori_verb > 0)
+		std::cout << " Follower " << node->rank << " shares references with " << node_size - 1 << " other follower(s) on its node" << std::endl;
+#endif
+}
+
+void MlOptimiserMpi::freeNodeCommunicators()
+{
+#if MPI_VERSION >= 3
+	// The shared windows were allocated on nodeC
+	releaseSharedReferences();
+
+	if (nodeC != MPI_COMM_NULL)
+		MPI_Comm_free(&nodeC);
+	if (nodeLeadersC != MPI_COMM_NULL)
+		MPI_Comm_free(&nodeLeadersC);
+#endif
+}
+
+void MlOptimiserMpi::shareReferencesOnNode()
+{
+#if MPI_VERSION >= 3
+	releaseSharedReferences();
+
+	for (int i = 0; i < mymodel.PPref.size(); i++)
+	{
+		MultidimArray<Complex> &Mref = mymodel.PPref[i].data;
+		long int n = MULTIDIM_SIZE(Mref);
+
+		// The first follower on the node allocates the window, the others point into it
+		Complex *shared;
+		MPI_Win win;
+		MPI_Aint my_size = (node_rank == 0) ? n * sizeof(Complex) : 0;
+		int result = MPI_Win_allocate_shared(my_size, sizeof(Complex), MPI_INFO_NULL, nodeC, &shared, &win);
+		if (result != MPI_SUCCESS)
+			node->report_MPI_ERROR(result);
+		if (node_rank != 0)
+		{
+			MPI_Aint size;
+			int disp_unit;
+			MPI_Win_shared_query(win, 0, &size, &disp_unit, &shared);
+		}
+		shared_ref_wins.push_back(win);
+
+		MPI_Win_fence(0, win);
+		if (do_split_random_halves)
+		{
+			// The first follower on the node calculated the references of its half-set (see initialiseWorkLoad)
+			if (node_rank == 0)
+				memcpy(shared, MULTIDIM_ARRAY(Mref), n * sizeof(Complex));
+			if (i < mymodel.nr_classes * mymodel.nr_bodies)
+				node->relion_MPI_Bcast(MULTIDIM_ARRAY(mymodel.tau2_class[i]),
+				                       MULTIDIM_SIZE(mymodel.tau2_class[0]), MY_MPI_DOUBLE, 0, nodeC);
+			MPI_Win_fence(0, win);
+		}
+		else
+		{
+			// The sender copies its reference into the window of its node, which then sends it to the other nodes
+			int sender = (i)%(node->size - 1);
+			int sender_node = node_index;
+			MPI_Bcast(&sender_node, 1, MPI_INT, sender, node->followerC);
+			if (node->followerRank == sender)
+				memcpy(shared, MULTIDIM_ARRAY(Mref), n * sizeof(Complex));
+			MPI_Win_fence(0, win);
+			if (node_rank == 0)
+				node->relion_MPI_Bcast(shared, n, MY_MPI_COMPLEX, sender_node, nodeLeadersC);
+			if (i < mymodel.nr_classes * mymodel.nr_bodies)
+				node->relion_MPI_Bcast(MULTIDIM_ARRAY(mymodel.tau2_class[i]),
+				                       MULTIDIM_SIZE(mymodel.tau2_class[0]), MY_MPI_DOUBLE, sender, node->followerC);
+			MPI_Win_fence(0, win);
+		}
+
+		// Free the private copy and use the shared one (read-only) instead
+		Mref.coreDeallocate();
+		Mref.data = shared;
+		Mref.nzyxdimAlloc = n;
+		Mref.destroyData = false;
+	}
+#endif
+}
+
+void MlOptimiserMpi::releaseSharedReferences()
+{
+	if (shared_ref_wins.empty())
+		return;
+
+	for (int i = 0; i < shared_ref_wins.size(); i++)
+	{
+		// The window is not ours to free through the array
+		mymodel.PPref[i].data.data = NULL;
+		mymodel.PPref[i].data.clear();
+		MPI_Win_free(&shared_ref_wins[i]);
+	}
+	shared_ref_wins.clear();
+}
+
 void MlOptimiserMpi::expectation()
 {
 #ifdef TIMING
@@ -731,7 +873,7 @@ void MlOptimiserMpi::expectation()
 
 #ifdef MKLFFT
 	// Allow parallel FFTW execution
-	fftw_plan_with_nthreads(nr_threads);
+	FourierTransformer::setPlannerThreads(nr_threads);
 #endif
 
 	// Initialise some stuff
@@ -759,7 +901,13 @@ void MlOptimiserMpi::expectation()
 	timer.toc(TIMING_EXP_1a);
 #endif
 
-	if(!do_split_random_halves)
+	if (do_node_shared_memory)
+	{
+		if (!node->isLeader())
+			shareReferencesOnNode();
+		MPI_Barrier(MPI_COMM_WORLD);
+	}
+	else if(!do_split_random_halves)
 	{
 		if (!node->isLeader())
 		{
@@ -1034,7 +1182,7 @@ void MlOptimiserMpi::expectation()
 
 #ifdef MKLFFT
 	// Single-threaded FFTW execution for code inside parallel processing loop
-	fftw_plan_with_nthreads(1);
+	FourierTransformer::setPlannerThreads(1);
 #endif
 
 #ifdef TIMING
@@ -1390,6 +1538,12 @@ void MlOptimiserMpi::expectation()
 			}
 //		TODO: define MPI_COMM_SLAVES!!!!	MPI_Barrier(node->MPI_COMM_SLAVES);
 
+#ifdef TIMING
+			reportExpectationStats(node->rank == 1);
+#else
+			reportExpectationStats(false);
+#endif
+
 #ifdef _CUDA_ENABLED
 			if (do_gpu)
 			{
@@ -1530,7 +1684,7 @@ void MlOptimiserMpi::expectation()
 #ifdef  MKLFFT
 	// Allow parallel FFTW execution to continue now that we are outside the parallel
 	// portion of expectation
-	fftw_plan_with_nthreads(nr_threads);
+	FourierTransformer::setPlannerThreads(nr_threads);
 #endif
 
 	// Just make sure the temporary arrays are empty...
@@ -1555,6 +1709,8 @@ void MlOptimiserMpi::expectation()
 	// All followers reset the size of their projector to zero to save memory
 	if (!node->isLeader())
 	{
+		if (do_node_shared_memory)
+			releaseSharedReferences();
 		for (int iclass = 0; iclass < mymodel.nr_classes; iclass++)
 			mymodel.PPref[iclass].initialiseData(0);
 	}
@@ -1813,6 +1969,86 @@ void MlOptimiserMpi::combineAllWeightedSums()
 #endif
 }
 
+void MlOptimiserMpi::combineAllWeightedSumsAllreduce()
+{
+#ifdef TIMING
+	timer.tic(TIMING_MPICOMBINENETW);
+#endif
+
+	int nr_halfsets = (do_split_random_halves) ? 2 : 1;
+#ifdef DEBUG
+	std::cerr << " starting combineAllWeightedSumsAllreduce..." << std::endl;
+#endif
+	// Only combine weighted sums if there are more than one followers per subset!
+	if ((node->size - 1)/nr_halfsets > 1)
+	{
+		// Make one communicator for the followers of each subset; the leader does not take part
+		MPI_Comm halfsetC;
+		int color = (node->isLeader()) ? MPI_UNDEFINED : (node->rank - 1) % nr_halfsets;
+		int result = MPI_Comm_split(MPI_COMM_WORLD, color, node->rank, &halfsetC);
+		if (result != MPI_SUCCESS)
+			node->report_MPI_ERROR(result);
+
+		if (!node->isLeader())
+		{
+#if MPI_VERSION >= 3
+			MPI_Request request;
+#endif
+			wsum_model.reduceInPieces(
+				[&](MultidimArray<RFLOAT> &Mpack)
+			{
+				RFLOAT *buffer = MULTIDIM_ARRAY(Mpack);
+				long int count = MULTIDIM_SIZE(Mpack);
+#if MPI_VERSION >= 3
+				if (do_node_shared_memory)
+				{
+					// Sum on the node first, then between the nodes of this half-set, and pass the result back on the node
+					result = MPI_Reduce((node_rank == 0) ? MPI_IN_PLACE : buffer, buffer, count, MY_MPI_DOUBLE, MPI_SUM, 0, nodeC);
+					if (result == MPI_SUCCESS && node_rank == 0)
+						result = MPI_Allreduce(MPI_IN_PLACE, buffer, count, MY_MPI_DOUBLE, MPI_SUM, nodeLeadersC);
+					if (result != MPI_SUCCESS)
+						node->report_MPI_ERROR(result);
+					node->relion_MPI_Bcast(buffer, count, MY_MPI_DOUBLE, 0, nodeC);
+				}
+				else
+				{
+					result = MPI_Iallreduce(MPI_IN_PLACE, buffer, count, MY_MPI_DOUBLE, MPI_SUM, halfsetC, &request);
+					if (result != MPI_SUCCESS)
+						node->report_MPI_ERROR(result);
+				}
+#else
+				// No non-blocking collectives before MPI-3: the next piece is only packed after this reduction
+				result = MPI_Allreduce(MPI_IN_PLACE, buffer, count, MY_MPI_DOUBLE, MPI_SUM, halfsetC);
+				if (result != MPI_SUCCESS)
+					node->report_MPI_ERROR(result);
+#endif
+			},
+				[&](MultidimArray<RFLOAT> &Mpack)
+			{
+#if MPI_VERSION >= 3
+				if (!do_node_shared_memory)
+				{
+					result = MPI_Wait(&request, MPI_STATUS_IGNORE);
+					if (result != MPI_SUCCESS)
+						node->report_MPI_ERROR(result);
+				}
+#endif
+#ifdef DEBUG
+				std::cerr << " AR node->rank= " << node->rank << " MULTIDIM_SIZE(Mpack)= " << MULTIDIM_SIZE(Mpack) << std::endl;
+#endif
+			});
+
+			MPI_Comm_free(&halfsetC);
+		}
+
+		MPI_Barrier(MPI_COMM_WORLD);
+	}
+
+#ifdef TIMING
+	timer.toc(TIMING_MPICOMBINENETW);
+#endif
+}
+
 void MlOptimiserMpi::combineWeightedSumsTwoRandomHalvesViaFile()
 {
 	// Just sum the weighted halves from follower 1 and follower 2 and Bcast to everyone else
@@ -3514,6 +3750,8 @@ void MlOptimiserMpi::iterate()
 #endif
 		if (combine_weights_thru_disc)
 			combineAllWeightedSumsViaFile();
+		else if (do_combine_weights_allreduce)
+			combineAllWeightedSumsAllreduce();
 		else
 			combineAllWeightedSums();
 #ifdef DEBUG
@@ -3825,5 +4063,6 @@ void MlOptimiserMpi::iterate()
 
 	// delete threads etc.
 	MlOptimiser::iterateWrapUp();
+	freeNodeCommunicators();
 	MPI_Barrier(MPI_COMM_WORLD);
 }
@@ -45,6 +45,19 @@ public:
     // Original verb
     int ori_verb;
 
+    // Combine the weighted sums through a pipelined MPI allreduce within each half-set, instead of passing them along all followers
+    bool do_combine_weights_allreduce;
+
+    // Followers on one node share a single copy of the references in MPI-3 shared memory, and reduce their weighted sums on the node first
+    bool do_node_shared_memory;
+
+    // Followers on this node (of the same half-set), and one leader per node (for each half-set)
+    MPI_Comm nodeC, nodeLeadersC;
+    int node_rank, node_index;
+
+    // Shared-memory windows that hold mymodel.PPref during the expectation
+    std::vector<MPI_Win> shared_ref_wins;
+
 	/** Destructor, calls MPI_Finalize */
     ~MlOptimiserMpi()
     {
@@ -68,6 +81,22 @@ public:
      */
     void initialiseWorkLoad();
 
+    /** Split the followers into groups that share memory on one node (within each half-set),
+     *  and make a communicator between the first follower of each group
+     */
+    void setupNodeCommunicators();
+
+    /** Free the communicators made by setupNodeCommunicators */
+    void freeNodeCommunicators();
+
+    /** Replace each follower's copy of mymodel.PPref by one copy in a shared-memory window per node.
+     *  Without split random halves, this also distributes the references from the followers that calculated them.
+     */
+    void shareReferencesOnNode();
+
+    /** Detach mymodel.PPref from the shared-memory windows and free these */
+    void releaseSharedReferences();
+
     /** Expectation
      *  This cares care of gathering all weighted sums after the expectation
      */
@@ -87,6 +116,12 @@ public:
      */
     void combineAllWeightedSums();
 
+    /** After expectation combine all weighted sum arrays across all nodes
+     *  Use one (non-blocking) allreduce per half-set, in which the packing of the next piece of wsum_model
+     *  overlaps with the reduction of the current one, instead of passing Msum along all followers in turn
+     */
+    void combineAllWeightedSumsAllreduce();
+
     /** Join the sums from two random halves
      */
     void combineWeightedSumsTwoRandomHalves();
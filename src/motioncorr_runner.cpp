@@ -18,6 +18,9 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include <omp.h>
+#include <memory>
+#include <sstream>
+#include <exception>
 
 #include "src/motioncorr_runner.h"
 #ifdef _CUDA_ENABLED
@@ -126,6 +129,8 @@ void MotioncorrRunner::read(int argc, char **argv, int rank)
 	if (max_iter != 5 && !do_own)
 		REPORT_ERROR("--max_iter is valid only with --do_own");
 	interpolate_shifts = parser.checkOption("--interpolate_shifts", "(EXPERIMENTAL) Interpolate shifts");
+	prefetch_movies = textToInteger(parser.getOption("--prefetch_movies", "Read (and gain-correct) this many movies ahead in a background thread while aligning the current one", "0"));
+	prefetch_max_memory = textToFloat(parser.getOption("--prefetch_max_memory", "Maximum memory (in GB) for the movies that are read ahead (0 = no limit)", "0"));
 	ccf_downsample = textToFloat(parser.getOption("--ccf_downsample", "(EXPERT) Downsampling rate of CC map. default = 0 = automatic based on B factor", "0"));
 	if (parser.checkOption("--early_binning", "Do binning before alignment to reduce memory usage. This might dampen signal near Nyquist. (ON by default)"))
 		std::cerr << "Since RELION 3.1, --early_binning is on by default. Use --no_early_binning to disable it." << std::endl;
@@ -454,6 +459,8 @@ void MotioncorrRunner::run()
 		barstep = XMIPP_MAX(1, fn_micrographs.size() / 60);
 	}
 
+	startMoviePrefetch(fn_micrographs);
+
 	for (long int imic = 0; imic < fn_micrographs.size(); imic++)
 	{
 		if (verb > 0 && imic % barstep == 0)
@@ -483,6 +490,8 @@ void MotioncorrRunner::run()
 		}
 	}
 
+	stopMoviePrefetch();
+
 	if (verb > 0)
 		progress_bar(fn_micrographs.size());
 
@@ -994,62 +1003,110 @@ void MotioncorrRunner::generateLogFilePDFAndWriteStarFiles()
 	}
 }
 
-bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
-	FileName fn_mic = mic.getMovieFilename();
-	FileName fn_avg = getOutputFileNames(fn_mic);
-	FileName fn_avg_noDW = fn_avg.withoutExtension() + "_noDW.mrc";
-	FileName fn_log = fn_avg.withoutExtension() + ".log";
-	FileName fn_ps = fn_avg.withoutExtension() + "_PS.mrc";
-	std::ofstream logfile;
-	logfile.open(fn_log);
+// All frames of a movie for our own implementation, read (and corrected for gain and defects)
+// either just before alignment or ahead of time by the prefetch thread
+struct MotioncorrMovie
+{
+	FileName fn_mic;
+	std::vector<int> frames; // 0-indexed
+	std::vector<Image<float> > Iframes;
+	int nx, ny, nn;
+	int n_groups;
+	std::vector<int> group_start, group_size;
+	std::vector<int> hotpixelX, hotpixelY;
+
+	// Output for the logfile, which is only opened when the movie is aligned
+	std::stringstream log;
+
+	// Can the movie be aligned (i.e. does it have enough frames)?
+	bool is_usable;
+
+	// For the prefetch thread: have all frames been read, how much memory do they take and did anything go wrong?
+	bool is_read;
+	size_t nr_bytes;
+	std::exception_ptr error;
 
 	// EER and compressed MRC related things
 	// TODO: will be refactored
 	EERRenderer renderer;
-	const bool isEER = EERRenderer::isEER(fn_mic);
+	bool isEER;
 	CompressedMRCReader compressedMRCreader;
-	const bool isCompressedMRC = compressedMRCreader.isCompressedMRC(fn_mic);
+	bool isCompressedMRC;
 
-	int n_io_threads = n_threads;
-	logfile << "Working on " << fn_mic << " with " << n_threads << " thread(s)." << std::endl << std::endl;
-	if (max_io_threads > 0 && n_io_threads > max_io_threads)
-	{
-		n_io_threads = max_io_threads;
-		logfile << "Limitted the number of IO threads per movie to " << n_io_threads << " thread(s)." << std::endl;
-	}
+	// EER frames are rendered binned by this factor (a power of two) instead of being binned in Fourier space.
+	// Iframes, the gain reference and the defect mask are then smaller than nx x ny by this factor.
+	int render_binning;
 
-	Image<float> Ihead, Igain, Iref;
-	std::vector<MultidimArray<fComplex> > Fframes;
-	std::vector<Image<float> > Iframes;
-	std::vector<int> frames; // 0-indexed
+	MotioncorrMovie(FileName _fn_mic):
+		fn_mic(_fn_mic), nx(0), ny(0), nn(0), n_groups(0), is_usable(false), is_read(false), nr_bytes(0), render_binning(1)
+	{}
+};
 
-	RFLOAT output_angpix = angpix * bin_factor;
-	RFLOAT prescaling = 1;
+// Size of the down-sampled cross-correlation function and the B-factor weight
+// for the alignment of a patch of pnx x pny pixels
+struct MotioncorrCCF
+{
+	int pnx, pny; // real space patch size
+	int nfx, nfy; // size of the Fourier transform of the patch
+	int ccf_nx, ccf_ny, ccf_nfx, ccf_nfy;
+	RFLOAT ccf_scale_x, ccf_scale_y;
+	int search_range;
+	MultidimArray<float> weight;
+};
 
-	const int hotpixel_sigma = 6;
-	const int fit_rmsd_threshold = 10; // px
-	int nx, ny, nn;
+// One patch for local alignment and its results
+struct MotioncorrPatch
+{
+	int x_start, x_end, y_start, y_end; // start inclusive, end exclusive
+	std::vector<RFLOAT> xshifts, yshifts; // per frame group
+	bool converged;
+	std::stringstream log;
+};
+
+bool MotioncorrRunner::readMovieHeader(MotioncorrMovie &movie, int n_io_threads)
+{
+	FileName fn_mic = movie.fn_mic;
+	std::stringstream &logfile = movie.log;
+	int &nx = movie.nx, &ny = movie.ny, &nn = movie.nn;
+
+	movie.isEER = EERRenderer::isEER(fn_mic);
+	movie.isCompressedMRC = movie.compressedMRCreader.isCompressedMRC(fn_mic);
+
+	logfile << "Working on " << fn_mic << " with " << n_threads << " thread(s)." << std::endl << std::endl;
+	if (n_io_threads < n_threads)
+		logfile << "Limitted the number of IO threads per movie to " << n_io_threads << " thread(s)." << std::endl;
 
 	// Check image size
-	if (isEER)
+	if (movie.isEER)
 	{
-		renderer.read(fn_mic, eer_upsampling);
-		nx = renderer.getWidth(); ny = renderer.getHeight();
-		nn = renderer.getNFrames() / eer_grouping; // remaining frames are truncated
+		movie.renderer.read(fn_mic, eer_upsampling);
+		nx = movie.renderer.getWidth(); ny = movie.renderer.getHeight();
+		nn = movie.renderer.getNFrames() / eer_grouping; // remaining frames are truncated
+
+		// Early binning by a power of two: count the electrons directly into the binned pixels
+		const int binning = ROUND(bin_factor);
+		if (early_binning && bin_factor == binning && (binning & (binning - 1)) == 0 &&
+		    nx % (2 * binning) == 0 && ny % (2 * binning) == 0)
+		{
+			movie.render_binning = binning;
+			logfile << "EER frames are rendered binned by " << binning << "." << std::endl;
+		}
 	}
-	else if (isCompressedMRC)
+	else if (movie.isCompressedMRC)
 	{
-		compressedMRCreader.read(fn_mic, n_io_threads);
-		nx = XSIZE(compressedMRCreader.Ihead()); ny = YSIZE(compressedMRCreader.Ihead());
-		nn = NSIZE(compressedMRCreader.Ihead());
+		movie.compressedMRCreader.read(fn_mic, n_io_threads);
+		nx = XSIZE(movie.compressedMRCreader.Ihead()); ny = YSIZE(movie.compressedMRCreader.Ihead());
+		nn = NSIZE(movie.compressedMRCreader.Ihead());
 	}
 	else
 	{
+		Image<float> Ihead;
 		Ihead.read(fn_mic, false, -1, false, true); // select_img -1, mmap false, is_2D true
 		nx = XSIZE(Ihead()); ny = YSIZE(Ihead()); nn = NSIZE(Ihead());
 	}
 
 	// Which frame to use?
+	std::vector<int> &frames = movie.frames;
 	logfile << "Movie size: X = " << nx << " Y = " << ny << " N = " << nn << std::endl;
 	logfile << "Frames to be used:";
 	for (int i = 0; i < nn; i++) {
@@ -1063,21 +1120,18 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	logfile << std::endl;
 
 	const int n_frames = frames.size();
-	Iframes.resize(n_frames);
-	Fframes.resize(n_frames);
-
-	std::vector<RFLOAT> xshifts(n_frames), yshifts(n_frames);
+	movie.nr_bytes = (size_t)n_frames * (nx / movie.render_binning) * (ny / movie.render_binning) * sizeof(float);
 
 	// Setup grouping
 	logfile << "Frame grouping: n_frames = " << n_frames << ", requested group size = " << group << std::endl;
-	const int n_groups = n_frames / group;
+	const int n_groups = movie.n_groups = n_frames / group;
 	if (n_groups < 3)
-	{
-		std::cerr << "Skipped " << fn_mic << ": too few frames (" << n_groups << " < 3) after grouping . Probably the movie is truncated or you made a mistake in frame grouping." << std::endl;
 		return false;
-	}
+
 	int n_remaining = n_frames % group;
-	std::vector<int> group_start(n_groups, 0), group_size(n_groups, group);
+	std::vector<int> &group_start = movie.group_start, &group_size = movie.group_size;
+	group_start.assign(n_groups, 0);
+	group_size.assign(n_groups, group);
 	while (n_remaining > 0) {
 		for (int i = n_groups - 1; i >= 1 && n_remaining > 0; i--) {
 			// Do not expand the first group, where the motion is largest.
@@ -1104,6 +1158,25 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	logfile << "interpolate_shifts = " << interpolate_shifts << std::endl;
 	logfile << std::endl;
 
+	movie.is_usable = true;
+	return true;
+}
+
+void MotioncorrRunner::readMovieFrames(MotioncorrMovie &movie, int n_io_threads)
+{
+	FileName fn_mic = movie.fn_mic;
+	std::stringstream &logfile = movie.log;
+	const int render_binning = movie.render_binning;
+	const int nx = movie.nx / render_binning, ny = movie.ny / render_binning; // size of the frames as read
+	const std::vector<int> &frames = movie.frames;
+	std::vector<Image<float> > &Iframes = movie.Iframes;
+	const bool isEER = movie.isEER, isCompressedMRC = movie.isCompressedMRC;
+	const int n_frames = frames.size();
+	Iframes.resize(n_frames);
+
+	const int hotpixel_sigma = 6;
+	Image<float> Igain;
+
 	// Read gain reference
 	RCTIC(TIMING_READ_GAIN);
 	if (fn_gain_reference != "") {
@@ -1112,23 +1185,79 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 		else
 			Igain.read(fn_gain_reference);
 
-		if (XSIZE(Igain()) != nx || YSIZE(Igain()) != ny) {
-			std::cerr << "fn_mic: " << fn_mic << " nx = " << nx << " ny = " << ny << " gain nx = " << XSIZE(Igain()) << " gain ny = " << YSIZE(Igain()) <<  std::endl;
+		if (XSIZE(Igain()) != movie.nx || YSIZE(Igain()) != movie.ny) {
+			std::cerr << "fn_mic: " << fn_mic << " nx = " << movie.nx << " ny = " << movie.ny << " gain nx = " << XSIZE(Igain()) << " gain ny = " << YSIZE(Igain()) <<  std::endl;
 			REPORT_ERROR("The size of the image and the size of the gain reference do not match. Make sure the gain reference has been rotated if necessary.");
 		}
+
+		if (render_binning > 1)
+			EERRenderer::binEERGain(Igain(), render_binning);
 	}
 	RCTOC(TIMING_READ_GAIN);
 
 	// Read images
 	RCTIC(TIMING_READ_MOVIE);
-	#pragma omp parallel for num_threads(isCompressedMRC ? 1 : n_io_threads)
-	for (int iframe = 0; iframe < n_frames; iframe++) {
-		if (isEER)
-			renderer.renderFrames(frames[iframe] * eer_grouping + 1, (frames[iframe] + 1) * eer_grouping, Iframes[iframe]());
-		else if (isCompressedMRC)
-			compressedMRCreader.readFrameInto(Iframes[iframe], frames[iframe]);
-		else
-			Iframes[iframe].read(fn_mic, true, frames[iframe], false, true); // mmap false, is_2D true
+	if (isCompressedMRC)
+	{
+		// The decompression pipe can only be read in order, but the frames can be converted in parallel
+		std::exception_ptr error;
+		#pragma omp parallel for ordered schedule(static, 1) num_threads(n_io_threads)
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			std::vector<char> raw;
+			#pragma omp ordered
+			{
+				try
+				{
+					if (!error)
+						movie.compressedMRCreader.readRawFrame(raw, frames[iframe]);
+				}
+				catch (...)
+				{
+					error = std::current_exception();
+				}
+			}
+			if (!raw.empty())
+				movie.compressedMRCreader.convertRawFrame(raw, Iframes[iframe]);
+		}
+		if (error)
+			std::rethrow_exception(error);
+	}
+	else if (fn_mic.getExtension().find("tif") != std::string::npos)
+	{
+		// Read the (compressed) file only once and decode the frames from memory,
+		// either the frames in parallel or, if that is faster, the strips of each frame.
+		std::vector<char> raw;
+		FILE *fh = fopen(fn_mic.c_str(), "rb");
+		if (fh == NULL)
+			REPORT_ERROR("Failed to open " + fn_mic);
+		fseek(fh, 0, SEEK_END);
+		raw.resize(ftell(fh));
+		fseek(fh, 0, SEEK_SET);
+		const bool read_ok = (fread(&raw[0], raw.size(), 1, fh) == 1);
+		fclose(fh);
+		if (!read_ok)
+			REPORT_ERROR("Failed to read " + fn_mic);
+
+		const int strip_threads = getTiffStripThreads(&raw[0], raw.size(), n_frames, n_io_threads);
+		#pragma omp parallel for num_threads(strip_threads > 1 ? 1 : n_io_threads)
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			Iframes[iframe].readTiffInMemory(&raw[0], raw.size(), true, frames[iframe], false, true, strip_threads);
+		}
+	}
+	else
+	{
+		#pragma omp parallel for num_threads(n_io_threads)
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			if (isEER)
+			{
+				movie.renderer.renderFrames(frames[iframe] * eer_grouping + 1, (frames[iframe] + 1) * eer_grouping, Iframes[iframe](), render_binning);
+				// Average, rather than sum, the binned pixels, as the binning in Fourier space does
+				if (render_binning > 1)
+					Iframes[iframe]() /= (float)(render_binning * render_binning);
+			}
+			else
+				Iframes[iframe].read(fn_mic, true, frames[iframe], false, true); // mmap false, is_2D true
+		}
 	}
 	RCTOC(TIMING_READ_MOVIE);
 
@@ -1177,7 +1306,19 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 
 		MultidimArray<bool> bBad(ny, nx);
 		bBad.initZeros();
-		if (fn_defect != "")
+		if (fn_defect != "" && render_binning > 1)
+		{
+			// The defects are given for the pixels of the movie; a binned pixel is bad if any of its pixels is
+			MultidimArray<bool> bBad_movie(movie.ny, movie.nx);
+			bBad_movie.initZeros();
+			fillDefectMask(bBad_movie, fn_defect, n_threads);
+			FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(bBad_movie)
+			{
+				if (DIRECT_A2D_ELEM(bBad_movie, i, j))
+					DIRECT_A2D_ELEM(bBad, i / render_binning, j / render_binning) = true;
+			}
+		}
+		else if (fn_defect != "")
 		{
 			fillDefectMask(bBad, fn_defect, n_threads);
 #ifdef DEBUG_HOTPIXELS
@@ -1204,8 +1345,15 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 			if (DIRECT_MULTIDIM_ELEM(Isum, n) > threshold && !DIRECT_MULTIDIM_ELEM(bBad, n)) {
 				DIRECT_MULTIDIM_ELEM(bBad, n) = true;
 				n_bad++;
-				mic.hotpixelX.push_back(n % nx);
-				mic.hotpixelY.push_back(n / nx);
+				// In the pixels of the movie, i.e. all pixels of a binned pixel
+				for (int dy = 0; dy < render_binning; dy++)
+				{
+					for (int dx = 0; dx < render_binning; dx++)
+					{
+						movie.hotpixelX.push_back((n % nx) * render_binning + dx);
+						movie.hotpixelY.push_back((n / nx) * render_binning + dy);
+					}
+				}
 			}
 		}
 		logfile << "Detected " << n_bad << " hot pixels to be corrected." << std::endl;
@@ -1256,6 +1404,172 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 		RCTOC(TIMING_FIX_DEFECT);
 		logfile << "Fixed hot pixels." << std::endl;
 	} // !skip_defect
+}
+
+void MotioncorrRunner::startMoviePrefetch(const std::vector<FileName> &fn_movies)
+{
+	if (!do_own || prefetch_movies <= 0 || prefetch_thread.joinable())
+		return;
+
+	prefetch_stop = false;
+	prefetched_bytes = 0;
+	prefetch_thread = std::thread(&MotioncorrRunner::prefetchMovies, this, fn_movies);
+}
+
+void MotioncorrRunner::stopMoviePrefetch()
+{
+	if (!prefetch_thread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(prefetch_mutex);
+		prefetch_stop = true;
+	}
+	prefetch_cond.notify_all();
+	prefetch_thread.join();
+
+	for (size_t i = 0; i < prefetched_movies.size(); i++)
+		delete prefetched_movies[i];
+	prefetched_movies.clear();
+	prefetched_bytes = 0;
+}
+
+void MotioncorrRunner::prefetchMovies(std::vector<FileName> fn_movies)
+{
+	const size_t max_bytes = (size_t)(prefetch_max_memory * 1024. * 1024. * 1024.);
+	int n_io_threads = n_threads;
+	if (max_io_threads > 0 && n_io_threads > max_io_threads)
+		n_io_threads = max_io_threads;
+
+	for (size_t imov = 0; imov < fn_movies.size(); imov++)
+	{
+		MotioncorrMovie *movie = new MotioncorrMovie(fn_movies[imov]);
+		bool do_read = false;
+		try
+		{
+			do_read = readMovieHeader(*movie, n_io_threads);
+		}
+		catch (...)
+		{
+			movie->error = std::current_exception();
+		}
+
+		// Wait until the movie fits in the queue. One movie is always allowed, even if it exceeds the memory limit.
+		{
+			std::unique_lock<std::mutex> lock(prefetch_mutex);
+			prefetch_cond.wait(lock, [&]{ return prefetch_stop ||
+				(prefetched_movies.size() < (size_t)prefetch_movies &&
+				 (prefetched_movies.empty() || max_bytes == 0 || prefetched_bytes + movie->nr_bytes <= max_bytes)); });
+			if (prefetch_stop)
+			{
+				delete movie;
+				return;
+			}
+			prefetched_movies.push_back(movie);
+			prefetched_bytes += movie->nr_bytes;
+		}
+
+		if (do_read)
+		{
+			try
+			{
+				readMovieFrames(*movie, n_io_threads);
+			}
+			catch (...)
+			{
+				movie->error = std::current_exception();
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(prefetch_mutex);
+			movie->is_read = true;
+		}
+		prefetch_cond.notify_all();
+	}
+}
+
+MotioncorrMovie* MotioncorrRunner::getPrefetchedMovie(FileName fn_mic)
+{
+	MotioncorrMovie *movie;
+	{
+		std::unique_lock<std::mutex> lock(prefetch_mutex);
+		prefetch_cond.wait(lock, [&]{ return !prefetched_movies.empty() && prefetched_movies.front()->is_read; });
+		movie = prefetched_movies.front();
+		prefetched_movies.pop_front();
+		prefetched_bytes -= movie->nr_bytes;
+	}
+	// Make room for the next movie
+	prefetch_cond.notify_all();
+
+	if (movie->fn_mic != fn_mic)
+	{
+		delete movie;
+		REPORT_ERROR("BUG: MotioncorrRunner::getPrefetchedMovie: movies are aligned in a different order than they were read");
+	}
+
+	return movie;
+}
+
+bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
+	FileName fn_mic = mic.getMovieFilename();
+	FileName fn_avg = getOutputFileNames(fn_mic);
+	FileName fn_avg_noDW = fn_avg.withoutExtension() + "_noDW.mrc";
+	FileName fn_log = fn_avg.withoutExtension() + ".log";
+	FileName fn_ps = fn_avg.withoutExtension() + "_PS.mrc";
+	std::ofstream logfile;
+	logfile.open(fn_log);
+
+	// Read the movie, unless the prefetch thread has done so already
+	std::unique_ptr<MotioncorrMovie> movie;
+	if (prefetch_thread.joinable())
+	{
+		movie.reset(getPrefetchedMovie(fn_mic));
+	}
+	else
+	{
+		int n_io_threads = n_threads;
+		if (max_io_threads > 0 && n_io_threads > max_io_threads)
+			n_io_threads = max_io_threads;
+
+		movie.reset(new MotioncorrMovie(fn_mic));
+		try
+		{
+			if (readMovieHeader(*movie, n_io_threads))
+				readMovieFrames(*movie, n_io_threads);
+		}
+		catch (...)
+		{
+			movie->error = std::current_exception();
+		}
+	}
+	logfile << movie->log.str();
+	if (movie->error)
+		std::rethrow_exception(movie->error);
+
+	if (!movie->is_usable)
+	{
+		std::cerr << "Skipped " << fn_mic << ": too few frames (" << movie->n_groups << " < 3) after grouping . Probably the movie is truncated or you made a mistake in frame grouping." << std::endl;
+		return false;
+	}
+	mic.hotpixelX.insert(mic.hotpixelX.end(), movie->hotpixelX.begin(), movie->hotpixelX.end());
+	mic.hotpixelY.insert(mic.hotpixelY.end(), movie->hotpixelY.begin(), movie->hotpixelY.end());
+
+	std::vector<Image<float> > &Iframes = movie->Iframes;
+	const std::vector<int> &frames = movie->frames;
+	std::vector<int> &group_start = movie->group_start, &group_size = movie->group_size;
+	const int n_frames = frames.size();
+	const int n_groups = movie->n_groups;
+	int nx = movie->nx, ny = movie->ny;
+
+	Image<float> Iref;
+	std::vector<MultidimArray<fComplex> > Fframes(n_frames);
+	std::vector<RFLOAT> xshifts(n_frames), yshifts(n_frames);
+
+	RFLOAT output_angpix = angpix * bin_factor;
+	RFLOAT prescaling = 1;
+
+	const int fit_rmsd_threshold = 10; // px
 
 //#define WRITE_FRAMES
 #ifdef WRITE_FRAMES
@@ -1281,7 +1595,7 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	RCTIC(TIMING_GLOBAL_FFT);
 	#pragma omp parallel for num_threads(n_threads)
 	for (int iframe = 0; iframe < n_frames; iframe++) {
-		if (!early_binning) {
+		if (!early_binning || movie->render_binning > 1) { // EER frames may have been rendered binned already
 			NewFFT::FourierTransform(Iframes[iframe](), Fframes[iframe]);
 		} else {
 			MultidimArray<fComplex> Fframe;
@@ -1426,11 +1740,10 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	if (do_local) {
 		const int patch_nx = nx / patch_x, patch_ny = ny / patch_y, n_patches = patch_x * patch_y;
 		std::vector<RFLOAT> patch_xshifts, patch_yshifts, patch_frames, patch_xs, patch_ys;
-		std::vector<MultidimArray<fComplex> > Fpatches(n_groups);
+		std::vector<MotioncorrPatch> patches(n_patches);
 
-		int ipatch = 1;
-		for (int iy = 0; iy < patch_y; iy++) {
-			for (int ix = 0; ix < patch_x; ix++) {
+		for (int iy = 0, ipatch = 0; iy < patch_y; iy++) {
+			for (int ix = 0; ix < patch_x; ix++, ipatch++) {
 				int x_start = ix * patch_nx, y_start = iy * patch_ny; // Inclusive
 				int x_end = x_start + patch_nx, y_end = y_start + patch_ny; // Exclusive
 				if (x_end > nx) x_end = nx;
@@ -1445,69 +1758,57 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 					else y_end--;
 				}
 
+				MotioncorrPatch &patch = patches[ipatch];
+				patch.x_start = x_start; patch.x_end = x_end;
+				patch.y_start = y_start; patch.y_end = y_end;
+
 				int x_center = (x_start + x_end - 1) / 2, y_center = (y_start + y_end - 1) / 2;
-				logfile << "Patch (" << iy + 1 << ", " << ix + 1 << "): " << ipatch << " / " << patch_x * patch_y;
-				logfile << ", X range = [" << x_start << ", " << x_end << "), Y range = [" << y_start << ", " << y_end << ")";
-				logfile << ", Center = (" << x_center << ", " << y_center << ")" << std::endl;
-				ipatch++;
-
-				std::vector<RFLOAT> local_xshifts(n_groups), local_yshifts(n_groups);
-				RCTIC(TIMING_PREP_PATCH);
-				std::vector<MultidimArray<float> >Ipatches(n_threads);
-				#pragma omp parallel for num_threads(n_threads)
-				for (int igroup = 0; igroup < n_groups; igroup++) {
-					const int tid = omp_get_thread_num();
-					Ipatches[tid].reshape(y_end - y_start, x_end - x_start); // end is not included
-					RCTIC(TIMING_CLIP_PATCH);
-					for (int iframe = group_start[igroup]; iframe < group_start[igroup] + group_size[igroup]; iframe++) {
-						for (int ipy = y_start; ipy < y_end; ipy++) {
-							for (int ipx = x_start; ipx < x_end; ipx++) {
-								DIRECT_A2D_ELEM(Ipatches[tid], ipy - y_start, ipx - x_start) = DIRECT_A2D_ELEM(Iframes[iframe](), ipy, ipx);
-							}
-						}
-					}
-					RCTOC(TIMING_CLIP_PATCH);
+				patch.log << "Patch (" << iy + 1 << ", " << ix + 1 << "): " << ipatch + 1 << " / " << patch_x * patch_y;
+				patch.log << ", X range = [" << x_start << ", " << x_end << "), Y range = [" << y_start << ", " << y_end << ")";
+				patch.log << ", Center = (" << x_center << ", " << y_center << ")" << std::endl;
+			}
+		}
 
-					RCTIC(TIMING_PATCH_FFT);
-					NewFFT::FourierTransform(Ipatches[tid], Fpatches[igroup]);
-					RCTOC(TIMING_PATCH_FFT);
+		RCTIC(TIMING_PATCH_ALIGN);
+		alignPatches(Iframes, group_start, group_size, bfactor / (prescaling * prescaling), patches);
+		RCTOC(TIMING_PATCH_ALIGN);
+
+		for (int ipatch = 0; ipatch < n_patches; ipatch++) {
+			MotioncorrPatch &patch = patches[ipatch];
+			logfile << patch.log.str();
+			if (!patch.converged) continue;
+
+			std::vector<RFLOAT> &local_xshifts = patch.xshifts, &local_yshifts = patch.yshifts;
+			const int x_center = (patch.x_start + patch.x_end - 1) / 2, y_center = (patch.y_start + patch.y_end - 1) / 2;
+
+			std::vector<RFLOAT> interpolated_xshifts(n_frames), interpolated_yshifts(n_frames);
+			interpolateShifts(group_start, group_size, local_xshifts, local_yshifts, n_frames, interpolated_xshifts, interpolated_yshifts);
+			if (interpolate_shifts) {
+				// Recenter to the first frame
+				for (int iframe = 0; iframe < n_frames; iframe++) {
+					interpolated_xshifts[iframe] -= interpolated_xshifts[0];
+					interpolated_yshifts[iframe] -= interpolated_yshifts[0];
 				}
-				RCTOC(TIMING_PREP_PATCH);
-
-				RCTIC(TIMING_PATCH_ALIGN);
-				bool converged = alignPatch(Fpatches, x_end - x_start, y_end - y_start, bfactor / (prescaling * prescaling), local_xshifts, local_yshifts, logfile);
-				RCTOC(TIMING_PATCH_ALIGN);
-				if (!converged) continue;
-
-				std::vector<RFLOAT> interpolated_xshifts(n_frames), interpolated_yshifts(n_frames);
-				interpolateShifts(group_start, group_size, local_xshifts, local_yshifts, n_frames, interpolated_xshifts, interpolated_yshifts);
-				if (interpolate_shifts) {
-					// Recenter to the first frame
-					for (int iframe = 0; iframe < n_frames; iframe++) {
-						interpolated_xshifts[iframe] -= interpolated_xshifts[0];
-						interpolated_yshifts[iframe] -= interpolated_yshifts[0];
-					}
-					// Store shifts
-					for (int iframe = 0; iframe < n_frames; iframe++) {
-						patch_xshifts.push_back(interpolated_xshifts[iframe]);
-						patch_yshifts.push_back(interpolated_yshifts[iframe]);
-						patch_frames.push_back(iframe);
-						patch_xs.push_back(x_center);
-						patch_ys.push_back(y_center);
-					}
-				} else { // only recenter to the center
-					for (int igroup = 0; igroup < n_groups; igroup++) {
-						patch_xshifts.push_back(local_xshifts[igroup] - interpolated_xshifts[0]);
-						patch_yshifts.push_back(local_yshifts[igroup] - interpolated_yshifts[0]);
-						RFLOAT middle_frame = group_start[igroup] + group_size[igroup] / 2.0;
-						patch_frames.push_back(middle_frame);
-						patch_xs.push_back(x_center);
-						patch_ys.push_back(y_center);
-					}
+				// Store shifts
+				for (int iframe = 0; iframe < n_frames; iframe++) {
+					patch_xshifts.push_back(interpolated_xshifts[iframe]);
+					patch_yshifts.push_back(interpolated_yshifts[iframe]);
+					patch_frames.push_back(iframe);
+					patch_xs.push_back(x_center);
+					patch_ys.push_back(y_center);
+				}
+			} else { // only recenter to the center
+				for (int igroup = 0; igroup < n_groups; igroup++) {
+					patch_xshifts.push_back(local_xshifts[igroup] - interpolated_xshifts[0]);
+					patch_yshifts.push_back(local_yshifts[igroup] - interpolated_yshifts[0]);
+					RFLOAT middle_frame = group_start[igroup] + group_size[igroup] / 2.0;
+					patch_frames.push_back(middle_frame);
+					patch_xs.push_back(x_center);
+					patch_ys.push_back(y_center);
 				}
 			}
 		}
-		Fpatches.clear();
+		patches.clear();
 
 		// Fit polynomial model
 
@@ -1898,28 +2199,14 @@ void MotioncorrRunner::realSpaceInterpolation_ThirdOrderPolynomial(Image <float>
 	}
 }
 
-bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes, const int pnx, const int pny, const RFLOAT scaled_B, std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile) {
-	std::vector<Image<float> > Iccs(n_threads);
-	MultidimArray<fComplex> Fref;
-	std::vector<MultidimArray<fComplex> > Fccs(n_threads);
-	MultidimArray<float> weight;
-	std::vector<RFLOAT> cur_xshifts, cur_yshifts;
-	bool converged = false;
-
-	// Parameters TODO: make an option
-	int search_range = 50; // px
-	const RFLOAT tolerance = 0.5; // px
-	const RFLOAT EPS = 1e-15;
-
-	// Shifts within an iteration
-	const int n_frames = xshifts.size();
-	cur_xshifts.resize(n_frames);
-	cur_yshifts.resize(n_frames);
-
+void MotioncorrRunner::prepareCCF(const int pnx, const int pny, const RFLOAT scaled_B, MotioncorrCCF &ccf) {
 	if (pny % 2 == 1 || pnx % 2 == 1) {
 		REPORT_ERROR("Patch size must be even");
 	}
 
+	// Parameters TODO: make an option
+	int search_range = 50; // px
+
 	// Calculate the size of down-sampled CCF
 	float ccf_requested_scale = ccf_downsample;
 	if (ccf_downsample <= 0) {
@@ -1938,14 +2225,14 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 	if (search_range * 2 + 1 > ccf_nx) search_range = ccf_nx / 2 - 1;
 	if (search_range * 2 + 1 > ccf_ny) search_range = ccf_ny / 2 - 1;
 
-	const int nfx = XSIZE(Fframes[0]), nfy = YSIZE(Fframes[0]);
-	const int nfy_half = nfy / 2;
+	const int nfx = pnx / 2 + 1, nfy = pny;
 
-	Fref.reshape(ccf_nfy, ccf_nfx);
-	for (int i = 0; i < n_threads; i++) {
-		Iccs[i]().reshape(ccf_ny, ccf_nx);
-		Fccs[i].reshape(Fref);
-	}
+	ccf.pnx = pnx; ccf.pny = pny;
+	ccf.nfx = nfx; ccf.nfy = nfy;
+	ccf.ccf_nx = ccf_nx; ccf.ccf_ny = ccf_ny;
+	ccf.ccf_nfx = ccf_nfx; ccf.ccf_nfy = ccf_nfy;
+	ccf.ccf_scale_x = ccf_scale_x; ccf.ccf_scale_y = ccf_scale_y;
+	ccf.search_range = search_range;
 
 #ifdef DEBUG
 	std::cout << "Patch Size X = " << pnx << " Y  = " << pny << std::endl;
@@ -1953,11 +2240,11 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 	std::cout << "Fccf X = " << ccf_nfx << " Y = " << ccf_nfy << std::endl;
 	std::cout << "CCF crop request = " << ccf_requested_scale << ", actual X = " << 1 / ccf_scale_x << " Y = " << 1 / ccf_scale_y << std::endl;
 	std::cout << "CCF search range = " << search_range << std::endl;
-	std::cout << "Trajectory size: " << xshifts.size() << std::endl;
 #endif
 
 	// Initialize B factor weight
-	weight.reshape(Fref);
+	MultidimArray<float> &weight = ccf.weight;
+	weight.reshape(ccf_nfy, ccf_nfx);
 	RCTIC(TIMING_PREP_WEIGHT);
 	#pragma omp parallel for num_threads(n_threads)
 	for (int y = 0; y < ccf_nfy; y++) {
@@ -1970,6 +2257,90 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 		}
 	}
 	RCTOC(TIMING_PREP_WEIGHT);
+}
+
+void MotioncorrRunner::findCCFPeak(const MultidimArray<float> &Iccf, const MotioncorrCCF &ccf, RFLOAT &shiftx, RFLOAT &shifty) {
+	const RFLOAT EPS = 1e-15;
+	const int ccf_nx = ccf.ccf_nx, ccf_ny = ccf.ccf_ny, search_range = ccf.search_range;
+
+	RFLOAT maxval = -1E30;
+	int posx = 0, posy = 0;
+	for (int y = -search_range; y <= search_range; y++) {
+		const int iy = (y < 0) ? ccf_ny + y : y;
+
+		for (int x = -search_range; x <= search_range; x++) {
+			const int ix = (x < 0) ? ccf_nx + x : x;
+			RFLOAT val = DIRECT_A2D_ELEM(Iccf, iy, ix);
+			if (val > maxval) {
+				posx = x; posy = y;
+				maxval = val;
+			}
+		}
+	}
+
+	int ipx_n = posx - 1, ipx = posx, ipx_p = posx + 1, ipy_n = posy - 1, ipy = posy, ipy_p = posy + 1;
+	if (ipx_n < 0) ipx_n = ccf_nx + ipx_n;
+	if (ipx < 0) ipx = ccf_nx + ipx;
+	if (ipx_p < 0) ipx_p = ccf_nx + ipx_p;
+	if (ipy_n < 0) ipy_n = ccf_ny + ipy_n;
+	if (ipy < 0) ipy = ccf_ny + ipy;
+	if (ipy_p < 0) ipy_p = ccf_ny + ipy_p;
+
+	// Quadratic interpolation by Jasenko
+	RFLOAT vp, vn;
+	vp = DIRECT_A2D_ELEM(Iccf, ipy, ipx_p);
+	vn = DIRECT_A2D_ELEM(Iccf, ipy, ipx_n);
+	if (std::abs(vp + vn - 2.0 * maxval) > EPS) {
+		shiftx = posx - 0.5 * (vp - vn) / (vp + vn - 2.0 * maxval);
+	} else {
+		shiftx = posx;
+	}
+
+	vp = DIRECT_A2D_ELEM(Iccf, ipy_p, ipx);
+	vn = DIRECT_A2D_ELEM(Iccf, ipy_n, ipx);
+	if (std::abs(vp + vn - 2.0 * maxval) > EPS) {
+		shifty = posy - 0.5 * (vp - vn) / (vp + vn - 2.0 * maxval);
+	} else {
+		shifty = posy;
+	}
+	shiftx *= ccf.ccf_scale_x;
+	shifty *= ccf.ccf_scale_y;
+#ifdef DEBUG_OWN
+	std::cout << "raw shift x = " << posx << " y = " << posy << " cc = " << maxval << " interpolated x = " << shiftx << " y = " << shifty << std::endl;
+#endif
+}
+
+bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes, const int pnx, const int pny, const RFLOAT scaled_B, std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile) {
+	std::vector<Image<float> > Iccs(n_threads);
+	MultidimArray<fComplex> Fref;
+	std::vector<MultidimArray<fComplex> > Fccs(n_threads);
+	std::vector<RFLOAT> cur_xshifts, cur_yshifts;
+	bool converged = false;
+
+	// Parameters TODO: make an option
+	const RFLOAT tolerance = 0.5; // px
+
+	// Shifts within an iteration
+	const int n_frames = xshifts.size();
+	cur_xshifts.resize(n_frames);
+	cur_yshifts.resize(n_frames);
+
+	MotioncorrCCF ccf;
+	prepareCCF(pnx, pny, scaled_B, ccf);
+	const int ccf_nx = ccf.ccf_nx, ccf_ny = ccf.ccf_ny, ccf_nfx = ccf.ccf_nfx, ccf_nfy = ccf.ccf_nfy;
+	const int ccf_nfy_half = ccf_ny / 2;
+	const MultidimArray<float> &weight = ccf.weight;
+
+	const int nfx = XSIZE(Fframes[0]), nfy = YSIZE(Fframes[0]);
+	if (nfx != ccf.nfx || nfy != ccf.nfy) {
+		REPORT_ERROR("Frame size does not match the patch size");
+	}
+
+	Fref.reshape(ccf_nfy, ccf_nfx);
+	for (int i = 0; i < n_threads; i++) {
+		Iccs[i]().reshape(ccf_ny, ccf_nx);
+		Fccs[i].reshape(Fref);
+	}
 
 	for (int iter = 1; iter	<= max_iter; iter++) {
 		RCTIC(TIMING_MAKE_REF);
@@ -2005,52 +2376,7 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 			RCTOC(TIMING_CCF_IFFT);
 
 			RCTIC(TIMING_CCF_FIND_MAX);
-			RFLOAT maxval = -1E30;
-			int posx = 0, posy = 0;
-			for (int y = -search_range; y <= search_range; y++) {
-				const int iy = (y < 0) ? ccf_ny + y : y;
-
-				for (int x = -search_range; x <= search_range; x++) {
-					const int ix = (x < 0) ? ccf_nx + x : x;
-					RFLOAT val = DIRECT_A2D_ELEM(Iccs[tid](), iy, ix);
-//					std::cout << "(x, y) = " << x << ", " << y << ", (ix, iy) = " << ix << " , " << iy << " val = " << val << std::endl;
-					if (val > maxval) {
-						posx = x; posy = y;
-						maxval = val;
-					}
-				}
-			}
-
-			int ipx_n = posx - 1, ipx = posx, ipx_p = posx + 1, ipy_n = posy - 1, ipy = posy, ipy_p = posy + 1;
-			if (ipx_n < 0) ipx_n = ccf_nx + ipx_n;
-			if (ipx < 0) ipx = ccf_nx + ipx;
-			if (ipx_p < 0) ipx_p = ccf_nx + ipx_p;
-			if (ipy_n < 0) ipy_n = ccf_ny + ipy_n;
-			if (ipy < 0) ipy = ccf_ny + ipy;
-			if (ipy_p < 0) ipy_p = ccf_ny + ipy_p;
-
-			// Quadratic interpolation by Jasenko
-			RFLOAT vp, vn;
-			vp = DIRECT_A2D_ELEM(Iccs[tid](), ipy, ipx_p);
-			vn = DIRECT_A2D_ELEM(Iccs[tid](), ipy, ipx_n);
- 			if (std::abs(vp + vn - 2.0 * maxval) > EPS) {
-				cur_xshifts[iframe] = posx - 0.5 * (vp - vn) / (vp + vn - 2.0 * maxval);
-			} else {
-				cur_xshifts[iframe] = posx;
-			}
-
-			vp = DIRECT_A2D_ELEM(Iccs[tid](), ipy_p, ipx);
-			vn = DIRECT_A2D_ELEM(Iccs[tid](), ipy_n, ipx);
- 			if (std::abs(vp + vn - 2.0 * maxval) > EPS) {
-				cur_yshifts[iframe] = posy - 0.5 * (vp - vn) / (vp + vn - 2.0 * maxval);
-			} else {
-				cur_yshifts[iframe] = posy;
-			}
-			cur_xshifts[iframe] *= ccf_scale_x;
-			cur_yshifts[iframe] *= ccf_scale_y;
-#ifdef DEBUG_OWN
-			std::cout << "tid " << tid << " Frame " << 1 + iframe << ": raw shift x = " << posx << " y = " << posy << " cc = " << maxval << " interpolated x = " << cur_xshifts[iframe] << " y = " << cur_yshifts[iframe] << std::endl;
-#endif
+			findCCFPeak(Iccs[tid](), ccf, cur_xshifts[iframe], cur_yshifts[iframe]);
 			RCTOC(TIMING_CCF_FIND_MAX);
 		}
 
@@ -2098,6 +2424,158 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 	return converged;
 }
 
+void MotioncorrRunner::alignPatches(std::vector<Image<float> > &Iframes, std::vector<int> &group_start, std::vector<int> &group_size,
+                                    const RFLOAT scaled_B, std::vector<MotioncorrPatch> &patches) {
+	const int n_patches = patches.size(), n_groups = group_start.size();
+
+	// Usually all patches have the same size, so the FFT plans and the B factor weight are made only once.
+	// The plans are used by all threads at the same time, which is safe for the execution of FFTW plans.
+	RCTIC(TIMING_PREP_PATCH);
+	std::vector<MotioncorrCCF> ccfs;
+	std::vector<NewFFT::FloatPlan> patch_plans, ccf_plans;
+	std::vector<int> patch_ccf(n_patches);
+	for (int ipatch = 0; ipatch < n_patches; ipatch++) {
+		const int pnx = patches[ipatch].x_end - patches[ipatch].x_start;
+		const int pny = patches[ipatch].y_end - patches[ipatch].y_start;
+
+		int iccf = 0;
+		while (iccf < (int)ccfs.size() && (ccfs[iccf].pnx != pnx || ccfs[iccf].pny != pny)) iccf++;
+		if (iccf == (int)ccfs.size()) {
+			ccfs.push_back(MotioncorrCCF());
+			prepareCCF(pnx, pny, scaled_B, ccfs.back());
+			patch_plans.push_back(NewFFT::FloatPlan(pnx, pny));
+			ccf_plans.push_back(NewFFT::FloatPlan(ccfs.back().ccf_nx, ccfs.back().ccf_ny));
+		}
+		patch_ccf[ipatch] = iccf;
+	}
+	RCTOC(TIMING_PREP_PATCH);
+
+	// Each thread aligns one patch at a time. This scales much better than
+	// spreading the (few and small) frames of a single patch over all threads.
+	std::exception_ptr error;
+	#pragma omp parallel num_threads(n_threads)
+	{
+		MultidimArray<float> Ipatch;
+		MultidimArray<fComplex> Fpatch, Fspectra;
+
+		#pragma omp for schedule(dynamic)
+		for (int ipatch = 0; ipatch < n_patches; ipatch++) {
+			try {
+				MotioncorrPatch &patch = patches[ipatch];
+				const MotioncorrCCF &ccf = ccfs[patch_ccf[ipatch]];
+				const int ccf_nfx = ccf.ccf_nfx, ccf_nfy = ccf.ccf_nfy, ccf_nfy_half = ccf.ccf_ny / 2;
+
+				// Only the frequencies within the down-sampled CCF are ever used,
+				// so the spectra of all frame groups are cropped into one contiguous array.
+				Ipatch.reshape(patch.y_end - patch.y_start, patch.x_end - patch.x_start);
+				Fspectra.reshape(n_groups, ccf_nfy, ccf_nfx);
+				for (int igroup = 0; igroup < n_groups; igroup++) {
+					RCTIC(TIMING_CLIP_PATCH);
+					for (int iframe = group_start[igroup]; iframe < group_start[igroup] + group_size[igroup]; iframe++) {
+						for (int ipy = patch.y_start; ipy < patch.y_end; ipy++) {
+							for (int ipx = patch.x_start; ipx < patch.x_end; ipx++) {
+								DIRECT_A2D_ELEM(Ipatch, ipy - patch.y_start, ipx - patch.x_start) = DIRECT_A2D_ELEM(Iframes[iframe](), ipy, ipx);
+							}
+						}
+					}
+					RCTOC(TIMING_CLIP_PATCH);
+
+					RCTIC(TIMING_PATCH_FFT);
+					NewFFT::FourierTransform(Ipatch, Fpatch, patch_plans[patch_ccf[ipatch]]);
+					RCTOC(TIMING_PATCH_FFT);
+
+					for (int y = 0; y < ccf_nfy; y++) {
+						const int ly = (y > ccf_nfy_half) ? (y - ccf_nfy + ccf.nfy) : y;
+						for (int x = 0; x < ccf_nfx; x++) {
+							DIRECT_A3D_ELEM(Fspectra, igroup, y, x) = DIRECT_A2D_ELEM(Fpatch, ly, x);
+						}
+					}
+				}
+
+				patch.xshifts.assign(n_groups, 0.);
+				patch.yshifts.assign(n_groups, 0.);
+				patch.converged = alignPatchSpectra(Fspectra, ccf, ccf_plans[patch_ccf[ipatch]], patch.xshifts, patch.yshifts, patch.log);
+			}
+			catch (...) {
+				#pragma omp critical(MotioncorrRunner_alignPatches)
+				error = std::current_exception();
+			}
+		}
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+bool MotioncorrRunner::alignPatchSpectra(MultidimArray<fComplex> &Fspectra, const MotioncorrCCF &ccf, const NewFFT::FloatPlan &ccf_plan,
+                                         std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile) {
+	// This does the same as alignPatch, but in a single thread and on spectra that have already been cropped to the CCF size.
+	const RFLOAT tolerance = 0.5; // px
+	const int n_frames = xshifts.size();
+	const int ccf_nfx = ccf.ccf_nfx, ccf_nfy = ccf.ccf_nfy;
+	const size_t ccf_nf = (size_t)ccf_nfx * ccf_nfy;
+	std::vector<RFLOAT> cur_xshifts(n_frames), cur_yshifts(n_frames);
+	MultidimArray<fComplex> Fref(ccf_nfy, ccf_nfx), Fccf(ccf_nfy, ccf_nfx);
+	MultidimArray<float> Iccf(ccf.ccf_ny, ccf.ccf_nx);
+	const float *weight = MULTIDIM_ARRAY(ccf.weight);
+	bool converged = false;
+
+	for (int iter = 1; iter <= max_iter; iter++) {
+		Fref.initZeros();
+		fComplex *ref = MULTIDIM_ARRAY(Fref);
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			const fComplex *frame = &DIRECT_A3D_ELEM(Fspectra, iframe, 0, 0);
+			for (size_t n = 0; n < ccf_nf; n++) {
+				ref[n] += frame[n];
+			}
+		}
+
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			const fComplex *frame = &DIRECT_A3D_ELEM(Fspectra, iframe, 0, 0);
+			fComplex *cc = MULTIDIM_ARRAY(Fccf);
+			for (size_t n = 0; n < ccf_nf; n++) {
+				cc[n] = (ref[n] - frame[n]) * frame[n].conj() * weight[n];
+			}
+
+			NewFFT::inverseFourierTransform(Fccf, Iccf, ccf_plan, NewFFT::FwdOnly, false);
+			findCCFPeak(Iccf, ccf, cur_xshifts[iframe], cur_yshifts[iframe]);
+		}
+
+		// Set origin
+		RFLOAT x_sumsq = 0, y_sumsq = 0;
+		for (int iframe = n_frames - 1; iframe >= 0; iframe--) { // do frame 0 last!
+			cur_xshifts[iframe] -= cur_xshifts[0];
+			cur_yshifts[iframe] -= cur_yshifts[0];
+			x_sumsq += cur_xshifts[iframe] * cur_xshifts[iframe];
+			y_sumsq += cur_yshifts[iframe] * cur_yshifts[iframe];
+		}
+		cur_xshifts[0] = 0; cur_yshifts[0] = 0;
+
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			xshifts[iframe] += cur_xshifts[iframe];
+			yshifts[iframe] += cur_yshifts[iframe];
+		}
+
+		// Apply shifts. The phases only depend on the frequency and the real space patch size,
+		// so the cropped spectra are shifted exactly as the full ones would be.
+		for (int iframe = 1; iframe < n_frames; iframe++) {
+			shiftNonSquareImageInFourierTransform(&DIRECT_A3D_ELEM(Fspectra, iframe, 0, 0), ccf_nfx, ccf_nfy,
+			                                      -cur_xshifts[iframe] / ccf.pnx, -cur_yshifts[iframe] / ccf.pny);
+		}
+
+		// Test convergence
+		RFLOAT rmsd = std::sqrt((x_sumsq + y_sumsq) / n_frames);
+		logfile << " Iteration " << iter << ": RMSD = " << rmsd << " px" << std::endl;
+
+		if (rmsd < tolerance) {
+			converged = true;
+			break;
+		}
+	}
+
+	return converged;
+}
+
 int MotioncorrRunner::findGoodSize(int request) {
 	// numbers that do not contain large prime numbers
 	const int good_numbers[] = {192, 216, 256, 288, 324,
@@ -2163,7 +2641,10 @@ void MotioncorrRunner::doseWeighting(std::vector<MultidimArray<fComplex> > &Ffra
 
 // shiftx, shifty is relative to the (real space) image size
 void MotioncorrRunner::shiftNonSquareImageInFourierTransform(MultidimArray<fComplex> &frame, RFLOAT shiftx, RFLOAT shifty) {
-	const int nfx = XSIZE(frame), nfy = YSIZE(frame);
+	shiftNonSquareImageInFourierTransform(MULTIDIM_ARRAY(frame), XSIZE(frame), YSIZE(frame), shiftx, shifty);
+}
+
+void MotioncorrRunner::shiftNonSquareImageInFourierTransform(fComplex *frame, const int nfx, const int nfy, RFLOAT shiftx, RFLOAT shifty) {
 	const int nfy_half = nfy / 2;
 	const RFLOAT twoPI = 2 * PI;
 
@@ -2210,12 +2691,13 @@ void MotioncorrRunner::shiftNonSquareImageInFourierTransform(MultidimArray<fComp
 			SINCOS(phase_shift, &b, &a);
 			#endif
 #endif
-			c = DIRECT_A2D_ELEM(frame, y, x).real;
-			d = DIRECT_A2D_ELEM(frame, y, x).imag;
+			fComplex &val = frame[(size_t)y * nfx + x];
+			c = val.real;
+			d = val.imag;
 			ac = a * c;
 			bd = b * d;
 			ab_cd = (a + b) * (c + d); // (ab_cd-ac-bd = ad+bc : but needs 4 multiplications)
-			DIRECT_A2D_ELEM(frame, y, x) = fComplex(ac - bd, ab_cd - ac - bd);
+			val = fComplex(ac - bd, ab_cd - ac - bd);
 		}
 	}
 }
@@ -27,11 +27,20 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <src/time.h>
 #include "src/metadata_table.h"
 #include "src/image.h"
 #include "src/micrograph_model.h"
 #include <src/jaz/single_particle/obs_model.h>
+#include <src/jaz/single_particle/new_ft.h>
+
+struct MotioncorrMovie;
+struct MotioncorrCCF;
+struct MotioncorrPatch;
 
 class MotioncorrRunner
 {
@@ -72,6 +81,10 @@ public:
 	// Maximum number of iterations
 	int max_iter;
 
+	// Number of movies to read ahead (in a background thread) while aligning the current one, and the memory they may take (in GB, 0 = no limit)
+	int prefetch_movies;
+	double prefetch_max_memory;
+
 	// Save aligned but non-dose weighted micrograph.
 	// With MOTIONCOR2, this flag is always assumed to be true
 	bool save_noDW;
@@ -152,6 +165,11 @@ public:
 	std::string gpu_ids;
 	std::vector < std::vector < std::string > > allThreadIDs;
 
+	~MotioncorrRunner()
+	{
+		stopMoviePrefetch();
+	}
+
 	// Read command line arguments
 	void read(int argc, char **argv, int rank = 0);
 
@@ -178,6 +196,11 @@ public:
 	// Execute our own implementation for a single micrograph
 	bool executeOwnMotionCorrection(Micrograph &mic);
 
+	// Start reading the movies for our own implementation in the background (only with prefetch_movies > 0).
+	// executeOwnMotionCorrection should then be called for the same movies, in the same order.
+	void startMoviePrefetch(const std::vector<FileName> &fn_movies);
+	void stopMoviePrefetch();
+
 	// Plot the shifts
 	void plotShifts(FileName fn_mic, Micrograph &mic);
 
@@ -197,11 +220,46 @@ public:
 	static bool detectSerialEMDefectText(FileName fn_defect);
 
 private:
+	// Background reading of movies for our own implementation
+	std::thread prefetch_thread;
+	std::mutex prefetch_mutex;
+	std::condition_variable prefetch_cond;
+	std::deque<MotioncorrMovie*> prefetched_movies;
+	size_t prefetched_bytes;
+	bool prefetch_stop;
+
+	void prefetchMovies(std::vector<FileName> fn_movies);
+
+	// Wait for the oldest prefetched movie, which must be fn_mic. The caller owns the result.
+	MotioncorrMovie* getPrefetchedMovie(FileName fn_mic);
+
+	// Read the header of a movie and decide on its frames and frame groups. Returns false if there are too few frames.
+	bool readMovieHeader(MotioncorrMovie &movie, int n_io_threads);
+
+	// Read all frames of a movie, apply the gain reference and fix hot pixels and defects
+	void readMovieFrames(MotioncorrMovie &movie, int n_io_threads);
+
 	// shiftx, shifty is relative to the (real space) image size
 	void shiftNonSquareImageInFourierTransform(MultidimArray<fComplex> &frame, RFLOAT shiftx, RFLOAT shifty);
+	void shiftNonSquareImageInFourierTransform(fComplex *frame, const int nfx, const int nfy, RFLOAT shiftx, RFLOAT shifty);
+
+	// Decide on the size of the down-sampled CCF and calculate the B factor weight for a patch of pnx x pny pixels
+	void prepareCCF(const int pnx, const int pny, const RFLOAT scaled_B, MotioncorrCCF &ccf);
 
+	// Find the (interpolated) maximum of the CCF within the search range, in pixels of the patch
+	void findCCFPeak(const MultidimArray<float> &Iccf, const MotioncorrCCF &ccf, RFLOAT &shiftx, RFLOAT &shifty);
+
+	// Align frames of a single patch (or the whole movie), using all threads
 	bool alignPatch(std::vector<MultidimArray<fComplex> > &Fframes, const int pnx, const int pny, const RFLOAT scaled_B, std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile);
 
+	// Align all patches of a movie, one patch per thread
+	void alignPatches(std::vector<Image<float> > &Iframes, std::vector<int> &group_start, std::vector<int> &group_size,
+	                  const RFLOAT scaled_B, std::vector<MotioncorrPatch> &patches);
+
+	// Single-threaded alignment of frame spectra that were cropped to the CCF size (n_frames x ccf_nfy x ccf_nfx)
+	bool alignPatchSpectra(MultidimArray<fComplex> &Fspectra, const MotioncorrCCF &ccf, const NewFFT::FloatPlan &ccf_plan,
+	                       std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile);
+
 	void binNonSquareImage(Image<float> &Iwork, RFLOAT bin_factor);
 
 	int findGoodSize(int request);
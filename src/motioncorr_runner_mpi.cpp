@@ -58,6 +58,10 @@ void MotioncorrRunnerMpi::run()
 		barstep = XMIPP_MAX(1, my_nr_micrographs / 60);
 	}
 
+	if (my_nr_micrographs > 0)
+		startMoviePrefetch(std::vector<FileName>(fn_micrographs.begin() + my_first_micrograph,
+		                                         fn_micrographs.begin() + my_last_micrograph + 1));
+
 	for (long int imic = my_first_micrograph; imic <= my_last_micrograph; imic++)
 	{
 		if (verb > 0 && imic % barstep == 0)
@@ -86,6 +90,8 @@ void MotioncorrRunnerMpi::run()
 			plotShifts(fn_micrographs[imic], mic);
 		}
 	}
+	stopMoviePrefetch();
+
 	if (verb > 0)
 		progress_bar(my_nr_micrographs);
 
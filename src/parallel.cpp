@@ -42,6 +42,7 @@
  *  e-mail address 'xmipp@cnb.csic.es'
  ***************************************************************************/
 #include "src/parallel.h"
+#include "src/macros.h"
 
 // ================= MUTEX ==========================
 Mutex::Mutex()
@@ -152,6 +153,173 @@ bool ThreadTaskDistributor::distribute(size_t &first, size_t &last)
     return result;
 }
 
+// =================== WORK-STEALING TASK DISTRIBUTOR ============================
+
+WorkStealingTaskDistributor::WorkStealingTaskDistributor(int _nThreads)
+{
+	if (_nThreads < 1)
+		REPORT_ERROR("WorkStealingTaskDistributor: nThreads should be > 0");
+
+	nThreads = _nThreads;
+	deques = new Deque[nThreads];
+	for (int t = 0; t < nThreads; t++)
+	{
+		omp_init_lock(&deques[t].lock);
+		deques[t].residue = t;
+		deques[t].head = deques[t].tail = 0;
+		deques[t].has_task = false;
+	}
+	resetTimes();
+}
+
+WorkStealingTaskDistributor::~WorkStealingTaskDistributor()
+{
+	for (int t = 0; t < nThreads; t++)
+		omp_destroy_lock(&deques[t].lock);
+	delete [] deques;
+}
+
+void WorkStealingTaskDistributor::reset(size_t nTasks)
+{
+	double now = omp_get_wtime();
+	for (int t = 0; t < nThreads; t++)
+	{
+		Deque &d = deques[t];
+		omp_set_lock(&d.lock);
+		d.residue = t;
+		d.head = 0;
+		// Number of tasks with this residue
+		d.tail = (nTasks > (size_t)t) ? (nTasks - t + nThreads - 1) / nThreads : 0;
+		d.has_task = false;
+		d.t_last = now;
+		omp_unset_lock(&d.lock);
+	}
+}
+
+bool WorkStealingTaskDistributor::getTasks(int thread_id, size_t &first, size_t &last)
+{
+	Deque &d = deques[thread_id];
+	double now = omp_get_wtime();
+	if (d.has_task)
+		d.busy += now - d.t_last;
+	else
+		d.idle += now - d.t_last;
+	d.t_last = now;
+
+	while (true)
+	{
+		omp_set_lock(&d.lock);
+		if (d.head < d.tail)
+		{
+			first = last = d.head * nThreads + d.residue;
+			d.head++;
+			omp_unset_lock(&d.lock);
+			d.has_task = true;
+			return true;
+		}
+		omp_unset_lock(&d.lock);
+
+		if (!steal(thread_id))
+			break;
+	}
+
+	d.has_task = false;
+	first = last = 0;
+	return false;
+}
+
+bool WorkStealingTaskDistributor::steal(int thread_id)
+{
+	// Only one lock is held at any time, so threads cannot deadlock on each other
+	while (true)
+	{
+		// Pick the deque with most tasks left (it may have changed by the time it is locked again below)
+		int victim = -1;
+		size_t most = 0;
+		for (int t = 0; t < nThreads; t++)
+		{
+			if (t == thread_id)
+				continue;
+			omp_set_lock(&deques[t].lock);
+			size_t left = (deques[t].tail > deques[t].head) ? deques[t].tail - deques[t].head : 0;
+			omp_unset_lock(&deques[t].lock);
+			if (left > most)
+			{
+				most = left;
+				victim = t;
+			}
+		}
+		if (victim < 0)
+			return false;
+
+		Deque &v = deques[victim];
+		size_t residue, head, tail;
+		omp_set_lock(&v.lock);
+		if (v.head >= v.tail)
+		{
+			// Someone else got there first
+			omp_unset_lock(&v.lock);
+			continue;
+		}
+		// Take the back half (at least one task)
+		tail = v.tail;
+		head = v.head + (v.tail - v.head) / 2;
+		v.tail = head;
+		residue = v.residue;
+		omp_unset_lock(&v.lock);
+
+		Deque &d = deques[thread_id];
+		omp_set_lock(&d.lock);
+		d.residue = residue;
+		d.head = head;
+		d.tail = tail;
+		d.nr_steals++;
+		omp_unset_lock(&d.lock);
+		return true;
+	}
+}
+
+void WorkStealingTaskDistributor::finish()
+{
+	// Threads that ran out of tasks early have been idle until the last one finished
+	double t_end = 0.;
+	for (int t = 0; t < nThreads; t++)
+		t_end = XMIPP_MAX(t_end, deques[t].t_last);
+	for (int t = 0; t < nThreads; t++)
+	{
+		deques[t].idle += t_end - deques[t].t_last;
+		deques[t].t_last = t_end;
+	}
+}
+
+size_t WorkStealingTaskDistributor::getNrSteals() const
+{
+	size_t sum = 0;
+	for (int t = 0; t < nThreads; t++)
+		sum += deques[t].nr_steals;
+	return sum;
+}
+
+double WorkStealingTaskDistributor::getBusyTime(int thread_id) const
+{
+	return deques[thread_id].busy;
+}
+
+double WorkStealingTaskDistributor::getIdleTime(int thread_id) const
+{
+	return deques[thread_id].idle;
+}
+
+void WorkStealingTaskDistributor::resetTimes()
+{
+	for (int t = 0; t < nThreads; t++)
+	{
+		deques[t].busy = deques[t].idle = 0.;
+		deques[t].nr_steals = 0;
+		deques[t].t_last = omp_get_wtime();
+	}
+}
+
 /** Divides a number into most equally groups */
 long int divide_equally(long int N, int size, int rank, long int &first, long int &last)
 {
@@ -197,6 +197,62 @@ protected:
     virtual bool distribute(size_t &first, size_t &last);
 };//end of class ThreadTaskDistributor
 
+/** Work-stealing distribution of N tasks between a fixed number of threads.
+ * Each thread owns a deque of tasks: thread t starts with tasks t, t+nThreads, t+2*nThreads, ...
+ * (so that all threads together still work through the tasks roughly in order).
+ * A thread takes tasks from the front of its own deque, and once that is empty,
+ * it steals the back half of the deque with most tasks left.
+ * This keeps all threads busy when the cost per task varies a lot.
+ *
+ * The time each thread spends on tasks (busy) and waits for the others to finish
+ * (idle) is accumulated over all calls to reset(), until resetTimes() is called.
+ */
+class WorkStealingTaskDistributor
+{
+public:
+    WorkStealingTaskDistributor(int nThreads);
+    ~WorkStealingTaskDistributor();
+
+    /** Distribute tasks 0 ... nTasks-1. Should only be called in the main thread, before the workers start. */
+    void reset(size_t nTasks);
+
+    /** Gets the next task for this thread (first == last). False = no more tasks. */
+    bool getTasks(int thread_id, size_t &first, size_t &last);
+
+    /** Account the idle time at the end of the current set of tasks.
+     * Should be called in the main thread, after all workers have finished.
+     */
+    void finish();
+
+    /** Number of tasks taken from other threads since resetTimes() */
+    size_t getNrSteals() const;
+
+    /** Seconds this thread spent on tasks, and waiting for other threads to finish, since resetTimes() */
+    double getBusyTime(int thread_id) const;
+    double getIdleTime(int thread_id) const;
+    void resetTimes();
+
+private:
+    // Tasks slot*nThreads + residue, for slot in [head, tail); padded to avoid false sharing
+    struct Deque
+    {
+        omp_lock_t lock;
+        size_t residue, head, tail;
+        double t_last, busy, idle;
+        size_t nr_steals;
+        bool has_task;
+        char padding[64];
+    };
+
+    int nThreads;
+    Deque *deques;
+
+    bool steal(int thread_id);
+
+    WorkStealingTaskDistributor(const WorkStealingTaskDistributor&);
+    WorkStealingTaskDistributor& operator=(const WorkStealingTaskDistributor&);
+};//end of class WorkStealingTaskDistributor
+
 /// @name Miscellaneous functions
 //@{
 /** Divides a number into most equally groups
@@ -18,7 +18,9 @@
  * author citations must be preserved.
  ***************************************************************************/
 
+#include <exception>
 #include "src/particle_subtractor.h"
+#include "src/image_prefetcher.h"
 
 void ParticleSubtractor::read(int argc, char **argv)
 {
@@ -32,6 +34,8 @@ void ParticleSubtractor::read(int argc, char **argv)
 	fn_revert = parser.getOption("--revert", "Name of particle STAR file to revert. When this is provided, all other options are ignored.", "");
 	do_ssnr = parser.checkOption("--ssnr", "Don't subtract, only calculate average spectral SNR in the images");
 	write_float16  = parser.checkOption("--float16", "Write in half-precision 16 bit floating point numbers (MRC mode 12), instead of 32 bit (MRC mode 0).");
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to subtract particles with", "1"));
+	batch_size = textToInteger(parser.getOption("--batch_size", "Number of particles to read, subtract and write out together (default: 64 per thread for 2D, 1 per thread for 3D)", "-1"));
 
 	int center_section = parser.addSection("Centering options");
 	do_recenter_on_mask = parser.checkOption("--recenter_on_mask", "Use this flag to center the subtracted particles on projections of the centre-of-mass of the input mask");
@@ -301,7 +305,6 @@ void ParticleSubtractor::run()
 {
 
 	long int nr_parts = my_last_part_id - my_first_part_id + 1;
-	long int barstep = XMIPP_MAX(1, nr_parts/120);
 	if (verb > 0)
 	{
 		if (do_ssnr) std::cout << " + Calculating SNR for all particles ..." << std::endl;
@@ -311,21 +314,76 @@ void ParticleSubtractor::run()
 	}
 
 	MDimg_out.clear();
-	//for (long int part_id_sorted = my_first_part_id, cc = 0; part_id_sorted <= my_last_part_id; part_id_sorted++, cc++)
-	for (long int part_id_sorted = my_first_part_id, cc = 0; part_id_sorted <= my_last_part_id; part_id_sorted++, cc++)
+
+	// subtractOneImage sets these from multiple threads: make sure they are not added to MDimg in the meantime
+	opt.mydata.MDimg.addLabel(EMDL_ORIENT_ROT);
+	opt.mydata.MDimg.addLabel(EMDL_ORIENT_TILT);
+	opt.mydata.MDimg.addLabel(EMDL_ORIENT_PSI);
+	opt.mydata.MDimg.addLabel(EMDL_ORIENT_ORIGIN_X_ANGSTROM);
+	opt.mydata.MDimg.addLabel(EMDL_ORIENT_ORIGIN_Y_ANGSTROM);
+	if (opt.mymodel.data_dim == 3) opt.mydata.MDimg.addLabel(EMDL_ORIENT_ORIGIN_Z_ANGSTROM);
+
+	// Subtomograms are big: only keep one per thread in memory
+	long int my_batch_size = batch_size;
+	if (my_batch_size < 1)
+		my_batch_size = (opt.mymodel.data_dim == 3) ? nr_threads : 64 * nr_threads;
+	long int nr_batches = (nr_parts + my_batch_size - 1) / my_batch_size;
+
+	// Read the images of the next batch while this one is being subtracted
+	ImagePrefetcher prefetcher(1);
+	for (long int ibatch = 0; ibatch < nr_batches; ibatch++)
 	{
+		if (pipeline_control_check_abort_job())
+			exit(RELION_EXIT_ABORTED);
+
+		for (long int jbatch = ibatch; jbatch <= ibatch + 1 && jbatch < nr_batches; jbatch++)
+		{
+			if (prefetcher.isQueued(jbatch)) continue;
+
+			std::vector<FileName> fn_imgs;
+			long int first = my_first_part_id + jbatch * my_batch_size;
+			long int last = XMIPP_MIN(first + my_batch_size - 1, my_last_part_id);
+			for (long int part_id_sorted = first; part_id_sorted <= last; part_id_sorted++)
+				fn_imgs.push_back(opt.mydata.particles[opt.mydata.sorted_idx[part_id_sorted]].images[0].name);
+			prefetcher.push(jbatch, fn_imgs);
+		}
+
+		long int first_cc = ibatch * my_batch_size;
+		long int my_nr_parts = XMIPP_MIN(my_batch_size, nr_parts - first_cc);
+		std::vector<long int> part_ids(my_nr_parts);
+		for (long int i = 0; i < my_nr_parts; i++)
+			part_ids[i] = opt.mydata.sorted_idx[my_first_part_id + first_cc + i];
 
-		//long int part_id = opt.mydata.sorted_idx[part_id_sorted];
-		if (cc % barstep == 0)
+		// All threads project from the same (read-only) references in opt.mymodel.PPref
+		std::vector<MultidimArray<RFLOAT> > imgs(my_nr_parts);
+		std::exception_ptr error;
+		#pragma omp parallel num_threads(nr_threads)
 		{
-			if (pipeline_control_check_abort_job())
-				exit(RELION_EXIT_ABORTED);
+			FourierTransformer transformer;
+
+			#pragma omp for schedule(dynamic)
+			for (long int i = 0; i < my_nr_parts; i++)
+			{
+				try
+				{
+					imgs[i] = prefetcher.get(i);
+					subtractOneImage(part_ids[i], imgs[i], transformer);
+				}
+				catch (...)
+				{
+					#pragma omp critical(ParticleSubtractor_error)
+					error = std::current_exception();
+				}
+			}
 		}
+		prefetcher.release();
+		if (error)
+			std::rethrow_exception(error);
 
-		long int part_id = opt.mydata.sorted_idx[part_id_sorted];
-		subtractOneParticle(part_id, 0, cc);
+		if (!do_ssnr)
+			writeSubtractedImages(part_ids, first_cc, imgs);
 
-		if (cc % barstep == 0 && verb > 0) progress_bar(cc);
+		if (verb > 0) progress_bar(first_cc + my_nr_parts);
 	}
 
 	if (verb > 0) progress_bar(nr_parts);
@@ -460,14 +518,10 @@ FileName ParticleSubtractor::getParticleName(long int imgno, int myrank, int opt
 	return fn_img;
 }
 
-void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, long int counter)
+void ParticleSubtractor::subtractOneImage(long int part_id, MultidimArray<RFLOAT> &img, FourierTransformer &transformer)
 {
-	// Read the particle image
-	Image<RFLOAT> img;
-	long int ori_img_id = opt.mydata.particles[part_id].images[imgno].id;
+	long int ori_img_id = opt.mydata.particles[part_id].images[0].id;
 	int optics_group = opt.mydata.getOpticsGroup(part_id, 0);
-	img.read(opt.mydata.particles[part_id].images[0].name);
-	img().setXmippOrigin();
 
 	// Make sure gold-standard is adhered to!
 	int my_subset = (rank % 2 == 1) ? 1 : 2;
@@ -479,7 +533,7 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 
 	// Get the consensus class, orientational parameters and norm (if present)
 	RFLOAT my_pixel_size = opt.mydata.getImagePixelSize(part_id, 0);
-	RFLOAT remap_image_sizes = (opt.mymodel.ori_size * opt.mymodel.pixel_size) / (XSIZE(img()) * my_pixel_size);
+	RFLOAT remap_image_sizes = (opt.mymodel.ori_size * opt.mymodel.pixel_size) / (XSIZE(img) * my_pixel_size);
 	Matrix1D<RFLOAT> my_old_offset(3), my_residual_offset(3), centering_offset(3);
 	Matrix2D<RFLOAT> Aori;
 	RFLOAT rot, tilt, psi, xoff, yoff, zoff, mynorm, scale;
@@ -505,7 +559,7 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 
 	// Apply the norm_correction term
 	if (!opt.mydata.MDimg.getValue(EMDL_IMAGE_NORM_CORRECTION, mynorm, ori_img_id)) mynorm = 1.;
-	if (opt.do_norm_correction) img() *= opt.mymodel.avg_norm_correction / mynorm;
+	if (opt.do_norm_correction) img *= opt.mymodel.avg_norm_correction / mynorm;
 
 	Matrix1D<RFLOAT> my_projected_com(3), my_refined_ibody_offset(3);
 	if (opt.fn_body_masks != "None")
@@ -520,7 +574,7 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 		my_residual_offset = my_old_offset;
 		// Apply the old_offset (rounded to avoid interpolation errors)
 		my_old_offset.selfROUND();
-		selfTranslate(img(), my_old_offset, WRAP);
+		selfTranslate(img, my_old_offset, WRAP);
 		// keep track of the differences between the rounded and the original offsets
 		my_residual_offset -= my_old_offset;
 
@@ -529,8 +583,7 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 	// Now that the particle is centered (for multibody), get the FourierTransform of the particle
 	MultidimArray<Complex> Faux, Fimg;
 	MultidimArray<RFLOAT> Fctf;
-	FourierTransformer transformer;
-	transformer.FourierTransform(img(), Fimg);
+	transformer.FourierTransform(img, Fimg);
 	CenterFFTbySign(Fimg);
 	Fctf.resize(Fimg);
 	bool ctf_premultiplied = opt.mydata.obsModel.getCtfPremultiplied(optics_group);
@@ -598,7 +651,7 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 		{
 			CTF ctf;
 			ctf.readByGroup(opt.mydata.MDimg, &opt.mydata.obsModel, ori_img_id);
-			ctf.getFftwImage(Fctf, XSIZE(img()), YSIZE(img()), my_pixel_size,
+			ctf.getFftwImage(Fctf, XSIZE(img), YSIZE(img), my_pixel_size,
 					opt.ctf_phase_flipped, false, opt.intact_ctf_first_peak, true);
 
 			if (ctf_premultiplied)
@@ -666,7 +719,7 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 			// Subtract the projected COM already applied to this image for ibody
 			other_projected_com -= my_projected_com;
 
-			shiftImageInFourierTransform(FTo, Faux, (RFLOAT)XSIZE(img()),
+			shiftImageInFourierTransform(FTo, Faux, (RFLOAT)XSIZE(img),
 					XX(other_projected_com), YY(other_projected_com), ZZ(other_projected_com));
 
 			// Sum the Fourier transforms of all the obodies
@@ -711,7 +764,7 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 		opt.mymodel.PPref[myclass].get2DFourierTransform(Fsubtract, A3D);
 
 		// Shift in opposite direction as offsets in the STAR file
-		shiftImageInFourierTransform(Fsubtract, Fsubtract, (RFLOAT)XSIZE(img()),
+		shiftImageInFourierTransform(Fsubtract, Fsubtract, (RFLOAT)XSIZE(img),
 				-XX(my_old_offset), -YY(my_old_offset), -ZZ(my_old_offset));
 
 		if (do_center)
@@ -753,6 +806,11 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 	{
 		// Don't write out subtracted image,
 		// only accumulate power of the signal (in Fsubtract) divided by the power of the noise (now in Fimg)
+		// Sum locally first, as other threads may be accumulating as well
+		MultidimArray<RFLOAT> my_S2, my_N2, my_count;
+		my_S2.initZeros(sum_S2);
+		my_N2.initZeros(sum_N2);
+		my_count.initZeros(sum_count);
 		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Fimg)
 		{
 			long int idx = ROUND(sqrt(kp*kp + ip*ip + jp*jp));
@@ -763,17 +821,24 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 				RFLOAT N2 = norm( dAkij(Fimg, k, i, j) );
 				// division by two keeps the numbers similar to tau2 and sigma2_noise,
 				// which are per real/imaginary component
-				sum_S2(idx_remapped) += S2 / 2.;
-				sum_N2(idx_remapped) += N2 / 2.;
-				sum_count(idx_remapped) += 1.;
+				my_S2(idx_remapped) += S2 / 2.;
+				my_N2(idx_remapped) += N2 / 2.;
+				my_count(idx_remapped) += 1.;
 			}
 		}
+
+		#pragma omp critical(ParticleSubtractor_ssnr)
+		{
+			sum_S2 += my_S2;
+			sum_N2 += my_N2;
+			sum_count += my_count;
+		}
 	}
 	else
 	{
 		// And go finally back to real-space
 		CenterFFTbySign(Fimg);
-		transformer.inverseFourierTransform(Fimg, img());
+		transformer.inverseFourierTransform(Fimg, img);
 
 		if (do_center || opt.fn_body_masks != "None")
 		{
@@ -781,7 +846,7 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 			centering_offset = my_residual_offset;
 			centering_offset.selfROUND();
 			my_residual_offset -= centering_offset;
-			selfTranslate(img(), centering_offset, WRAP);
+			selfTranslate(img, centering_offset, WRAP);
 
 			// Set the non-integer difference between the rounded centering offset and the actual offsets in the STAR file
 			opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_X_ANGSTROM, my_pixel_size * XX(my_residual_offset), ori_img_id);
@@ -795,39 +860,85 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 		// Rebox the image
 		if (boxsize > 0)
 		{
-			if (img().getDim() == 2)
+			if (img.getDim() == 2)
 			{
-				img().window(FIRST_XMIPP_INDEX(boxsize), FIRST_XMIPP_INDEX(boxsize),
+				img.window(FIRST_XMIPP_INDEX(boxsize), FIRST_XMIPP_INDEX(boxsize),
 						   LAST_XMIPP_INDEX(boxsize),  LAST_XMIPP_INDEX(boxsize));
 			}
-			else if (img().getDim() == 3)
+			else if (img.getDim() == 3)
 			{
-				img().window(FIRST_XMIPP_INDEX(boxsize), FIRST_XMIPP_INDEX(boxsize), FIRST_XMIPP_INDEX(boxsize),
+				img.window(FIRST_XMIPP_INDEX(boxsize), FIRST_XMIPP_INDEX(boxsize), FIRST_XMIPP_INDEX(boxsize),
 						   LAST_XMIPP_INDEX(boxsize),  LAST_XMIPP_INDEX(boxsize),  LAST_XMIPP_INDEX(boxsize));
 			}
 		}
+	}
+}
 
-		// Now write out the image & set filenames in output metadatatable
-		FileName fn_img = getParticleName(counter, rank, optics_group);
-		opt.mydata.MDimg.setValue(EMDL_IMAGE_NAME, fn_img, ori_img_id);
+void ParticleSubtractor::writeSubtractedImages(const std::vector<long int> &part_ids, long int first_counter,
+                                               std::vector<MultidimArray<RFLOAT> > &imgs)
+{
+	// Set filenames in output metadatatable, in the order of the particles
+	std::vector<FileName> fn_imgs(part_ids.size());
+	for (size_t i = 0; i < part_ids.size(); i++)
+	{
+		long int part_id = part_ids[i];
+		long int ori_img_id = opt.mydata.particles[part_id].images[0].id;
+		int optics_group = opt.mydata.getOpticsGroup(part_id, 0);
+
+		fn_imgs[i] = getParticleName(first_counter + i, rank, optics_group);
+		opt.mydata.MDimg.setValue(EMDL_IMAGE_NAME, fn_imgs[i], ori_img_id);
 		opt.mydata.MDimg.setValue(EMDL_IMAGE_ORI_NAME, opt.mydata.particles[part_id].images[0].name, ori_img_id);
 		//Also set the original order in the input STAR file for later combination
 		opt.mydata.MDimg.setValue(EMDL_IMAGE_ID, ori_img_id, ori_img_id);
 		MDimg_out.addObject();
 		MDimg_out.setObject(opt.mydata.MDimg.getObject(ori_img_id));
+	}
 
-		//printf("Writing: fn_orig = %s counter = %ld rank = %d optics_group = %d fn_img = %s SIZE = %d nr_particles_in_optics_group[optics_group] = %d\n", fn_orig.c_str(), counter, rank, optics_group+1, fn_img.c_str(), XSIZE(img()), nr_particles_in_optics_group[optics_group]);
-		img.setSamplingRateInHeader(my_pixel_size);
-		if (opt.mymodel.data_dim == 3)
+	DataType datatype = write_float16 ? Float16: Float;
+	if (opt.mymodel.data_dim == 3)
+	{
+		// Every subtomogram goes into its own file
+		for (size_t i = 0; i < part_ids.size(); i++)
 		{
-			img.write(fn_img, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+			Image<RFLOAT> img;
+			img() = imgs[i];
+			img.setSamplingRateInHeader(opt.mydata.getImagePixelSize(part_ids[i], 0));
+			img.write(fn_imgs[i], -1, false, WRITE_OVERWRITE, datatype);
 		}
-		else
+		return;
+	}
+
+	// The particles of one optics group got consecutive numbers in its output stack:
+	// write them out as a single block
+	std::vector<bool> done(part_ids.size(), false);
+	for (size_t i = 0; i < part_ids.size(); i++)
+	{
+		if (done[i]) continue;
+
+		int optics_group = opt.mydata.getOpticsGroup(part_ids[i], 0);
+		std::vector<size_t> block;
+		for (size_t j = i; j < part_ids.size(); j++)
 		{
-			if (nr_particles_in_optics_group[optics_group] == 0)
-				img.write(fn_img, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
-			else
-				img.write(fn_img, -1, false, WRITE_APPEND, write_float16 ? Float16: Float);
+			if (!done[j] && opt.mydata.getOpticsGroup(part_ids[j], 0) == optics_group)
+			{
+				block.push_back(j);
+				done[j] = true;
+			}
 		}
+
+		Image<RFLOAT> Iblock(XSIZE(imgs[i]), YSIZE(imgs[i]), 1, block.size());
+		for (size_t b = 0; b < block.size(); b++)
+		{
+			const MultidimArray<RFLOAT> &Mimg = imgs[block[b]];
+			if (XSIZE(Mimg) != XSIZE(imgs[i]) || YSIZE(Mimg) != YSIZE(imgs[i]))
+				REPORT_ERROR("ERROR: subtracted particles in optics group " + integerToString(optics_group + 1) + " have different sizes.");
+			memcpy(&DIRECT_NZYX_ELEM(Iblock(), b, 0, 0, 0), MULTIDIM_ARRAY(Mimg), MULTIDIM_SIZE(Mimg) * sizeof(RFLOAT));
+		}
+
+		long int first_nr;
+		FileName fn_stack;
+		fn_imgs[i].decompose(first_nr, fn_stack);
+		Iblock.setSamplingRateInHeader(opt.mydata.getImagePixelSize(part_ids[i], 0));
+		Iblock.write(fn_stack, -1, true, (first_nr == 1) ? WRITE_OVERWRITE : WRITE_APPEND, datatype);
 	}
 }
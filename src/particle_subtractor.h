@@ -52,6 +52,10 @@ public:
 	// Write in half-precision 16 bit floating point numbers (MRC mode 12)
 	bool write_float16;
 
+	// Number of threads, and number of particles to read, subtract and write out together
+	int nr_threads;
+	long int batch_size;
+
 	// Running sums of power of signal and noise for SSNR calculation (keep public for MPI access)
 	MultidimArray<RFLOAT> sum_count, sum_S2, sum_N2;
 
@@ -86,8 +90,13 @@ public:
 	// Get name of a single subtracted particle
 	FileName getParticleName(long int imgno, int myrank, int optics_group=-1);
 
-	// subtract one particle
-	void subtractOneParticle(long int part_id, long int imgno, long int counter);
+	// Subtract the projection from one particle image that has already been read (thread-safe)
+	void subtractOneImage(long int part_id, MultidimArray<RFLOAT> &img, FourierTransformer &transformer);
+
+	// Register the names of subtracted particles (counting from first_counter) and write them out,
+	// as one block per optics group
+	void writeSubtractedImages(const std::vector<long int> &part_ids, long int first_counter,
+	                           std::vector<MultidimArray<RFLOAT> > &imgs);
 
 private:
 	// Pre-calculated rotation matrix for (0,90,0) rotation, and its transpose, for multi-body orientations
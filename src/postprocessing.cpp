@@ -60,6 +60,8 @@ void Postprocessing::read(int argc, char **argv)
 	locres_edgwidth = textToFloat(parser.getOption("--locres_edgwidth", "Width of soft edge (in A) on masks for local-resolution map (default = sampling)", "-1"));
 	locres_randomize_fsc = textToFloat(parser.getOption("--locres_randomize_at", "Randomize phases from this resolution (in A)", "25."));
 	locres_minres = textToFloat(parser.getOption("--locres_minres", "Lowest local resolution allowed (in A)", "50."));
+	do_locres_fft = parser.checkOption("--locres_fft", "Calculate the local FSCs of all sampling points at once by band-pass filtering and Fourier-space convolution (much faster for fine sampling)");
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads (only for --locres_fft; unless RELION was built with MKL, this only threads the loops over voxels, not the FFTs)", "1"));
 
 	int expert_section = parser.addSection("Expert options");
 	do_ampl_corr = parser.checkOption("--ampl_corr", "Perform amplitude correlation and DPR, also re-normalize amplitudes for non-uniform angular distributions");
@@ -105,6 +107,8 @@ void Postprocessing::clear()
 	randomize_fsc_at = 0.8;
 	randomize_at_A = -1.;
 	filter_edge_width = 2.;
+	do_locres_fft = false;
+	nr_threads = 1;
 	verb = 1;
 	do_ampl_corr = false;
 }
@@ -203,6 +207,16 @@ void Postprocessing::initialise()
 
 	if (do_auto_bfac && ABS(adhoc_bfac) > 0.)
 		REPORT_ERROR("Postprocessing::initialise ERROR: provide either --auto_bfac OR --adhoc_bfac, but not both!");
+
+#ifdef MKLFFT
+	if (nr_threads > 1)
+	{
+		// Enable multi-threaded FFTW (used by --locres_fft)
+		int success = fftw_init_threads();
+		if (0 == success)
+			REPORT_ERROR("Multithreaded FFTW failed to initialize");
+	}
+#endif
 }
 
 bool Postprocessing::getMask()
@@ -971,6 +985,336 @@ void Postprocessing::writeFscDat(MetaDataTable &MDfsc)
 	}
 }
 
+// Inverse Fourier transform of only those components of FT that are in one resolution shell
+static void getShellInRealSpace(const MultidimArray<Complex> &FT, const std::vector<long int> &shell,
+		FourierTransformer &transformer, MultidimArray<RFLOAT> &out)
+{
+	transformer.setReal(out);
+	MultidimArray<Complex> &Fout = transformer.getFourierReference();
+	Fout.initZeros();
+	for (size_t ipix = 0; ipix < shell.size(); ipix++)
+		DIRECT_MULTIDIM_ELEM(Fout, shell[ipix]) = DIRECT_MULTIDIM_ELEM(FT, shell[ipix]);
+	transformer.inverseFourierTransform();
+}
+
+// Inverse Fourier transform of FT, band-pass filtered with a triangular profile over the shells ishell +/- band_halfwidth
+static void getBandInRealSpace(const MultidimArray<Complex> &FT, const std::vector<std::vector<long int> > &shells,
+		int ishell, int band_halfwidth, FourierTransformer &transformer, MultidimArray<RFLOAT> &out)
+{
+	transformer.setReal(out);
+	MultidimArray<Complex> &Fout = transformer.getFourierReference();
+	Fout.initZeros();
+	int nr_shells = shells.size();
+	for (int jshell = XMIPP_MAX(0, ishell - band_halfwidth); jshell <= XMIPP_MIN(nr_shells - 1, ishell + band_halfwidth); jshell++)
+	{
+		RFLOAT weight = 1. - ABS(jshell - ishell) / (RFLOAT)(band_halfwidth + 1);
+		const std::vector<long int> &shell = shells[jshell];
+		for (size_t ipix = 0; ipix < shell.size(); ipix++)
+			DIRECT_MULTIDIM_ELEM(Fout, shell[ipix]) = weight * DIRECT_MULTIDIM_ELEM(FT, shell[ipix]);
+	}
+	transformer.inverseFourierTransform();
+}
+
+// (Circular) convolution of v with a kernel, given by its real-valued and un-normalised Fourier transform W
+static void convolveWithKernel(MultidimArray<RFLOAT> &v, const MultidimArray<RFLOAT> &W,
+		FourierTransformer &transformer, int nr_threads)
+{
+	transformer.setReal(v);
+	transformer.FourierTransform();
+	MultidimArray<Complex> &Fv = transformer.getFourierReference();
+	#pragma omp parallel for num_threads(nr_threads)
+	for (long int n = 0; n < NZYXSIZE(Fv); n++)
+		DIRECT_MULTIDIM_ELEM(Fv, n) *= DIRECT_MULTIDIM_ELEM(W, n);
+	transformer.inverseFourierTransform();
+}
+
+// Correlation of the band-pass filtered half maps A and B around each sampling point, weighted by the kernel in W
+// This overwrites A, B and AB
+static void getLocalShellCorrelation(MultidimArray<RFLOAT> &A, MultidimArray<RFLOAT> &B, MultidimArray<RFLOAT> &AB,
+		const MultidimArray<RFLOAT> &W, FourierTransformer &transformer, int nr_threads,
+		const std::vector<long int> &points, float *fsc)
+{
+	#pragma omp parallel for num_threads(nr_threads)
+	for (long int n = 0; n < NZYXSIZE(A); n++)
+	{
+		RFLOAT a = DIRECT_MULTIDIM_ELEM(A, n);
+		RFLOAT b = DIRECT_MULTIDIM_ELEM(B, n);
+		DIRECT_MULTIDIM_ELEM(AB, n) = a * b;
+		DIRECT_MULTIDIM_ELEM(A, n) = a * a;
+		DIRECT_MULTIDIM_ELEM(B, n) = b * b;
+	}
+
+	convolveWithKernel(AB, W, transformer, nr_threads);
+	convolveWithKernel(A, W, transformer, nr_threads);
+	convolveWithKernel(B, W, transformer, nr_threads);
+
+	for (long int ipoint = 0; ipoint < points.size(); ipoint++)
+	{
+		long int n = points[ipoint];
+		RFLOAT den = DIRECT_MULTIDIM_ELEM(A, n) * DIRECT_MULTIDIM_ELEM(B, n);
+		fsc[ipoint] = (den > 0.) ? DIRECT_MULTIDIM_ELEM(AB, n) / sqrt(den) : 0.;
+	}
+}
+
+float Postprocessing::getLocalResolution(int first_below_0143, int ori_size)
+{
+	// As in run_locres: the resolution of the last shell before the corrected FSC drops below 0.143
+	int ires = first_below_0143 - 1;
+	float local_resol = (ires > 0) ? ori_size * angpix / (RFLOAT)ires : 999.;
+	return XMIPP_MIN(locres_minres, local_resol);
+}
+
+RFLOAT Postprocessing::getLocalFilterWeight(int ishell, RFLOAT fsc, int first_below_0143, int first_below_0001,
+		int ori_size, int nr_shells)
+{
+	// The weight of applyFscWeighting, times that of lowPassFilterMap evaluated at the radius of the shell
+	int ires_max = XMIPP_MAX(0, first_below_0001 - 1);
+	RFLOAT weight = (ishell <= ires_max && fsc > 0.) ? sqrt((2 * fsc) / (1 + fsc)) : 0.;
+
+	int ires_filter = ROUND((ori_size * angpix) / getLocalResolution(first_below_0143, ori_size));
+	int filter_edge_halfwidth = filter_edge_width / 2;
+	RFLOAT edge_low = XMIPP_MAX(0., (ires_filter - filter_edge_halfwidth) / (RFLOAT)ori_size);
+	RFLOAT edge_high = XMIPP_MIN(nr_shells, (ires_filter + filter_edge_halfwidth) / (RFLOAT)ori_size);
+	RFLOAT edge_width = edge_high - edge_low;
+	RFLOAT res = ishell / (RFLOAT)ori_size;
+	if (res > edge_high)
+		weight = 0.;
+	else if (res >= edge_low && edge_width > 0.)
+		weight *= 0.5 + 0.5 * cos( PI * (res-edge_low)/edge_width);
+
+	return weight;
+}
+
+void Postprocessing::localResolutionByConvolution(MultidimArray<RFLOAT> &I1p, MultidimArray<RFLOAT> &I2p, MultidimArray<Complex> &FTsum,
+		int randomize_at, int step_size, int maskrad_pix, int edgewidth_pix, std::ofstream &fh,
+		MultidimArray<RFLOAT> &Ifil, MultidimArray<RFLOAT> &Ilocres, MultidimArray<RFLOAT> &Isumw,
+		int rank, int size)
+{
+	/* For each resolution shell s, let a_s and b_s be the half maps band-pass filtered around that shell (with a soft
+	 * band of about the width of the Fourier transform of the local mask m, see band_halfwidth below).
+	 * The FSC in shell s of the half maps multiplied with the local mask m around point p is approximated by
+	 *   sum_x m^2(x-p) a_s(x) b_s(x) / sqrt( sum_x m^2(x-p) a_s^2(x) * sum_x m^2(x-p) b_s^2(x) ),
+	 * i.e. by three convolutions with m^2 per shell, which give the local FSCs of all sampling points at once.
+	 * Likewise, the sum over all sampling points of the local mask times the locally filtered map is, per shell,
+	 * the band-pass filtered sum map times the convolution of m with the filter weights of all sampling points.
+	 */
+	FourierTransformer::setPlannerThreads(nr_threads);
+	FourierTransformer transformer;
+	int ori_size = XSIZE(I1());
+	int nr_shells = XSIZE(FTsum);
+
+	// The sampling points, in the same order as in run_locres
+	// (the local masks there are centred at x=kk, y=ii, z=jj)
+	std::vector<long int> points, point_kk, point_ii, point_jj;
+	int myrad = ori_size/2 - maskrad_pix;
+	for (long int kk=((I1()).zinit); kk<=((I1()).zinit + (I1()).zdim - 1); kk+= step_size)
+		for (long int ii=((I1()).yinit); ii<=((I1()).yinit + (I1()).ydim - 1); ii+= step_size)
+			for (long int jj=((I1()).xinit); jj<=((I1()).xinit + (I1()).xdim - 1); jj+= step_size)
+			{
+				float rad = sqrt(kk*kk + ii*ii + jj*jj);
+				if (rad < myrad)
+				{
+					points.push_back((jj - STARTINGZ(I1())) * YXSIZE(I1()) + (ii - STARTINGY(I1())) * XSIZE(I1()) + (kk - STARTINGX(I1())));
+					point_kk.push_back(kk);
+					point_ii.push_back(ii);
+					point_jj.push_back(jj);
+				}
+			}
+	long int nr_points = points.size();
+
+	// Indices of the Fourier components in each resolution shell (as in getFSC)
+	std::vector<std::vector<long int> > shells(nr_shells);
+	FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(FTsum)
+	{
+		int ires = ROUND(sqrt((RFLOAT)(kp*kp + ip*ip + jp*jp)));
+		if (ires < nr_shells)
+			shells[ires].push_back((k * YSIZE(FTsum) + i) * XSIZE(FTsum) + j);
+	}
+
+	// Fourier transforms of the local mask m (for the filtered map) and of m^2 (for the local FSCs), centred at the origin
+	MultidimArray<RFLOAT> A, B, AB, Wm, Wm2;
+	MultidimArray<Complex> FTmask;
+	A.resize(I1());
+	raisedCosineMask(A, maskrad_pix, maskrad_pix + edgewidth_pix, 0, 0, 0);
+	CenterFFT(A, true);
+	B = A * A;
+	// Undo the normalisation of the forward transform, so that convolveWithKernel gives the plain sums over the mask
+	RFLOAT norm = (RFLOAT)MULTIDIM_SIZE(A);
+	transformer.FourierTransform(A, FTmask, false);
+	Wm.resize(ZSIZE(FTmask), YSIZE(FTmask), XSIZE(FTmask));
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Wm)
+		DIRECT_MULTIDIM_ELEM(Wm, n) = norm * DIRECT_MULTIDIM_ELEM(FTmask, n).real;
+	transformer.FourierTransform(B, FTmask, false);
+	Wm2.resize(Wm);
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Wm2)
+		DIRECT_MULTIDIM_ELEM(Wm2, n) = norm * DIRECT_MULTIDIM_ELEM(FTmask, n).real;
+
+	MultidimArray<Complex> FT1, FT2, FT1p, FT2p;
+	transformer.FourierTransform(I1(), FT1);
+	transformer.FourierTransform(I2(), FT2);
+	transformer.FourierTransform(I1p, FT1p);
+	transformer.FourierTransform(I2p, FT2p);
+	I1p.clear();
+	I2p.clear();
+	AB.resize(I1());
+
+	/* The shells are done in rounds of one shell per MPI process, from low to high resolution.
+	 * The filter weights of a shell only depend on the corrected FSC in that shell and on where it first drops below
+	 * 0.143 and 0.0001, and the latter are known well enough once the FSCs up to filter_edge_width/2 shells further out are.
+	 * Therefore, only the local FSCs of the last few rounds are kept, and each shell is filtered as soon as it can be.
+	 * (Unlike the per-point estimation, this does not write the local FSC curves to the STAR file.)
+	 */
+	int filter_edge_halfwidth = filter_edge_width / 2;
+	// Masking the maps, as in run_locres, blurs their spectra by the width of the mask's Fourier transform,
+	// so the local FSCs are calculated over bands of that width (narrower bands would spread the signal over the whole box)
+	int band_halfwidth = ROUND(ori_size / (2. * maskrad_pix + edgewidth_pix));
+	int nr_rounds = (nr_shells + size - 1) / size;
+	int nr_rounds_kept = 1 + (filter_edge_halfwidth + size - 1) / size;
+	std::vector<float> fsc_true_pts((long int)nr_rounds_kept * size * nr_points, 0.), fsc_random_pts(nr_points);
+	// For each sampling point, the first shell where the corrected FSC drops below 0.143 and 0.0001 (nr_shells if not yet)
+	std::vector<int> first_below_0143(nr_points, nr_shells), first_below_0001(nr_points, nr_shells);
+
+	if (verb > 0)
+	{
+		std::cout << " Calculating local FSCs in " << nr_shells << " shells for " << nr_points << " sampling points ..." << std::endl;
+		init_progress_bar(nr_rounds);
+	}
+	int next_shell_to_filter = 0;
+	for (int iround = 0; iround < nr_rounds; iround++)
+	{
+		// Abort through the pipeline_control system
+		if (pipeline_control_check_abort_job())
+			exit(RELION_EXIT_ABORTED);
+
+		int first_shell = iround * size;
+		int last_shell = XMIPP_MIN(first_shell + size, nr_shells) - 1;
+		float *fsc_round = &fsc_true_pts[(long int)(iround % nr_rounds_kept) * size * nr_points];
+
+		int ishell = first_shell + rank;
+		if (ishell <= last_shell)
+		{
+			float *fsc_true_shell = fsc_round + (long int)rank * nr_points;
+			getBandInRealSpace(FT1, shells, ishell, band_halfwidth, transformer, A);
+			getBandInRealSpace(FT2, shells, ishell, band_halfwidth, transformer, B);
+			getLocalShellCorrelation(A, B, AB, Wm2, transformer, nr_threads, points, fsc_true_shell);
+
+			// As in calculateFSCtrue: the FSC of the phase-randomised maps is only used from 2 shells beyond randomize_at
+			if (ishell >= randomize_at + 2)
+			{
+				getBandInRealSpace(FT1p, shells, ishell, band_halfwidth, transformer, A);
+				getBandInRealSpace(FT2p, shells, ishell, band_halfwidth, transformer, B);
+				getLocalShellCorrelation(A, B, AB, Wm2, transformer, nr_threads, points, &fsc_random_pts[0]);
+				for (long int ipoint = 0; ipoint < nr_points; ipoint++)
+				{
+					RFLOAT fsct = fsc_true_shell[ipoint];
+					RFLOAT fscn = fsc_random_pts[ipoint];
+					fsc_true_shell[ipoint] = (fsct - fscn) / (1. - fscn);
+				}
+			}
+			else if (ishell == 0)
+			{
+				for (long int ipoint = 0; ipoint < nr_points; ipoint++)
+					if (fsc_true_shell[ipoint] <= 0.)
+						fsc_true_shell[ipoint] = 1.;
+			}
+		}
+
+		if (size > 1)
+			MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, fsc_round, nr_points, MPI_FLOAT, MPI_COMM_WORLD);
+
+		for (ishell = first_shell; ishell <= last_shell; ishell++)
+		{
+			float *fsc_true_shell = fsc_round + (long int)(ishell - first_shell) * nr_points;
+			for (long int ipoint = 0; ipoint < nr_points; ipoint++)
+			{
+				if (first_below_0143[ipoint] == nr_shells && fsc_true_shell[ipoint] < 0.143)
+					first_below_0143[ipoint] = ishell;
+				if (first_below_0001[ipoint] == nr_shells && fsc_true_shell[ipoint] < 0.0001)
+					first_below_0001[ipoint] = ishell;
+			}
+		}
+
+		// Sum of the local masks times the locally filtered maps, for all shells whose filter weights are now known
+		int last_shell_to_filter = (last_shell == nr_shells - 1) ? last_shell : last_shell - filter_edge_halfwidth;
+		for (; next_shell_to_filter <= last_shell_to_filter; next_shell_to_filter++)
+		{
+			ishell = next_shell_to_filter;
+			if (ishell % size != rank)
+				continue;
+
+			const float *fsc_true_shell = &fsc_true_pts[((long int)((ishell / size) % nr_rounds_kept) * size + ishell % size) * nr_points];
+			// Nothing to add beyond the filters of all sampling points
+			bool is_empty = true;
+			B.initZeros();
+			for (long int ipoint = 0; ipoint < nr_points; ipoint++)
+			{
+				RFLOAT weight = getLocalFilterWeight(ishell, fsc_true_shell[ipoint], first_below_0143[ipoint],
+						first_below_0001[ipoint], ori_size, nr_shells);
+				if (weight != 0.)
+				{
+					DIRECT_MULTIDIM_ELEM(B, points[ipoint]) = weight;
+					is_empty = false;
+				}
+			}
+
+			if (!is_empty)
+			{
+				convolveWithKernel(B, Wm, transformer, nr_threads);
+				getShellInRealSpace(FTsum, shells[ishell], transformer, A);
+				#pragma omp parallel for num_threads(nr_threads)
+				for (long int n = 0; n < NZYXSIZE(A); n++)
+					DIRECT_MULTIDIM_ELEM(Ifil, n) += DIRECT_MULTIDIM_ELEM(A, n) * DIRECT_MULTIDIM_ELEM(B, n);
+			}
+		}
+
+		if (verb > 0)
+			progress_bar(iround);
+	}
+	std::vector<float>().swap(fsc_true_pts);
+	std::vector<float>().swap(fsc_random_pts);
+	FT1.clear();
+	FT2.clear();
+	FT1p.clear();
+	FT2p.clear();
+
+	std::vector<RFLOAT> local_resols(nr_points);
+	for (long int ipoint = 0; ipoint < nr_points; ipoint++)
+	{
+		local_resols[ipoint] = getLocalResolution(first_below_0143[ipoint], ori_size);
+		if (rank == 0)
+			fh << " kk= " << point_kk[ipoint] << " ii= " << point_ii[ipoint] << " jj= " << point_jj[ipoint]
+			   << " local resolution= " << local_resols[ipoint] << std::endl;
+	}
+
+	// The weighted sum of local resolutions and the sum of weights (the other processes only add to Ifil)
+	if (rank == 0)
+	{
+		A.initZeros();
+		B.initZeros();
+		for (long int ipoint = 0; ipoint < nr_points; ipoint++)
+		{
+			DIRECT_MULTIDIM_ELEM(A, points[ipoint]) = 1. / local_resols[ipoint];
+			DIRECT_MULTIDIM_ELEM(B, points[ipoint]) = 1.;
+		}
+		convolveWithKernel(A, Wm, transformer, nr_threads);
+		convolveWithKernel(B, Wm, transformer, nr_threads);
+		// Outside all local masks, only rounding errors of the convolution remain
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(B)
+		{
+			if (DIRECT_MULTIDIM_ELEM(B, n) < 1e-6)
+			{
+				DIRECT_MULTIDIM_ELEM(A, n) = 0.;
+				DIRECT_MULTIDIM_ELEM(B, n) = 0.;
+			}
+		}
+		Ilocres = A;
+		Isumw = B;
+	}
+
+	if (verb > 0)
+		progress_bar(nr_rounds);
+}
+
 void Postprocessing::run_locres(int rank, int size)
 {
 	// Read input maps and perform some checks
@@ -983,11 +1327,8 @@ void Postprocessing::run_locres(int rank, int size)
 
 	// Get sum of two half-maps and sharpen according to estimated or ad-hoc B-factor
 	Isum.resize(I1());
-	I1m.resize(I1());
-	I2m.resize(I1());
 	I1p.resize(I1());
 	I2p.resize(I1());
-	locmask.resize(I1());
 	// Initialise local-resolution maps, weights etc
 	Ifil.initZeros(I1());
 	Ilocres.initZeros(I1());
@@ -1040,6 +1381,19 @@ void Postprocessing::run_locres(int rank, int size)
 			REPORT_ERROR( (std::string)"MlOptimiser::write: Cannot write file: " + fn_tmp);
 	}
 
+	if (do_locres_fft)
+	{
+		localResolutionByConvolution(I1p, I2p, FTsum, randomize_at, step_size, maskrad_pix, edgewidth_pix, fh,
+				Ifil, Ilocres, Isumw, rank, size);
+		fh.close();
+		writeLocalResolutionMaps(Ifil, Ilocres, Isumw, rank, size);
+		return;
+	}
+
+	I1m.resize(I1());
+	I2m.resize(I1());
+	locmask.resize(I1());
+
 	// Sample the entire volume (within the provided mask)
 
 	int myrad = XSIZE(I1())/2 - maskrad_pix;
@@ -1146,6 +1500,15 @@ void Postprocessing::run_locres(int rank, int size)
 	if (verb > 0)
 		init_progress_bar(nr_samplings);
 
+	writeLocalResolutionMaps(Ifil, Ilocres, Isumw, rank, size);
+}
+
+void Postprocessing::writeLocalResolutionMaps(MultidimArray<RFLOAT> &Ifil, MultidimArray<RFLOAT> &Ilocres, MultidimArray<RFLOAT> &Isumw,
+		int rank, int size)
+{
+	MultidimArray<RFLOAT> I1m;
+	I1m.resize(Ifil);
+	FileName fn_tmp;
 
 	if (size > 1)
 	{
@@ -110,6 +110,12 @@ public:
 	// Lowest resolution allowed in the locres map
 	RFLOAT locres_minres;
 
+	// Calculate the local FSCs of all sampling points at once, through band-pass filtering and convolution with the local mask
+	bool do_locres_fft;
+
+	// Number of threads (for the FFT-based local-resolution calculation)
+	int nr_threads;
+
 	//////// Sharpening
 
 	// Filename for the STAR-file with the MTF of the detector
@@ -214,6 +220,25 @@ public:
 	// Local-resolution running
 	void run_locres(int rank = 0, int size = 1);
 
+	// Local resolution (in A) for a corrected FSC that first drops below 0.143 in shell first_below_0143
+	float getLocalResolution(int first_below_0143, int ori_size);
+
+	// Weight of the local filter in shell ishell, for a corrected FSC of fsc in that shell that first drops below 0.143
+	// and 0.0001 in the given shells (nr_shells if it does not, or not up to filter_edge_width/2 shells beyond ishell)
+	RFLOAT getLocalFilterWeight(int ishell, RFLOAT fsc, int first_below_0143, int first_below_0001, int ori_size, int nr_shells);
+
+	// Local-resolution estimation for all sampling points at once (called from run_locres):
+	// local FSCs from the products of band-pass filtered half maps, convolved with the local mask in Fourier space.
+	// Only the FSCs of the last few shells are kept, so the memory use does not grow with the number of shells.
+	void localResolutionByConvolution(MultidimArray<RFLOAT> &I1p, MultidimArray<RFLOAT> &I2p, MultidimArray<Complex> &FTsum,
+			int randomize_at, int step_size, int maskrad_pix, int edgewidth_pix, std::ofstream &fh,
+			MultidimArray<RFLOAT> &Ifil, MultidimArray<RFLOAT> &Ilocres, MultidimArray<RFLOAT> &Isumw,
+			int rank = 0, int size = 1);
+
+	// Sum the local-resolution maps over the MPI processes and write them out (called from run_locres)
+	void writeLocalResolutionMaps(MultidimArray<RFLOAT> &Ifil, MultidimArray<RFLOAT> &Ilocres, MultidimArray<RFLOAT> &Isumw,
+			int rank = 0, int size = 1);
+
 	// General Running
 	void run();
 
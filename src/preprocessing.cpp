@@ -77,6 +77,8 @@ void Preprocessing::read(int argc, char **argv, int rank)
 	extract_bias_y  = textToInteger(parser.getOption("--extract_bias_y", "Bias in Y-direction of picked particles (this value in pixels will be added to the coords)", "0"));
 	only_extract_unfinished = parser.checkOption("--only_do_unfinished", "Extract only particles if the STAR file for that micrograph does not yet exist.");
 	extract_minimum_fom = textToFloat(parser.getOption("--minimum_pick_fom", "Minimum value for rlnAutopickFigureOfMerit for particle extraction","-999."));
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to extract the particles of each micrograph with (this also reads the next micrograph in the background)", "1"));
+	mic_prefetcher = NULL;
 
 	int perpart_section = parser.addSection("Particle operations");
 	do_project_3d = parser.checkOption("--project3d", "Project sub-tomograms along Z to generate 2D particles");
@@ -523,10 +525,16 @@ void Preprocessing::runExtractParticles()
 		if (verb > 0 && imic % barstep == 0)
 			progress_bar(imic);
 
+		prefetchMicrographs(imic, nr_mics - 1);
+
 		TIMING_TIC(TIMING_TOP);
 		micIsUsed = extractParticlesFromFieldOfView(fn_mic, imic);
 		TIMING_TOC(TIMING_TOP);
 
+		// Drop the prefetched micrograph if it was not used
+		if (mic_prefetcher != NULL && mic_prefetcher->isCurrent(imic))
+			mic_prefetcher->release();
+
 		if(micIsUsed)
 		{
 			MDoutMics.addObject(MDmics.getObject(current_object));
@@ -535,6 +543,12 @@ void Preprocessing::runExtractParticles()
 		imic++;
 	}
 
+	if (mic_prefetcher != NULL)
+	{
+		delete mic_prefetcher;
+		mic_prefetcher = NULL;
+	}
+
 	MDmics = MDoutMics;
 	if (verb > 0)
 		progress_bar(fn_coords.size());
@@ -543,6 +557,33 @@ void Preprocessing::runExtractParticles()
 	joinAllStarFiles();
 }
 
+void Preprocessing::prefetchMicrographs(long int imic, long int last_mic)
+{
+	// Only for 2D micrographs: tomograms are too big to keep two in memory
+	if (nr_threads < 2 || dimensionality != 2)
+		return;
+
+	if (mic_prefetcher == NULL)
+		mic_prefetcher = new ImagePrefetcher(1);
+
+	for (long int inext = imic; inext <= XMIPP_MIN(imic + 1, last_mic); inext++)
+	{
+		if (mic_prefetcher->isQueued(inext) || !mic_prefetcher->canPush())
+			continue;
+
+		// Don't read micrographs that extractParticlesFromFieldOfView will skip anyway
+		FileName fn_mic;
+		MDmics.getValue(EMDL_MICROGRAPH_NAME, fn_mic, inext);
+		FileName fn_star = getOutputFileNameRoot(fn_mic) + "_extract.star";
+		if (!exists(fn_mic) || (only_extract_unfinished && exists(fn_star)))
+			continue;
+		if (fn_data == "" && !exists(micname2coordname[fn_mic]))
+			continue;
+
+		mic_prefetcher->push(inext, std::vector<FileName>(1, fn_mic));
+	}
+}
+
 void Preprocessing::readCoordinates(FileName fn_coord, MetaDataTable &MD)
 {
 	MD.clear();
@@ -837,11 +878,21 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 	bool MDin_has_ctf = MD.containsLabel(EMDL_CTF_DEFOCUSU);
 	bool MDin_has_tiltgroup = MD.containsLabel(EMDL_PARTICLE_BEAM_TILT_CLASS);
 	int my_extract_size = (do_phase_flip || do_premultiply_ctf) ? premultiply_ctf_extract_size : extract_size;
-	RFLOAT my_angpix;
+	RFLOAT my_angpix = angpix;
 
 	TIMING_TIC(TIMING_READ_IMG);
 
-	Imic.read(fn_mic);
+	if (mic_prefetcher != NULL && mic_prefetcher->isCurrent(imic))
+	{
+		Imic() = mic_prefetcher->get(0);
+		// The prefetcher centres the origin, Imic.read() does not
+		STARTINGZ(Imic()) = STARTINGY(Imic()) = STARTINGX(Imic()) = 0;
+		mic_prefetcher->release();
+	}
+	else
+	{
+		Imic.read(fn_mic);
+	}
 
 	// Calculate average value in the micrograph, for filling empty region around large-box extraction for premultiplication with CTF
 	RFLOAT mic_avg = Imic().computeAvg();
@@ -860,9 +911,14 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 		obsModelMic.opticsMdt.getValue(EMDL_MICROGRAPH_PIXEL_SIZE, my_angpix, optics_group);
 	}
 
+	// With multiple threads, the particles are only collected here, and extracted and written as one stack below
+	bool do_parallel = (nr_threads > 1 && dimensionality == 2 && my_current_nr_images == 0);
+	std::vector<long int> all_xpos, all_ypos;
+	std::vector<CTF> all_ctfs;
+	std::vector<RFLOAT> all_angpix, all_tilt_deg, all_psi_deg;
+
 	// Now window all particles from the micrograph
 	// Now do the actual phase flipping or CTF-multiplication
-	MultidimArray<Complex> FT;
 	FourierTransformer transformer;
 	int ipos = 0;
 	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MD)
@@ -874,6 +930,7 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 		MD.getValue(EMDL_IMAGE_COORD_Y, dypos);
 		xpos = (long int)dxpos;
 		ypos = (long int)dypos;
+		zpos = 0;
 
 		x0 = xpos + FIRST_XMIPP_INDEX(my_extract_size);
 		xF = xpos + LAST_XMIPP_INDEX(my_extract_size);
@@ -909,102 +966,6 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 			obsModelPart.opticsMdt.getValue(EMDL_MICROGRAPH_PIXEL_SIZE, my_angpix, optics_group);
 		}
 
-		TIMING_TIC(TIMING_WINDOW);
-		// extract one particle in Ipart
-		if (dimensionality == 3)
-			Imic().window(Ipart(), z0, y0, x0, zF, yF, xF);
-		else
-			Imic().window(Ipart(), y0, x0, yF, xF, mic_avg);
-		Ipart().setXmippOrigin();
-		TIMING_TOC(TIMING_WINDOW);
-
-		// Premultiply the CTF of each particle, possibly in a bigger box (premultiply_ctf_extract_size)
-		if (do_phase_flip || do_premultiply_ctf)
-		{
-			transformer.FourierTransform(Ipart(), FT, false);
-
-			MultidimArray<RFLOAT> Fctf;
-			Fctf.resize(YSIZE(FT), XSIZE(FT));
-			// do_abs, phase_flip, intact_first_peak, damping, padding
-			// 190802 TAKANORI: The original code using getCTF was do_damping=false, but for consistency with Polishing, I changed it.
-			// The boxsize in ObsModel has been updated above.
-			// In contrast to Polish, we premultiply particle BEFORE down-sampling, so PixelSize in ObsModel is OK.
-			// But we are doing this after extraction, so there is not much merit...
-			ctf.getFftwImage(Fctf, my_extract_size, my_extract_size, my_angpix, false, do_phase_flip, do_ctf_intact_first_peak, true, false);
-
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(FT)
-			{
-				DIRECT_MULTIDIM_ELEM(FT, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
-			}
-
-			transformer.inverseFourierTransform(FT, Ipart());
-
-			if (extract_size != premultiply_ctf_extract_size)
-			{
-				Ipart().window(FIRST_XMIPP_INDEX(extract_size), FIRST_XMIPP_INDEX(extract_size),
-				               LAST_XMIPP_INDEX(extract_size),  LAST_XMIPP_INDEX(extract_size));
-			}
-		}
-
-		TIMING_TIC(TIMING_BOUNDARY);
-		// Check boundaries: fill pixels outside the boundary with the nearest ones inside
-		// This will create lines at the edges, rather than zeros
-		Ipart().setXmippOrigin();
-
-		// X-boundaries
-		if (x0 < 0 || xF >= XSIZE(Imic()) )
-		{
-			FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
-			{
-				if (j + xpos < 0)
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, -xpos);
-				else if (j + xpos >= XSIZE(Imic()))
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, XSIZE(Imic()) - xpos - 1);
-			}
-		}
-
-		// Y-boundaries
-		if (y0 < 0 || yF >= YSIZE(Imic()))
-		{
-			FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
-			{
-				if (i + ypos < 0)
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, -ypos, j);
-				else if (i + ypos >= YSIZE(Imic()))
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, YSIZE(Imic()) - ypos - 1, j);
-			}
-		}
-
-		if (dimensionality == 3)
-		{
-			// Z-boundaries
-			if (z0 < 0 || zF >= ZSIZE(Imic()))
-			{
-				FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
-				{
-					if (k + zpos < 0)
-						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), -zpos, i, j);
-					else if (k + zpos >= ZSIZE(Imic()))
-						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), ZSIZE(Imic()) - zpos - 1, i, j);
-				}
-			}
-		}
-
-		// 2D projection of 3D sub-tomograms
-		if (dimensionality == 3 && do_project_3d)
-		{
-			// Project the 3D sub-tomogram into a 2D particle again
-			Image<RFLOAT> Iproj(YSIZE(Ipart()), XSIZE(Ipart()));
-			Iproj().setXmippOrigin();
-			FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Ipart())
-			{
-				DIRECT_A2D_ELEM(Iproj(), i, j) += DIRECT_A3D_ELEM(Ipart(), k, i, j);
-			}
-			Ipart = Iproj;
-		}
-		TIMING_TOC(TIMING_BOUNDARY);
-
-		// performPerImageOperations will also append the particle to the output stack in fn_stack
 		// Jun24,2015 - Shaoda, extract helical segments
 		RFLOAT tilt_deg, psi_deg;
 		tilt_deg = psi_deg = 0.;
@@ -1014,11 +975,27 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 			MD.getValue(EMDL_ORIENT_PSI_PRIOR, psi_deg);
 		}
 
-		TIMING_TIC(TIMING_PRE_IMG_OPS);
-		performPerImageOperations(Ipart, fn_output_img_root, my_current_nr_images + ipos, my_total_nr_images,
-		                          tilt_deg, psi_deg, all_avg, all_stddev, all_minval, all_maxval);
-		TIMING_TOC(TIMING_PRE_IMG_OPS);
-
+		if (do_parallel)
+		{
+			all_xpos.push_back(xpos);
+			all_ypos.push_back(ypos);
+			all_ctfs.push_back(ctf);
+			all_angpix.push_back(my_angpix);
+			all_tilt_deg.push_back(tilt_deg);
+			all_psi_deg.push_back(psi_deg);
+		}
+		else
+		{
+			TIMING_TIC(TIMING_WINDOW);
+			extractOneParticle(Imic(), mic_avg, xpos, ypos, zpos, ctf, my_angpix, transformer, Ipart);
+			TIMING_TOC(TIMING_WINDOW);
+
+			// performPerImageOperations will also append the particle to the output stack in fn_stack
+			TIMING_TIC(TIMING_PRE_IMG_OPS);
+			performPerImageOperations(Ipart, fn_output_img_root, my_current_nr_images + ipos, my_total_nr_images,
+			                          tilt_deg, psi_deg, all_avg, all_stddev, all_minval, all_maxval);
+			TIMING_TOC(TIMING_PRE_IMG_OPS);
+		}
 		TIMING_TIC(TIMING_REST);
 		// Also store all the particles information in the STAR file
 		FileName fn_img;
@@ -1088,6 +1065,181 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 
 		ipos++;
 	}
+
+	if (do_parallel && ipos > 0)
+	{
+		// The size of the particles after rescaling and rewindowing
+		int out_size = (do_rewindow) ? window : ((do_rescale) ? scale : extract_size);
+		long int nr_parts = ipos;
+		Image<RFLOAT> Istack(out_size, out_size, 1, nr_parts);
+		std::vector<RFLOAT> avgs(nr_parts), stddevs(nr_parts), minvals(nr_parts), maxvals(nr_parts);
+		std::exception_ptr error;
+
+		TIMING_TIC(TIMING_WINDOW);
+		#pragma omp parallel num_threads(nr_threads)
+		{
+			Image<RFLOAT> Ithread;
+			FourierTransformer thread_transformer;
+
+			#pragma omp for schedule(dynamic)
+			for (long int ipart = 0; ipart < nr_parts; ipart++)
+			{
+				try
+				{
+					extractOneParticle(Imic(), mic_avg, all_xpos[ipart], all_ypos[ipart], 0, all_ctfs[ipart], all_angpix[ipart],
+					                   thread_transformer, Ithread);
+					if (white_dust_stddev > 0. || black_dust_stddev > 0.)
+					{
+						// Dust removal draws from rnd_gaus(), which is not thread-safe
+						#pragma omp critical(Preprocessing_dust_removal)
+						modifyOneImage(Ithread, all_tilt_deg[ipart], all_psi_deg[ipart]);
+					}
+					else
+					{
+						modifyOneImage(Ithread, all_tilt_deg[ipart], all_psi_deg[ipart]);
+					}
+					if (XSIZE(Ithread()) != out_size || YSIZE(Ithread()) != out_size)
+						REPORT_ERROR("BUG: Preprocessing::extractParticlesFromOneMicrograph: unexpected particle size");
+
+					Ithread().computeStats(avgs[ipart], stddevs[ipart], minvals[ipart], maxvals[ipart]);
+					memcpy(&DIRECT_NZYX_ELEM(Istack(), ipart, 0, 0, 0), MULTIDIM_ARRAY(Ithread()), out_size * out_size * sizeof(RFLOAT));
+				}
+				catch (...)
+				{
+					#pragma omp critical(Preprocessing_extraction_error)
+					error = std::current_exception();
+				}
+			}
+		}
+		TIMING_TOC(TIMING_WINDOW);
+		if (error)
+			std::rethrow_exception(error);
+
+		// Same overall statistics as when writing the particles one by one in performPerImageOperations
+		for (long int ipart = 0; ipart < nr_parts; ipart++)
+		{
+			all_minval = XMIPP_MIN(minvals[ipart], all_minval);
+			all_maxval = XMIPP_MAX(maxvals[ipart], all_maxval);
+			all_avg	+= avgs[ipart];
+			all_stddev += stddevs[ipart] * stddevs[ipart];
+		}
+		all_avg /= nr_parts;
+		all_stddev = sqrt(all_stddev/nr_parts);
+		Istack.MDMainHeader.setValue(EMDL_IMAGE_STATS_MIN, all_minval);
+		Istack.MDMainHeader.setValue(EMDL_IMAGE_STATS_MAX, all_maxval);
+		Istack.MDMainHeader.setValue(EMDL_IMAGE_STATS_AVG, all_avg);
+		Istack.MDMainHeader.setValue(EMDL_IMAGE_STATS_STDDEV, all_stddev);
+		Istack.setSamplingRateInHeader(output_angpix);
+
+		// Write the entire stack at once
+		TIMING_TIC(TIMING_PER_IMG_OP_WRITE);
+		Istack.write(fn_output_img_root+".mrcs", -1, (nr_parts > 1), WRITE_OVERWRITE, write_float16 ? Float16: Float);
+		TIMING_TOC(TIMING_PER_IMG_OP_WRITE);
+	}
+}
+
+void Preprocessing::extractOneParticle(const MultidimArray<RFLOAT> &Mmic, RFLOAT mic_avg, long int xpos, long int ypos, long int zpos,
+		CTF &ctf, RFLOAT my_angpix, FourierTransformer &transformer, Image<RFLOAT> &Ipart)
+{
+	int my_extract_size = (do_phase_flip || do_premultiply_ctf) ? premultiply_ctf_extract_size : extract_size;
+	long int x0 = xpos + FIRST_XMIPP_INDEX(my_extract_size);
+	long int xF = xpos + LAST_XMIPP_INDEX(my_extract_size);
+	long int y0 = ypos + FIRST_XMIPP_INDEX(my_extract_size);
+	long int yF = ypos + LAST_XMIPP_INDEX(my_extract_size);
+	long int z0 = zpos + FIRST_XMIPP_INDEX(extract_size);
+	long int zF = zpos + LAST_XMIPP_INDEX(extract_size);
+
+	// extract one particle in Ipart
+	if (dimensionality == 3)
+		Mmic.window(Ipart(), z0, y0, x0, zF, yF, xF);
+	else
+		Mmic.window(Ipart(), y0, x0, yF, xF, mic_avg);
+	Ipart().setXmippOrigin();
+
+	// Premultiply the CTF of each particle, possibly in a bigger box (premultiply_ctf_extract_size)
+	if (do_phase_flip || do_premultiply_ctf)
+	{
+		MultidimArray<Complex> FT;
+		transformer.FourierTransform(Ipart(), FT, false);
+
+		MultidimArray<RFLOAT> Fctf;
+		Fctf.resize(YSIZE(FT), XSIZE(FT));
+		// do_abs, phase_flip, intact_first_peak, damping, padding
+		// 190802 TAKANORI: The original code using getCTF was do_damping=false, but for consistency with Polishing, I changed it.
+		// The boxsize in ObsModel has been updated above.
+		// In contrast to Polish, we premultiply particle BEFORE down-sampling, so PixelSize in ObsModel is OK.
+		// But we are doing this after extraction, so there is not much merit...
+		ctf.getFftwImage(Fctf, my_extract_size, my_extract_size, my_angpix, false, do_phase_flip, do_ctf_intact_first_peak, true, false);
+
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(FT)
+		{
+			DIRECT_MULTIDIM_ELEM(FT, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
+		}
+
+		transformer.inverseFourierTransform(FT, Ipart());
+
+		if (extract_size != premultiply_ctf_extract_size)
+		{
+			Ipart().window(FIRST_XMIPP_INDEX(extract_size), FIRST_XMIPP_INDEX(extract_size),
+			               LAST_XMIPP_INDEX(extract_size),  LAST_XMIPP_INDEX(extract_size));
+		}
+	}
+
+	// Check boundaries: fill pixels outside the boundary with the nearest ones inside
+	// This will create lines at the edges, rather than zeros
+	Ipart().setXmippOrigin();
+
+	// X-boundaries
+	if (x0 < 0 || xF >= XSIZE(Mmic) )
+	{
+		FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+		{
+			if (j + xpos < 0)
+				A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, -xpos);
+			else if (j + xpos >= XSIZE(Mmic))
+				A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, XSIZE(Mmic) - xpos - 1);
+		}
+	}
+
+	// Y-boundaries
+	if (y0 < 0 || yF >= YSIZE(Mmic))
+	{
+		FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+		{
+			if (i + ypos < 0)
+				A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, -ypos, j);
+			else if (i + ypos >= YSIZE(Mmic))
+				A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, YSIZE(Mmic) - ypos - 1, j);
+		}
+	}
+
+	if (dimensionality == 3)
+	{
+		// Z-boundaries
+		if (z0 < 0 || zF >= ZSIZE(Mmic))
+		{
+			FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+			{
+				if (k + zpos < 0)
+					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), -zpos, i, j);
+				else if (k + zpos >= ZSIZE(Mmic))
+					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), ZSIZE(Mmic) - zpos - 1, i, j);
+			}
+		}
+	}
+
+	// 2D projection of 3D sub-tomograms
+	if (dimensionality == 3 && do_project_3d)
+	{
+		// Project the 3D sub-tomogram into a 2D particle again
+		Image<RFLOAT> Iproj(YSIZE(Ipart()), XSIZE(Ipart()));
+		Iproj().setXmippOrigin();
+		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Ipart())
+		{
+			DIRECT_A2D_ELEM(Iproj(), i, j) += DIRECT_A3D_ELEM(Ipart(), k, i, j);
+		}
+		Ipart = Iproj;
+	}
 }
 
 void Preprocessing::runOperateOnInputFile()
@@ -1147,31 +1299,10 @@ void Preprocessing::performPerImageOperations(
 		RFLOAT &all_minval,
 		RFLOAT &all_maxval)
 {
-
-	Ipart().setXmippOrigin();
-
-	if (do_rescale) rescale(Ipart, scale);
-
-	if (do_rewindow) rewindow(Ipart, window);
-
-	Ipart().setXmippOrigin();
-
 	TIMING_TIC(TIMING_NORMALIZE);
-	// Jun24,2015 - Shaoda, helical segments
-	if (do_normalise)
-	{
-		RFLOAT bg_helical_radius = (helical_tube_outer_diameter * 0.5) / angpix;
-		if (do_rescale)
-			bg_helical_radius *= scale / extract_size;
-		normalise(Ipart, bg_radius, white_dust_stddev, black_dust_stddev, do_ramp,
-				do_extract_helix, bg_helical_radius, tilt_deg, psi_deg);
-	}
+	modifyOneImage(Ipart, tilt_deg, psi_deg);
 	TIMING_TOC(TIMING_NORMALIZE);
 
-	TIMING_TIC(TIMING_INV_CONT);
-	if (do_invert_contrast) invert_contrast(Ipart);
-	TIMING_TOC(TIMING_INV_CONT);
-
 	// Calculate mean, stddev, min and max
 	RFLOAT avg, stddev, minval, maxval;
 	TIMING_TIC(TIMING_COMP_STATS);
@@ -1224,6 +1355,29 @@ void Preprocessing::performPerImageOperations(
 	}
 }
 
+void Preprocessing::modifyOneImage(Image<RFLOAT> &Ipart, RFLOAT tilt_deg, RFLOAT psi_deg)
+{
+	Ipart().setXmippOrigin();
+
+	if (do_rescale) rescale(Ipart, scale);
+
+	if (do_rewindow) rewindow(Ipart, window);
+
+	Ipart().setXmippOrigin();
+
+	// Jun24,2015 - Shaoda, helical segments
+	if (do_normalise)
+	{
+		RFLOAT bg_helical_radius = (helical_tube_outer_diameter * 0.5) / angpix;
+		if (do_rescale)
+			bg_helical_radius *= scale / extract_size;
+		normalise(Ipart, bg_radius, white_dust_stddev, black_dust_stddev, do_ramp,
+				do_extract_helix, bg_helical_radius, tilt_deg, psi_deg);
+	}
+
+	if (do_invert_contrast) invert_contrast(Ipart);
+}
+
 // Get the coordinate file from a given micrograph filename from MDdata
 MetaDataTable Preprocessing::getCoordinateMetaDataTable(FileName fn_mic)
 {
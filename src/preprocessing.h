@@ -35,6 +35,7 @@
 #include <src/jaz/single_particle/obs_model.h>
 #include <src/fftw.h>
 #include <src/time.h>
+#include "src/image_prefetcher.h"
 
 class Preprocessing
 {
@@ -134,6 +135,12 @@ public:
 	// Bias in picked coordinates in X and in Y direction (in pixels)
 	RFLOAT extract_bias_x, extract_bias_y;
 
+	// Number of threads to extract the particles of one (2D) micrograph with
+	int nr_threads;
+
+	// With more than one thread: reads the next micrograph while the particles of the current one are extracted
+	ImagePrefetcher *mic_prefetcher;
+
 	////////////////////////////////////// Post-extraction image modifications
 	// Perform re-scaling of extracted images
 	bool do_rescale;
@@ -214,15 +221,26 @@ public:
 	// For the given coordinate file, read the micrograph and/or movie and extract all particles
 	bool extractParticlesFromFieldOfView(FileName fn_mic, long int imic);
 
+	// Start reading micrograph imic (and the next one, up to last_mic) in the background
+	void prefetchMicrographs(long int imic, long int last_mic);
+
 	// Actually extract particles. This can be from one micrgraph
 	void extractParticlesFromOneMicrograph(MetaDataTable &MD,
 			FileName fn_mic, int ipos, FileName fn_output_img_root, FileName fn_oristack,
 			long int &my_current_nr_images, long int my_total_nr_images,
 			RFLOAT &all_avg, RFLOAT &all_stddev, RFLOAT &all_minval, RFLOAT &all_maxval);
 
+	// Window one particle from the micrograph, premultiply it with its CTF or flip its phases, and fill pixels outside the micrograph
+	// This is thread-safe, as long as every thread uses its own transformer
+	void extractOneParticle(const MultidimArray<RFLOAT> &Mmic, RFLOAT mic_avg, long int xpos, long int ypos, long int zpos,
+			CTF &ctf, RFLOAT my_angpix, FourierTransformer &transformer, Image<RFLOAT> &Ipart);
+
 	// Perform per-image operations (e.g. normalise, rescaling, rewindowing and inverting contrast) on an input stack (or STAR file)
 	void runOperateOnInputFile();
 
+	// Rescaling, rewindowing, normalisation and contrast inversion of an individual image (thread-safe)
+	void modifyOneImage(Image<RFLOAT> &Ipart, RFLOAT tilt_deg, RFLOAT psi_deg);
+
 	// Here normalisation, windowing etc is performed on an individual image and it is written to disc
 	// Jun24,2015 - Shaoda, extract helical segments
 	void performPerImageOperations(
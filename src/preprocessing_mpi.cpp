@@ -97,10 +97,22 @@ void PreprocessingMpi::runExtractParticles()
 				if (verb > 0 && imic % barstep == 0)
 					progress_bar(imic);
 
+				prefetchMicrographs(imic, my_last_mic);
+
 				extractParticlesFromFieldOfView(fn_mic, imic);
+
+				// Drop the prefetched micrograph if it was not used
+				if (mic_prefetcher != NULL && mic_prefetcher->isCurrent(imic))
+					mic_prefetcher->release();
 			}
 			imic++;
 		}
+
+		if (mic_prefetcher != NULL)
+		{
+			delete mic_prefetcher;
+			mic_prefetcher = NULL;
+		}
 	}
 
 	// Wait until all nodes have finished to make final star file
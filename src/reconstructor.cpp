@@ -17,6 +17,7 @@
  * source code. Additional authorship citations may be added, but existing
  * author citations must be preserved.
  ***************************************************************************/
+#include <exception>
 #include "src/reconstructor.h"
 
 void Reconstructor::read(int argc, char **argv)
@@ -33,6 +34,7 @@ void Reconstructor::read(int argc, char **argv)
 	subset = textToInteger(parser.getOption("--subset", "Subset of images to consider (1: only reconstruct half1; 2: only half2; other: reconstruct all)", "-1"));
 	chosen_class = textToInteger(parser.getOption("--class", "Consider only this class (-1: use all classes)", "-1"));
 	angpix  = textToFloat(parser.getOption("--angpix", "Pixel size in the reconstruction (take from first optics group by default)", "-1"));
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to back-project (and symmetrise) with", "1"));
 
 	int ctf_section = parser.addSection("CTF options");
 	do_ctf = parser.checkOption("--ctf", "Apply CTF correction");
@@ -310,20 +312,52 @@ void Reconstructor::backproject(int rank, int size)
 		init_progress_bar(nr_parts);
 	}
 
-	for (long int ipart = 0; ipart < nr_parts; ipart++)
+	if (nr_threads > 1)
 	{
-		if (ipart % size == rank)
-			backprojectOneParticle(ipart);
+		// All threads back-project into the same arrays, locking only the planes they write to
+		BackProjectorLocks locks(ZSIZE(backprojector.data));
+		std::exception_ptr error;
 
-		if (ipart % barstep == 0 && verb > 0)
-			progress_bar(ipart);
+		#pragma omp parallel for num_threads(nr_threads) schedule(dynamic, 4)
+		for (long int ipart = 0; ipart < nr_parts; ipart++)
+		{
+			if (ipart % size == rank)
+			{
+				try
+				{
+					backprojectOneParticle(ipart, &locks);
+				}
+				catch (...)
+				{
+					#pragma omp critical(Reconstructor_error)
+					error = std::current_exception();
+				}
+			}
+
+			if (ipart % barstep == 0 && verb > 0 && omp_get_thread_num() == 0)
+				progress_bar(ipart);
+		}
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+	else
+	{
+		for (long int ipart = 0; ipart < nr_parts; ipart++)
+		{
+			if (ipart % size == rank)
+				backprojectOneParticle(ipart);
+
+			if (ipart % barstep == 0 && verb > 0)
+				progress_bar(ipart);
+		}
 	}
 
 	if (verb > 0)
 		progress_bar(nr_parts);
 }
 
-void Reconstructor::backprojectOneParticle(long int p)
+void Reconstructor::backprojectOneParticle(long int p, BackProjectorLocks *locks)
 {
 	RFLOAT rot, tilt, psi, fom, r_ewald_sphere;
 	Matrix2D<RFLOAT> A3D;
@@ -359,9 +393,13 @@ void Reconstructor::backprojectOneParticle(long int p)
 
 	if (angular_error > 0.)
 	{
-		rot += rnd_gaus(0., angular_error);
-		tilt += rnd_gaus(0., angular_error);
-		psi += rnd_gaus(0., angular_error);
+		// rnd_gaus is not thread-safe
+		#pragma omp critical(Reconstructor_rnd_gaus)
+		{
+			rot += rnd_gaus(0., angular_error);
+			tilt += rnd_gaus(0., angular_error);
+			psi += rnd_gaus(0., angular_error);
+		}
 		//std::cout << rnd_gaus(0., angular_error) << std::endl;
 	}
 
@@ -397,8 +435,11 @@ void Reconstructor::backprojectOneParticle(long int p)
 
 	if (shift_error > 0.)
 	{
-		XX(trans) += rnd_gaus(0., shift_error);
-		YY(trans) += rnd_gaus(0., shift_error);
+		#pragma omp critical(Reconstructor_rnd_gaus)
+		{
+			XX(trans) += rnd_gaus(0., shift_error);
+			YY(trans) += rnd_gaus(0., shift_error);
+		}
 	}
 
 	if (data_dim == 3)
@@ -408,6 +449,7 @@ void Reconstructor::backprojectOneParticle(long int p)
 
 		if (shift_error > 0.)
 		{
+			#pragma omp critical(Reconstructor_rnd_gaus)
 			ZZ(trans) += rnd_gaus(0., shift_error);
 		}
 	}
@@ -450,9 +492,10 @@ void Reconstructor::backprojectOneParticle(long int p)
 	{
 
 		int optics_group = 0;
-		DF.getValue(EMDL_IMAGE_OPTICS_GROUP, optics_group);
+		DF.getValue(EMDL_IMAGE_OPTICS_GROUP, optics_group, p);
 
 		// Make coloured noise image
+		#pragma omp critical(Reconstructor_rnd_gaus)
 		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(F2D)
 		{
 			int ires = ROUND(sqrt((RFLOAT)(kp*kp + ip*ip + jp*jp)));
@@ -605,7 +648,7 @@ void Reconstructor::backprojectOneParticle(long int p)
 			DIRECT_MULTIDIM_ELEM(F2D, n) -= DIRECT_MULTIDIM_ELEM(Fsub, n);
 		}
 		// Back-project difference image
-		backprojector.set2DFourierTransform(F2D, A3D);
+		backprojector.set2DFourierTransform(F2D, A3D, NULL, -1., true, 0, locks);
 	}
 	else
 	{
@@ -727,12 +770,12 @@ void Reconstructor::backprojectOneParticle(long int p)
 				magMat.initIdentity();
 			}
 
-			backprojector.set2DFourierTransform(F2DP, A3D, &Fctf, r_ewald_sphere, true, &magMat);
-			backprojector.set2DFourierTransform(F2DQ, A3D, &Fctf, r_ewald_sphere, false, &magMat);
+			backprojector.set2DFourierTransform(F2DP, A3D, &Fctf, r_ewald_sphere, true, &magMat, locks);
+			backprojector.set2DFourierTransform(F2DQ, A3D, &Fctf, r_ewald_sphere, false, &magMat, locks);
 		}
 		else
 		{
-			backprojector.set2DFourierTransform(F2D, A3D, &Fctf);
+			backprojector.set2DFourierTransform(F2D, A3D, &Fctf, -1., true, 0, locks);
 		}
 	}
 
@@ -766,7 +809,7 @@ void Reconstructor::reconstruct()
 	if (verb > 0)
 		std::cout << " + Starting the reconstruction ..." << std::endl;
 
-	backprojector.symmetrise(nr_helical_asu, helical_twist, helical_rise/angpix);
+	backprojector.symmetrise(nr_helical_asu, helical_twist, helical_rise/angpix, nr_threads);
 
 	if (do_reconstruct_ctf)
 	{
@@ -45,7 +45,7 @@ public:
 	int r_max, r_min_nn, blob_order, ref_dim, interpolator, iter,
 	    debug_ori_size, debug_size,
 	    ctf_dim, nr_helical_asu, newbox, width_mask_edge, nr_sectors, subset, chosen_class,
-	    data_dim, output_boxsize, verb;
+	    data_dim, output_boxsize, verb, nr_threads;
 
 	RFLOAT blob_radius, blob_alpha, angular_error, shift_error, angpix, maxres,
 	       helical_rise, helical_twist;
@@ -95,7 +95,8 @@ public:
 	void backproject(int rank = 0, int size = 1);
 
 	// For parallelisation purposes
-	void backprojectOneParticle(long int ipart);
+	// With locks, this can be called by multiple threads at the same time
+	void backprojectOneParticle(long int ipart, BackProjectorLocks *locks = NULL);
 
 	// perform the gridding reconstruction
 	void reconstruct();
@@ -63,40 +63,6 @@ void EERRenderer::silenceTIFFWarnings()
 	}
 }
 
-template <typename T>
-void EERRenderer::render16K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
-{
-	for (int i = 0; i < n_electrons; i++)
-	{
-		int x = ((positions[i] & 4095) << 2) | (symbols[i] & 3); // 4095 = 111111111111b, 3 = 00000011b
-		int y = ((positions[i] >> 12) << 2) | ((symbols[i] & 12) >> 2); //  4096 = 2^12, 12 = 00001100b
-			DIRECT_A2D_ELEM(image, y, x)++;
-	}
-}
-
-
-template <typename T>
-void EERRenderer::render8K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
-{
-	for (int i = 0; i < n_electrons; i++)
-	{
-		int x = ((positions[i] & 4095) << 1) | ((symbols[i] & 2) >> 1); // 4095 = 111111111111b, 2 = 00000010b
-		int y = ((positions[i] >> 12) << 1) | ((symbols[i] & 8) >> 3); //  4096 = 2^12, 8 = 00001000b
-			DIRECT_A2D_ELEM(image, y, x)++;
-	}
-}
-
-template <typename T>
-void EERRenderer::render4K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
-{
-	for (int i = 0; i < n_electrons; i++)
-	{
-		int x = positions[i] & 4095; // 4095 = 111111111111b
-		int y = positions[i] >> 12; //  4096 = 2^12
-			DIRECT_A2D_ELEM(image, y, x)++;
-	}
-}
-
 EERRenderer::EERRenderer()
 {
 	ready = false;
@@ -224,10 +190,14 @@ void EERRenderer::readLegacy(FILE *fh)
 
 void EERRenderer::lazyReadFrames()
 {
-	#pragma omp critical(EERRenderer_lazyReadFrames)
+	// Once the data are there, threads rendering different frames never wait for each other
+	if (read_data)
+		return;
+
+	std::lock_guard<std::mutex> lock(read_mutex);
 	{
-		if (!read_data) // cannot return from within omp critical
-		{	
+		if (!read_data)
+		{
 			TIFF *ftiff = TIFFOpen(fn_movie.c_str(), "r");
 
 			frame_starts.resize(nframes, 0);
@@ -300,12 +270,140 @@ int EERRenderer::getHeight()
 	return EER_IMAGE_HEIGHT << (eer_upsampling - 1);
 }
 
+// Sub-pixel offsets of the 16 EER symbols at 16K (the two bits of X and Y are flipped).
+// The symbol is 0000YyXx after flipping with 0x0A.
+static void makeSymbolTables(int grid_shift, unsigned int *sym_x, unsigned int *sym_y)
+{
+	for (int s = 0; s < 16; s++)
+	{
+		const int symbol = s ^ 0x0A;
+		// At 8K (grid_shift = 1) only the upper bit is used; at 4K and coarser none
+		sym_x[s] = (grid_shift > 0) ? (symbol & 3) >> (2 - grid_shift) : 0;
+		sym_y[s] = (grid_shift > 0) ? ((symbol >> 2) & 3) >> (2 - grid_shift) : 0;
+	}
+}
+
+bool EERRenderer::decodeFrame(int iframe, int grid_shift, std::vector<unsigned int> &indices, unsigned int &n_electron)
+{
+	lazyReadFrames();
+
+	unsigned int sym_x[16], sym_y[16];
+	makeSymbolTables(grid_shift, sym_x, sym_y);
+
+	const int up = XMIPP_MAX(grid_shift, 0), down = XMIPP_MAX(-grid_shift, 0);
+	const int width_shift = 12 + grid_shift; // log2 of the output width
+	const long long pos_start = frame_starts[iframe];
+	const long long pos_limit = pos_start + frame_sizes[iframe];
+
+	// At least 11 bits per electron, plus what may be decoded from the last 64 bits of a corrupted frame
+	const size_t max_electrons = frame_sizes[iframe] * 8 / 11 + 8;
+	if (indices.size() < max_electrons)
+		indices.resize(max_electrons);
+
+	unsigned int n_pix = 0;
+	n_electron = 0;
+
+	// Place an electron at the 4K pixel n_pix with symbol s (before flipping)
+	#define EER_ADD_ELECTRON(s) \
+	{ \
+		const unsigned int x = ((n_pix & 4095) << up | sym_x[s]) >> down; \
+		const unsigned int y = ((n_pix >> 12) << up | sym_y[s]) >> down; \
+		indices[n_electron++] = (y << width_shift) | x; \
+	}
+
+	if (is_7bit)
+	{
+		// Codes are 7 bits of skipped pixels (127 means more to come), followed by 4 bits for the symbol.
+		// Fetch 64 bits at a time: this holds at least 5 complete codes.
+		// Since the size of buf is larger than the actual size by the TIFF header size (or the footer),
+		// it is always safe to read ahead.
+		unsigned long long bit_pos = 0;
+		while (true)
+		{
+			const long long first_byte = pos_start + (bit_pos >> 3);
+			if (first_byte >= pos_limit)
+				break; // corrupted frame
+
+			unsigned long long chunk;
+			memcpy(&chunk, buf + first_byte, sizeof(chunk));
+			int bits_left = 64 - (bit_pos & 7);
+			chunk >>= (bit_pos & 7);
+
+			while (bits_left >= 11)
+			{
+				const unsigned int p = chunk & 127; // 127 = 01111111
+				chunk >>= 7;
+				bits_left -= 7;
+				bit_pos += 7;
+				n_pix += p;
+				if (n_pix >= EER_IMAGE_PIXELS)
+					goto done;
+				if (p == 127) // this should be rare.
+					continue;
+
+				const unsigned int s = chunk & 15;
+				chunk >>= 4;
+				bits_left -= 4;
+				bit_pos += 4;
+				EER_ADD_ELECTRON(s);
+				n_pix++;
+			}
+		}
+	}
+	else
+	{
+		// Codes are 8 bits of skipped pixels (255 means more to come), followed by 4 bits for the symbol.
+		// Two codes fill three bytes: high <- |bbbbBBBB|BBBBaaaa|AAAAAAAA| -> low
+		// Fetch 64 bits at a time and unpack two such pairs.
+		// Because there is a footer, it is safe to read beyond the limit.
+		long long pos = pos_start;
+		while (pos < pos_limit)
+		{
+			unsigned long long chunk;
+			memcpy(&chunk, buf + pos, sizeof(chunk));
+
+			const int n_codes = (pos + 3 < pos_limit) ? 4 : 2;
+			for (int i = 0; i < n_codes; i++, chunk >>= 12)
+			{
+				// Note the order. Add p before checking the size and placing a new electron.
+				const unsigned int p = chunk & 255;
+				n_pix += p;
+				if (n_pix >= EER_IMAGE_PIXELS)
+					goto done;
+				if (p < 255)
+				{
+					const unsigned int s = (chunk >> 8) & 15;
+					EER_ADD_ELECTRON(s);
+					n_pix++;
+				}
+			}
+			pos += 6;
+		}
+	}
+	#undef EER_ADD_ELECTRON
+
+done:
+	return (n_pix == EER_IMAGE_PIXELS);
+}
+
 template <typename T>
 long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArray<T> &image)
+{
+	return renderFrames(frame_start, frame_end, image, 1);
+}
+
+template <typename T>
+long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArray<T> &image, int binning)
 {
 	if (!ready)
 		REPORT_ERROR("EERRenderer::renderNFrames called before ready.");
 
+	int log2_binning = 0;
+	while ((1 << log2_binning) < binning)
+		log2_binning++;
+	if (binning < 1 || (1 << log2_binning) != binning || binning > getWidth())
+		REPORT_ERROR("EERRenderer::renderFrames: binning must be a power of two, and not larger than the image.");
+
 	lazyReadFrames();
 
 	if (frame_start <= 0 || frame_start > getNFrames() ||
@@ -321,9 +419,11 @@ long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArra
 
 	long long total_n_electron = 0;
 
-	std::vector<unsigned int> positions;
-	std::vector<unsigned char> symbols;
-	image.initZeros(getHeight(), getWidth());
+	// The size of the output with respect to 4K
+	const int grid_shift = (eer_upsampling - 1) - log2_binning;
+	std::vector<unsigned int> indices;
+	image.initZeros(getHeight() / binning, getWidth() / binning);
+	T *pimage = MULTIDIM_ARRAY(image);
 
 	for (int iframe = frame_start; iframe <= frame_end; iframe++)
 	{
@@ -335,125 +435,23 @@ long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArra
 			REPORT_ERROR("Tried to render frames outside pre-read region");
 		}		
 
-		long long pos = frame_starts[iframe];
-		unsigned int n_pix = 0, n_electron = 0;
-		const int max_electrons = frame_sizes[iframe] * 2; // at 4 bits per electron (very permissive bound!)
-		if (positions.size() < max_electrons)
-		{
-			positions.resize(max_electrons);
-			symbols.resize(max_electrons);
-		}
-
-		if (is_7bit)
-		{
-			unsigned int bit_pos = 0; // 4 K * 4 K * 11 bit << 2 ** 32
-			unsigned char p, s;
-
-			while (true)
-			{
-				// Fetch 32 bits and unpack up to 2 chunks of 7 + 4 bits.
-				// This is faster than unpack 7 and 4 bits sequentially.
-				// Since the size of buf is larger than the actual size by the TIFF header size,
-				// it is always safe to read ahead.
-
-				long long first_byte = pos + (bit_pos >> 3);
-				const unsigned int bit_offset_in_first_byte = bit_pos & 7; // 7 = 00000111 (same as % 8)
-				const unsigned int chunk = (*(unsigned int*)(buf + first_byte)) >> bit_offset_in_first_byte;
-
-				p = (unsigned char)(chunk & 127); // 127 = 01111111
-				bit_pos += 7; // TODO: we can remove this for further speed.
-				n_pix += p;
-				if (n_pix >= EER_IMAGE_PIXELS) break;
-				if (p == 127) continue; // this should be rare.
-				
-				s = (unsigned char)((chunk >> 7) & 15) ^ 0x0A; // 15 = 00001111; See below for 0x0A
-				bit_pos += 4;
-				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
-				n_electron++;
-				n_pix++;
-
-				p = (unsigned char)((chunk >> 11) & 127); // 127 = 01111111
-				bit_pos += 7;
-				n_pix += p;
-				if (n_pix >= EER_IMAGE_PIXELS) break;
-				if (p == 127) continue;
-				
-				s = (unsigned char)((chunk >> 18) & 15) ^ 0x0A; // 15 = 00001111; See below for 0x0A
-				bit_pos += 4;
-				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
-				n_electron++;
-				n_pix++;
-			}
-		}
-		else
-		{
-			// unpack every two symbols = 12 bit * 2 = 24 bit = 3 byte
-			// high <- |bbbbBBBB|BBBBaaaa|AAAAAAAA| -> low
-			// With SIMD intrinsics at the SSSE3 level, we can unpack 10 symbols (120 bits) simultaneously.
-			unsigned char p1, p2, s1, s2;
-
-			const long long pos_limit = frame_starts[iframe] + frame_sizes[iframe];
-			// Because there is a footer, it is safe to go beyond the limit by two bytes.
-			while (pos < pos_limit)
-			{
-				// symbol is bit tricky. 0000YyXx; Y and X must be flipped.
-				p1 = buf[pos];
-				s1 = (buf[pos + 1] & 0x0F) ^ 0x0A; // 0x0F = 00001111, 0x0A = 00001010
-
-				p2 = (buf[pos + 1] >> 4) | (buf[pos + 2] << 4);
-				s2 = (buf[pos + 2] >> 4) ^ 0x0A;
-
-				// Note the order. Add p before checking the size and placing a new electron.
-				n_pix += p1;
-				if (n_pix >= EER_IMAGE_PIXELS) break;
-				if (p1 < 255)
-				{
-					positions[n_electron] = n_pix;
-					symbols[n_electron] = s1;
-					n_electron++;
-					n_pix++;
-				}
-
-				n_pix += p2;
-				if (n_pix >= EER_IMAGE_PIXELS) break;
-				if (p2 < 255)
-				{
-					positions[n_electron] = n_pix;
-					symbols[n_electron] = s2;
-					n_electron++;
-					n_pix++;
-				}
-#ifdef DEBUG_EER_DETAIL
-				printf("%d: %u %u, %u %u %d\n", pos, p1, s1, p2, s2, n_pix);
-#endif
-				pos += 3;
-			}
-		}
-
-		if (n_pix != EER_IMAGE_PIXELS)
+		unsigned int n_electron;
+		if (!decodeFrame(iframe, grid_shift, indices, n_electron))
 		{
 			std::cerr << "WARNING: The number of pixels is not right in " + fn_movie + " frame " + integerToString(iframe + 1) + ". Probably this frame is corrupted. This frame is skipped." << std::endl;
 			continue;
 		}
-
 		RCTOC(TIMING_UNPACK_RLE);
 
 		RCTIC(TIMING_RENDER_ELECTRONS);
-		if (eer_upsampling == 3)
-			render16K(image, positions, symbols, n_electron);
-		else if (eer_upsampling == 2)
-			render8K(image, positions, symbols, n_electron);
-		else if (eer_upsampling == 1)
-			render4K(image, positions, symbols, n_electron);
-		else
-			REPORT_ERROR("Invalid EER upsample");
+		const unsigned int *pindices = &indices[0];
+		for (unsigned int i = 0; i < n_electron; i++)
+			pimage[pindices[i]]++;
 		RCTOC(TIMING_RENDER_ELECTRONS);
 
 		total_n_electron += n_electron;
 #ifdef DEBUG_EER
-		printf("Decoded %lld electrons / %d pixels from frame %5d.\n", n_electron, n_pix, iframe);
+		printf("Decoded %u electrons from frame %5d.\n", n_electron, iframe);
 #endif
 	}
 #ifdef DEBUG_EER
@@ -474,3 +472,5 @@ template long long EERRenderer::renderFrames<unsigned short>(int frame_start, in
 template long long EERRenderer::renderFrames<char>(int frame_start, int frame_end, MultidimArray<char> &image);
 template long long EERRenderer::renderFrames<signed char>(int frame_start, int frame_end, MultidimArray<signed char> &image);
 template long long EERRenderer::renderFrames<unsigned char>(int frame_start, int frame_end, MultidimArray<unsigned char> &image);
+template long long EERRenderer::renderFrames<float>(int frame_start, int frame_end, MultidimArray<float> &image, int binning);
+template long long EERRenderer::renderFrames<unsigned short>(int frame_start, int frame_end, MultidimArray<unsigned short> &image, int binning);
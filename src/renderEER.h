@@ -3,6 +3,8 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <omp.h>
 
 #include <src/image.h>
@@ -17,7 +19,8 @@ class EERRenderer {
 	bool ready;
 	bool is_legacy;
 	bool is_7bit;
-	bool read_data;
+	std::atomic<bool> read_data;
+	std::mutex read_mutex;
 
 	std::vector<long long> frame_starts, frame_sizes;
 	unsigned char* buf;
@@ -35,15 +38,6 @@ class EERRenderer {
 	void readLegacy(FILE *fh);
 	void lazyReadFrames();
 
-	template <typename T>
-	void render16K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
-
-	template <typename T>
-	void render8K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
-
-	template <typename T>
-	void render4K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
-
 	static TIFFErrorHandler prevTIFFWarningHandler;
 
 	public:
@@ -91,6 +85,17 @@ class EERRenderer {
 	template <typename T>
 	long long renderFrames(int frame_start, int frame_end, MultidimArray<T> &image);
 
+	// As above, but binned by a power of two (1, 2, 4, ...) with respect to the upsampled grid,
+	// i.e. the image is getHeight() / binning by getWidth() / binning.
+	// The electrons are counted directly into the binned pixels.
+	template <typename T>
+	long long renderFrames(int frame_start, int frame_end, MultidimArray<T> &image, int binning);
+
+	// Decode one frame (0-indexed; renderFrames is 1-indexed) into the indices (in an image of width << grid_shift, or width >> -grid_shift,
+	// with respect to 4K) of all its electrons. Returns false if the frame is corrupted.
+	// indices is enlarged as needed; only the first n_electron elements are valid.
+	bool decodeFrame(int iframe, int grid_shift, std::vector<unsigned int> &indices, unsigned int &n_electron);
+
 	// The gain reference for EER is not multiplicative! So the inverse is taken here.
 	// 0 means defect.
 	template <typename T>
@@ -165,6 +170,37 @@ class EERRenderer {
 		}
 	}
 
+	// Bin a gain reference from loadEERGain by a power of two, for frames rendered with the same binning.
+	// A binned pixel is 0 (defect) if any of its pixels is; otherwise it gets the harmonic mean of their gains,
+	// which corrects for their total efficiency.
+	template <typename T>
+	static void binEERGain(MultidimArray<T> &gain, int binning)
+	{
+		const int ny_out = YSIZE(gain) / binning, nx_out = XSIZE(gain) / binning;
+		MultidimArray<T> binned(ny_out, nx_out);
+		binned.initZeros();
+
+		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(binned)
+		{
+			double sum_inverse = 0;
+			bool is_defect = false;
+			for (int y = i * binning; y < (i + 1) * binning; y++)
+			{
+				for (int x = j * binning; x < (j + 1) * binning; x++)
+				{
+					if (DIRECT_A2D_ELEM(gain, y, x) == 0)
+						is_defect = true;
+					else
+						sum_inverse += 1. / DIRECT_A2D_ELEM(gain, y, x);
+				}
+			}
+			if (!is_defect)
+				DIRECT_A2D_ELEM(binned, i, j) = binning * binning / sum_inverse;
+		}
+
+		gain = binned;
+	}
+
 	static bool isEER(FileName fn_movie)
 	{
 		FileName ext = fn_movie.getExtension();
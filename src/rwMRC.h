@@ -322,11 +322,17 @@ int writeMRC(long int img_select, bool isStack=false, const int mode=WRITE_OVERW
 		imgStart = img_select;
 		imgEnd = img_select + 1;
 	}
-	if (mode == WRITE_APPEND || mode == WRITE_REPLACE)
+	if (mode == WRITE_REPLACE)
 	{
 		imgStart = 0;
 		imgEnd = 1;
 	}
+	else if (mode == WRITE_APPEND)
+	{
+		// Append all images in data
+		imgStart = 0;
+		imgEnd = Ndim;
+	}
 	header->nx = Xdim;
 	header->ny = Ydim;
 	if (isStack)
@@ -480,7 +486,7 @@ int writeMRC(long int img_select, bool isStack=false, const int mode=WRITE_OVERW
 	// For multi-image files
 	if (mode == WRITE_APPEND && isStack)
 	{
-		header->nz = replaceNsize + 1;
+		header->nz = replaceNsize + Ndim;
 	}
 	//else header-> is correct
 
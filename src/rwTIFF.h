@@ -29,7 +29,9 @@
 /** TIFF Reader
   * @ingroup TIFF
 */
-int readTIFF(TIFF* ftiff, long int img_select, bool readdata=false, bool isStack=false, const FileName &name="")
+// in_memory and n_threads: see readTiffInMemory
+int readTIFF(TIFF* ftiff, long int img_select, bool readdata=false, bool isStack=false, const FileName &name="",
+             const TiffInMemory *in_memory = NULL, int n_threads = 1)
 {
 //#define DEBUG_TIFF
 #ifdef DEBUG_TIFF
@@ -200,11 +202,60 @@ int readTIFF(TIFF* ftiff, long int img_select, bool readdata=false, bool isStack
 
 			tsize_t stripSize = TIFFStripSize(ftiff);
 			tstrip_t numberOfStrips = TIFFNumberOfStrips(ftiff);
-			tdata_t buf = _TIFFmalloc(stripSize);
 #ifdef DEBUG_TIFF
 			size_t readsize_n = stripSize * 8 / bitsPerSample;
 			std::cout << "TIFF stripSize=" << stripSize << " numberOfStrips=" << numberOfStrips << " readsize_n=" << readsize_n << std::endl;
 #endif
+			if (in_memory != NULL && n_threads > 1 && numberOfStrips > 1)
+			{
+				// Decode the strips in parallel. libtiff handles cannot be shared between threads,
+				// but every thread can open its own handle on the same buffer.
+				// All strips but the last one are full, so each strip knows where its pixels go.
+				size_t strip_n = stripSize * 8 / bitsPerSample;
+				if (packed_4bit)
+					strip_n *= 2;
+				bool failed = false;
+
+				#pragma omp parallel num_threads(n_threads)
+				{
+					TiffInMemory my_handle = *in_memory;
+					my_handle.pos = 0;
+					TIFF* my_tiff = TIFFClientOpen("in-memory-tiff", "r", (thandle_t)&my_handle,
+					                               TiffInMemoryReadProc, TiffInMemoryWriteProc, TiffInMemorySeekProc,
+					                               TiffInMemoryCloseProc, TiffInMemorySizeProc, TiffInMemoryMapFileProc,
+					                               TiffInMemoryUnmapFileProc);
+					tdata_t my_buf = _TIFFmalloc(stripSize);
+					const bool ok = (my_tiff != NULL && TIFFSetDirectory(my_tiff, img_select) != 0);
+
+					#pragma omp for schedule(dynamic)
+					for (tstrip_t strip = 0; strip < numberOfStrips; strip++)
+					{
+						tsize_t actually_read = ok ? TIFFReadEncodedStrip(my_tiff, strip, my_buf, stripSize) : -1;
+						if (actually_read == -1)
+						{
+							#pragma omp atomic write
+							failed = true;
+							continue;
+						}
+						tsize_t actually_read_n = actually_read * 8 / bitsPerSample;
+						if (packed_4bit)
+							actually_read_n *= 2; // convert physical size to logical size
+						castPage2T((char*)my_buf, MULTIDIM_ARRAY(data) + haveread_n + strip * strip_n, datatype, actually_read_n);
+					}
+
+					_TIFFfree(my_buf);
+					if (my_tiff != NULL)
+						TIFFClose(my_tiff);
+				}
+
+				if (failed)
+					REPORT_ERROR((std::string)"Failed to read an image data from " + name);
+				haveread_n += _xDim * _yDim;
+				img_select++;
+				continue;
+			}
+
+			tdata_t buf = _TIFFmalloc(stripSize);
 			for (tstrip_t strip = 0; strip < numberOfStrips; strip++)
 			{
 				tsize_t actually_read = TIFFReadEncodedStrip(ftiff, strip, buf, stripSize);
@@ -0,0 +1,254 @@
+#include <catch2/catch.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "src/metadata_table.h"
+
+// Quoted strings, '#' inside and after tokens, unknown labels, all column types,
+// numbers that strtod would read differently (nan, inf, 0x10, 1e), a list and an empty loop
+static const char *test_star =
+	"\n"
+	"# version 30001\n"
+	"\n"
+	"data_optics\n"
+	"\n"
+	"loop_\n"
+	"_rlnOpticsGroupName #1\n"
+	"_rlnOpticsGroup #2\n"
+	"_rlnVoltage #3\n"
+	"opticsGroup1 1 300.000000\n"
+	"\"optics group 2\" 2 200.0\n"
+	"\n"
+	"\n"
+	"data_particles\n"
+	"\n"
+	"loop_\n"
+	"_rlnImageName #1\n"
+	"_rlnMicrographName #2\n"
+	"_rlnCoordinateX #3\n"
+	"_rlnClassNumber #4\n"
+	"_rlnEnabled #5\n"
+	"_rlnMyUnknownLabel #6\n"
+	"_rlnLBP #7\n"
+	"000001@Particles/mic1.mrcs\t\"mic 1.mrc\"  10.5 1 1 foo [1,2,3]\n"
+	"000002@Particles/mic1.mrcs mic#1.mrc -3.25e2 2 0 'bar baz' [0.5]\n"
+	"000003@Particles/mic2.mrcs mic2.mrc nan 0x10 2 x [] # a comment\n"
+	"000004@Particles/mic2.mrcs mic2.mrc inf -7 1 y [4,5]\n"
+	"000005@Particles/mic2.mrcs mic2.mrc 1e 1.5 1 \"\" [6]\n"
+	"\n"
+	"\n"
+	"data_general\n"
+	"\n"
+	"_rlnVoltage 300.0\n"
+	"_rlnMicrographName \"a b.mrc\"\n"
+	"\n"
+	"\n"
+	"data_empty\n"
+	"\n"
+	"loop_\n"
+	"_rlnImageName #1\n"
+	"_rlnCoordinateX #2\n";
+
+static void writeTestStar(const std::string &fn)
+{
+	std::ofstream out(fn.c_str());
+	out << test_star;
+}
+
+static std::string toStarString(const MetaDataTable &MD)
+{
+	std::ostringstream out;
+	MD.write(out);
+	return out.str();
+}
+
+// The tables as read by the stream tokenizer (readStarLoop without a mapped file)
+static std::vector<MetaDataTable> readReference(const std::string &fn)
+{
+	std::ifstream in(fn.c_str());
+	return MetaDataTable::readAll(in);
+}
+
+static void requireSameTables(const std::vector<MetaDataTable> &tables, const std::vector<MetaDataTable> &reference)
+{
+	REQUIRE(tables.size() == reference.size());
+	for (int i = 0; i < reference.size(); i++)
+	{
+		REQUIRE(tables[i].getName() == reference[i].getName());
+		REQUIRE(tables[i].numberOfObjects() == reference[i].numberOfObjects());
+		REQUIRE(toStarString(tables[i]) == toStarString(reference[i]));
+	}
+}
+
+TEST_CASE( "The mapped STAR tokenizer reads the same as the stream tokenizer", "[metadata_table]" ) {
+	const std::string fn = "test_metadata_table_mapped.star";
+	writeTestStar(fn);
+
+	std::vector<MetaDataTable> reference = readReference(fn);
+	REQUIRE(reference.size() == 4);
+	REQUIRE(reference[1].numberOfObjects() == 5);
+	REQUIRE(reference[3].numberOfObjects() == 0);
+
+	for (int nr_threads = 1; nr_threads <= 3; nr_threads += 2)
+	{
+		MetaDataTable::setReadThreads(nr_threads);
+		requireSameTables(MetaDataTable::readAll(fn), reference);
+
+		for (int i = 0; i < reference.size(); i++)
+		{
+			MetaDataTable MD;
+			MD.read(fn, reference[i].getName());
+			REQUIRE(toStarString(MD) == toStarString(reference[i]));
+		}
+	}
+	MetaDataTable::setReadThreads(1);
+
+	// Values that strtod alone would have read differently
+	MetaDataTable MD;
+	MD.read(fn, "particles");
+	RFLOAT x;
+	int class_nr;
+	std::string mic;
+	REQUIRE(MD.getValue(EMDL_IMAGE_COORD_X, x, 2));
+	REQUIRE(x == 0.);
+	REQUIRE(MD.getValue(EMDL_PARTICLE_CLASS, class_nr, 2));
+	REQUIRE(class_nr == 0);
+	REQUIRE(MD.getValue(EMDL_IMAGE_COORD_X, x, 3));
+	REQUIRE(x == 0.);
+	REQUIRE(MD.getValue(EMDL_IMAGE_COORD_X, x, 4));
+	REQUIRE(x == 0.);
+	REQUIRE(MD.getValue(EMDL_MICROGRAPH_NAME, mic, 0));
+	REQUIRE(mic == "mic 1.mrc");
+	REQUIRE(MD.getValue(EMDL_MICROGRAPH_NAME, mic, 1));
+	REQUIRE(mic == "mic#1.mrc");
+
+	std::remove(fn.c_str());
+}
+
+TEST_CASE( "Whole rows are copied between tables column by column", "[metadata_table]" ) {
+	const std::string fn = "test_metadata_table_rows.star";
+	writeTestStar(fn);
+
+	MetaDataTable MDin;
+	MDin.read(fn, "particles");
+	std::remove(fn.c_str());
+
+	// Row by row, from several threads at once into separate tables
+	const int nr_copies = 4;
+	std::vector<MetaDataTable> copies(nr_copies);
+	#pragma omp parallel for num_threads(nr_copies)
+	for (int i = 0; i < nr_copies; i++)
+	{
+		copies[i].setName(MDin.getName());
+		for (long int j = 0; j < MDin.numberOfObjects(); j++)
+			copies[i].addObject(MDin.getObject(j));
+	}
+	for (int i = 0; i < nr_copies; i++)
+		REQUIRE(toStarString(copies[i]) == toStarString(MDin));
+
+	// All at once, in a different order, and into a cleared table
+	std::vector<long> order;
+	for (long int j = MDin.numberOfObjects() - 1; j >= 0; j--)
+		order.push_back(j);
+	MetaDataTable MDreversed, MDtwice;
+	MDtwice.setName(MDin.getName());
+	MDreversed.addObjects(MDin, order);
+	MDtwice.addObjects(MDreversed, order);
+	REQUIRE(toStarString(MDtwice) == toStarString(MDin));
+
+	MDtwice.clear();
+	MDtwice.addObjects(MDin, std::vector<long>(1, 1));
+	std::string mic;
+	REQUIRE(MDtwice.numberOfObjects() == 1);
+	REQUIRE(MDtwice.getValue(EMDL_MICROGRAPH_NAME, mic, 0));
+	REQUIRE(mic == "mic#1.mrc");
+}
+
+TEST_CASE( "Binary STAR companions hold the same tables as the text", "[metadata_table]" ) {
+	const std::string fn_in = "test_metadata_table_text.star";
+	const std::string fn = "test_metadata_table_binary.star";
+	writeTestStar(fn_in);
+	std::vector<MetaDataTable> reference = readReference(fn_in);
+	std::remove(fn_in.c_str());
+
+	setenv("RELION_BINARY_STAR", "1", 1);
+
+	std::vector<const MetaDataTable*> tables;
+	{
+		std::ofstream out(fn.c_str());
+		for (int i = 0; i < reference.size(); i++)
+		{
+			reference[i].write(out);
+			tables.push_back(&reference[i]);
+		}
+	}
+	MetaDataTable::writeBinaryStar(fn, tables);
+
+	const FileName fn_binary = MetaDataTable::getBinaryStarName(fn);
+	REQUIRE(exists(fn_binary));
+
+	// The text remains the reference (write() leaves out the empty table)
+	reference = readReference(fn);
+	REQUIRE(reference.size() == 3);
+	requireSameTables(MetaDataTable::readAll(fn), reference);
+
+	for (int i = 0; i < reference.size(); i++)
+	{
+		MetaDataTable MD;
+		MD.read(fn, reference[i].getName());
+		REQUIRE(toStarString(MD) == toStarString(reference[i]));
+	}
+
+	// Only the requested columns
+	MetaDataTable MD;
+	std::vector<EMDLabel> labels(1, EMDL_MICROGRAPH_NAME);
+	MD.read(fn, "particles", labels);
+	REQUIRE(MD.numberOfObjects() == 5);
+	REQUIRE(MD.containsLabel(EMDL_MICROGRAPH_NAME));
+	REQUIRE(!MD.containsLabel(EMDL_IMAGE_COORD_X));
+
+	// A companion that differs from the text proves that it is used
+	RFLOAT x;
+	MetaDataTable MDmarked = reference[1];
+	MDmarked.setValue(EMDL_IMAGE_COORD_X, 12345., 0);
+	tables.clear();
+	for (int i = 0; i < reference.size(); i++)
+		tables.push_back(i == 1 ? &MDmarked : &reference[i]);
+	MetaDataTable::writeBinaryStar(fn, tables);
+
+	MD.read(fn, "particles");
+	REQUIRE(MD.getValue(EMDL_IMAGE_COORD_X, x, 0));
+	REQUIRE(x == 12345.);
+	REQUIRE(toStarString(MetaDataTable::readAll(fn)[1]) == toStarString(MDmarked));
+
+	// Rewriting the text with the same size and modification time makes the companion stale
+	struct stat file_status;
+	REQUIRE(stat(fn.c_str(), &file_status) == 0);
+	std::string text;
+	{
+		std::ifstream in(fn.c_str());
+		std::stringstream buffer;
+		buffer << in.rdbuf();
+		text = buffer.str();
+	}
+	const size_t pos = text.find("10.500000");
+	REQUIRE(pos != std::string::npos);
+	text.replace(pos, 9, "10.600000");
+	{
+		std::ofstream out(fn.c_str());
+		out << text;
+	}
+	const struct timespec times[2] = {file_status.st_atim, file_status.st_mtim};
+	REQUIRE(utimensat(AT_FDCWD, fn.c_str(), times, 0) == 0);
+
+	MD.read(fn, "particles");
+	REQUIRE(MD.getValue(EMDL_IMAGE_COORD_X, x, 0));
+	REQUIRE(x == 10.6);
+
+	unsetenv("RELION_BINARY_STAR");
+	std::remove(fn.c_str());
+	std::remove(fn_binary.c_str());
+}
@@ -0,0 +1,120 @@
+#include <catch2/catch.hpp>
+#include "src/ml_model.h"
+
+// A small weighted-sum model, with distinct values everywhere
+static void makeWsumModel(MlWsumModel &wsum)
+{
+	const int ori_size = 16;
+	const int nr_classes = 3;
+	const int nr_groups = 2;
+	const int nr_directions = 7;
+
+	wsum.ori_size = ori_size;
+	wsum.current_size = ori_size;
+	wsum.ref_dim = 2;
+	wsum.nr_classes = nr_classes;
+	wsum.nr_groups = nr_groups;
+	wsum.nr_optics_groups = nr_groups;
+	wsum.nr_directions = nr_directions;
+
+	RFLOAT value = 1.;
+
+	wsum.LL = value++;
+	wsum.ave_Pmax = value++;
+	wsum.sigma2_offset = value++;
+	wsum.avg_norm_correction = value++;
+	wsum.sigma2_rot = value++;
+	wsum.sigma2_tilt = value++;
+	wsum.sigma2_psi = value++;
+
+	wsum.sigma2_noise.resize(nr_groups);
+	wsum.sumw_ctf2.resize(nr_groups);
+	wsum.sumw_stMulti.resize(nr_groups);
+	wsum.sumw_group.resize(nr_groups);
+	wsum.wsum_signal_product.resize(nr_groups);
+	wsum.wsum_reference_power.resize(nr_groups);
+	for (int igroup = 0; igroup < nr_groups; igroup++)
+	{
+		wsum.sigma2_noise[igroup].resize(ori_size / 2 + 1);
+		wsum.sumw_ctf2[igroup].resize(ori_size / 2 + 1);
+		wsum.sumw_stMulti[igroup].resize(ori_size / 2 + 1);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(wsum.sigma2_noise[igroup])
+		{
+			DIRECT_MULTIDIM_ELEM(wsum.sigma2_noise[igroup], n) = value++;
+			DIRECT_MULTIDIM_ELEM(wsum.sumw_ctf2[igroup], n) = value++;
+			DIRECT_MULTIDIM_ELEM(wsum.sumw_stMulti[igroup], n) = value++;
+		}
+		wsum.sumw_group[igroup] = value++;
+		wsum.wsum_signal_product[igroup] = value++;
+		wsum.wsum_reference_power[igroup] = value++;
+	}
+
+	wsum.BPref.clear();
+	wsum.pdf_direction.resize(nr_classes);
+	wsum.pdf_class.resize(nr_classes);
+	wsum.prior_offset_class.resize(nr_classes);
+	for (int iclass = 0; iclass < nr_classes; iclass++)
+	{
+		BackProjector BP(ori_size, 2, "C1");
+		BP.initZeros(ori_size);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BP.data)
+		{
+			DIRECT_MULTIDIM_ELEM(BP.data, n) = Complex(value, value + 0.5);
+			DIRECT_MULTIDIM_ELEM(BP.weight, n) = value + 0.25;
+			value++;
+		}
+		wsum.BPref.push_back(BP);
+
+		wsum.pdf_direction[iclass].resize(nr_directions);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(wsum.pdf_direction[iclass])
+			DIRECT_MULTIDIM_ELEM(wsum.pdf_direction[iclass], n) = value++;
+
+		wsum.pdf_class[iclass] = value++;
+		wsum.prior_offset_class[iclass].resize(2);
+		XX(wsum.prior_offset_class[iclass]) = value++;
+		YY(wsum.prior_offset_class[iclass]) = value++;
+	}
+}
+
+static MultidimArray<RFLOAT> packWhole(MlWsumModel &wsum)
+{
+	MultidimArray<RFLOAT> packed;
+	int piece = -1, nr_pieces = -1;
+	wsum.pack(packed, piece, nr_pieces, false);
+	return packed;
+}
+
+// The engine used by MlOptimiserMpi::combineAllWeightedSumsAllreduce, with a reduction
+// that stands in for the sum over two followers: piece N+1 is packed before piece N is unpacked
+TEST_CASE( "Pack the next piece before unpacking the current one", "[ml_model]" ) {
+	MlWsumModel wsum;
+	makeWsumModel(wsum);
+
+	MultidimArray<RFLOAT> before = packWhole(wsum);
+
+	// Pieces that end in the middle of the spectra and of the BPref arrays
+	const unsigned long long max_pack_size = 37;
+	int nr_pieces = 0;
+
+	wsum.reduceInPieces(
+		[&](MultidimArray<RFLOAT> &Mpack)
+	{
+		Mpack *= 2.;
+		nr_pieces++;
+	},
+		[&](MultidimArray<RFLOAT> &Mpack) {},
+		max_pack_size);
+
+	REQUIRE(nr_pieces > 2);
+
+	MultidimArray<RFLOAT> after = packWhole(wsum);
+
+	REQUIRE(MULTIDIM_SIZE(after) == MULTIDIM_SIZE(before));
+	long int mismatches = 0;
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(before)
+	{
+		if (DIRECT_MULTIDIM_ELEM(after, n) != 2. * DIRECT_MULTIDIM_ELEM(before, n))
+			mismatches++;
+	}
+	REQUIRE(mismatches == 0);
+}
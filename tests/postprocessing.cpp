@@ -0,0 +1,129 @@
+#include <catch2/catch.hpp>
+#include <algorithm>
+#include "src/postprocessing.h"
+
+// Half maps of a band-limited random structure with independent noise, which is stronger in one half of the box
+static void writeSyntheticHalfMaps(const FileName &fn_half1, const FileName &fn_half2, int box, RFLOAT angpix)
+{
+	init_random_generator(1234);
+	MultidimArray<RFLOAT> signal(box, box, box);
+	signal.setXmippOrigin();
+	FOR_ALL_ELEMENTS_IN_ARRAY3D(signal)
+		A3D_ELEM(signal, k, i, j) = (k*k + i*i + j*j < (box/2 - 2)*(box/2 - 2)) ? rnd_gaus(0., 1.) : 0.;
+
+	// Damp the signal towards high resolution, so that the local resolution is set by the noise level
+	// (without masking, the FSC drops below 0.143 around shell 19 of 20 in the less noisy half, and shell 15 in the other)
+	MultidimArray<Complex> FT;
+	FourierTransformer transformer;
+	transformer.FourierTransform(signal, FT, false);
+	FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(FT)
+		DIRECT_A3D_ELEM(FT, k, i, j) *= exp(-8. * (kp*kp + ip*ip + jp*jp) / (RFLOAT)(box*box));
+	transformer.inverseFourierTransform();
+
+	Image<RFLOAT> half1(box, box, box), half2(box, box, box);
+	half1().setXmippOrigin();
+	half2().setXmippOrigin();
+	FOR_ALL_ELEMENTS_IN_ARRAY3D(signal)
+	{
+		RFLOAT sigma = (j < 0) ? 0.4 : 0.8;
+		A3D_ELEM(half1(), k, i, j) = A3D_ELEM(signal, k, i, j) + rnd_gaus(0., sigma);
+		A3D_ELEM(half2(), k, i, j) = A3D_ELEM(signal, k, i, j) + rnd_gaus(0., sigma);
+	}
+	half1.setSamplingRateInHeader(angpix);
+	half2.setSamplingRateInHeader(angpix);
+	half1.write(fn_half1);
+	half2.write(fn_half2);
+}
+
+// The local resolutions of the sampling points and their X-coordinates, from the STAR file of run_locres
+static std::vector<RFLOAT> readLocalResolutions(const FileName &fn_star, std::vector<int> &xs)
+{
+	std::vector<RFLOAT> local_resols;
+	xs.clear();
+	std::ifstream fh(fn_star.c_str());
+	std::string line;
+	while (getline(fh, line))
+	{
+		size_t pos = line.find("local resolution=");
+		if (pos != std::string::npos)
+		{
+			// Lines like " kk= -5 ii= 0 jj= 5 local resolution= 6.15385", where kk is the X-coordinate
+			local_resols.push_back(textToFloat(line.substr(pos + 17)));
+			xs.push_back(textToInteger(line.substr(4, line.find(" ii=") - 4)));
+		}
+	}
+	return local_resols;
+}
+
+static std::vector<RFLOAT> runLocres(const FileName &fn_half1, const FileName &fn_half2, const FileName &fn_out, RFLOAT angpix, bool do_fft,
+		std::vector<int> &xs)
+{
+	Postprocessing prm;
+	prm.clear();
+	prm.verb = 0;
+	prm.fn_I1 = fn_half1;
+	prm.fn_I2 = fn_half2;
+	prm.fn_out = fn_out;
+	prm.angpix = prm.mtf_angpix = angpix;
+	prm.molweight = -1.;
+	prm.do_locres = true;
+	prm.locres_sampling = 10.;
+	prm.locres_maskrad = 10.;
+	prm.locres_edgwidth = 6.;
+	prm.locres_randomize_fsc = 25.;
+	prm.locres_minres = 50.;
+	prm.do_locres_fft = do_fft;
+
+	// The same randomised phases for both engines
+	init_random_generator(5678);
+	prm.run_locres();
+
+	std::vector<RFLOAT> local_resols = readLocalResolutions(fn_out + "_locres_fscs.star", xs);
+	remove((fn_out + "_locres_fscs.star").c_str());
+	remove((fn_out + "_locres.mrc").c_str());
+	remove((fn_out + "_locres_filtered.mrc").c_str());
+	return local_resols;
+}
+
+TEST_CASE("Local resolution by convolution agrees with the per-point estimation", "[postprocessing]")
+{
+	const int box = 40;
+	const RFLOAT angpix = 2.;
+	const FileName fn_half1 = "test_locres_half1.mrc", fn_half2 = "test_locres_half2.mrc";
+	writeSyntheticHalfMaps(fn_half1, fn_half2, box, angpix);
+
+	std::vector<int> xs_points, xs_fft;
+	std::vector<RFLOAT> locres_points = runLocres(fn_half1, fn_half2, "test_locres_points", angpix, false, xs_points);
+	std::vector<RFLOAT> locres_fft = runLocres(fn_half1, fn_half2, "test_locres_fft", angpix, true, xs_fft);
+	remove(fn_half1.c_str());
+	remove(fn_half2.c_str());
+	REQUIRE(locres_points.size() > 50);
+	REQUIRE(xs_fft == xs_points);
+
+	// Both engines estimate the FSCs of the locally masked maps, but from differently blurred spectra, and where
+	// a local FSC is noisy around 0.143, either may stop at a very different shell. Therefore, the local resolutions
+	// (in shells) must agree within one shell for the median sampling point, and within 1.5 shells on average in
+	// each half of the box, where the less noisy half must have the higher local resolution.
+	std::vector<RFLOAT> diffs;
+	RFLOAT sum_points[2] = {0., 0.}, sum_fft[2] = {0., 0.};
+	int nr_half[2] = {0, 0};
+	for (int ipoint = 0; ipoint < locres_points.size(); ipoint++)
+	{
+		RFLOAT shell_points = box * angpix / locres_points[ipoint], shell_fft = box * angpix / locres_fft[ipoint];
+		diffs.push_back(ABS(shell_points - shell_fft));
+
+		if (xs_points[ipoint] != 0)
+		{
+			int ihalf = (xs_points[ipoint] < 0) ? 0 : 1;
+			sum_points[ihalf] += shell_points;
+			sum_fft[ihalf] += shell_fft;
+			nr_half[ihalf]++;
+		}
+	}
+	std::sort(diffs.begin(), diffs.end());
+	CHECK(diffs[diffs.size() / 2] <= 1.01);
+	for (int ihalf = 0; ihalf < 2; ihalf++)
+		CHECK(ABS(sum_points[ihalf] - sum_fft[ihalf]) / nr_half[ihalf] <= 1.5);
+	CHECK(sum_points[0] / nr_half[0] > sum_points[1] / nr_half[1]);
+	CHECK(sum_fft[0] / nr_half[0] > sum_fft[1] / nr_half[1]);
+}
@@ -0,0 +1,238 @@
+#include <catch2/catch.hpp>
+#include <random>
+#include "src/renderEER.h"
+
+// The electrons of a synthetic EER frame (at 4K pixels, with their 4-bit sub-pixel symbols)
+// and the frame run-length encoded with codes of 7 or 8 bits
+struct SyntheticEERFrame
+{
+	std::vector<unsigned int> pixels;
+	std::vector<unsigned char> symbols;
+	std::vector<unsigned char> stream;
+	unsigned long long n_bits;
+};
+
+static void putBits(SyntheticEERFrame &frame, unsigned int value, int n_bits)
+{
+	for (int i = 0; i < n_bits; i++, frame.n_bits++)
+	{
+		if ((frame.n_bits >> 3) >= frame.stream.size())
+			frame.stream.push_back(0);
+		if ((value >> i) & 1)
+			frame.stream[frame.n_bits >> 3] |= 1 << (frame.n_bits & 7);
+	}
+}
+
+// Skip n_skip pixels; with 8-bit codes, every code has a symbol, even if it does not place an electron
+static void putSkip(SyntheticEERFrame &frame, unsigned int n_skip, int code_bits)
+{
+	const unsigned int max_skip = (1 << code_bits) - 1;
+	for (; n_skip >= max_skip; n_skip -= max_skip)
+	{
+		putBits(frame, max_skip, code_bits);
+		if (code_bits == 8)
+			putBits(frame, 0, 4);
+	}
+	putBits(frame, n_skip, code_bits);
+}
+
+static SyntheticEERFrame makeSyntheticEERFrame(std::mt19937 &rng, int n_electrons, int code_bits, bool electron_at_last_pixel)
+{
+	const unsigned int n_pixels = 4096 * 4096, max_skip = (1 << code_bits) - 1;
+	// Mostly random gaps, but also those at the limits of the codes
+	const unsigned int special_gaps[] = {0, 1, max_skip - 1, max_skip, max_skip + 1, 2 * max_skip, 2 * max_skip + 1};
+	std::uniform_int_distribution<unsigned int> random_gap(0, 1500), random_special(0, 6), random_symbol(0, 15);
+	std::uniform_real_distribution<double> random_unif(0., 1.);
+
+	SyntheticEERFrame frame;
+	frame.n_bits = 0;
+	unsigned int n_pix = 0;
+	for (int i = 0; i < n_electrons; i++)
+	{
+		const unsigned int gap = (random_unif(rng) < 0.2) ? special_gaps[random_special(rng)] : random_gap(rng);
+		if (n_pix + gap >= n_pixels - 1)
+			break;
+		frame.pixels.push_back(n_pix + gap);
+		frame.symbols.push_back(random_symbol(rng));
+		n_pix += gap + 1;
+	}
+	if (electron_at_last_pixel)
+	{
+		frame.pixels.push_back(n_pixels - 1);
+		frame.symbols.push_back(random_symbol(rng));
+	}
+
+	n_pix = 0;
+	for (int i = 0; i < frame.pixels.size(); i++)
+	{
+		putSkip(frame, frame.pixels[i] - n_pix, code_bits);
+		putBits(frame, frame.symbols[i], 4);
+		n_pix = frame.pixels[i] + 1;
+	}
+	// Skip to the end of the frame
+	putSkip(frame, n_pixels - n_pix, code_bits);
+	if (code_bits == 8)
+		putBits(frame, 0, 4);
+
+	return frame;
+}
+
+// The decoder before the 64-bit fetches, which unpacks one or two codes at a time, with the symbols after flipping
+static void decodeEERFramePerCode(const std::vector<unsigned char> &stream, bool is_7bit,
+		std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols)
+{
+	const unsigned int n_pixels = 4096 * 4096;
+	std::vector<unsigned char> buf(stream);
+	buf.resize(stream.size() + 8, 0); // the decoder reads ahead
+	positions.clear();
+	symbols.clear();
+
+	unsigned int n_pix = 0;
+	if (is_7bit)
+	{
+		unsigned int bit_pos = 0;
+		while (true)
+		{
+			unsigned int chunk;
+			memcpy(&chunk, &buf[bit_pos >> 3], sizeof(chunk));
+			chunk >>= (bit_pos & 7);
+
+			unsigned char p = (unsigned char)(chunk & 127);
+			bit_pos += 7;
+			n_pix += p;
+			if (n_pix >= n_pixels) break;
+			if (p == 127) continue;
+
+			positions.push_back(n_pix);
+			symbols.push_back((unsigned char)((chunk >> 7) & 15) ^ 0x0A);
+			bit_pos += 4;
+			n_pix++;
+		}
+	}
+	else
+	{
+		for (long long pos = 0; pos < stream.size(); pos += 3)
+		{
+			const unsigned char p1 = buf[pos], s1 = (buf[pos + 1] & 0x0F) ^ 0x0A;
+			const unsigned char p2 = (buf[pos + 1] >> 4) | (buf[pos + 2] << 4), s2 = (buf[pos + 2] >> 4) ^ 0x0A;
+
+			n_pix += p1;
+			if (n_pix >= n_pixels) break;
+			if (p1 < 255)
+			{
+				positions.push_back(n_pix);
+				symbols.push_back(s1);
+				n_pix++;
+			}
+
+			n_pix += p2;
+			if (n_pix >= n_pixels) break;
+			if (p2 < 255)
+			{
+				positions.push_back(n_pix);
+				symbols.push_back(s2);
+				n_pix++;
+			}
+		}
+	}
+}
+
+// The index of an electron in an image of 4K << grid_shift (grid_shift <= 2)
+static unsigned int getEERIndex(unsigned int position, unsigned char symbol, int grid_shift)
+{
+	const unsigned int x16 = ((position & 4095) << 2) | (symbol & 3);
+	const unsigned int y16 = ((position >> 12) << 2) | ((symbol & 12) >> 2);
+	return ((y16 >> (2 - grid_shift)) << (12 + grid_shift)) | (x16 >> (2 - grid_shift));
+}
+
+static void checkEERDecoding(bool is_7bit)
+{
+	const int code_bits = is_7bit ? 7 : 8, n_frames = 8;
+	const FileName fn_eer = is_7bit ? "test_eer_7bit.eer" : "test_eer_8bit.eer";
+
+	// Frames of different lengths, not all of which end at a 64-bit word
+	std::mt19937 rng(1234);
+	std::vector<SyntheticEERFrame> frames;
+	bool ends_mid_word = false;
+	for (int iframe = 0; iframe < n_frames; iframe++)
+	{
+		frames.push_back(makeSyntheticEERFrame(rng, 20000 + 37 * iframe, code_bits, iframe == 0));
+		ends_mid_word = ends_mid_word || (frames[iframe].n_bits % 64 != 0);
+	}
+	REQUIRE(ends_mid_word);
+
+	TIFF *ftiff = TIFFOpen(fn_eer.c_str(), "w");
+	REQUIRE(ftiff != NULL);
+	for (int iframe = 0; iframe < n_frames; iframe++)
+	{
+		TIFFSetField(ftiff, TIFFTAG_IMAGEWIDTH, 4096);
+		TIFFSetField(ftiff, TIFFTAG_IMAGELENGTH, 4096);
+		TIFFSetField(ftiff, TIFFTAG_ROWSPERSTRIP, 4096);
+		TIFFSetField(ftiff, TIFFTAG_COMPRESSION, is_7bit ? 65001 : 65000);
+		TIFFWriteRawStrip(ftiff, 0, &frames[iframe].stream[0], frames[iframe].stream.size());
+		TIFFWriteDirectory(ftiff);
+	}
+	TIFFClose(ftiff);
+
+	EERRenderer renderer;
+	renderer.read(fn_eer, 1);
+	REQUIRE(renderer.getNFrames() == n_frames);
+
+	std::vector<unsigned int> positions, indices;
+	std::vector<unsigned char> symbols;
+	std::vector<unsigned short> expected_binned(2048 * 2048, 0);
+	for (int iframe = 0; iframe < n_frames; iframe++)
+	{
+		const SyntheticEERFrame &frame = frames[iframe];
+
+		// The synthetic frame is what the old decoder expects
+		decodeEERFramePerCode(frame.stream, is_7bit, positions, symbols);
+		std::vector<unsigned char> flipped_symbols(frame.symbols);
+		for (int i = 0; i < flipped_symbols.size(); i++)
+			flipped_symbols[i] ^= 0x0A;
+		REQUIRE(positions == frame.pixels);
+		REQUIRE(symbols == flipped_symbols);
+
+		// Both decoders place the electrons at the same (upsampled or binned) pixels
+		for (int grid_shift = 2; grid_shift >= -1; grid_shift--)
+		{
+			unsigned int n_electron;
+			REQUIRE(renderer.decodeFrame(iframe, grid_shift, indices, n_electron));
+			indices.resize(n_electron);
+
+			std::vector<unsigned int> expected_indices;
+			for (int i = 0; i < positions.size(); i++)
+				expected_indices.push_back(getEERIndex(positions[i], symbols[i], grid_shift));
+			CHECK(indices == expected_indices);
+		}
+
+		for (int i = 0; i < positions.size(); i++)
+			expected_binned[getEERIndex(positions[i], symbols[i], -1)]++;
+	}
+
+	// Rendering at 4K binned by 2 counts the electrons into 2K pixels
+	MultidimArray<unsigned short> binned;
+	long long n_electron = renderer.renderFrames(1, n_frames, binned, 2);
+	remove(fn_eer.c_str());
+	REQUIRE(XSIZE(binned) == 2048);
+	REQUIRE(YSIZE(binned) == 2048);
+	long long n_expected = 0;
+	bool same_pixels = true;
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(binned)
+	{
+		n_expected += expected_binned[n];
+		same_pixels = same_pixels && (DIRECT_MULTIDIM_ELEM(binned, n) == expected_binned[n]);
+	}
+	CHECK(n_electron == n_expected);
+	CHECK(same_pixels);
+}
+
+TEST_CASE("EER frames with 7-bit codes are decoded as by the per-code decoder", "[render_eer]")
+{
+	checkEERDecoding(true);
+}
+
+TEST_CASE("EER frames with 8-bit codes are decoded as by the per-code decoder", "[render_eer]")
+{
+	checkEERDecoding(false);
+}
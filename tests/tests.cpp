@@ -2,3 +2,7 @@
 
 #include <catch2/catch.hpp>
 #include "ctf.cpp"
+#include "ml_model.cpp"
+#include "metadata_table.cpp"
+#include "postprocessing.cpp"
+#include "render_eer.cpp"